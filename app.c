@@ -12,42 +12,192 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
 
 #include "app.h"
+#include "avail.h"
+#include "buf.h"
+#include "event.h"
+#include "json.h"
+#include "mdindex.h"
+#include "reactor.h"
+#include "meter.h"
+#include "net.h"
 #include "player.h"
 #include "playlist.h"
+#include "playqueue.h"
+#include "prefetch.h"
 #include "rpi-gpio.h"
+#include "search.h"
+#include "shuffle.h"
 
 static int app_playlist_is_special_kind(sp_playlist *pl);
-static app_event_t app_next_event(void);
+static int app_next_event(event_t *event);
+static void app_retry_metadata(void *arg);
 static const char *app_event_name(app_event_t event);
+static void app_audio_underrun(void);
+static void app_notify_track(void);
+static void app_notify_playback(const char *state);
+static void app_notify_underrun(void);
+static void app_randomize_playlist_order(int resume);
+static void app_avail_scan(void *arg);
+static void app_retry_prefetch(void *arg);
+static void app_flush_skips(void *arg);
+
+/* How a posted event is combined with a queued event of the same type */
+typedef enum {
+	APP_COALESCE_NONE = 0,	/* Always queue, order matters (play/stop) */
+	APP_COALESCE_DROP,	/* Drop while one is still queued */
+	APP_COALESCE_SUM,	/* Add count to the queued one */
+} app_coalesce_t;
+
+static const app_coalesce_t app_coalesce_rules[APP_MAX] = {
+	[APP_LOGGED_IN]		= APP_COALESCE_DROP,
+	[APP_DO_METADATA]	= APP_COALESCE_DROP,
+	[APP_DO_NEXT_TRACK]	= APP_COALESCE_SUM,
+	[APP_DO_PLAY]		= APP_COALESCE_NONE,
+	[APP_DO_PREFETCH]	= APP_COALESCE_DROP,
+	[APP_DO_STOP]		= APP_COALESCE_NONE,
+	[APP_DO_LOGOUT]		= APP_COALESCE_DROP,
+	[APP_DO_EXIT]		= APP_COALESCE_DROP,
+	[APP_UNDERRUN]		= APP_COALESCE_SUM,
+};
+
+/* Latency histogram exported on /metrics, bucket bounds in seconds */
+typedef struct {
+	const double *bounds;
+	int num_bounds;
+	unsigned long buckets[APP_HISTOGRAM_BUCKETS];
+	unsigned long count;
+	double sum;
+} app_histogram_t;
+
+static const double app_loop_bounds[] = {
+	0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1
+};
+static const double app_skip_bounds[] = {
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+/* Entry in the playlist URI cache, keyed on the playlist pointer */
+typedef struct {
+	sp_playlist *pl;
+	char *uri;
+} app_uri_t;
 
 /* Application global state */
 typedef struct {
-	app_event_t events;
+	/* Events posted from any thread, drained by the main thread */
+	event_queue_t queue;
+
+	/* Coalescing state per type, atomics only; a summed count is kept
+	   shifted up a bit, the low bit set while its event is queued */
+	unsigned int pending[APP_MAX];
+	pthread_t main_thread;
+
+	/* Event statistics */
+	unsigned long events_posted;
+	unsigned long events_coalesced;
+	unsigned long events_dropped;
+	unsigned long events_handled;
+	unsigned int events_max_depth;
+	uint64_t events_latency_us;
+	uint64_t events_max_latency_us;
+
+	/* Waiting for metadata, main thread only */
+	unsigned int waits;
 
 	sp_session *session;
 	sp_track *track;
+	int track_queued;
 	sp_link *link;
 	sp_playlist *inbox;
 	sp_playlist *starred;
 
-	/* Active playlist and track */
+	/* Active playlist, its play order and the current index in it */
 	sp_playlist *active_playlist;
-	int *randomized_track_idx;
+	shuffle_t *shuffle;
 	int playlist_track_idx;
 
+	/* Which of its tracks can be played, filled in ahead of the index */
+	avail_t *avail;
+	int avail_timer;
+
+	/* Upcoming tracks to hold on to and the network, which decides how
+	   many of them get their audio prefetched */
+	int prefetch_window;
+	int prefetch_timer;
+	sp_connection_type connection_type;
+
+	/* Seed for the next shuffle (0 for a random one) and spread mode */
+	uint64_t shuffle_seed;
+	int shuffle_spread;
+
 	/* Audio fifo buffer */
 	audio_fifo_t audio_fifo;
 
 	/* Main thread signaling */
-	int signal_fds[2];
+	int retry_timer;
 
 	/* GPIO */
 	int gpio_fd;
 
-	/* Status message available over network */
-	char status[8192];
+	/* Power saving mode and statistics for comparing it to normal mode */
+	int power_save;
+	struct timespec stats_start;
+	double stats_cpu;
+	uint64_t stats_played_us;
+	unsigned long stats_driver_wakeups;
+	unsigned long wakeups;
+
+	/* Status message available over network, built on request */
+	buf_t status;
+
+	/* Offline playlists section, rebuilt only when marked dirty */
+	buf_t status_playlists;
+	int status_dirty;
+	struct timespec status_built;
+
+	/* Playlist URIs, computed once per playlist */
+	app_uri_t *uris;
+	unsigned int uris_size;
+	unsigned int uris_used;
+
+	/* Event pushed to subscribed control clients */
+	buf_t notify;
+
+	/* Time spent per main loop iteration and from skip to playback */
+	app_histogram_t loop_hist;
+	app_histogram_t skip_hist;
+	struct timespec skip_start;
+	int skip_pending;
+
+	/* Skip requests waiting out the coalescing window */
+	int skip_timer;
+	int skips_queued;
+	struct timespec skip_window_start;
+	unsigned long skips_coalesced;
+	unsigned long skip_loads_avoided;
+
+	/* Time from picking the next track until a playable one is found */
+	app_histogram_t playable_hist;
+	struct timespec next_start;
+	int next_pending;
+
+	/* Unplayable tracks passed over from the index or found when loading */
+	unsigned long unplayable_skipped;
+	unsigned long unplayable_loaded;
+
+	/* Playlists only loaded once selected, and the URI it was selected by */
+	int lazy_playlists;
+	char active_uri[256];
+
+	/* For logging how long it took to get the first track playing */
+	struct timespec started;
+	int first_audio;
 
 } app_private_t;
 static app_private_t *g_app;
@@ -56,25 +206,153 @@ static app_private_t *g_app;
 void *app_create(void) {
 
 	g_app = calloc(1, sizeof(app_private_t));
+	event_queue_init(&g_app->queue);
+	g_app->main_thread = pthread_self();
+	clock_gettime(CLOCK_MONOTONIC, &g_app->started);
+	meter_init();
+	g_app->audio_fifo.underrun_cb = app_audio_underrun;
 	audio_init(&g_app->audio_fifo);
 
-	if(pipe(g_app->signal_fds) < 0)
-		syslog(LOG_ERR, "app_create: pipe() failed with error: %s",
-			strerror(errno));
+	g_app->retry_timer = reactor_timer_create(app_retry_metadata, NULL);
+	g_app->avail_timer = reactor_timer_create(app_avail_scan, NULL);
+	g_app->prefetch_timer = reactor_timer_create(app_retry_prefetch, NULL);
+	g_app->skip_timer = reactor_timer_create(app_flush_skips, NULL);
+	g_app->prefetch_window = APP_PREFETCH_WINDOW;
+	g_app->connection_type = SP_CONNECTION_TYPE_UNKNOWN;
+	buf_init(&g_app->status);
+	buf_init(&g_app->status_playlists);
+	g_app->status_dirty = 1;
+	buf_init(&g_app->notify);
+	g_app->loop_hist.bounds = app_loop_bounds;
+	g_app->loop_hist.num_bounds = sizeof(app_loop_bounds) / sizeof(double);
+	g_app->skip_hist.bounds = app_skip_bounds;
+	g_app->skip_hist.num_bounds = sizeof(app_skip_bounds) / sizeof(double);
+	g_app->playable_hist.bounds = app_skip_bounds;
+	g_app->playable_hist.num_bounds = sizeof(app_skip_bounds) / sizeof(double);
 
 	g_app->gpio_fd = rpi_gpio_init();
 
+	app_set_power_save(0);
+
 	return g_app;
 }
 
-int app_signal_write_fd(void) {
+static double app_cpu_seconds(void) {
+	struct rusage ru;
+
+	if(getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* ru_maxrss is in kilobytes on Linux but in bytes on Mac OS X */
+static long app_maxrss_kb(const struct rusage *ru) {
+
+#ifdef __APPLE__
+	return ru->ru_maxrss / 1024;
+#else
+	return ru->ru_maxrss;
+#endif
+}
+
+/* Switch power saving mode and restart statistics */
+void app_set_power_save(int enable) {
+	audio_fifo_t *af = &g_app->audio_fifo;
+
+	pthread_mutex_lock(&af->mutex);
+	af->max_ms = enable? APP_POWERSAVE_BUFFER_MS: APP_BUFFER_MS;
+	af->block_ms = enable? APP_POWERSAVE_BLOCK_MS: 0;
+	g_app->stats_played_us = af->played_us;
+	g_app->stats_driver_wakeups = af->driver_wakeups;
+	pthread_mutex_unlock(&af->mutex);
+
+	g_app->power_save = enable;
+	g_app->wakeups = 0;
+	g_app->stats_cpu = app_cpu_seconds();
+	clock_gettime(CLOCK_MONOTONIC, &g_app->stats_start);
+
+	syslog(LOG_INFO, "App: power saving mode %s", enable? "enabled": "disabled");
+}
+
+int app_get_power_save(void) {
+
+	return g_app->power_save;
+}
+
+/* Called by the main loop for every wakeup */
+void app_count_wakeup(void) {
+
+	g_app->wakeups++;
+}
+
+static double app_seconds_since(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void app_histogram_observe(app_histogram_t *h, double value) {
+	int i;
+
+	for(i = 0; i < h->num_bounds && value > h->bounds[i]; i++);
+	if(i < h->num_bounds)
+		h->buckets[i]++;
+
+	h->count++;
+	h->sum += value;
+}
+
+/* Called by the main loop before it goes back to sleep */
+void app_record_loop_time(const struct timespec *start) {
 
-	return g_app->signal_fds[1];
+	app_histogram_observe(&g_app->loop_hist, app_seconds_since(start));
 }
 
-int app_signal_read_fd(void) {
+/* Skip requests of the window just closed, as one event */
+static void app_flush_skips(void *arg) {
+	int count = g_app->skips_queued;
+
+	if(count == 0)
+		return;
+
+	g_app->skips_queued = 0;
+	g_app->skips_coalesced += count - 1;
+	if(count > 1)
+		syslog(LOG_INFO, "App: Taking %d skip requests together", count);
 
-	return g_app->signal_fds[0];
+	app_post_event_data(APP_DO_NEXT_TRACK, count, NULL);
+}
+
+/**
+ * Skip to the next track on user request, main thread only.  Requests in
+ * quick succession are counted until none has come for APP_SKIP_WINDOW_MS,
+ * so the tracks skipped past are never loaded.
+ */
+void app_skip_track(void) {
+	int ms;
+
+	/* Skip latency is measured from the first of several quick skips */
+	if(!g_app->skip_pending) {
+		clock_gettime(CLOCK_MONOTONIC, &g_app->skip_start);
+		g_app->skip_pending = 1;
+	}
+
+	if(g_app->skips_queued++ == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &g_app->skip_window_start);
+
+		/* Don't make the user sit through seconds of buffered audio */
+		if(g_app->power_save)
+			audio_fifo_flush(&g_app->audio_fifo);
+	}
+
+	/* Someone holding the button down still gets somewhere */
+	ms = APP_SKIP_MAX_DELAY_MS - (int)(app_seconds_since(&g_app->skip_window_start) * 1000);
+	if(ms < 0)
+		ms = 0;
+	reactor_timer_set(g_app->skip_timer, ms < APP_SKIP_WINDOW_MS? ms: APP_SKIP_WINDOW_MS);
 }
 
 int app_gpio_fd(void) {
@@ -92,10 +370,16 @@ void app_set_session(sp_session *session) {
 	if(g_app->session != NULL) {
 		sp_session_player_play(g_app->session, 0);
 		sp_session_player_unload(g_app->session);
+		prefetch_release();
+		playqueue_release();
 		sp_session_release(g_app->session);
 	}
 
 	g_app->session = session;
+	if(session != NULL) {
+		playqueue_init(session);
+		prefetch_init(session);
+	}
 }
 
 void app_set_link(sp_link *link) {
@@ -107,117 +391,275 @@ void app_set_link(sp_link *link) {
 		sp_link_add_ref(g_app->link);
 }
 
-const char *app_get_status(void) {
+/* Called by callbacks when something shown in the status has changed */
+void app_status_invalidate(int what) {
+	unsigned int i;
+
+	if(g_app == NULL)
+		return;
+
+	g_app->status_dirty = 1;
+
+	/* Playlists may go away, so a pointer could be reused for another */
+	if(what & APP_STATUS_URIS) {
+		for(i = 0; i < g_app->uris_size; i++) {
+			free(g_app->uris[i].uri);
+			g_app->uris[i].pl = NULL;
+			g_app->uris[i].uri = NULL;
+		}
 
-	return g_app->status;
+		g_app->uris_used = 0;
+	}
 }
 
-static void app_update_status(void) {
-	sp_playlistcontainer *pc = sp_session_playlistcontainer(g_app->session);
-	sp_playlist *pl = g_app->active_playlist;
-	sp_track *t = app_get_track();
-	sp_offline_sync_status ss;
-	sp_playlist_offline_status plos;
+static unsigned int app_uri_hash(sp_playlist *pl, unsigned int size) {
+	unsigned long v = (unsigned long)pl;
+
+	v ^= v >> 17;
+	v *= 0x9E3779B1UL;
+
+	return (unsigned int)(v ^ (v >> 15)) & (size - 1);
+}
+
+static const char *app_playlist_uri(sp_playlist *pl) {
+	app_uri_t *uris, *e;
+	unsigned int i, size;
 	sp_link *link;
-	char *buf = g_app->status;
 	char uri[512];
-	int i, n, r = sizeof(g_app->status);
 
-	/* Update app status */
-	n = 0;
+	if(g_app->uris_size) {
+		for(i = app_uri_hash(pl, g_app->uris_size); g_app->uris[i].pl != NULL;
+				i = (i + 1) & (g_app->uris_size - 1)) {
+			if(g_app->uris[i].pl == pl)
+				return g_app->uris[i].uri;
+		}
+	}
 
-	if(t == NULL)
-		n = snprintf(buf, r, "Current track: [not yet selected]\n");
-	else if(sp_track_is_loaded(t))
-		n = snprintf(buf, r, "Current track: %s - %s\n",
-			sp_track_name(t), sp_artist_name(sp_track_artist(t, 0)));
-	else
-		n = snprintf(buf, r, "Current track: [selected but not loaded]\n");
+	/* Keep the table at most half full */
+	if((g_app->uris_used + 1) * 2 > g_app->uris_size) {
+		size = g_app->uris_size? g_app->uris_size * 2: 64;
+		uris = calloc(size, sizeof(app_uri_t));
+		if(uris == NULL)
+			return "";
 
-	if(n > 0) buf += n, r -= n;
+		for(i = 0; i < g_app->uris_size; i++) {
+			if(g_app->uris[i].pl == NULL)
+				continue;
 
-	if(pl) {
-		memset(uri, 0, sizeof(uri));
-		link = sp_link_create_from_playlist(pl);
-		if(link) {
-			sp_link_as_string(link, uri, sizeof(uri));
-			sp_link_release(link);
+			for(e = &uris[app_uri_hash(g_app->uris[i].pl, size)]; e->pl != NULL;
+					e = &uris[(e - uris + 1) & (size - 1)]);
+			*e = g_app->uris[i];
 		}
 
-		n = snprintf(buf, r, "Current playlist: %s - %s (%d tracks)\n",
-			app_playlist_is_special_kind(pl)? "[starred or inbox]":
-			sp_playlist_name(pl), uri, sp_playlist_num_tracks(pl));
+		free(g_app->uris);
+		g_app->uris = uris;
+		g_app->uris_size = size;
 	}
-	else
-		n = snprintf(buf, r, "Current playlist: [not yet selected]\n");
 
-	if(n > 0) buf += n, r -= n;
+	memset(uri, 0, sizeof(uri));
+	link = sp_link_create_from_playlist(pl);
+	if(link == NULL) {
+		/* Not loaded yet, try again next time */
+		if(pl == g_app->active_playlist)
+			return g_app->active_uri;
+
+		return "";
+	}
+
+	sp_link_as_string(link, uri, sizeof(uri));
+	sp_link_release(link);
+
+	for(i = app_uri_hash(pl, g_app->uris_size); g_app->uris[i].pl != NULL;
+			i = (i + 1) & (g_app->uris_size - 1));
+	g_app->uris[i].pl = pl;
+	g_app->uris[i].uri = strdup(uri);
+	g_app->uris_used++;
+
+	return g_app->uris[i].uri != NULL? g_app->uris[i].uri: "";
+}
+
+/* Name of a playlist without making libspotify load it, or NULL */
+static const char *app_playlist_name(sp_playlist *pl) {
+
+	if(sp_playlist_is_loaded(pl))
+		return sp_playlist_name(pl);
+
+	/* As the metadata index last saw it */
+	if(pl == g_app->active_playlist && *g_app->active_uri)
+		return mdindex_playlist_name(g_app->active_uri);
+
+	return NULL;
+}
+
+static void app_status_offline_playlist(buf_t *b, const char *name, sp_playlist *pl) {
+	sp_playlist_offline_status plos;
+
+	plos = sp_playlist_get_offline_status(g_app->session, pl);
+	if(plos == SP_PLAYLIST_OFFLINE_STATUS_NO)
+		return;
+
+	buf_printf(b, "Offline playlist: %s - %s"
+		"(%d tracks, offline status: %s)\n",
+		name, app_playlist_uri(pl), sp_playlist_num_tracks(pl),
+		plos == SP_PLAYLIST_OFFLINE_STATUS_YES? "synced":
+		plos == SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING? "downloading":
+		plos == SP_PLAYLIST_OFFLINE_STATUS_WAITING? "pending for download":
+		"unknown");
+}
 
+/* Walks the whole playlist container, so only done when something changed */
+static void app_status_update_playlists(void) {
+	sp_playlistcontainer *pc = sp_session_playlistcontainer(g_app->session);
+	buf_t *b = &g_app->status_playlists;
+	struct timespec now;
+	const char *name;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(!g_app->status_dirty &&
+		now.tv_sec - g_app->status_built.tv_sec < APP_STATUS_MAX_AGE)
+		return;
+
+	buf_reset(b);
 	for(i = 0; pc && i < sp_playlistcontainer_num_playlists(pc); i++) {
-		pl = sp_playlistcontainer_playlist(pc, i);
-		plos = sp_playlist_get_offline_status(g_app->session, pl);
-		if(plos == SP_PLAYLIST_OFFLINE_STATUS_NO)
-			continue;
+		sp_playlist *pl = sp_playlistcontainer_playlist(pc, i);
 
-		memset(uri, 0, sizeof(uri));
-		link = sp_link_create_from_playlist(pl);
-		if(link) {
-			sp_link_as_string(link, uri, sizeof(uri));
-			sp_link_release(link);
-		}
+		name = app_playlist_name(pl);
+		app_status_offline_playlist(b, name? name: "[not loaded]", pl);
+	}
 
-		n = snprintf(buf, r, "Offline playlist: %s - %s"
-			"(%d tracks, offline status: %s)\n",
-			sp_playlist_name(pl), uri, sp_playlist_num_tracks(pl),
-			plos == SP_PLAYLIST_OFFLINE_STATUS_YES? "synced":
-			plos == SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING? "downloading":
-			plos == SP_PLAYLIST_OFFLINE_STATUS_WAITING? "pending for download":
-			"unknown");
-		if(n > 0) buf += n, r -= n;
-	}
-
-	if((pl = g_app->inbox) != NULL &&
-		(plos = sp_playlist_get_offline_status(g_app->session, pl))
-			!= SP_PLAYLIST_OFFLINE_STATUS_NO) {
-		memset(uri, 0, sizeof(uri));
-		link = sp_link_create_from_playlist(pl);
-		if(link) {
-			sp_link_as_string(link, uri, sizeof(uri));
-			sp_link_release(link);
-		}
+	if(g_app->inbox != NULL)
+		app_status_offline_playlist(b, "Inbox playlist", g_app->inbox);
 
-		n = snprintf(buf, r, "Offline playlist: Inbox playlist - %s"
-			"(%d tracks, offline status: %s)\n",
-			uri, sp_playlist_num_tracks(pl),
-			plos == SP_PLAYLIST_OFFLINE_STATUS_YES? "synced":
-			plos == SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING? "downloading":
-			plos == SP_PLAYLIST_OFFLINE_STATUS_WAITING? "pending for download":
-			"unknown");
-		if(n > 0) buf += n, r -= n;
-	}
-
-	if((pl = g_app->starred) != NULL &&
-		(plos = sp_playlist_get_offline_status(g_app->session, pl))
-			!= SP_PLAYLIST_OFFLINE_STATUS_NO) {
-		memset(uri, 0, sizeof(uri));
-		link = sp_link_create_from_playlist(pl);
-		if(link) {
-			sp_link_as_string(link, uri, sizeof(uri));
-			sp_link_release(link);
-		}
+	if(g_app->starred != NULL)
+		app_status_offline_playlist(b, "Starred playlist", g_app->starred);
+
+	g_app->status_dirty = 0;
+	g_app->status_built = now;
+
+	syslog(LOG_DEBUG, "App: Rebuilt offline playlist status (%d playlists, %u URIs cached)",
+		pc? sp_playlistcontainer_num_playlists(pc): 0, g_app->uris_used);
+}
+
+const char *app_get_status(void) {
+	sp_playlist *pl = g_app->active_playlist;
+	sp_track *t = app_get_track();
+	sp_offline_sync_status ss;
+	buf_t *b = &g_app->status;
+	unsigned long prefetch[PREFETCH_RESULTS], prefetch_requests;
+	mdindex_track_t cached;
+	size_t md_bytes;
+	char dev[512];
+	int i, md_tracks, md_playlists;
+	int elapsed, remaining;
+
+	buf_reset(b);
+
+	if(t == NULL)
+		buf_printf(b, "Current track: [not yet selected]\n");
+	else if(sp_track_is_loaded(t))
+		buf_printf(b, "Current track: %s - %s\n",
+			sp_track_name(t), sp_artist_name(sp_track_artist(t, 0)));
+	else if(mdindex_lookup_track(t, &cached) == 0 && *cached.title)
+		buf_printf(b, "Current track: %s - %s (not loaded, cached)\n",
+			cached.title, cached.artist);
+	else
+		buf_printf(b, "Current track: [selected but not loaded]\n");
 
-		n = snprintf(buf, r, "Offline playlist: Starred playlist - %s"
-			"(%d tracks, offline status: %s)\n",
-			uri, sp_playlist_num_tracks(pl),
-			plos == SP_PLAYLIST_OFFLINE_STATUS_YES? "synced":
-			plos == SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING? "downloading":
-			plos == SP_PLAYLIST_OFFLINE_STATUS_WAITING? "pending for download":
-			"unknown");
-		if(n > 0) buf += n, r -= n;
+	if(audio_get_device(dev, sizeof(dev), &i))
+		buf_printf(b, "Audio device: %s (open, %d failures)\n", dev, i);
+	else
+		buf_printf(b, "Audio device: %s (not open, %d failures)\n", dev, i);
+
+	{
+		audio_fifo_t *af = &g_app->audio_fifo;
+		struct timespec now;
+		double secs, audio_min;
+		unsigned long driver_wakeups;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = (now.tv_sec - g_app->stats_start.tv_sec)
+			+ (now.tv_nsec - g_app->stats_start.tv_nsec) / 1e9;
+
+		pthread_mutex_lock(&af->mutex);
+		audio_min = (af->played_us - g_app->stats_played_us) / 60e6;
+		driver_wakeups = af->driver_wakeups - g_app->stats_driver_wakeups;
+		pthread_mutex_unlock(&af->mutex);
+
+		buf_printf(b, "Power: %s mode, %.1f main loop and %.1f audio wakeups/s,"
+			" %.2fs CPU per minute of audio (%.1f minutes played)\n",
+			g_app->power_save? "power saving": "normal",
+			secs > 0? g_app->wakeups / secs: 0,
+			secs > 0? driver_wakeups / secs: 0,
+			audio_min > 0? (app_cpu_seconds() - g_app->stats_cpu) / audio_min: 0,
+			audio_min);
 	}
 
+	{
+		unsigned long requests, signals, deliveries;
+
+		reactor_get_wakeup_stats(&requests, &signals, &deliveries);
+		buf_printf(b, "Wakeups: %lu notifies, %lu signalled, %lu delivered"
+			" (%.1f notifies per wakeup)\n",
+			requests, signals, deliveries,
+			deliveries? (double)requests / deliveries: 0);
+	}
+
+	buf_printf(b, "Events: %lu posted, %lu coalesced, %lu dropped,"
+		" max queue depth %u, latency avg %.2fms max %.2fms\n",
+		__atomic_load_n(&g_app->events_posted, __ATOMIC_RELAXED),
+		__atomic_load_n(&g_app->events_coalesced, __ATOMIC_RELAXED),
+		__atomic_load_n(&g_app->events_dropped, __ATOMIC_RELAXED),
+		__atomic_load_n(&g_app->events_max_depth, __ATOMIC_RELAXED),
+		g_app->events_handled? g_app->events_latency_us / 1000.0 / g_app->events_handled: 0,
+		g_app->events_max_latency_us / 1000.0);
+
+	if(t != NULL && player_get_position(&elapsed, &remaining) == 0)
+		buf_printf(b, "Position: %d:%02d elapsed, %d:%02d remaining\n",
+			elapsed / 60000, (elapsed / 1000) % 60,
+			remaining / 60000, (remaining / 1000) % 60);
+
+	if(pl && app_playlist_is_special_kind(pl))
+		buf_printf(b, "Current playlist: [starred or inbox] - %s (%d tracks)\n",
+			app_playlist_uri(pl), sp_playlist_num_tracks(pl));
+	else if(pl && sp_playlist_is_loaded(pl))
+		buf_printf(b, "Current playlist: %s - %s (%d tracks)\n",
+			sp_playlist_name(pl), app_playlist_uri(pl), sp_playlist_num_tracks(pl));
+	else if(pl)
+		buf_printf(b, "Current playlist: %s - %s (not loaded)\n",
+			app_playlist_name(pl)? app_playlist_name(pl): "[not loaded]",
+			app_playlist_uri(pl));
+	else
+		buf_printf(b, "Current playlist: [not yet selected]\n");
+
+	if(pl && g_app->avail)
+		buf_printf(b, "Track availability: %d playable, %d unplayable, %d not yet known\n",
+			avail_count(g_app->avail, AVAIL_PLAYABLE),
+			avail_count(g_app->avail, AVAIL_UNPLAYABLE),
+			avail_count(g_app->avail, AVAIL_UNKNOWN));
+
+	prefetch_get_stats(prefetch, &prefetch_requests);
+	buf_printf(b, "Prefetch: %d of %d tracks held on %s connection, %lu audio hits, "
+		"%lu metadata only, %lu misses\n", prefetch_window(), g_app->prefetch_window,
+		app_get_connection_type(), prefetch[PREFETCH_AUDIO], prefetch[PREFETCH_METADATA],
+		prefetch[PREFETCH_MISS]);
+
+	mdindex_get_stats(&md_tracks, &md_playlists, &md_bytes);
+	buf_printf(b, "Metadata index: %d tracks in %d playlists, %lu bytes mapped\n",
+		md_tracks, md_playlists, (unsigned long)md_bytes);
+	search_get_stats(&md_tracks, &md_playlists, &md_bytes);
+	buf_printf(b, "Search index: %d tracks, %d words, %lu bytes\n",
+		md_tracks, md_playlists, (unsigned long)md_bytes);
+
+	if(playqueue_length() || playqueue_pending())
+		buf_printf(b, "Play queue: %d tracks (%d albums or playlists loading)\n",
+			playqueue_length(), playqueue_pending());
+
+	app_status_update_playlists();
+	buf_append(b, g_app->status_playlists.data, g_app->status_playlists.len);
+
 	if(sp_offline_sync_get_status(g_app->session, &ss))
-		n = snprintf(buf, r, "Offline status: %d tracks queued, %d tracks downloaded,"
+		buf_printf(b, "Offline status: %d tracks queued, %d tracks downloaded,"
 			" %d tracks done, %d tracks failed, %d tracks remaining,"
 			" syncing in progress: %s\n",
 			ss.queued_tracks, ss.copied_tracks,
@@ -225,14 +667,458 @@ static void app_update_status(void) {
 			sp_offline_tracks_to_sync(g_app->session),
 			ss.syncing? "yes": "no");
 	else 
-		n = snprintf(buf, r, "Offline status: No syncing in progress,"
+		buf_printf(b, "Offline status: No syncing in progress,"
 			"%d tracks remaining\n",
 			sp_offline_tracks_to_sync(g_app->session));
 
-	if(n > 0) buf += n, r -= n;
+	return buf_str(b);
+}
+
+static const char *app_offline_status_name(sp_playlist_offline_status plos) {
+
+	switch(plos) {
+	case SP_PLAYLIST_OFFLINE_STATUS_NO:
+		return "no";
+	case SP_PLAYLIST_OFFLINE_STATUS_YES:
+		return "synced";
+	case SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING:
+		return "downloading";
+	case SP_PLAYLIST_OFFLINE_STATUS_WAITING:
+		return "waiting";
+	}
+
+	return "unknown";
+}
+
+static void app_track_uri(sp_track *t, char *uri, size_t len) {
+	sp_link *link;
+
+	memset(uri, 0, len);
+	if((link = sp_link_create_from_track(t, 0)) != NULL) {
+		sp_link_as_string(link, uri, len);
+		sp_link_release(link);
+	}
+}
+
+static void app_status_json_playlist(json_t *j, const char *key, sp_playlist *pl, const char *name) {
+
+	json_object_begin(j, key);
+	json_string(j, "name", name);
+	json_string(j, "uri", app_playlist_uri(pl));
+	json_int(j, "tracks", sp_playlist_num_tracks(pl));
+	json_bool(j, "loaded", sp_playlist_is_loaded(pl));
+	json_string(j, "offline", app_offline_status_name(
+		sp_playlist_get_offline_status(g_app->session, pl)));
+	json_object_end(j);
+}
+
+/**
+ * Serialize status into out with a stable schema (see README), version
+ * APP_STATUS_JSON_VERSION.  Fields are only ever added, never renamed.
+ * Returns -1 if out could not be grown.
+ */
+int app_get_status_json(buf_t *out) {
+	sp_playlistcontainer *pc = sp_session_playlistcontainer(g_app->session);
+	sp_playlist *pl = g_app->active_playlist;
+	sp_track *t = app_get_track();
+	audio_fifo_t *af = &g_app->audio_fifo;
+	sp_offline_sync_status ss;
+	unsigned long requests, signals, deliveries;
+	char dev[512];
+	json_t j;
+	int i, failures, open, elapsed, remaining;
+	int qlen, latency, rate;
+	uint64_t played_us;
+	unsigned long driver_wakeups;
+
+	json_init(&j, out);
+	json_object_begin(&j, NULL);
+	json_string(&j, "type", "status");
+	json_int(&j, "version", APP_STATUS_JSON_VERSION);
+
+	if(t != NULL) {
+		mdindex_track_t cached;
+		char uri[256];
+
+		app_track_uri(t, uri, sizeof(uri));
+		json_object_begin(&j, "track");
+		json_bool(&j, "loaded", sp_track_is_loaded(t));
+		if(sp_track_is_loaded(t)) {
+			json_string(&j, "name", sp_track_name(t));
+			json_string(&j, "artist", sp_artist_name(sp_track_artist(t, 0)));
+			json_int(&j, "duration_ms", sp_track_duration(t));
+		}
+		else if(mdindex_find_track(uri, &cached) == 0 && *cached.title) {
+			/* As last seen, until libspotify has loaded the track */
+			json_string(&j, "name", cached.title);
+			json_string(&j, "artist", cached.artist);
+			json_int(&j, "duration_ms", cached.duration_ms);
+		}
+		else {
+			json_null(&j, "name");
+			json_null(&j, "artist");
+			json_int(&j, "duration_ms", sp_track_duration(t));
+		}
+		json_string(&j, "uri", uri);
+		if(player_get_position(&elapsed, &remaining) == 0) {
+			json_int(&j, "elapsed_ms", elapsed);
+			json_int(&j, "remaining_ms", remaining);
+		}
+		else {
+			json_null(&j, "elapsed_ms");
+			json_null(&j, "remaining_ms");
+		}
+		json_object_end(&j);
+	}
+	else
+		json_null(&j, "track");
+
+	if(pl != NULL)
+		app_status_json_playlist(&j, "playlist", pl,
+			app_playlist_is_special_kind(pl)? NULL: app_playlist_name(pl));
+	else
+		json_null(&j, "playlist");
+
+	json_object_begin(&j, "queue");
+	json_int(&j, "tracks", playqueue_length());
+	json_int(&j, "loading", playqueue_pending());
+	json_object_end(&j);
+
+	json_object_begin(&j, "offline");
+	if(sp_offline_sync_get_status(g_app->session, &ss)) {
+		json_bool(&j, "syncing", ss.syncing);
+		json_int(&j, "queued", ss.queued_tracks);
+		json_int(&j, "copied", ss.copied_tracks);
+		json_int(&j, "done", ss.done_tracks);
+		json_int(&j, "failed", ss.error_tracks);
+	}
+	else {
+		json_bool(&j, "syncing", 0);
+		json_int(&j, "queued", 0);
+		json_int(&j, "copied", 0);
+		json_int(&j, "done", 0);
+		json_int(&j, "failed", 0);
+	}
+	json_int(&j, "remaining", sp_offline_tracks_to_sync(g_app->session));
+
+	json_array_begin(&j, "playlists");
+	for(i = 0; pc && i < sp_playlistcontainer_num_playlists(pc); i++) {
+		sp_playlist *p = sp_playlistcontainer_playlist(pc, i);
+
+		if(sp_playlist_get_offline_status(g_app->session, p) != SP_PLAYLIST_OFFLINE_STATUS_NO)
+			app_status_json_playlist(&j, NULL, p, app_playlist_name(p));
+	}
+	if(g_app->inbox != NULL && sp_playlist_get_offline_status(g_app->session,
+			g_app->inbox) != SP_PLAYLIST_OFFLINE_STATUS_NO)
+		app_status_json_playlist(&j, NULL, g_app->inbox, "Inbox");
+	if(g_app->starred != NULL && sp_playlist_get_offline_status(g_app->session,
+			g_app->starred) != SP_PLAYLIST_OFFLINE_STATUS_NO)
+		app_status_json_playlist(&j, NULL, g_app->starred, "Starred");
+	json_array_end(&j);
+	json_object_end(&j);
+
+	open = audio_get_device(dev, sizeof(dev), &failures);
+	pthread_mutex_lock(&af->mutex);
+	qlen = af->qlen;
+	played_us = af->played_us;
+	driver_wakeups = af->driver_wakeups;
+	pthread_mutex_unlock(&af->mutex);
+	rate = player_get_rate();
+	latency = audio_get_latency(af, rate);
+
+	json_object_begin(&j, "audio");
+	json_string(&j, "device", dev);
+	json_bool(&j, "open", open);
+	json_int(&j, "failures", failures);
+	json_int(&j, "buffered_frames", qlen);
+	json_int(&j, "latency_ms", latency * 1000LL / rate);
+	json_int(&j, "buffer_max_ms", af->max_ms);
+	json_int(&j, "block_ms", af->block_ms);
+	json_int(&j, "played_ms", (long long)(played_us / 1000));
+	json_int(&j, "driver_wakeups", driver_wakeups);
+	json_bool(&j, "trim", player_get_trim());
+	json_bool(&j, "power_save", g_app->power_save);
+	json_object_end(&j);
+
+	reactor_get_wakeup_stats(&requests, &signals, &deliveries);
+	json_object_begin(&j, "mainloop");
+	json_int(&j, "wakeups", g_app->wakeups);
+	json_int(&j, "notifies", requests);
+	json_int(&j, "notifies_signalled", signals);
+	json_int(&j, "notifies_delivered", deliveries);
+	json_int(&j, "events_posted", __atomic_load_n(&g_app->events_posted, __ATOMIC_RELAXED));
+	json_int(&j, "events_coalesced", __atomic_load_n(&g_app->events_coalesced, __ATOMIC_RELAXED));
+	json_int(&j, "events_dropped", __atomic_load_n(&g_app->events_dropped, __ATOMIC_RELAXED));
+	json_int(&j, "events_max_depth", __atomic_load_n(&g_app->events_max_depth, __ATOMIC_RELAXED));
+	json_double(&j, "event_latency_avg_ms", g_app->events_handled?
+		g_app->events_latency_us / 1000.0 / g_app->events_handled: 0);
+	json_double(&j, "event_latency_max_ms", g_app->events_max_latency_us / 1000.0);
+	json_object_end(&j);
+
+	json_object_end(&j);
+
+	return json_finish(&j);
+}
+
+/* Start an event for subscribed control clients, see net_publish() */
+static int app_notify_begin(json_t *j, int topic, const char *type) {
+
+	if(!net_has_subscribers(topic))
+		return -1;
+
+	buf_reset(&g_app->notify);
+	json_init(j, &g_app->notify);
+	json_object_begin(j, NULL);
+	json_string(j, "type", type);
+
+	return 0;
+}
+
+static void app_notify_end(json_t *j, int topic) {
+
+	json_object_end(j);
+	if(json_finish(j) == 0)
+		net_publish(topic, g_app->notify.data, g_app->notify.len);
+}
+
+static void app_notify_track(void) {
+	sp_track *t = app_get_track();
+	char uri[256];
+	json_t j;
+
+	if(t == NULL || app_notify_begin(&j, NET_TOPIC_TRACK, "track") < 0)
+		return;
+
+	app_track_uri(t, uri, sizeof(uri));
+	json_string(&j, "uri", uri);
+	json_string(&j, "name", sp_track_name(t));
+	json_string(&j, "artist", sp_artist_name(sp_track_artist(t, 0)));
+	json_int(&j, "duration_ms", sp_track_duration(t));
+	app_notify_end(&j, NET_TOPIC_TRACK);
+}
+
+static void app_notify_playback(const char *state) {
+	json_t j;
+
+	if(app_notify_begin(&j, NET_TOPIC_PLAYBACK, "playback") < 0)
+		return;
+
+	json_string(&j, "state", state);
+	app_notify_end(&j, NET_TOPIC_PLAYBACK);
+}
+
+/* Active playlist selected or its tracks changed */
+void app_notify_playlist(sp_playlist *pl) {
+	json_t j;
+
+	if(pl != g_app->active_playlist
+		|| app_notify_begin(&j, NET_TOPIC_PLAYLIST, "playlist") < 0)
+		return;
+
+	json_string(&j, "name", app_playlist_is_special_kind(pl)? NULL: app_playlist_name(pl));
+	json_string(&j, "uri", app_playlist_uri(pl));
+	json_int(&j, "tracks", sp_playlist_num_tracks(pl));
+	json_bool(&j, "loaded", sp_playlist_is_loaded(pl));
+	app_notify_end(&j, NET_TOPIC_PLAYLIST);
+}
+
+/* Offline sync progress, called from the offline_status_updated callback */
+void app_notify_offline(void) {
+	sp_offline_sync_status ss;
+	json_t j;
+
+	if(app_notify_begin(&j, NET_TOPIC_OFFLINE, "offline") < 0)
+		return;
+
+	if(!sp_offline_sync_get_status(g_app->session, &ss))
+		memset(&ss, 0, sizeof(ss));
+
+	json_bool(&j, "syncing", ss.syncing);
+	json_int(&j, "done", ss.done_tracks);
+	json_int(&j, "failed", ss.error_tracks);
+	json_int(&j, "remaining", sp_offline_tracks_to_sync(g_app->session));
+	json_int(&j, "playlists", sp_offline_num_playlists(g_app->session));
+	app_notify_end(&j, NET_TOPIC_OFFLINE);
+}
+
+static void app_notify_underrun(void) {
+	json_t j;
+
+	if(app_notify_begin(&j, NET_TOPIC_UNDERRUN, "underrun") < 0)
+		return;
+
+	json_int(&j, "count", __atomic_load_n(&g_app->audio_fifo.underruns, __ATOMIC_RELAXED));
+	app_notify_end(&j, NET_TOPIC_UNDERRUN);
+}
+
+/* Called on the audio thread, the event is handled by the main thread */
+static void app_audio_underrun(void) {
+
+	app_post_event(APP_UNDERRUN);
+}
+
+static int app_metric(buf_t *b, const char *name, const char *type,
+		const char *help, double value) {
+
+	return buf_printf(b, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n",
+		name, help, name, type, name, value);
+}
+
+static int app_metric_histogram(buf_t *b, const char *name, const char *help,
+		const app_histogram_t *h) {
+	unsigned long cumulative = 0;
+	int i, ret;
+
+	ret = buf_printf(b, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for(i = 0; i < h->num_bounds && ret >= 0; i++) {
+		cumulative += h->buckets[i];
+		ret = buf_printf(b, "%s_bucket{le=\"%g\"} %lu\n", name, h->bounds[i], cumulative);
+	}
+	if(ret >= 0)
+		ret = buf_printf(b, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9g\n%s_count %lu\n",
+			name, h->count, name, h->sum, name, h->count);
+
+	return ret;
+}
+
+/**
+ * Format metrics in the Prometheus text exposition format, served on
+ * /metrics.  Returns -1 if out could not be grown.
+ */
+int app_get_metrics(buf_t *out) {
+	audio_fifo_t *af = &g_app->audio_fifo;
+	sp_offline_sync_status ss;
+	unsigned long requests, signals, deliveries;
+	unsigned long accepted, rejected, evicted, udp_commands, udp_duplicates;
+	unsigned long prefetch[PREFETCH_RESULTS], prefetch_requests;
+	uint64_t played_us;
+	unsigned long driver_wakeups;
+	int qlen, clients, failures, open, rate, err = 0;
+	char dev[512];
+
+	rate = player_get_rate();
+	open = audio_get_device(dev, sizeof(dev), &failures);
+	pthread_mutex_lock(&af->mutex);
+	qlen = af->qlen;
+	played_us = af->played_us;
+	driver_wakeups = af->driver_wakeups;
+	pthread_mutex_unlock(&af->mutex);
+
+	err |= app_metric(out, "boombox_audio_buffered_frames", "gauge",
+		"Frames queued in the audio FIFO.", qlen);
+	err |= app_metric(out, "boombox_audio_latency_seconds", "gauge",
+		"Audio buffered between delivery and the speaker.",
+		audio_get_latency(af, rate) / (double)rate);
+	err |= app_metric(out, "boombox_audio_buffer_max_seconds", "gauge",
+		"Capacity of the audio FIFO.", af->max_ms / 1000.0);
+	err |= app_metric(out, "boombox_audio_underruns_total", "counter",
+		"Times the audio device ran out of audio.",
+		__atomic_load_n(&af->underruns, __ATOMIC_RELAXED));
+	err |= app_metric(out, "boombox_audio_played_seconds_total", "counter",
+		"Audio handed to the audio device.", played_us / 1e6);
+	err |= app_metric(out, "boombox_audio_driver_wakeups_total", "counter",
+		"Wakeups of the audio output thread.", driver_wakeups);
+	err |= app_metric(out, "boombox_audio_device_open", "gauge",
+		"Whether the audio device is open.", open);
+	err |= app_metric(out, "boombox_audio_device_failures", "gauge",
+		"Consecutive failures to open the audio device.", failures);
+	err |= app_metric(out, "boombox_power_save", "gauge",
+		"Whether power saving mode is enabled.", g_app->power_save);
+
+	err |= app_metric_histogram(out, "boombox_skip_latency_seconds",
+		"Time from a skip request until the next track starts playing.",
+		&g_app->skip_hist);
+	err |= app_metric_histogram(out, "boombox_next_to_playable_seconds",
+		"Time from picking the next track until a playable one is found.",
+		&g_app->playable_hist);
+	prefetch_get_stats(prefetch, &prefetch_requests);
+	err |= app_metric(out, "boombox_skips_coalesced_total", "counter",
+		"Skip requests taken together with an earlier one.", g_app->skips_coalesced);
+	err |= app_metric(out, "boombox_skip_loads_avoided_total", "counter",
+		"Tracks skipped past without being loaded.", g_app->skip_loads_avoided);
+	err |= app_metric(out, "boombox_prefetch_hits_total", "counter",
+		"Tracks played whose audio had been prefetched.", prefetch[PREFETCH_AUDIO]);
+	err |= app_metric(out, "boombox_prefetch_warm_total", "counter",
+		"Tracks played whose metadata had been held, but no audio prefetched.",
+		prefetch[PREFETCH_METADATA]);
+	err |= app_metric(out, "boombox_prefetch_misses_total", "counter",
+		"Tracks played that weren't in the prefetch window.", prefetch[PREFETCH_MISS]);
+	err |= app_metric(out, "boombox_prefetch_requests_total", "counter",
+		"Audio prefetches requested.", prefetch_requests);
+	err |= app_metric(out, "boombox_unplayable_skipped_total", "counter",
+		"Unplayable tracks passed over without waiting for them to load.",
+		g_app->unplayable_skipped);
+	err |= app_metric(out, "boombox_unplayable_loaded_total", "counter",
+		"Tracks found unplayable only once picked and loaded.",
+		g_app->unplayable_loaded);
+	err |= app_metric(out, "boombox_playlist_tracks_playable", "gauge",
+		"Tracks of the active playlist known to be playable.",
+		g_app->avail? avail_count(g_app->avail, AVAIL_PLAYABLE): 0);
+	err |= app_metric(out, "boombox_playlist_tracks_unplayable", "gauge",
+		"Tracks of the active playlist known to be unplayable.",
+		g_app->avail? avail_count(g_app->avail, AVAIL_UNPLAYABLE): 0);
+	err |= app_metric_histogram(out, "boombox_mainloop_iteration_seconds",
+		"Time spent by the main loop per wakeup.", &g_app->loop_hist);
+
+	reactor_get_wakeup_stats(&requests, &signals, &deliveries);
+	err |= app_metric(out, "boombox_mainloop_notifies_total", "counter",
+		"Main loop wakeups requested by other threads.", requests);
+	err |= app_metric(out, "boombox_mainloop_notifies_signalled_total", "counter",
+		"Main loop wakeups actually signalled.", signals);
+	err |= app_metric(out, "boombox_events_posted_total", "counter",
+		"Application events queued.",
+		__atomic_load_n(&g_app->events_posted, __ATOMIC_RELAXED));
+	err |= app_metric(out, "boombox_events_coalesced_total", "counter",
+		"Application events merged into one already queued.",
+		__atomic_load_n(&g_app->events_coalesced, __ATOMIC_RELAXED));
+	err |= app_metric(out, "boombox_events_dropped_total", "counter",
+		"Application events dropped on a full queue.",
+		__atomic_load_n(&g_app->events_dropped, __ATOMIC_RELAXED));
+	err |= app_metric(out, "boombox_events_queue_max_depth", "gauge",
+		"Deepest the application event queue has been.",
+		__atomic_load_n(&g_app->events_max_depth, __ATOMIC_RELAXED));
+
+	if(!sp_offline_sync_get_status(g_app->session, &ss))
+		memset(&ss, 0, sizeof(ss));
+	err |= app_metric(out, "boombox_offline_syncing", "gauge",
+		"Whether offline sync is in progress.", ss.syncing);
+	err |= app_metric(out, "boombox_offline_tracks_queued", "gauge",
+		"Tracks queued by the current offline sync.", ss.queued_tracks);
+	err |= app_metric(out, "boombox_offline_tracks_done", "gauge",
+		"Tracks synced by the current offline sync.", ss.done_tracks);
+	err |= app_metric(out, "boombox_offline_tracks_failed", "gauge",
+		"Tracks that failed to sync in the current offline sync.", ss.error_tracks);
+	err |= app_metric(out, "boombox_offline_tracks_remaining", "gauge",
+		"Tracks left to sync for offline use.",
+		sp_offline_tracks_to_sync(g_app->session));
+	err |= app_metric(out, "boombox_offline_playlists", "gauge",
+		"Playlists marked for offline use.",
+		sp_offline_num_playlists(g_app->session));
+
+	net_get_stats(&clients, &accepted, &rejected, &evicted);
+	err |= app_metric(out, "boombox_control_clients", "gauge",
+		"Connected control and HTTP clients.", clients);
+	err |= app_metric(out, "boombox_control_accepted_total", "counter",
+		"Control and HTTP connections accepted.", accepted);
+	err |= app_metric(out, "boombox_control_rejected_total", "counter",
+		"Control and HTTP connections rejected.", rejected);
+	err |= app_metric(out, "boombox_control_evicted_total", "counter",
+		"Clients disconnected for not keeping up with their output.", evicted);
+
+	net_get_udp_stats(&udp_commands, &udp_duplicates, &rejected);
+	err |= app_metric(out, "boombox_udp_commands_total", "counter",
+		"Commands run from UDP remote control datagrams.", udp_commands);
+	err |= app_metric(out, "boombox_udp_duplicates_total", "counter",
+		"Retransmitted or stale UDP datagrams that were only acknowledged.", udp_duplicates);
+	err |= app_metric(out, "boombox_udp_rejected_total", "counter",
+		"UDP datagrams dropped for a bad MAC.", rejected);
+
+	return err < 0? -1: 0;
 }
 
 static void app_set_inbox(sp_session *session) {
+	app_status_invalidate(APP_STATUS_URIS);
+
 	if(g_app->inbox) {
 		playlist_monitor(g_app->inbox, 0);
 		sp_playlist_release(g_app->inbox);
@@ -246,6 +1132,8 @@ static void app_set_inbox(sp_session *session) {
 }
 
 static void app_set_starred(sp_session *session) {
+	app_status_invalidate(APP_STATUS_URIS);
+
 	if(g_app->starred) {
 		playlist_monitor(g_app->starred, 0);
 		sp_playlist_release(g_app->starred);
@@ -281,6 +1169,12 @@ sp_track *app_get_track(void) {
 	return g_app->track;
 }
 
+/* Current track is from the active playlist, not the play queue */
+static int app_playlist_track_playing(void) {
+
+	return g_app->track != NULL && !g_app->track_queued;
+}
+
 static int app_playlist_is_special_kind(sp_playlist *pl) {
 	if(pl == g_app->inbox || pl == g_app->starred)
 		return 1;
@@ -288,28 +1182,49 @@ static int app_playlist_is_special_kind(sp_playlist *pl) {
 	return 0;
 }
 
+sp_playlist *app_get_active_playlist(void) {
+
+	return g_app->active_playlist;
+}
+
 /* Set playlist to select tracks from */
 static sp_playlist *app_set_active_playlist(sp_playlist *pl) {
 	if(g_app->active_playlist) {
+		/* Its last reference may be dropped below */
+		app_status_invalidate(APP_STATUS_URIS);
 
 		if(!app_playlist_is_special_kind(g_app->active_playlist)) {
 			/* stop monitoring for track changes */
 			playlist_monitor(g_app->active_playlist, 0);
+
+			/* Only keep the playlists in use loaded (-L) */
+			if(g_app->lazy_playlists && g_app->active_playlist != pl
+				&& !playqueue_holds(g_app->active_playlist)) {
+				syslog(LOG_DEBUG, "App: Unloading previous playlist");
+				sp_playlist_set_in_ram(g_app->session, g_app->active_playlist, 0);
+			}
 		}
 
 		sp_playlist_release(g_app->active_playlist);
 		g_app->active_playlist = NULL;
 
-		if(g_app->randomized_track_idx) {
-			free(g_app->randomized_track_idx);
-			g_app->randomized_track_idx = NULL;
-		}
+		shuffle_release(g_app->shuffle);
+		g_app->shuffle = NULL;
+		avail_release(g_app->avail);
+		g_app->avail = NULL;
 	}
 
-	if(pl == NULL)
+	if(pl == NULL) {
+		g_app->active_uri[0] = 0;
 		return NULL;
+	}
 
 	sp_playlist_add_ref(pl);
+
+	/* Left unloaded at login (-L), so have libspotify load this one */
+	if(g_app->lazy_playlists && !sp_playlist_is_in_ram(g_app->session, pl))
+		sp_playlist_set_in_ram(g_app->session, pl, 1);
+
 	if(!app_playlist_is_special_kind(pl)) {
 		sp_error error;
 
@@ -321,11 +1236,13 @@ static sp_playlist *app_set_active_playlist(sp_playlist *pl) {
 
 	g_app->active_playlist = pl;
 	g_app->playlist_track_idx = 0;
-	app_randomize_playlist_order();
+	app_randomize_playlist_order(1);
 	syslog(LOG_INFO, "App: Selected playlist '%s' with %d tracks (loaded: %d)",
 		app_playlist_is_special_kind(pl)?
-		"internal (inbox or starred)": sp_playlist_name(pl),
+		"internal (inbox or starred)": app_playlist_name(pl)?
+		app_playlist_name(pl): app_playlist_uri(pl),
 		sp_playlist_num_tracks(pl), sp_playlist_is_loaded(pl));
+	app_notify_playlist(pl);
 
 	return pl;
 }
@@ -335,52 +1252,404 @@ sp_playlist *app_set_active_playlist_link(sp_link *link) {
 	sp_playlist *pl;
 
 	pl = sp_playlist_create(g_app->session, link);
+
+	/* Its name and URI can't be had from libspotify before it's loaded */
+	sp_link_as_string(link, g_app->active_uri, sizeof(g_app->active_uri));
+
 	return app_set_active_playlist(pl);
 }
 
-void app_randomize_playlist_order(void) {
-	int *arr;
-	int i, r, t;
-	int num;
+/* Make the playlist at uri active; returns NULL or an error message */
+const char *app_set_playlist_uri(const char *uri) {
+	const char *error = NULL;
+	sp_link *link;
+
+	link = sp_link_create_from_string(uri);
+	if(!link) {
+		syslog(LOG_WARNING, "App: Not a Spotify URI '%s'", uri);
+		return "not a Spotify URI";
+	}
 
-	if(g_app->randomized_track_idx != NULL) {
-		free(g_app->randomized_track_idx);
-		g_app->randomized_track_idx = NULL;
+	switch(sp_link_type(link)) {
+	case SP_LINKTYPE_INVALID:
+		syslog(LOG_WARNING, "App: Invalid Spotify URI '%s'", uri);
+		error = "invalid Spotify URI";
+		break;
+	case SP_LINKTYPE_PLAYLIST:
+	case SP_LINKTYPE_STARRED:
+		syslog(LOG_NOTICE, "App: Spotify URI is of type playlist");
+		if(app_set_active_playlist_link(link))
+			app_set_track(NULL);
+		else
+			error = "failed to make playlist active";
+		break;
+	default:
+		syslog(LOG_NOTICE, "App: Unhandled Spotify URI with type: %d", sp_link_type(link));
+		error = "only URIs of type playlist suppported";
+		break;
 	}
 
+	sp_link_release(link);
+
+	return error;
+}
+
+/* Spread key for an artist or album name, 0 if it isn't known */
+static uintptr_t app_shuffle_key(const char *name, uint32_t salt) {
+	uint32_t h;
+
+	if(name == NULL || *name == 0)
+		return 0;
+
+	/* 0 stands for not known */
+	h = mdindex_hash(name) ^ salt * 0x9e3779b9u;
+
+	return h? h: 1;
+}
+
+/**
+ * Artist and album of every track in the playlist for spread mode, NULL
+ * if out of memory.  Tracks without metadata yet are shuffled at random.
+ */
+static shuffle_key_t *app_shuffle_keys(sp_playlist *pl, int num_tracks) {
+	shuffle_key_t *keys;
+	mdindex_track_t cached;
+	const char *artist, *album;
+	sp_track *t;
+	int i;
+
+	if((keys = calloc(num_tracks + 1, sizeof(shuffle_key_t))) == NULL)
+		return NULL;
+
+	/* Keyed on names rather than libspotify objects, so tracks not loaded
+	   yet can go by what the metadata index last saw of them.  An album is
+	   told apart by artist too, there are many called "Greatest Hits" */
+	for(i = 0; i < num_tracks; i++) {
+		t = sp_playlist_track(pl, i);
+		if(t == NULL)
+			continue;
+
+		if(sp_track_is_loaded(t)) {
+			artist = sp_track_num_artists(t) > 0?
+				sp_artist_name(sp_track_artist(t, 0)): NULL;
+			album = sp_track_album(t) != NULL?
+				sp_album_name(sp_track_album(t)): NULL;
+		}
+		else if(mdindex_lookup_track(t, &cached) == 0) {
+			artist = cached.artist;
+			album = cached.album;
+		}
+		else
+			continue;
+
+		keys[i].artist = app_shuffle_key(artist, 0);
+		keys[i].album = app_shuffle_key(album, artist != NULL? mdindex_hash(artist): 0);
+	}
+
+	return keys;
+}
+
+/**
+ * Read the shuffle saved by app_save_shuffle_state(); only used if it was
+ * for the same playlist with the same number of tracks.
+ */
+static int app_load_shuffle_state(sp_playlist *pl, int num_tracks, uint64_t *seed,
+		int *spread, int *index) {
+	char uri[256];
+	unsigned long long saved_seed;
+	int saved_spread, saved_index, saved_tracks, ret = -1;
+	FILE *fp;
+
+	if((fp = fopen(APP_SHUFFLE_STATE_FILE, "r")) == NULL)
+		return -1;
+
+	if(fscanf(fp, "%255s %llu %d %d %d", uri, &saved_seed, &saved_spread,
+			&saved_index, &saved_tracks) == 5
+		&& !strcmp(uri, app_playlist_uri(pl)) && saved_tracks == num_tracks
+		&& saved_index >= 0 && saved_index < num_tracks) {
+		*seed = saved_seed;
+		*spread = saved_spread;
+		*index = saved_index;
+		ret = 0;
+	}
+
+	fclose(fp);
+
+	return ret;
+}
+
+/* Remember the shuffle and current index so they survive a restart */
+static void app_save_shuffle_state(void) {
+	FILE *fp;
+
+	if(g_app->shuffle == NULL || (fp = fopen(APP_SHUFFLE_STATE_FILE ".tmp", "w")) == NULL)
+		return;
+
+	fprintf(fp, "%s %llu %d %d %d\n", app_playlist_uri(g_app->active_playlist),
+		(unsigned long long)shuffle_seed(g_app->shuffle), g_app->shuffle_spread,
+		g_app->playlist_track_idx, shuffle_size(g_app->shuffle));
+
+	if(fclose(fp) == 0)
+		rename(APP_SHUFFLE_STATE_FILE ".tmp", APP_SHUFFLE_STATE_FILE);
+}
+
+/* Shuffle the active playlist; with resume, pick up a saved shuffle of it */
+static void app_randomize_playlist_order(int resume) {
+	shuffle_key_t *keys = NULL;
+	uint64_t seed = g_app->shuffle_seed;
+	int num_tracks, index;
+
+	shuffle_release(g_app->shuffle);
+	g_app->shuffle = NULL;
+
 	if(g_app->active_playlist == NULL)
 		return;
 
-	num = sp_playlist_num_tracks(g_app->active_playlist);
+	num_tracks = sp_playlist_num_tracks(g_app->active_playlist);
+	if(resume && num_tracks > 0 && app_load_shuffle_state(g_app->active_playlist, num_tracks,
+			&seed, &g_app->shuffle_spread, &index) == 0) {
+		syslog(LOG_INFO, "App: Resuming shuffle with seed %llu at track %d/%d",
+			(unsigned long long)seed, index + 1, num_tracks);
+		g_app->playlist_track_idx = index;
+	}
+
+	if(g_app->shuffle_spread)
+		keys = app_shuffle_keys(g_app->active_playlist, num_tracks);
+
+	/* What's known about the tracks holds whatever their order */
+	if(g_app->avail == NULL || avail_size(g_app->avail) != num_tracks) {
+		avail_release(g_app->avail);
+		g_app->avail = avail_create(num_tracks);
+	}
+
+	reactor_timer_set(g_app->avail_timer, 0);
+
+	g_app->shuffle = shuffle_create(num_tracks, seed, keys);
+	if(g_app->shuffle == NULL)
+		syslog(LOG_WARNING, "App: Out of memory, playing tracks in playlist order");
+	else
+		syslog(LOG_DEBUG, "App: Shuffled %d tracks with seed %llu%s", num_tracks,
+			(unsigned long long)shuffle_seed(g_app->shuffle), keys? ", spread": "");
 
-	arr = malloc(sizeof(int) * num);
-	if(arr == NULL)
+	free(keys);
+}
+
+/**
+ * Shuffle the active playlist again, with seed or a random one if 0.
+ * The current track plays on and the new order starts with the next.
+ */
+void app_reshuffle(uint64_t seed) {
+
+	g_app->shuffle_seed = seed;
+	if(g_app->active_playlist == NULL)
 		return;
 
-	for(i = 0; i < num; i++)
-		arr[i] = i;
+	g_app->playlist_track_idx = app_playlist_track_playing()? -1: 0;
+	app_randomize_playlist_order(0);
+	app_save_shuffle_state();
+}
 
-	srand(time(NULL));
-	for(i = num - 1; i > 0; i--) {
-		r = rand() % i;
+void app_set_shuffle_spread(int enable) {
+
+	if(g_app->shuffle_spread == enable)
+		return;
+
+	g_app->shuffle_spread = enable;
+	app_reshuffle(g_app->shuffle_seed);
+}
+
+int app_get_shuffle_spread(void) {
+
+	return g_app->shuffle_spread;
+}
+
+/* Seed of the current shuffle, 0 if there's none */
+uint64_t app_get_shuffle_seed(void) {
+
+	return g_app->shuffle? shuffle_seed(g_app->shuffle): 0;
+}
+
+/* Playlist position of the track at index in the play order */
+static int app_shuffled_track(int index) {
+	int i;
+
+	if(g_app->shuffle == NULL || (i = shuffle_track(g_app->shuffle, index)) < 0)
+		return index;
+
+	return i;
+}
 
-		t = arr[i];
-		arr[i] = arr[r];
-		arr[r] = t;
+/**
+ * Keep the play order in step with edits of the active playlist.  Tracks
+ * played so far keep their place, new tracks are shuffled in among the
+ * rest and the current index follows the current track.
+ */
+void app_playlist_tracks_added(sp_playlist *pl, int position, int num_tracks) {
+	int played;
+
+	if(pl != g_app->active_playlist || g_app->shuffle == NULL)
+		return;
+
+	/* Shuffle the whole playlist once it's loaded, in one go */
+	if(shuffle_size(g_app->shuffle) == 0) {
+		app_randomize_playlist_order(1);
+		return;
+	}
+
+	if(g_app->avail != NULL && avail_insert(g_app->avail, position, num_tracks) < 0) {
+		avail_release(g_app->avail);
+		g_app->avail = NULL;
 	}
 
-	g_app->randomized_track_idx = arr;
+	played = g_app->playlist_track_idx + app_playlist_track_playing();
+	if(shuffle_insert(g_app->shuffle, position, num_tracks, played) < 0)
+		app_randomize_playlist_order(0);
+	else
+		reactor_timer_set(g_app->avail_timer, 0);
+}
+
+static int app_compare_desc(const void *a, const void *b) {
+
+	return *(const int *)b - *(const int *)a;
+}
+
+void app_playlist_tracks_removed(sp_playlist *pl, const int *tracks, int num_tracks) {
+	int *sorted, i, index;
+
+	if(pl != g_app->active_playlist || g_app->shuffle == NULL)
+		return;
+
+	if((sorted = malloc(num_tracks * sizeof(int))) == NULL) {
+		app_randomize_playlist_order(0);
+		return;
+	}
+
+	/* Positions are from before the removal, so start from the end */
+	memcpy(sorted, tracks, num_tracks * sizeof(int));
+	qsort(sorted, num_tracks, sizeof(int), app_compare_desc);
+
+	for(i = 0; i < num_tracks; i++) {
+		if(g_app->avail != NULL)
+			avail_remove(g_app->avail, sorted[i]);
+
+		if((index = shuffle_remove(g_app->shuffle, sorted[i])) < 0)
+			continue;
+
+		/* The next track follows the one still playing */
+		if(index < g_app->playlist_track_idx
+			|| (index == g_app->playlist_track_idx && app_playlist_track_playing()))
+			g_app->playlist_track_idx--;
+	}
+
+	free(sorted);
+}
+
+void app_playlist_tracks_moved(sp_playlist *pl, const int *tracks, int num_tracks, int new_position) {
+
+	if(pl != g_app->active_playlist || g_app->shuffle == NULL)
+		return;
+
+	shuffle_move(g_app->shuffle, tracks, num_tracks, new_position);
+	if(g_app->avail != NULL)
+		avail_move(g_app->avail, tracks, num_tracks, new_position);
+}
+
+/* Swap the first offline synced track within reach into the current position */
+static void app_prefer_offline_track(sp_playlist *pl, int num_tracks) {
+	int i, pos;
+	sp_track *track;
+
+	if(g_app->shuffle == NULL)
+		return;
+
+	for(i = 0; i < APP_POWERSAVE_LOOKAHEAD && i < num_tracks; i++) {
+		pos = (g_app->playlist_track_idx + i) % num_tracks;
+		track = sp_playlist_track(pl, app_shuffled_track(pos));
+		if(track == NULL || !sp_track_is_loaded(track)
+			|| sp_track_offline_get_status(track) != SP_TRACK_OFFLINE_DONE)
+			continue;
+
+		shuffle_swap(g_app->shuffle, pos, g_app->playlist_track_idx);
+		return;
+	}
+}
+
+/**
+ * Move the cursor past count tracks as if each had been selected in turn,
+ * without looking them up, loading them or saving the shuffle state.  The
+ * next app_do_next_track() then selects the track after those.
+ */
+static void app_skip_ahead(int count) {
+	sp_track *track;
+	sp_playlist *pl = g_app->active_playlist;
+	int num_tracks, playing;
+
+	/* Whether the last track passed over came from the playlist */
+	playing = app_playlist_track_playing();
+
+	for(; count > 0; count--) {
+		if((track = playqueue_pop()) != NULL) {
+			sp_track_release(track);
+			g_app->playlist_track_idx += playing;
+			playing = 0;
+			continue;
+		}
+
+		if(pl == NULL || (num_tracks = sp_playlist_num_tracks(pl)) == 0)
+			break;
+
+		g_app->playlist_track_idx = (g_app->playlist_track_idx + playing) % num_tracks;
+		playing = 1;
+
+		if(g_app->avail == NULL
+			|| avail_count(g_app->avail, AVAIL_UNPLAYABLE) >= num_tracks)
+			continue;
+
+		while(avail_get(g_app->avail,
+				app_shuffled_track(g_app->playlist_track_idx)) == AVAIL_UNPLAYABLE)
+			g_app->playlist_track_idx = (g_app->playlist_track_idx + 1) % num_tracks;
+	}
+
+	/* app_do_next_track() steps past the current track if it's from the
+	   playlist, make that step past the last one skipped instead */
+	g_app->playlist_track_idx += playing - app_playlist_track_playing();
 }
 
 /* Advance to next track and start playing */
 sp_track *app_do_next_track(void) {
 	sp_track *track;
 	sp_playlist *pl;
-	int i, num_tracks;
+	int i, num_tracks, skipped;
+
+	/* Timed until a track turns out playable, across unplayable ones */
+	if(!g_app->next_pending) {
+		clock_gettime(CLOCK_MONOTONIC, &g_app->next_start);
+		g_app->next_pending = 1;
+	}
+
+	/* Queued tracks go first, the playlist picks up where it left off */
+	if((track = playqueue_pop()) != NULL) {
+		if(app_playlist_track_playing())
+			++g_app->playlist_track_idx;
+
+		prefetch_lookup(track);
+		app_set_track(track);
+		sp_track_release(track);
+		g_app->track_queued = 1;
+		syslog(LOG_NOTICE, "App: Selected next track from the play queue (%d left): %s",
+			playqueue_length(), sp_track_name(track));
+
+		g_app->waits |= APP_WAIT_PLAY;
+		app_post_event(APP_DO_METADATA);
+		app_post_event(APP_DO_PREFETCH);
+
+		return track;
+	}
 
 	pl = g_app->active_playlist;
 	if(pl == NULL) {
 		syslog(LOG_WARNING, "App: Attempted 'next track' without an active playlist");
+		g_app->next_pending = 0;
 		return NULL;
 	}
 
@@ -388,26 +1657,58 @@ sp_track *app_do_next_track(void) {
 	if(num_tracks == 0) {
 		syslog(LOG_WARNING, "App: Attempted 'next track' on %s playlist with zero tracks",
 			sp_playlist_is_loaded(pl)? "loaded": "not yet loaded");
+		g_app->next_pending = 0;
 		return NULL;
 	}
 
-	track = app_get_track();
-	if(track != NULL)
+	if(app_playlist_track_playing())
 		++g_app->playlist_track_idx;
 
 	g_app->playlist_track_idx %= num_tracks;
 
-	i = g_app->randomized_track_idx[g_app->playlist_track_idx];
+	/* Keep the radio idle by preferring tracks that are already synced */
+	if(g_app->power_save)
+		app_prefer_offline_track(pl, num_tracks);
+
+	/* Pass over tracks already known to be unplayable */
+	if(g_app->avail != NULL) {
+		if(avail_count(g_app->avail, AVAIL_UNPLAYABLE) >= num_tracks) {
+			syslog(LOG_WARNING, "App: None of the %d tracks in the playlist can be played",
+				num_tracks);
+			app_set_track(NULL);
+			g_app->next_pending = 0;
+			return NULL;
+		}
+
+		for(skipped = 0; avail_get(g_app->avail,
+				app_shuffled_track(g_app->playlist_track_idx)) == AVAIL_UNPLAYABLE; skipped++)
+			g_app->playlist_track_idx = (g_app->playlist_track_idx + 1) % num_tracks;
+
+		if(skipped)
+			syslog(LOG_INFO, "App: Skipped %d unplayable tracks", skipped);
+		g_app->unplayable_skipped += skipped;
+
+		/* Look ahead of the new position */
+		reactor_timer_set(g_app->avail_timer, 0);
+	}
+
+	i = app_shuffled_track(g_app->playlist_track_idx);
 	track = sp_playlist_track(pl, i);
+	app_save_shuffle_state();
+	prefetch_lookup(track);
 	app_set_track(track);
+	g_app->track_queued = 0;
 	syslog(LOG_NOTICE, "App: Selected next track %d/%d (playlist pos: %d) in playlist: %s",
 			g_app->playlist_track_idx + 1, num_tracks, i + 1,
 			sp_track_name(track));
 
 	/* Trigger events to check if track can actually be played */
-	app_post_event(APP_WAIT_PLAY);
+	g_app->waits |= APP_WAIT_PLAY;
 	app_post_event(APP_DO_METADATA);
 
+	/* Move the prefetch window along, quick skips may outrun it */
+	app_post_event(APP_DO_PREFETCH);
+
 	return track;
 }
 
@@ -430,9 +1731,16 @@ void app_release(void) {
 	syslog(LOG_DEBUG, "App: Releasing Spotify session resources");
 	app_set_session(NULL);
 
-	syslog(LOG_DEBUG, "App: Shutting down synchronization sockets");
-	close(g_app->signal_fds[0]);
-	close(g_app->signal_fds[1]);
+	reactor_timer_delete(g_app->retry_timer);
+	reactor_timer_delete(g_app->avail_timer);
+	reactor_timer_delete(g_app->prefetch_timer);
+	reactor_timer_delete(g_app->skip_timer);
+
+	app_status_invalidate(APP_STATUS_URIS);
+	free(g_app->uris);
+	buf_release(&g_app->status);
+	buf_release(&g_app->status_playlists);
+	buf_release(&g_app->notify);
 
 	if(g_app->gpio_fd != -1)
 		rpi_gpio_release(g_app->gpio_fd);
@@ -441,29 +1749,185 @@ void app_release(void) {
 	g_app = NULL;
 }
 
+static void app_retry_metadata(void *arg) {
+
+	app_post_event(APP_DO_METADATA);
+}
+
+static void app_retry_prefetch(void *arg) {
+
+	app_post_event(APP_DO_PREFETCH);
+}
+
+/* Tracks to play next, queued ones first, leaving out unplayable ones */
+static int app_upcoming_tracks(sp_track **tracks, int max) {
+	sp_playlist *pl = g_app->active_playlist;
+	sp_track *t;
+	int i, n = 0, pos, start, num_tracks;
+
+	while(n < max && (t = playqueue_peek(n)) != NULL)
+		tracks[n++] = t;
+
+	num_tracks = pl? sp_playlist_num_tracks(pl): 0;
+	start = g_app->playlist_track_idx + app_playlist_track_playing();
+	for(i = 0; n < max && i < num_tracks; i++) {
+		pos = app_shuffled_track((start + i) % num_tracks);
+		if(g_app->avail != NULL && avail_get(g_app->avail, pos) == AVAIL_UNPLAYABLE)
+			continue;
+
+		if((t = sp_playlist_track(pl, pos)) != NULL)
+			tracks[n++] = t;
+	}
+
+	return n;
+}
+
+/* How many upcoming tracks to prefetch audio for right now */
+static int app_prefetch_audio(void) {
+	audio_fifo_t *af = &g_app->audio_fifo;
+	int buffered_ms, rate;
+
+	if(sp_session_connectionstate(g_app->session) != SP_CONNECTION_STATE_LOGGED_IN)
+		return 0;
+
+	/* Leave the bandwidth to the track playing until its buffer fills up */
+	rate = player_get_rate();
+	buffered_ms = (int)(audio_get_latency(af, rate) * 1000LL / rate);
+	if(app_get_track() != NULL && buffered_ms * 100 < af->max_ms * APP_PREFETCH_MIN_BUFFER) {
+		reactor_timer_set(g_app->prefetch_timer, APP_PREFETCH_RETRY_MS);
+		return 0;
+	}
+
+	switch(g_app->connection_type) {
+	case SP_CONNECTION_TYPE_NONE:
+		return 0;
+	case SP_CONNECTION_TYPE_MOBILE:
+	case SP_CONNECTION_TYPE_MOBILE_ROAMING:
+		return APP_PREFETCH_AUDIO_MOBILE;
+	default:
+		return APP_PREFETCH_AUDIO;
+	}
+}
+
+/* Keep the metadata of the next few tracks loaded and their audio coming */
+static void app_do_prefetch(void) {
+	sp_track *tracks[PREFETCH_MAX_WINDOW];
+	int n;
+
+	n = app_upcoming_tracks(tracks, g_app->prefetch_window);
+	prefetch_update(tracks, n, n? app_prefetch_audio(): 0);
+}
+
+static const char *app_connection_types[] = {
+	[SP_CONNECTION_TYPE_UNKNOWN]		= "unknown",
+	[SP_CONNECTION_TYPE_NONE]		= "none",
+	[SP_CONNECTION_TYPE_MOBILE]		= "mobile",
+	[SP_CONNECTION_TYPE_MOBILE_ROAMING]	= "roaming",
+	[SP_CONNECTION_TYPE_WIFI]		= "wifi",
+	[SP_CONNECTION_TYPE_WIRED]		= "wired",
+};
+
+/* Connection type by name, or -1 if there's no such type */
+int app_parse_connection_type(const char *name) {
+	unsigned int i;
+
+	for(i = 0; i < sizeof(app_connection_types) / sizeof(char *); i++)
+		if(app_connection_types[i] != NULL && !strcmp(app_connection_types[i], name))
+			return i;
+
+	return -1;
+}
+
+/* Tell libspotify what network we're on, which also decides prefetching */
+void app_set_connection_type(int type) {
+
+	g_app->connection_type = type;
+	sp_session_set_connection_type(g_app->session, type);
+	syslog(LOG_INFO, "App: Connection type set to %s", app_connection_types[type]);
+	app_post_event(APP_DO_PREFETCH);
+}
+
+const char *app_get_connection_type(void) {
+
+	return app_connection_types[g_app->connection_type];
+}
+
+void app_set_prefetch_window(int tracks) {
+
+	g_app->prefetch_window = tracks;
+	app_post_event(APP_DO_PREFETCH);
+}
+
+int app_get_prefetch_window(void) {
+
+	return g_app->prefetch_window;
+}
+
+/* Only load playlists once selected; libspotify must be told as well */
+void app_set_lazy_playlists(int enable) {
+
+	g_app->lazy_playlists = enable;
+}
+
+/**
+ * Fill in the availability of the tracks coming up in the play order.
+ * Tracks without metadata yet are looked at again later, libspotify
+ * loads it for every track of a playlist it holds.
+ */
+static void app_avail_scan(void *arg) {
+	sp_playlist *pl = g_app->active_playlist;
+	avail_state_t state;
+	int i, pos, start, num_tracks, unknown = 0;
+
+	if(pl == NULL || g_app->avail == NULL)
+		return;
+
+	num_tracks = avail_size(g_app->avail);
+	if(num_tracks == 0 || num_tracks != sp_playlist_num_tracks(pl))
+		return;
+
+	start = g_app->playlist_track_idx + app_playlist_track_playing();
+	for(i = 0; i < APP_AVAIL_LOOKAHEAD && i < num_tracks; i++) {
+		pos = app_shuffled_track((start + i) % num_tracks);
+		if(avail_get(g_app->avail, pos) != AVAIL_UNKNOWN)
+			continue;
+
+		state = avail_classify(g_app->session, sp_playlist_track(pl, pos));
+		if(state == AVAIL_UNKNOWN)
+			unknown++;
+		else
+			avail_set(g_app->avail, pos, state);
+	}
+
+	if(unknown)
+		reactor_timer_set(g_app->avail_timer, APP_AVAIL_RETRY_MS);
+}
+
 void app_do_metadata(void) {
 
-	if(g_app->events & APP_WAIT_INBOX && sp_playlist_is_loaded(g_app->inbox)) {
+	if(g_app->waits & APP_WAIT_INBOX && sp_playlist_is_loaded(g_app->inbox)) {
 		syslog(LOG_DEBUG, "App event: Inbox is loaded");
-		g_app->events ^= APP_WAIT_INBOX;
+		g_app->waits &= ~APP_WAIT_INBOX;
 	}
 
-	if(g_app->events & APP_WAIT_STARRED && sp_playlist_is_loaded(g_app->starred)) {
+	if(g_app->waits & APP_WAIT_STARRED && sp_playlist_is_loaded(g_app->starred)) {
 		syslog(LOG_DEBUG, "App event: Starred is loaded");
-		g_app->events ^= APP_WAIT_STARRED;
+		g_app->waits &= ~APP_WAIT_STARRED;
 
 		/* Select this as active playlist */
+		g_app->active_uri[0] = 0;
 		app_set_active_playlist(g_app->starred);
 		app_do_next_track();
 	}
 
-	if(g_app->events & APP_WAIT_PLAY) {
+	if(g_app->waits & APP_WAIT_PLAY) {
 		sp_track *track = app_get_track();
 		sp_error error;
 
 		if(track == NULL) {
 			syslog(LOG_WARNING, "App player: APP_WAIT_PLAY but no track loaded. Call next track first!");
-			g_app->events ^= APP_WAIT_PLAY;
+			g_app->waits &= ~APP_WAIT_PLAY;
+			g_app->next_pending = 0;
 			return;
 		}
 
@@ -472,54 +1936,74 @@ void app_do_metadata(void) {
 			return;
 		}
 
-		error = sp_track_error(track);
-		if(error != SP_ERROR_OK) {
+		if(avail_classify(g_app->session, track) == AVAIL_UNPLAYABLE) {
+			error = sp_track_error(track);
 			syslog(LOG_INFO, "App player: Track '%s' loaded but unavailable: %s",
-					sp_track_name(track), sp_error_message(error));
+					sp_track_name(track), error != SP_ERROR_OK?
+					sp_error_message(error): "not available in this region");
 
-			g_app->events ^= APP_WAIT_PLAY;
+			g_app->waits &= ~APP_WAIT_PLAY;
+			g_app->unplayable_loaded++;
+			if(app_playlist_track_playing() && g_app->avail != NULL)
+				avail_set(g_app->avail, app_shuffled_track(g_app->playlist_track_idx),
+					AVAIL_UNPLAYABLE);
 
 			/* Advance to next track and re-post APP_DO_METADATA|APP_WAIT_PLAY */
 			app_do_next_track();
 			return;
 		}
 
+		if(g_app->next_pending) {
+			app_histogram_observe(&g_app->playable_hist,
+				app_seconds_since(&g_app->next_start));
+			g_app->next_pending = 0;
+		}
+
 		error = sp_session_player_load(g_app->session, track);
 		if(error != SP_ERROR_OK) {
 			syslog(LOG_NOTICE, "App player: Loading of track '%s' failed with error: %s",
 					sp_track_name(track), sp_error_message(error));
 
-			g_app->events ^= APP_WAIT_PLAY;
+			g_app->waits &= ~APP_WAIT_PLAY;
 
 			/* Advance to next track and re-post APP_DO_METADATA|APP_WAIT_PLAY */
 			app_do_next_track();
 			return;
 		}
 
+		/* Restart the position clock and silence trimming for the
+		   new track only, not when APP_DO_PLAY resumes playback
+		   after a stop */
+		player_stats_reset();
+		player_trim_reset();
+
 		app_post_event(APP_DO_PLAY);
-		g_app->events ^= APP_WAIT_PLAY;
+		g_app->waits &= ~APP_WAIT_PLAY;
 	}
 }
 
+/* Returns -1 to exit, 1 if events are left for the next call and 0 otherwise */
 int app_process_events(void) {
-	app_event_t event;
+	event_t event;
+	int n;
 
-	/* Process application events */
-	while((event = app_next_event()) != APP_EVENT_NONE) {
-		syslog(LOG_DEBUG, "App event: dequeued event %s", app_event_name(event));
+	/* Process application events, a bounded batch at a time */
+	for(n = 0; n < APP_EVENT_BATCH && app_next_event(&event); n++) {
+		syslog(LOG_DEBUG, "App event: dequeued event %s (count %d)",
+			app_event_name(event.type), event.count);
 
-		switch(event) {
+		switch(event.type) {
 		case APP_LOGGED_IN:
 			/* Monitor rootlist for changes */
 			playlistcontainer_monitor(g_app->session, 1);
 
 			/* Load inbox playlist */
 			app_set_inbox(g_app->session);
-			g_app->events |= APP_WAIT_INBOX;
+			g_app->waits |= APP_WAIT_INBOX;
 
 			/* Load starred playlist */
 			app_set_starred(g_app->session);
-			g_app->events |= APP_WAIT_STARRED;
+			g_app->waits |= APP_WAIT_STARRED;
 			break;
 
 		case APP_DO_LOGOUT:
@@ -528,16 +2012,19 @@ int app_process_events(void) {
 			break;
 
 		case APP_DO_NEXT_TRACK:
-			/* Advance to next track in active playlist.
-			   This will also post APP_DO_METADATA|APP_WAIT_PLAY */
+			/* Advance to next track in active playlist, once per
+			   coalesced request.  Only the last track is selected,
+			   which will also post APP_DO_METADATA and set
+			   APP_WAIT_PLAY */
+			app_skip_ahead(event.count - 1);
 			app_do_next_track();
+			g_app->skip_loads_avoided += event.count - 1;
 			break;
 
 		case APP_DO_PLAY:
 			/* It is assumed there's an active track and that
 			   APP_WAIT_PLAY already did sp_session_player_loader() */
 			sp_session_player_play(g_app->session, 0);
-			player_stats_reset();
 			sp_session_player_play(g_app->session, 1);
 
 			syslog(LOG_NOTICE, "App player: starting playback of track: %02d. %s - %s",
@@ -545,36 +2032,51 @@ int app_process_events(void) {
 					sp_track_name(app_get_track()),
 					sp_artist_name(sp_track_artist(app_get_track(), 0)));
 
+			/* For comparing startup with and without lazy playlist loading */
+			if(!g_app->first_audio) {
+				struct rusage ru;
+
+				g_app->first_audio = 1;
+				getrusage(RUSAGE_SELF, &ru);
+				syslog(LOG_INFO, "App: First track playing %.1fs after startup with %s "
+					"playlist loading, peak RSS %ld kB",
+					app_seconds_since(&g_app->started),
+					g_app->lazy_playlists? "lazy": "full", app_maxrss_kb(&ru));
+			}
+
+			if(g_app->skip_pending) {
+				app_histogram_observe(&g_app->skip_hist,
+					app_seconds_since(&g_app->skip_start));
+				g_app->skip_pending = 0;
+			}
 
+			app_notify_track();
+			app_notify_playback("playing");
 			break;
 		case APP_DO_PREFETCH:
-			{
-				sp_track *track;
-				sp_playlist *pl = g_app->active_playlist;
-				int num_tracks = sp_playlist_num_tracks(pl);
-				int i = g_app->randomized_track_idx[(g_app->playlist_track_idx + 1) % num_tracks];
-
-				/* Attempt to prefetch next track */
-				track = sp_playlist_track(pl, i);
-				if(sp_track_error(track) == SP_ERROR_OK) {
-					if(sp_session_player_prefetch(g_app->session, track) == SP_ERROR_OK)
-						syslog(LOG_NOTICE, "App: Prefetching track '%s'", sp_track_name(track));
-					else
-						syslog(LOG_NOTICE, "App: Prefetching of track '%s' failed", sp_track_name(track));
-				}
-			}
+			app_do_prefetch();
 			break;
 
 		case APP_DO_STOP:
 			sp_session_player_play(g_app->session, 0);
+			g_app->skip_pending = 0;
+			app_notify_playback("stopped");
 			break;
 
 		case APP_DO_METADATA:
+			/* New metadata may tell more about the tracks coming up */
+			if(g_app->avail != NULL)
+				reactor_timer_set(g_app->avail_timer, 0);
+
 			/* Periodic attempts to do something hooked onto metadata processing */
-			if((g_app->events & (APP_WAIT_MAX-1)) == 0)
+			if(g_app->waits == 0)
 				break;
 
 			app_do_metadata();
+
+			/* Don't depend on libspotify to tell us about everything */
+			if(g_app->waits != 0)
+				reactor_timer_set(g_app->retry_timer, APP_METADATA_RETRY_MS);
 			break;
 
 		case APP_DO_EXIT:
@@ -582,43 +2084,120 @@ int app_process_events(void) {
 			return -1;
 			break;
 
+		case APP_UNDERRUN:
+			app_notify_underrun();
+			break;
+
 		default:
-			syslog(LOG_INFO, "App event: No handler for event %s", app_event_name(event));
+			syslog(LOG_INFO, "App event: No handler for event %s", app_event_name(event.type));
 			break;
 		}
 	}
 
-	app_update_status();
-
-	return 0;
+	return event_queue_depth(&g_app->queue) > 0? 1: 0;
 }
 
 void app_post_event(app_event_t event) {
-	if(g_app->events & event) {
-		syslog(LOG_DEBUG, "App event: re-queued event %s (0x%02x, events:0x%02x)",
-			app_event_name(event), event, g_app->events);
-		return;
-	}
 
-	g_app->events |= event;
-	syslog(LOG_DEBUG, "App event: queued event %s (0x%02x, events:0x%02x)",
-			app_event_name(event), event, g_app->events);
+	app_post_event_data(event, 1, NULL);
 }
 
-static app_event_t app_next_event(void) {
-	app_event_t i, event;
+/* May be called from any thread */
+void app_post_event_data(app_event_t type, int count, const char *uri) {
+	event_t event;
+	unsigned int depth, max, old;
 
-	for(i = APP_MAX >> 1; g_app->events & (APP_MAX-1); i >>= 1) {
+	switch(app_coalesce_rules[type]) {
+	case APP_COALESCE_DROP:
+		if(__atomic_exchange_n(&g_app->pending[type], 1, __ATOMIC_ACQ_REL)) {
+			__atomic_add_fetch(&g_app->events_coalesced, 1, __ATOMIC_RELAXED);
+			syslog(LOG_DEBUG, "App event: %s already queued", app_event_name(type));
+			return;
+		}
+		break;
 
-		if((event = g_app->events & i) == APP_EVENT_NONE)
-			continue;
+	case APP_COALESCE_SUM:
+		old = __atomic_load_n(&g_app->pending[type], __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&g_app->pending[type], &old,
+				(old + ((unsigned int)count << 1)) | 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+		if(old & 1) {
+			__atomic_add_fetch(&g_app->events_coalesced, 1, __ATOMIC_RELAXED);
+			syslog(LOG_DEBUG, "App event: merged %s into queued event", app_event_name(type));
+			return;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.count = count;
+	if(uri != NULL)
+		snprintf(event.uri, sizeof(event.uri), "%s", uri);
+	clock_gettime(CLOCK_MONOTONIC, &event.posted);
+
+	if(event_queue_push(&g_app->queue, &event) < 0) {
+		/* Only this count is lost, what was merged in meanwhile goes with
+		   the next one posted */
+		if(app_coalesce_rules[type] == APP_COALESCE_SUM) {
+			old = __atomic_load_n(&g_app->pending[type], __ATOMIC_RELAXED);
+			while(!__atomic_compare_exchange_n(&g_app->pending[type], &old,
+					(old - ((unsigned int)count << 1)) & ~1u, 1,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+		}
+		else
+			__atomic_store_n(&g_app->pending[type], 0, __ATOMIC_RELEASE);
+
+		__atomic_add_fetch(&g_app->events_dropped, 1, __ATOMIC_RELAXED);
+		syslog(LOG_WARNING, "App event: queue full, dropped event %s", app_event_name(type));
+		return;
+	}
+
+	__atomic_add_fetch(&g_app->events_posted, 1, __ATOMIC_RELAXED);
+	depth = event_queue_depth(&g_app->queue);
+	max = __atomic_load_n(&g_app->events_max_depth, __ATOMIC_RELAXED);
+	while(depth > max && !__atomic_compare_exchange_n(&g_app->events_max_depth,
+			&max, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-		g_app->events ^= event;
+	syslog(LOG_DEBUG, "App event: queued event %s (depth %u)", app_event_name(type), depth);
+
+	/* Make the main loop come around if we're on another thread */
+	if(!pthread_equal(pthread_self(), g_app->main_thread))
+		reactor_wakeup();
+}
 
-		return event;
+/* Dequeue next event and collect its coalesced state; main thread only */
+static int app_next_event(event_t *event) {
+	struct timespec now;
+	uint64_t latency;
+
+	if(event_queue_pop(&g_app->queue, event) < 0)
+		return 0;
+
+	switch(app_coalesce_rules[event->type]) {
+	case APP_COALESCE_DROP:
+		__atomic_store_n(&g_app->pending[event->type], 0, __ATOMIC_RELEASE);
+		break;
+	case APP_COALESCE_SUM:
+		event->count = __atomic_exchange_n(&g_app->pending[event->type], 0, __ATOMIC_ACQ_REL) >> 1;
+		break;
+	default:
+		break;
 	}
 
-	return APP_EVENT_NONE;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	latency = (uint64_t)(now.tv_sec - event->posted.tv_sec) * 1000000
+		+ (now.tv_nsec - event->posted.tv_nsec) / 1000;
+
+	g_app->events_handled++;
+	g_app->events_latency_us += latency;
+	if(latency > g_app->events_max_latency_us)
+		g_app->events_max_latency_us = latency;
+
+	return 1;
 }
 
 const char *app_event_name(app_event_t event) {
@@ -642,17 +2221,10 @@ const char *app_event_name(app_event_t event) {
 		return "APP_DO_LOGOUT";
 	case APP_DO_EXIT:
 		return "APP_DO_EXIT";
+	case APP_UNDERRUN:
+		return "APP_UNDERRUN";
 	case APP_MAX:
 		return "APP_MAX";
-
-	case APP_WAIT_INBOX:
-		return "APP_WAIT_INBOX";
-	case APP_WAIT_STARRED:
-		return "APP_WAIT_STARRED";
-	case APP_WAIT_PLAY:
-		return "APP_WAIT_PLAY";
-	case APP_WAIT_MAX:
-		return "APP_WAIT_MAX";
 	}
 
 	return NULL;
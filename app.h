@@ -6,48 +6,129 @@
 #ifndef APP_H
 #define APP_H
 
+#include <stdint.h>
+
 #include <libspotify/api.h>
 
 #include "audio.h"
+#include "buf.h"
 
 typedef enum {
 	APP_EVENT_NONE	= 0,
 
 	/* For event processing in app_process_events() */
-	APP_LOGGED_IN	= 0x01,
-	APP_DO_METADATA	= 0x02,
-	APP_DO_NEXT_TRACK = 0x04,
-	APP_DO_PLAY	= 0x08,
-	APP_DO_PREFETCH	= 0x10,
-	APP_DO_STOP	= 0x20,
-	APP_DO_LOGOUT	= 0x40,
-	APP_DO_EXIT	= 0x80,
-	APP_MAX	= 0x100,
-
-	/* For metadata processing; these are handled using APP_DO_METADATA */
-	APP_WAIT_INBOX	= 0x01000,
-	APP_WAIT_STARRED	= 0x02000,
-	APP_WAIT_PLAY		= 0x08000,
-	APP_WAIT_MAX		= 0x010000,
+	APP_LOGGED_IN,
+	APP_DO_METADATA,
+	APP_DO_NEXT_TRACK,
+	APP_DO_PLAY,
+	APP_DO_PREFETCH,
+	APP_DO_STOP,
+	APP_DO_LOGOUT,
+	APP_DO_EXIT,
+	APP_UNDERRUN,
+	APP_MAX,
 } app_event_t;
 
+/* For metadata processing; these are handled using APP_DO_METADATA */
+typedef enum {
+	APP_WAIT_INBOX	= 0x01,
+	APP_WAIT_STARRED	= 0x02,
+	APP_WAIT_PLAY		= 0x04,
+} app_wait_t;
+
+/* Max number of events handled per call to app_process_events() */
+#define APP_EVENT_BATCH 16
+
+/* Recheck pending metadata waits even without libspotify telling us to */
+#define APP_METADATA_RETRY_MS 2000
+
+/* What changed, for app_status_invalidate() */
+#define APP_STATUS_PLAYLISTS	0x01
+#define APP_STATUS_URIS		0x02
+
+/* Bumped only if fields of the JSON status are renamed or removed */
+#define APP_STATUS_JSON_VERSION 1
+
+/* Rebuild the offline playlists part of the status at least this often (s) */
+#define APP_STATUS_MAX_AGE 30
+
+/* Power saving mode: FIFO capacity, output block size and main loop batching */
+#define APP_BUFFER_MS			1000
+#define APP_POWERSAVE_BUFFER_MS		10000
+#define APP_POWERSAVE_BLOCK_MS		2000
+#define APP_POWERSAVE_BATCH_MS		1000
+
+/* How far ahead in the shuffle order to look for an offline synced track */
+#define APP_POWERSAVE_LOOKAHEAD		32
+
+/* How far ahead in the play order to find out which tracks can be played,
+ * and how soon to look again at those without metadata yet (ms) */
+#define APP_AVAIL_LOOKAHEAD		64
+#define APP_AVAIL_RETRY_MS		1000
+
+/* Skip requests this close together are taken as one skip by as many
+ * tracks, so only the last track gets loaded; held back at most so long */
+#define APP_SKIP_WINDOW_MS		150
+#define APP_SKIP_MAX_DELAY_MS		500
+
+/* Upcoming tracks held on to for their metadata, and how many of them get
+ * their audio prefetched on fast and on mobile connections */
+#define APP_PREFETCH_WINDOW		4
+#define APP_PREFETCH_AUDIO		2
+#define APP_PREFETCH_AUDIO_MOBILE	1
+
+/* Audio is prefetched once this share of the FIFO is filled (%), until
+ * then it's tried again every so often (ms) */
+#define APP_PREFETCH_MIN_BUFFER		50
+#define APP_PREFETCH_RETRY_MS		1000
+
+/* Shuffle seed and position of the active playlist, kept across restarts */
+#define APP_SHUFFLE_STATE_FILE "./tmp/shuffle.state"
+
+/* Max number of buckets in a latency histogram exported on /metrics */
+#define APP_HISTOGRAM_BUCKETS 12
+
 void *app_create(void);
-int app_signal_write_fd(void);
-int app_signal_read_fd(void);
 int app_gpio_fd(void);
 
 audio_fifo_t *app_get_audio_fifo(void);
 void app_set_session(sp_session *session);
 void app_set_link(sp_link *link);
 const char *app_get_status(void);
+int app_get_status_json(buf_t *out);
+int app_get_metrics(buf_t *out);
+void app_status_invalidate(int what);
+void app_notify_offline(void);
+void app_notify_playlist(sp_playlist *pl);
 
 void app_set_track(sp_track *track);
 sp_track *app_get_track(void);
+sp_playlist *app_get_active_playlist(void);
 sp_playlist *app_set_active_playlist_link(sp_link *link);
-void app_randomize_playlist_order(void);
+const char *app_set_playlist_uri(const char *uri);
+void app_playlist_tracks_added(sp_playlist *pl, int position, int num_tracks);
+void app_playlist_tracks_removed(sp_playlist *pl, const int *tracks, int num_tracks);
+void app_playlist_tracks_moved(sp_playlist *pl, const int *tracks, int num_tracks, int new_position);
 sp_track *app_do_next_track(void);
 void app_release(void);
 void app_post_event(app_event_t event);
+void app_post_event_data(app_event_t event, int count, const char *uri);
 int app_process_events(void);
 
+void app_skip_track(void);
+void app_set_power_save(int enable);
+int app_get_power_save(void);
+void app_reshuffle(uint64_t seed);
+void app_set_shuffle_spread(int enable);
+int app_get_shuffle_spread(void);
+uint64_t app_get_shuffle_seed(void);
+int app_parse_connection_type(const char *name);
+void app_set_connection_type(int type);
+const char *app_get_connection_type(void);
+void app_set_prefetch_window(int tracks);
+int app_get_prefetch_window(void);
+void app_set_lazy_playlists(int enable);
+void app_count_wakeup(void);
+void app_record_loop_time(const struct timespec *start);
+
 #endif
@@ -26,7 +26,9 @@
  */
 
 #include "audio.h"
+#include "meter.h"
 #include <stdlib.h>
+#include <string.h>
 
 audio_fifo_data_t* audio_get(audio_fifo_t *af)
 {
@@ -38,8 +40,61 @@ audio_fifo_data_t* audio_get(audio_fifo_t *af)
 
     TAILQ_REMOVE(&af->q, afd, link);
     af->qlen -= afd->nsamples;
+    af->played_us += (uint64_t)afd->nsamples * 1000000 / afd->rate;
 
     pthread_mutex_unlock(&af->mutex);
+
+    /* Snapshot for the level meter, never blocks */
+    meter_feed(afd);
+    return afd;
+}
+
+/* Like audio_get() but merges already queued data of the same format into
+ * blocks of up to block_ms, so that the driver can sleep longer between refills */
+audio_fifo_data_t* audio_get_block(audio_fifo_t *af)
+{
+    audio_fifo_data_t *afd, *next, *merged;
+    int max_frames;
+    size_t frame_size;
+
+    afd = audio_get(af);
+    frame_size = afd->channels * sizeof(int16_t);
+
+    for (;;) {
+        pthread_mutex_lock(&af->mutex);
+        max_frames = (int)((int64_t)af->block_ms * afd->rate / 1000);
+        next = TAILQ_FIRST(&af->q);
+        if (next == NULL || next->rate != afd->rate || next->channels != afd->channels
+            || afd->nsamples + next->nsamples > max_frames) {
+            pthread_mutex_unlock(&af->mutex);
+            break;
+        }
+
+        TAILQ_REMOVE(&af->q, next, link);
+        af->qlen -= next->nsamples;
+        af->played_us += (uint64_t)next->nsamples * 1000000 / next->rate;
+        pthread_mutex_unlock(&af->mutex);
+
+        meter_feed(next);
+
+        merged = realloc(afd, sizeof(audio_fifo_data_t)
+            + (afd->nsamples + next->nsamples) * frame_size);
+        if (merged == NULL) {
+            /* Put it back and make do with what we have */
+            pthread_mutex_lock(&af->mutex);
+            TAILQ_INSERT_HEAD(&af->q, next, link);
+            af->qlen += next->nsamples;
+            pthread_mutex_unlock(&af->mutex);
+            break;
+        }
+
+        afd = merged;
+        memcpy((char *)afd->samples + afd->nsamples * frame_size,
+            next->samples, next->nsamples * frame_size);
+        afd->nsamples += next->nsamples;
+        free(next);
+    }
+
     return afd;
 }
 
@@ -55,5 +110,49 @@ void audio_fifo_flush(audio_fifo_t *af)
     }
 
     af->qlen = 0;
+    af->generation++;
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/* Called by the output driver whenever it has (re)queued audio */
+void audio_set_device_latency(audio_fifo_t *af, int frames, int rate)
+{
+    pthread_mutex_lock(&af->mutex);
+    af->device_frames = frames;
+    af->device_rate = rate;
+    clock_gettime(CLOCK_MONOTONIC, &af->device_ts);
     pthread_mutex_unlock(&af->mutex);
 }
+
+/* Frames buffered between delivery and the speaker right now */
+int audio_get_latency(audio_fifo_t *af, int rate)
+{
+    struct timespec now;
+    int64_t played;
+    int frames, pending;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&af->mutex);
+    frames = af->qlen;
+    pending = af->device_frames;
+    if (pending > 0 && af->device_rate > 0) {
+        /* Extrapolate playback since the driver last reported */
+        played = (int64_t)(now.tv_sec - af->device_ts.tv_sec) * af->device_rate
+            + (int64_t)(now.tv_nsec - af->device_ts.tv_nsec) * af->device_rate / 1000000000;
+        pending = played >= pending? 0: pending - (int)played;
+        if (rate > 0 && rate != af->device_rate)
+            pending = (int)((int64_t)pending * rate / af->device_rate);
+    }
+    pthread_mutex_unlock(&af->mutex);
+
+    return frames + pending;
+}
+
+/* Called by the output driver when the device ran out of audio */
+void audio_report_underrun(audio_fifo_t *af)
+{
+    __atomic_add_fetch(&af->underruns, 1, __ATOMIC_RELAXED);
+    if (af->underrun_cb != NULL)
+        af->underrun_cb();
+}
@@ -28,7 +28,9 @@
 #define _JUKEBOX_AUDIO_H_
 
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include "queue.h"
 
 
@@ -46,6 +48,27 @@ typedef struct audio_fifo {
 	int qlen;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+
+	/* Frames handed to the output device but not yet played, as
+	 * reported by the audio thread at time device_ts */
+	int device_frames;
+	int device_rate;
+	struct timespec device_ts;
+
+	/* FIFO capacity and preferred output block size (0: as delivered) */
+	int max_ms;
+	int block_ms;
+
+	/* Bumped on flush so the driver drops audio already queued on the device */
+	unsigned int generation;
+
+	/* Statistics */
+	uint64_t played_us;
+	unsigned long driver_wakeups;
+	unsigned long underruns;
+
+	/* Called on the audio thread when the device ran dry, must not block */
+	void (*underrun_cb)(void);
 } audio_fifo_t;
 
 
@@ -53,5 +76,14 @@ typedef struct audio_fifo {
 extern void audio_init(audio_fifo_t *af);
 extern void audio_fifo_flush(audio_fifo_t *af);
 audio_fifo_data_t* audio_get(audio_fifo_t *af);
+audio_fifo_data_t* audio_get_block(audio_fifo_t *af);
+extern void audio_set_device_latency(audio_fifo_t *af, int frames, int rate);
+extern int audio_get_latency(audio_fifo_t *af, int rate);
+extern void audio_report_underrun(audio_fifo_t *af);
+
+/* Output device selection, implemented by the audio driver */
+extern void audio_set_device(const char *name);
+extern int audio_get_device(char *name, size_t len, int *failures);
+extern int audio_list_devices(char *buf, size_t len);
 
 #endif /* _JUKEBOX_AUDIO_H_ */
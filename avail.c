@@ -0,0 +1,166 @@
+/**
+ * avail.c
+ * Availability index of the tracks in a playlist
+ *
+ * One byte per playlist position, filled in as track metadata arrives, so
+ * unplayable tracks can be skipped when picking the next track instead of
+ * finding out only after waiting for each of them to load.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "avail.h"
+
+struct avail {
+	unsigned char *state;
+	int size;
+	int capacity;
+	int count[AVAIL_MAX];
+};
+
+
+avail_t *avail_create(int num_tracks) {
+	avail_t *a;
+
+	if((a = calloc(1, sizeof(*a))) == NULL)
+		return NULL;
+
+	a->capacity = num_tracks > 16? num_tracks: 16;
+	if((a->state = calloc(a->capacity, 1)) == NULL) {
+		free(a);
+		return NULL;
+	}
+
+	a->size = num_tracks;
+	a->count[AVAIL_UNKNOWN] = num_tracks;
+
+	return a;
+}
+
+void avail_release(avail_t *a) {
+
+	if(a == NULL)
+		return;
+
+	free(a->state);
+	free(a);
+}
+
+int avail_size(const avail_t *a) {
+
+	return a->size;
+}
+
+avail_state_t avail_get(const avail_t *a, int position) {
+
+	if(position < 0 || position >= a->size)
+		return AVAIL_UNKNOWN;
+
+	return a->state[position];
+}
+
+void avail_set(avail_t *a, int position, avail_state_t state) {
+
+	if(position < 0 || position >= a->size)
+		return;
+
+	a->count[a->state[position]]--;
+	a->state[position] = state;
+	a->count[state]++;
+}
+
+int avail_count(const avail_t *a, avail_state_t state) {
+
+	return a->count[state];
+}
+
+int avail_insert(avail_t *a, int position, int count) {
+	unsigned char *state;
+	int capacity;
+
+	if(position < 0 || position > a->size || count <= 0)
+		return -1;
+
+	if(a->size + count > a->capacity) {
+		for(capacity = a->capacity; capacity < a->size + count; capacity *= 2);
+		if((state = realloc(a->state, capacity)) == NULL)
+			return -1;
+
+		a->state = state;
+		a->capacity = capacity;
+	}
+
+	memmove(a->state + position + count, a->state + position, a->size - position);
+	memset(a->state + position, AVAIL_UNKNOWN, count);
+	a->size += count;
+	a->count[AVAIL_UNKNOWN] += count;
+
+	return 0;
+}
+
+void avail_remove(avail_t *a, int position) {
+
+	if(position < 0 || position >= a->size)
+		return;
+
+	a->count[a->state[position]]--;
+	memmove(a->state + position, a->state + position + 1, a->size - position - 1);
+	a->size--;
+}
+
+/**
+ * Tracks were moved to new_position, which counts positions as they were
+ * before the move, like shuffle_move().
+ */
+void avail_move(avail_t *a, const int *positions, int count, int new_position) {
+	unsigned char *moved;
+	int i, j, dest = new_position;
+
+	if(count <= 0 || (moved = malloc(count)) == NULL)
+		return;
+
+	for(i = 0; i < count; i++) {
+		moved[i] = avail_get(a, positions[i]);
+		if(positions[i] < new_position)
+			dest--;
+
+		/* Mark for removal, states only go up to AVAIL_MAX - 1 */
+		if(positions[i] >= 0 && positions[i] < a->size)
+			a->state[positions[i]] |= 0x80;
+	}
+
+	for(i = j = 0; i < a->size; i++)
+		if(!(a->state[i] & 0x80))
+			a->state[j++] = a->state[i];
+
+	count = a->size - j;
+	if(dest < 0)
+		dest = 0;
+	if(dest > j)
+		dest = j;
+
+	memmove(a->state + dest + count, a->state + dest, j - dest);
+	memcpy(a->state + dest, moved, count);
+
+	free(moved);
+}
+
+avail_state_t avail_classify(sp_session *session, sp_track *track) {
+
+	if(track == NULL || !sp_track_is_loaded(track))
+		return AVAIL_UNKNOWN;
+
+	if(sp_track_error(track) != SP_ERROR_OK)
+		return AVAIL_UNPLAYABLE;
+
+	/* Synced tracks play even when they can't be streamed right now */
+	if(sp_track_offline_get_status(track) == SP_TRACK_OFFLINE_DONE)
+		return AVAIL_PLAYABLE;
+
+	if(sp_track_get_availability(session, track) != SP_TRACK_AVAILABILITY_AVAILABLE)
+		return AVAIL_UNPLAYABLE;
+
+	return AVAIL_PLAYABLE;
+}
@@ -0,0 +1,38 @@
+/**
+ * avail.h
+ *
+ */
+
+#ifndef AVAIL_H
+#define AVAIL_H
+
+#include <libspotify/api.h>
+
+/* Whether the track at a playlist position can be played, as far as known */
+typedef enum {
+	AVAIL_UNKNOWN = 0,	/* No metadata yet */
+	AVAIL_PLAYABLE,
+	AVAIL_UNPLAYABLE,
+	AVAIL_MAX
+} avail_state_t;
+
+/* Availability of every track of a playlist, by playlist position */
+typedef struct avail avail_t;
+
+avail_t *avail_create(int num_tracks);
+void avail_release(avail_t *a);
+int avail_size(const avail_t *a);
+
+avail_state_t avail_get(const avail_t *a, int position);
+void avail_set(avail_t *a, int position, avail_state_t state);
+int avail_count(const avail_t *a, avail_state_t state);
+
+/* Keep up with playlist edits, new tracks are unknown */
+int avail_insert(avail_t *a, int position, int count);
+void avail_remove(avail_t *a, int position);
+void avail_move(avail_t *a, const int *positions, int count, int new_position);
+
+/* Tell from a track's metadata whether it can be played */
+avail_state_t avail_classify(sp_session *session, sp_track *track);
+
+#endif
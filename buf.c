@@ -0,0 +1,98 @@
+/**
+ * buf.c
+ * Growable text buffers
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "buf.h"
+
+
+void buf_init(buf_t *b) {
+
+	memset(b, 0, sizeof(*b));
+}
+
+void buf_reset(buf_t *b) {
+
+	b->len = 0;
+	if(b->data != NULL)
+		b->data[0] = 0;
+}
+
+/* Make room for len more bytes plus the terminating NUL */
+int buf_reserve(buf_t *b, size_t len) {
+	size_t size;
+	char *data;
+
+	if(b->len + len + 1 <= b->size)
+		return 0;
+
+	for(size = b->size? b->size: 256; size < b->len + len + 1; size *= 2);
+
+	data = realloc(b->data, size);
+	if(data == NULL)
+		return -1;
+
+	b->data = data;
+	b->size = size;
+
+	return 0;
+}
+
+int buf_append(buf_t *b, const char *data, size_t len) {
+
+	if(buf_reserve(b, len) < 0)
+		return -1;
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->data[b->len] = 0;
+
+	return 0;
+}
+
+int buf_printf(buf_t *b, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	/* Try with what's left first, grow and retry if it didn't fit */
+	if(buf_reserve(b, 0) < 0)
+		return -1;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+	va_end(ap);
+	if(n < 0)
+		return -1;
+
+	if((size_t)n >= b->size - b->len) {
+		if(buf_reserve(b, n) < 0) {
+			b->data[b->len] = 0;
+			return -1;
+		}
+
+		va_start(ap, fmt);
+		vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+	}
+
+	b->len += n;
+
+	return n;
+}
+
+const char *buf_str(const buf_t *b) {
+
+	return b->data != NULL? b->data: "";
+}
+
+void buf_release(buf_t *b) {
+
+	free(b->data);
+	buf_init(b);
+}
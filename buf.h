@@ -0,0 +1,27 @@
+/**
+ * buf.h
+ *
+ */
+
+#ifndef BUF_H
+#define BUF_H
+
+#include <stddef.h>
+
+/* Growable, always NUL terminated text buffer */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} buf_t;
+
+void buf_init(buf_t *b);
+void buf_reset(buf_t *b);
+int buf_reserve(buf_t *b, size_t len);
+int buf_append(buf_t *b, const char *data, size_t len);
+int buf_printf(buf_t *b, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+const char *buf_str(const buf_t *b);
+void buf_release(buf_t *b);
+
+#endif
@@ -0,0 +1,74 @@
+/**
+ * event.c
+ * Lock-free event queue
+ *
+ * A bounded multi-producer/single-consumer ring where each slot carries a
+ * sequence number telling whether it's free for the producer claiming that
+ * position or holds an event ready for the consumer.  Events may be posted
+ * from libspotify's internal threads while the main thread drains the queue.
+ *
+ */
+
+#include <string.h>
+
+#include "event.h"
+
+#define EVENT_QUEUE_MASK (EVENT_QUEUE_SIZE - 1)
+
+
+void event_queue_init(event_queue_t *q) {
+	unsigned int i;
+
+	memset(q, 0, sizeof(*q));
+	for(i = 0; i < EVENT_QUEUE_SIZE; i++)
+		q->slots[i].seq = i;
+}
+
+/* May be called from any thread. Returns -1 if the queue is full. */
+int event_queue_push(event_queue_t *q, const event_t *event) {
+	event_slot_t *slot;
+	unsigned int pos, seq;
+	int diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for(;;) {
+		slot = &q->slots[pos & EVENT_QUEUE_MASK];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+
+		if(diff == 0) {
+			/* Slot is free, try to claim it */
+			if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+
+	slot->event = *event;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Consumer (main thread) only. Returns -1 if the queue is empty. */
+int event_queue_pop(event_queue_t *q, event_t *event) {
+	event_slot_t *slot = &q->slots[q->tail & EVENT_QUEUE_MASK];
+
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->tail + 1)
+		return -1;
+
+	*event = slot->event;
+	__atomic_store_n(&slot->seq, q->tail + EVENT_QUEUE_SIZE, __ATOMIC_RELEASE);
+	q->tail++;
+
+	return 0;
+}
+
+unsigned int event_queue_depth(event_queue_t *q) {
+
+	return __atomic_load_n(&q->head, __ATOMIC_RELAXED) - q->tail;
+}
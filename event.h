@@ -0,0 +1,45 @@
+/**
+ * event.h
+ *
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <time.h>
+
+/* Number of slots in the event queue, must be a power of two */
+#define EVENT_QUEUE_SIZE 64
+
+/* Max length of a URI carried by an event */
+#define EVENT_URI_MAX 256
+
+typedef struct {
+	int type;
+
+	/* Payload */
+	int count;
+	char uri[EVENT_URI_MAX];
+
+	/* When the event was posted, for latency statistics */
+	struct timespec posted;
+} event_t;
+
+typedef struct {
+	unsigned int seq;
+	event_t event;
+} event_slot_t;
+
+/* Bounded lock-free multi-producer/single-consumer queue */
+typedef struct {
+	event_slot_t slots[EVENT_QUEUE_SIZE];
+	unsigned int head;	/* next slot to push, shared by producers */
+	unsigned int tail;	/* next slot to pop, consumer only */
+} event_queue_t;
+
+void event_queue_init(event_queue_t *q);
+int event_queue_push(event_queue_t *q, const event_t *event);
+int event_queue_pop(event_queue_t *q, event_t *event);
+unsigned int event_queue_depth(event_queue_t *q);
+
+#endif
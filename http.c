@@ -0,0 +1,319 @@
+/**
+ * http.c
+ * HTTP/1.1 API - the control commands as REST endpoints, plus /metrics
+ *
+ * Requests are parsed straight out of a connection's input buffer by
+ * net.c, which owns the sockets.  Keep-alive and pipelined requests are
+ * thereby served by the main loop just like any other control client.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+#include "app.h"
+#include "buf.h"
+#include "http.h"
+#include "json.h"
+
+typedef struct {
+	char method[8];
+	char path[HTTP_MAX_PATH];
+	int keep_alive;
+	const char *body;
+	size_t body_len;
+} http_request_t;
+
+typedef struct {
+	int status;
+	const char *type;
+	buf_t *body;
+} http_response_t;
+
+typedef struct {
+	const char *method;
+	const char *path;
+	void (*handler)(const http_request_t *req, http_response_t *res);
+} http_route_t;
+
+/* Response body, reused between requests */
+static buf_t http_body;
+
+
+static const char *http_reason(int status) {
+
+	switch(status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 505: return "HTTP Version Not Supported";
+	}
+
+	return "Unknown";
+}
+
+/* Small JSON reply for commands and errors */
+static void http_reply(http_response_t *res, int status, const char *message) {
+	json_t j;
+
+	res->status = status;
+	res->type = "application/json";
+
+	buf_reset(res->body);
+	json_init(&j, res->body);
+	json_object_begin(&j, NULL);
+	json_bool(&j, "ok", status == 200);
+	json_string(&j, "message", message);
+	json_object_end(&j);
+	json_finish(&j);
+}
+
+static void http_get_status(const http_request_t *req, http_response_t *res) {
+
+	res->status = 200;
+	res->type = "application/json";
+	if(app_get_status_json(res->body) < 0)
+		http_reply(res, 500, "failed to serialize status");
+}
+
+static void http_get_metrics(const http_request_t *req, http_response_t *res) {
+
+	res->status = 200;
+	res->type = "text/plain; version=0.0.4";
+	if(app_get_metrics(res->body) < 0)
+		http_reply(res, 500, "failed to format metrics");
+}
+
+static void http_post_next(const http_request_t *req, http_response_t *res) {
+
+	app_skip_track();
+	http_reply(res, 200, "playing next track");
+}
+
+static void http_post_play(const http_request_t *req, http_response_t *res) {
+
+	app_post_event(APP_DO_PLAY);
+	http_reply(res, 200, "starting playback");
+}
+
+static void http_post_stop(const http_request_t *req, http_response_t *res) {
+
+	app_post_event(APP_DO_STOP);
+	http_reply(res, 200, "stopping playback");
+}
+
+/* The body is the playlist URI, as sent on the control port */
+static void http_put_playlist(const http_request_t *req, http_response_t *res) {
+	char uri[256];
+	const char *error;
+	size_t len = req->body_len;
+
+	while(len > 0 && (req->body[len - 1] == '\n' || req->body[len - 1] == '\r'
+		|| req->body[len - 1] == ' '))
+		len--;
+
+	if(len == 0 || len >= sizeof(uri)) {
+		http_reply(res, 400, "expected a Spotify playlist URI");
+		return;
+	}
+
+	memcpy(uri, req->body, len);
+	uri[len] = 0;
+
+	if((error = app_set_playlist_uri(uri)) != NULL)
+		http_reply(res, 400, error);
+	else
+		http_reply(res, 200, "playlist is now the active playlist");
+}
+
+static const http_route_t http_routes[] = {
+	{ "GET",	"/status",	http_get_status },
+	{ "GET",	"/metrics",	http_get_metrics },
+	{ "POST",	"/next",	http_post_next },
+	{ "POST",	"/play",	http_post_play },
+	{ "POST",	"/stop",	http_post_stop },
+	{ "PUT",	"/playlist",	http_put_playlist },
+	{ "POST",	"/playlist",	http_put_playlist },
+	{ NULL }
+};
+
+/* Offset just past the empty line ending the headers, 0 if not there yet */
+static size_t http_header_end(const char *data, size_t len) {
+	size_t i;
+
+	for(i = 0; i + 1 < len; i++) {
+		if(data[i] != '\n')
+			continue;
+
+		if(data[i + 1] == '\n')
+			return i + 2;
+		if(data[i + 1] == '\r' && i + 2 < len && data[i + 2] == '\n')
+			return i + 3;
+	}
+
+	return 0;
+}
+
+/* Parse request line and headers; returns 0 or an HTTP error status */
+static int http_parse(const char *data, size_t len, http_request_t *req, size_t *content_length) {
+	char head[HTTP_MAX_REQUEST + 1], *line, *next, *value, *end;
+	int major, minor;
+	unsigned long n;
+
+	memcpy(head, data, len);
+	head[len] = 0;
+
+	*content_length = 0;
+	for(line = head; line != NULL; line = next) {
+		if((next = strchr(line, '\n')) != NULL)
+			*next++ = 0;
+		if((end = strchr(line, '\r')) != NULL)
+			*end = 0;
+
+		/* End of headers */
+		if(*line == 0)
+			break;
+
+		if(line == head) {
+			if(sscanf(line, "%7s %255s HTTP/%d.%d", req->method, req->path,
+					&major, &minor) != 4)
+				return 400;
+			if(major != 1)
+				return 505;
+
+			/* Persistent by default from HTTP/1.1 on */
+			req->keep_alive = minor >= 1;
+			continue;
+		}
+
+		if((value = strchr(line, ':')) == NULL)
+			return 400;
+		*value++ = 0;
+		while(*value == ' ' || *value == '\t')
+			value++;
+
+		if(!strcasecmp(line, "Content-Length")) {
+			n = strtoul(value, &end, 10);
+			if(end == value || *end)
+				return 400;
+			if(n > HTTP_MAX_REQUEST)
+				return 413;
+			*content_length = n;
+		}
+		else if(!strcasecmp(line, "Transfer-Encoding")) {
+			if(strcasecmp(value, "identity"))
+				return 501;
+		}
+		else if(!strcasecmp(line, "Connection")) {
+			if(!strncasecmp(value, "close", 5))
+				req->keep_alive = 0;
+			else if(!strncasecmp(value, "keep-alive", 10))
+				req->keep_alive = 1;
+		}
+	}
+
+	if(req->method[0] == 0)
+		return 400;
+
+	return 0;
+}
+
+/**
+ * Handle the first request in data and append the response to out.
+ * Returns the number of bytes consumed, or 0 if the request isn't
+ * complete yet.  keep_alive is cleared if the connection should be closed
+ * once the response has been sent.
+ */
+int http_handle(const char *data, size_t len, buf_t *out, int *keep_alive) {
+	const http_route_t *route;
+	http_request_t req;
+	http_response_t res;
+	size_t head_len, content_length = 0, consumed;
+	char allow[64], *query;
+	int status = 0;
+
+	memset(&req, 0, sizeof(req));
+	res.status = 0;
+	res.type = "application/json";
+	res.body = &http_body;
+	buf_reset(res.body);
+	allow[0] = 0;
+
+	if((head_len = http_header_end(data, len)) == 0) {
+		if(len < HTTP_MAX_REQUEST)
+			return 0;
+
+		status = 413;
+	}
+	else if((status = http_parse(data, head_len, &req, &content_length)) == 0
+		&& head_len + content_length > len) {
+		if(head_len + content_length <= HTTP_MAX_REQUEST)
+			return 0;
+
+		status = 413;
+	}
+
+	if(status) {
+		/* Can't tell where the next request would start */
+		http_reply(&res, status, http_reason(status));
+		req.keep_alive = 0;
+		consumed = len;
+	}
+	else {
+		req.body = data + head_len;
+		req.body_len = content_length;
+		consumed = head_len + content_length;
+
+		if((query = strchr(req.path, '?')) != NULL)
+			*query = 0;
+
+		for(route = http_routes; route->path != NULL; route++) {
+			if(strcmp(route->path, req.path))
+				continue;
+
+			if(!strcmp(route->method, req.method))
+				break;
+
+			snprintf(allow + strlen(allow), sizeof(allow) - strlen(allow),
+				"%s%s", allow[0]? ", ": "", route->method);
+		}
+
+		if(route->path != NULL)
+			route->handler(&req, &res);
+		else if(allow[0])
+			http_reply(&res, 405, "method not allowed");
+		else
+			http_reply(&res, 404, "no such endpoint");
+	}
+
+	syslog(LOG_DEBUG, "HTTP: %s %s, status %d", req.method[0]? req.method: "-",
+		req.path[0]? req.path: "-", res.status);
+
+	buf_printf(out, "HTTP/1.1 %d %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %lu\r\n"
+		"Cache-Control: no-store\r\n",
+		res.status, http_reason(res.status), res.type,
+		(unsigned long)res.body->len);
+	if(res.status == 405)
+		buf_printf(out, "Allow: %s\r\n", allow);
+	if(!req.keep_alive)
+		buf_printf(out, "Connection: close\r\n");
+	buf_printf(out, "\r\n");
+	buf_append(out, buf_str(res.body), res.body->len);
+
+	/* Don't hold on to memory from a large response */
+	if(http_body.size > HTTP_MAX_REQUEST)
+		buf_release(&http_body);
+
+	*keep_alive = req.keep_alive;
+
+	return (int)consumed;
+}
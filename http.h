@@ -0,0 +1,24 @@
+/**
+ * http.h
+ *
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+
+#include "buf.h"
+
+/* Serve the HTTP API on this TCP port, 0 to disable */
+#define HTTP_TCP_PORT 8080
+
+/* Largest request (request line, headers and body) accepted */
+#define HTTP_MAX_REQUEST 8192
+
+/* Max length of the request path */
+#define HTTP_MAX_PATH 256
+
+int http_handle(const char *data, size_t len, buf_t *out, int *keep_alive);
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * json.c
+ * Streaming JSON writer
+ *
+ * Values are appended straight to the output buffer as they're written, so
+ * nothing is built up in memory besides the serialized text itself.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "json.h"
+
+
+void json_init(json_t *j, buf_t *buf) {
+
+	memset(j, 0, sizeof(*j));
+	j->buf = buf;
+}
+
+static void json_append(json_t *j, const char *s, size_t len) {
+
+	if(buf_append(j->buf, s, len) < 0)
+		j->error = -1;
+}
+
+static void json_quote(json_t *j, const char *s) {
+	const char *run;
+	char esc[8];
+
+	json_append(j, "\"", 1);
+
+	for(run = s; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+
+		if(c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		/* Flush the run of characters that need no escaping */
+		json_append(j, run, s - run);
+		run = s + 1;
+
+		switch(c) {
+		case '"':	json_append(j, "\\\"", 2); break;
+		case '\\':	json_append(j, "\\\\", 2); break;
+		case '\n':	json_append(j, "\\n", 2); break;
+		case '\r':	json_append(j, "\\r", 2); break;
+		case '\t':	json_append(j, "\\t", 2); break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			json_append(j, esc, 6);
+			break;
+		}
+	}
+
+	json_append(j, run, s - run);
+	json_append(j, "\"", 1);
+}
+
+/* Comma and key for the next value at the current depth */
+static void json_key(json_t *j, const char *key) {
+
+	if(j->has_items[j->depth])
+		json_append(j, ",", 1);
+	j->has_items[j->depth] = 1;
+
+	if(j->depth > 0 && !j->in_array[j->depth]) {
+		json_quote(j, key != NULL? key: "");
+		json_append(j, ":", 1);
+	}
+}
+
+static void json_open(json_t *j, const char *key, int array) {
+
+	json_key(j, key);
+	json_append(j, array? "[": "{", 1);
+
+	if(j->depth == JSON_MAX_DEPTH) {
+		j->error = -1;
+		return;
+	}
+
+	j->depth++;
+	j->in_array[j->depth] = array;
+	j->has_items[j->depth] = 0;
+}
+
+static void json_close(json_t *j, int array) {
+
+	if(j->depth == 0 || j->in_array[j->depth] != array) {
+		j->error = -1;
+		return;
+	}
+
+	j->depth--;
+	json_append(j, array? "]": "}", 1);
+}
+
+void json_object_begin(json_t *j, const char *key) {
+
+	json_open(j, key, 0);
+}
+
+void json_object_end(json_t *j) {
+
+	json_close(j, 0);
+}
+
+void json_array_begin(json_t *j, const char *key) {
+
+	json_open(j, key, 1);
+}
+
+void json_array_end(json_t *j) {
+
+	json_close(j, 1);
+}
+
+void json_string(json_t *j, const char *key, const char *value) {
+
+	if(value == NULL) {
+		json_null(j, key);
+		return;
+	}
+
+	json_key(j, key);
+	json_quote(j, value);
+}
+
+void json_int(json_t *j, const char *key, long long value) {
+	char num[24];
+	int n;
+
+	json_key(j, key);
+	n = snprintf(num, sizeof(num), "%lld", value);
+	json_append(j, num, n);
+}
+
+/* JSON has no NaN or infinity, those are written as null */
+void json_double(json_t *j, const char *key, double value) {
+	char num[32];
+	int n;
+
+	if(isnan(value) || isinf(value)) {
+		json_null(j, key);
+		return;
+	}
+
+	json_key(j, key);
+	n = snprintf(num, sizeof(num), "%.3f", value);
+	json_append(j, num, n);
+}
+
+void json_bool(json_t *j, const char *key, int value) {
+
+	json_key(j, key);
+	if(value)
+		json_append(j, "true", 4);
+	else
+		json_append(j, "false", 5);
+}
+
+void json_null(json_t *j, const char *key) {
+
+	json_key(j, key);
+	json_append(j, "null", 4);
+}
+
+/* Terminate the document with a newline; -1 if it's malformed or truncated */
+int json_finish(json_t *j) {
+
+	if(j->depth != 0)
+		j->error = -1;
+
+	json_append(j, "\n", 1);
+
+	return j->error;
+}
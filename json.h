@@ -0,0 +1,35 @@
+/**
+ * json.h
+ *
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include "buf.h"
+
+/* Max nesting of objects and arrays */
+#define JSON_MAX_DEPTH 16
+
+/* Streaming JSON writer; keys are ignored inside arrays and at the top */
+typedef struct {
+	buf_t *buf;
+	int depth;
+	unsigned char in_array[JSON_MAX_DEPTH + 1];
+	unsigned char has_items[JSON_MAX_DEPTH + 1];
+	int error;
+} json_t;
+
+void json_init(json_t *j, buf_t *buf);
+void json_object_begin(json_t *j, const char *key);
+void json_object_end(json_t *j);
+void json_array_begin(json_t *j, const char *key);
+void json_array_end(json_t *j);
+void json_string(json_t *j, const char *key, const char *value);
+void json_int(json_t *j, const char *key, long long value);
+void json_double(json_t *j, const char *key, double value);
+void json_bool(json_t *j, const char *key, int value);
+void json_null(json_t *j, const char *key);
+int json_finish(json_t *j);
+
+#endif
@@ -22,6 +22,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -31,13 +32,17 @@
 #include <libspotify/api.h>
 
 #include "app.h"
+#include "http.h"
+#include "mdindex.h"
 #include "net.h"
 #include "player.h"
+#include "reactor.h"
 
 
 #define LIBSPOTIFY_USERAGENT "pi-boombox"
 #define LIBSPOTIFY_CACHE_DIR "./tmp"
 #define LIBSPOTIFY_AUTH_BLOB LIBSPOTIFY_CACHE_DIR "/libspotify.creds"
+#define LIBSPOTIFY_MDINDEX LIBSPOTIFY_CACHE_DIR "/mdindex"
 
 
 static char blob[1024];
@@ -154,9 +159,9 @@ static void sess_callback_metadata_updated(sp_session *session) {
 /* May be called from an internal thread */
 static void sess_callback_notify(sp_session *session) {
 
-	/* Write anything to piped fd in order to make net_poll()
-	 * return so that sp_session_process_events() is called */
-	write(app_signal_write_fd(), "NOTIFY", 6);
+	/* Make reactor_run() return so that
+	 * sp_session_process_events() is called */
+	reactor_wakeup();
 	syslog(LOG_DEBUG, "Session: Event processing requested by %s thread",
 			pthread_equal(pthread_self(), thread_main)? "the main": "an internal");
 }
@@ -201,6 +206,9 @@ static void sess_callback_offline_status_updated(sp_session *session) {
 		sp_offline_tracks_to_sync(session),
 		sp_offline_time_left(session) / 86400,
 		(sp_offline_time_left(session) % 86400) / 3600);
+
+	app_status_invalidate(APP_STATUS_PLAYLISTS);
+	app_notify_offline();
 }
 
 static void sess_callback_offline_error(sp_session *session, sp_error error) {
@@ -208,11 +216,22 @@ static void sess_callback_offline_error(sp_session *session, sp_error error) {
 	syslog(LOG_DEBUG, "Session: offline error is now: %s", sp_error_message(error));
 }
 
-int mainloop(sp_session *session, int listen_fd) {
+/* Nothing to do here, libspotify is serviced on every wakeup */
+static void spotify_timeout(void *arg) {
+
+}
+
+int mainloop(sp_session *session) {
 	int event, timeout;
-	int loops;
+	int loops, ret;
+	int spotify_timer;
+	struct timespec busy;
+
+	spotify_timer = reactor_timer_create(spotify_timeout, NULL);
+
 	event = 0;
 	do {
+		clock_gettime(CLOCK_MONOTONIC, &busy);
 
 		syslog(LOG_DEBUG, "EVENTLOOP [id %d]: Processing Spotify events", event);
 		loops = 0;
@@ -221,25 +240,143 @@ int mainloop(sp_session *session, int listen_fd) {
 			loops++;
 		} while(timeout == 0);
 		syslog(LOG_DEBUG, "EVENTLOOP [id %d]: Done processing %d Spotify events, next timeout %dms", event, loops, timeout);
+		reactor_timer_set(spotify_timer, timeout);
 
-		if(app_process_events() < 0) {
+		if((ret = app_process_events()) < 0) {
 			syslog(LOG_INFO, "EVENTLOOP [id %d]: app_process_events() failed", event);
 			break;
 		}
 
-		if(net_poll(listen_fd, timeout) < 0) {
-			syslog(LOG_INFO, "EVENTLOOP [id %d]: net_poll() failed", event);
+		/* Leave libspotify notifications pending for a while so
+		   that they are handled in batches instead of one by one */
+		if(app_get_power_save())
+			reactor_hold_wakeups(APP_POWERSAVE_BATCH_MS);
+
+		app_record_loop_time(&busy);
+
+		/* Come right back if there are more application events queued */
+		if(reactor_run(ret > 0? 0: -1) < 0) {
+			syslog(LOG_INFO, "EVENTLOOP [id %d]: reactor_run() failed", event);
 			break;
 		}
 
+		app_count_wakeup();
+
 		event++;
 	} while(1);
 
+	reactor_timer_delete(spotify_timer);
+
 	return 0;
 }
 
+static void usage(const char *argv0) {
+
+	fprintf(stderr, "Usage: %s [options] [<username> [<password> [<spotify link>]]]\n"
+		"  -b <address>  Listen on this address only, may be repeated (default: all)\n"
+		"  -p <port>     Control commands TCP port (default: %d)\n"
+		"  -H <port>     HTTP API port, 0 to disable (default: %d)\n"
+		"  -s <path>     Unix domain control socket, \"\" to disable (default: %s)\n"
+		"  -R            Only allow privileged commands on the Unix domain socket\n"
+		"  -u <port>     Accept UDP remote control datagrams (e.g, %d)\n"
+		"  -k <file>     Shared UDP key, 32 hex digits (required with -u)\n"
+		"  -n <type>     Network: wired, wifi, mobile or roaming (default: roaming)\n"
+		"  -L            Only load playlists once selected, saves memory and startup time\n",
+		argv0, CTRL_TCP_PORT, HTTP_TCP_PORT, NET_UNIX_PATH, NET_UDP_PORT);
+}
+
+/* Key file holds the key as hex digits, whitespace is ignored */
+static int read_udp_key(const char *path, uint8_t *key) {
+	FILE *fp;
+	int i, n = 0;
+
+	if((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Failed to open UDP key file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	for(i = 0; i < NET_UDP_KEY_SIZE && fscanf(fp, " %2hhx", &key[i]) == 1; i++)
+		n++;
+	fclose(fp);
+
+	if(n != NET_UDP_KEY_SIZE) {
+		fprintf(stderr, "UDP key file %s must hold %d hex digits\n", path, NET_UDP_KEY_SIZE * 2);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the index of the first positional argument or -1 on error */
+static int parse_options(int argc, char **argv, net_config_t *netconf, int *connection_type,
+		int *lazy_playlists) {
+	const char *key_file = NULL;
+	int opt;
+
+	memset(netconf, 0, sizeof(*netconf));
+	netconf->port = CTRL_TCP_PORT;
+	netconf->http_port = HTTP_TCP_PORT;
+	netconf->unix_path = NET_UNIX_PATH;
+
+	/* This program will be run on mobile internet connections */
+	*connection_type = SP_CONNECTION_TYPE_MOBILE_ROAMING;
+	*lazy_playlists = 0;
+
+	while((opt = getopt(argc, argv, "b:p:H:s:Ru:k:n:L")) != -1) {
+		switch(opt) {
+		case 'b':
+			if(netconf->num_bind == NET_MAX_BIND) {
+				fprintf(stderr, "%s: At most %d bind addresses\n", argv[0], NET_MAX_BIND);
+				return -1;
+			}
+			netconf->bind[netconf->num_bind++] = optarg;
+			break;
+		case 'p':
+			netconf->port = atoi(optarg);
+			if(netconf->port < 1 || netconf->port > 65535)
+				return -1;
+			break;
+		case 'H':
+			netconf->http_port = atoi(optarg);
+			if(netconf->http_port < 0 || netconf->http_port > 65535)
+				return -1;
+			break;
+		case 's':
+			netconf->unix_path = optarg;
+			break;
+		case 'R':
+			netconf->restrict_tcp = 1;
+			break;
+		case 'u':
+			netconf->udp_port = atoi(optarg);
+			if(netconf->udp_port < 1 || netconf->udp_port > 65535)
+				return -1;
+			break;
+		case 'k':
+			key_file = optarg;
+			break;
+		case 'n':
+			if((*connection_type = app_parse_connection_type(optarg)) < 0)
+				return -1;
+			break;
+		case 'L':
+			*lazy_playlists = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	/* An unauthenticated UDP port is not an option */
+	if(netconf->udp_port && (key_file == NULL || read_udp_key(key_file, netconf->udp_key) < 0))
+		return -1;
+
+	return optind;
+}
+
 int main(int argc, char **argv) {
-	int listen_fd;
+	net_config_t netconf;
+	int first_arg, connection_type, lazy_playlists;
 	sp_session *session;
 	static sp_session_config config;
 	static sp_session_callbacks callbacks = {
@@ -271,6 +408,17 @@ int main(int argc, char **argv) {
 
 	thread_main = pthread_self();
 
+	if((first_arg = parse_options(argc, argv, &netconf, &connection_type,
+			&lazy_playlists)) < 0 || argc - first_arg > 3) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	/* Leave the user, password and link where they've always been */
+	argv[first_arg - 1] = argv[0];
+	argv += first_arg - 1;
+	argc -= first_arg - 1;
+
 	/* Setup logging to stderr */
 	openlog(LIBSPOTIFY_USERAGENT, LOG_PERROR, LOG_USER);
 
@@ -290,10 +438,18 @@ int main(int argc, char **argv) {
 	config.application_key_size = sizeof(g_appkey);
 	config.user_agent = LIBSPOTIFY_USERAGENT;
 	config.callbacks = &callbacks;
+	if(reactor_init() < 0) {
+		syslog(LOG_ERR, "MAIN: Unable to initialize main loop");
+		return -1;
+	}
+
 	config.userdata = app_create();
 	config.compress_playlists = 1;
 	config.dont_save_metadata_for_playlists = 0;
-	config.initially_unload_playlists = 0;
+
+	/* Only one playlist is played at a time, the rest needn't be held */
+	config.initially_unload_playlists = lazy_playlists;
+	app_set_lazy_playlists(lazy_playlists);
 	config.device_id = NULL;
 
 	syslog(LOG_DEBUG, "MAIN: Initializing libspotify");
@@ -304,13 +460,15 @@ int main(int argc, char **argv) {
 	}
 
 	app_set_session(session);
+	if(mdindex_open(LIBSPOTIFY_MDINDEX, session) < 0)
+		syslog(LOG_WARNING, "MAIN: Failed to open metadata index, continuing without it");
+
 	if(argc == 4) {
 		sp_link *link = sp_link_create_from_string(argv[3]);
 		app_set_link(link);
 	}
 
-	/* This program will be run on mobile internet connections */
-	sp_session_set_connection_type(session, SP_CONNECTION_TYPE_MOBILE_ROAMING);
+	app_set_connection_type(connection_type);
 	sp_session_set_connection_rules(session, SP_CONNECTION_RULE_NETWORK|SP_CONNECTION_RULE_NETWORK_IF_ROAMING|SP_CONNECTION_RULE_ALLOW_SYNC_OVER_MOBILE);
 	sp_session_preferred_offline_bitrate(session, SP_BITRATE_160k, 0);
 
@@ -331,17 +489,19 @@ int main(int argc, char **argv) {
 		sp_session_login(session, argv[1], argc == 3? argv[2]: NULL, 1, get_auth_blob());
 	}
 
-	if((listen_fd = net_create(CTRL_TCP_PORT)) < 0) {
+	if(net_create(&netconf) < 0) {
 		syslog(LOG_ERR, "MAIN: Failed to initialize external network");
 		app_release();
 		return -1;
 	}
 
-	mainloop(session, listen_fd);
+	mainloop(session);
 	syslog(LOG_INFO, "MAIN: Outside main event loop, good bye!");
 
-	net_release(listen_fd);
+	net_release();
+	mdindex_close();
 	app_release();
+	reactor_release();
 
 	return 0;
 }
@@ -0,0 +1,892 @@
+/**
+ * mdindex.c
+ * Metadata of the playlists and tracks seen, kept on disk
+ *
+ * After a restart libspotify takes a while to load playlist and track
+ * metadata again.  The last known title, artist, album, duration and
+ * availability of every track in the playlists we've monitored are kept
+ * in a file that is memory-mapped read-only at startup, so they can be
+ * used before libspotify has caught up.
+ *
+ * The file holds fixed-width track and playlist records, the track ids of
+ * each playlist, a hash table on track URIs and a table of interned NUL
+ * terminated strings, all referred to by offset.  Changes read back from
+ * the playlist callbacks collect in memory on top of the mapped file,
+ * which is rewritten from both every so often.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "avail.h"
+#include "buf.h"
+#include "mdindex.h"
+#include "reactor.h"
+#include "search.h"
+
+#define MDINDEX_MAGIC		"BBMDIDX"
+#define MDINDEX_VERSION		1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_tracks;
+	uint32_t num_playlists;
+	uint32_t num_refs;
+	uint32_t hash_size;
+	uint32_t strings_size;
+	uint32_t tracks_off;
+	uint32_t playlists_off;
+	uint32_t refs_off;
+	uint32_t hash_off;
+	uint32_t strings_off;
+	uint32_t file_size;
+} mdindex_header_t;
+
+/* Strings are offsets into the string table */
+typedef struct {
+	uint32_t uri;
+	uint32_t title;
+	uint32_t artist;
+	uint32_t album;
+	uint32_t duration_ms;
+	uint32_t avail;
+} mdindex_disk_track_t;
+
+typedef struct {
+	uint32_t uri;
+	uint32_t name;
+	uint32_t first_ref;
+	uint32_t num_refs;
+} mdindex_disk_playlist_t;
+
+/* Track read back since the file was written */
+typedef struct {
+	char *uri;
+	char *title;
+	char *artist;
+	char *album;
+	int duration_ms;
+	int avail;
+} mdindex_rec_t;
+
+/* Playlist read back since; its tracks are ids of records in memory,
+   or -1 - id for tracks unchanged in the file */
+typedef struct {
+	char *uri;
+	char *name;
+	int *tracks;
+	int num_tracks;
+} mdindex_list_t;
+
+/* Growable array of words, sections of the file being written */
+typedef struct {
+	uint32_t *v;
+	uint32_t len;
+	uint32_t size;
+} mdindex_vec_t;
+
+typedef struct {
+	mdindex_vec_t tracks;
+	mdindex_vec_t playlists;
+	mdindex_vec_t refs;
+	buf_t strings;
+
+	/* Interned strings and track ids by URI, offset or id + 1 */
+	uint32_t *strs;
+	uint32_t strs_size;
+	uint32_t strs_used;
+	uint32_t *ids;
+	uint32_t ids_size;
+} mdindex_writer_t;
+
+static struct {
+	sp_session *session;
+	char *path;
+
+	/* Mapped file */
+	void *map;
+	size_t map_size;
+	const mdindex_header_t *hdr;
+	const mdindex_disk_track_t *tracks;
+	const mdindex_disk_playlist_t *playlists;
+	const uint32_t *refs;
+	const uint32_t *hash;
+	const char *strings;
+
+	/* Changes on top of it, records by URI as id + 1 */
+	mdindex_rec_t *recs;
+	int num_recs;
+	int recs_size;
+	uint32_t *rec_hash;
+	int rec_hash_size;
+	mdindex_list_t *lists;
+	int num_lists;
+
+	/* Playlists to read back once libspotify is done with them */
+	sp_playlist *dirty[MDINDEX_MAX_DIRTY];
+	int num_dirty;
+	int update_timer;
+	int update_armed;
+	int flush_timer;
+	int flush_armed;
+} g_md;
+
+
+/* FNV-1a, also used for spread mode keys */
+uint32_t mdindex_hash(const char *s) {
+	uint32_t h = 2166136261u;
+
+	while(*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static const char *mdindex_str(uint32_t off) {
+
+	if(g_md.map == NULL || off >= g_md.hdr->strings_size)
+		return "";
+
+	return g_md.strings + off;
+}
+
+/* Id of the track in the mapped file, or -1 */
+static int mdindex_disk_find(const char *uri) {
+	uint32_t i, n, id, mask;
+
+	if(g_md.map == NULL || g_md.hdr->hash_size == 0)
+		return -1;
+
+	mask = g_md.hdr->hash_size - 1;
+	for(i = mdindex_hash(uri) & mask, n = 0; n < g_md.hdr->hash_size && (id = g_md.hash[i]) != 0;
+			i = (i + 1) & mask, n++) {
+		if(id <= g_md.hdr->num_tracks && !strcmp(mdindex_str(g_md.tracks[id - 1].uri), uri))
+			return id - 1;
+	}
+
+	return -1;
+}
+
+static void mdindex_from_disk(int id, mdindex_track_t *t) {
+	const mdindex_disk_track_t *d = &g_md.tracks[id];
+
+	t->uri = mdindex_str(d->uri);
+	t->title = mdindex_str(d->title);
+	t->artist = mdindex_str(d->artist);
+	t->album = mdindex_str(d->album);
+	t->duration_ms = d->duration_ms;
+	t->avail = d->avail < AVAIL_MAX? (int)d->avail: AVAIL_UNKNOWN;
+}
+
+/* Id of the record in memory, or -1 */
+static int mdindex_rec_find(const char *uri) {
+	int i;
+	uint32_t id;
+
+	if(g_md.rec_hash_size == 0)
+		return -1;
+
+	for(i = mdindex_hash(uri) & (g_md.rec_hash_size - 1); (id = g_md.rec_hash[i]) != 0;
+			i = (i + 1) & (g_md.rec_hash_size - 1)) {
+		if(!strcmp(g_md.recs[id - 1].uri, uri))
+			return id - 1;
+	}
+
+	return -1;
+}
+
+static void mdindex_from_rec(int id, mdindex_track_t *t) {
+	const mdindex_rec_t *r = &g_md.recs[id];
+
+	t->uri = r->uri;
+	t->title = r->title? r->title: "";
+	t->artist = r->artist? r->artist: "";
+	t->album = r->album? r->album: "";
+	t->duration_ms = r->duration_ms;
+	t->avail = r->avail;
+}
+
+/* Track by reference from a playlist read back */
+static void mdindex_from_ref(int ref, mdindex_track_t *t) {
+
+	if(ref >= 0)
+		mdindex_from_rec(ref, t);
+	else
+		mdindex_from_disk(-1 - ref, t);
+}
+
+static int mdindex_rec_grow(void) {
+	mdindex_rec_t *recs;
+	uint32_t *hash;
+	int i, j, size;
+
+	if(g_md.num_recs == g_md.recs_size) {
+		size = g_md.recs_size? g_md.recs_size * 2: 256;
+		if((recs = realloc(g_md.recs, size * sizeof(mdindex_rec_t))) == NULL)
+			return -1;
+
+		g_md.recs = recs;
+		g_md.recs_size = size;
+	}
+
+	/* Keep the hash table at most half full */
+	if((g_md.num_recs + 1) * 2 <= g_md.rec_hash_size)
+		return 0;
+
+	size = g_md.rec_hash_size? g_md.rec_hash_size * 2: 512;
+	if((hash = calloc(size, sizeof(uint32_t))) == NULL)
+		return -1;
+
+	for(i = 0; i < g_md.num_recs; i++) {
+		for(j = mdindex_hash(g_md.recs[i].uri) & (size - 1); hash[j] != 0; j = (j + 1) & (size - 1));
+		hash[j] = i + 1;
+	}
+
+	free(g_md.rec_hash);
+	g_md.rec_hash = hash;
+	g_md.rec_hash_size = size;
+
+	return 0;
+}
+
+/* Add or update a record in memory, returns its id or -1 */
+static int mdindex_put(const mdindex_track_t *t) {
+	mdindex_rec_t *r;
+	int id, i;
+
+	if((id = mdindex_rec_find(t->uri)) < 0) {
+		if(mdindex_rec_grow() < 0)
+			return -1;
+
+		r = &g_md.recs[g_md.num_recs];
+		memset(r, 0, sizeof(*r));
+		if((r->uri = strdup(t->uri)) == NULL)
+			return -1;
+
+		id = g_md.num_recs++;
+		for(i = mdindex_hash(t->uri) & (g_md.rec_hash_size - 1); g_md.rec_hash[i] != 0;
+				i = (i + 1) & (g_md.rec_hash_size - 1));
+		g_md.rec_hash[i] = id + 1;
+	}
+	else {
+		r = &g_md.recs[id];
+		free(r->title);
+		free(r->artist);
+		free(r->album);
+	}
+
+	r->title = strdup(t->title);
+	r->artist = strdup(t->artist);
+	r->album = strdup(t->album);
+	r->duration_ms = t->duration_ms;
+	r->avail = t->avail;
+
+	return id;
+}
+
+static void mdindex_clear_overlay(void) {
+	int i;
+
+	for(i = 0; i < g_md.num_recs; i++) {
+		free(g_md.recs[i].uri);
+		free(g_md.recs[i].title);
+		free(g_md.recs[i].artist);
+		free(g_md.recs[i].album);
+	}
+
+	for(i = 0; i < g_md.num_lists; i++) {
+		free(g_md.lists[i].uri);
+		free(g_md.lists[i].name);
+		free(g_md.lists[i].tracks);
+	}
+
+	free(g_md.recs);
+	free(g_md.rec_hash);
+	free(g_md.lists);
+	g_md.recs = NULL;
+	g_md.rec_hash = NULL;
+	g_md.lists = NULL;
+	g_md.num_recs = g_md.recs_size = g_md.rec_hash_size = g_md.num_lists = 0;
+}
+
+/* Does a section of count elements at off fit in the file */
+static int mdindex_section_ok(uint32_t off, uint32_t count, size_t size) {
+
+	return off % 4 == 0 && (uint64_t)off + (uint64_t)count * size <= g_md.map_size;
+}
+
+static void mdindex_unmap(void) {
+
+	if(g_md.map != NULL)
+		munmap(g_md.map, g_md.map_size);
+
+	g_md.map = NULL;
+	g_md.hdr = NULL;
+}
+
+static int mdindex_map(void) {
+	const mdindex_header_t *h;
+	struct stat st;
+	int fd;
+
+	if((fd = open(g_md.path, O_RDONLY)) < 0)
+		return -1;
+
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(mdindex_header_t)) {
+		close(fd);
+		return -1;
+	}
+
+	g_md.map_size = st.st_size;
+	g_md.map = mmap(NULL, g_md.map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(g_md.map == MAP_FAILED) {
+		g_md.map = NULL;
+		return -1;
+	}
+
+	h = g_md.map;
+	if(memcmp(h->magic, MDINDEX_MAGIC, sizeof(MDINDEX_MAGIC)) || h->version != MDINDEX_VERSION
+		|| h->file_size != g_md.map_size
+		|| !mdindex_section_ok(h->tracks_off, h->num_tracks, sizeof(mdindex_disk_track_t))
+		|| !mdindex_section_ok(h->playlists_off, h->num_playlists, sizeof(mdindex_disk_playlist_t))
+		|| !mdindex_section_ok(h->refs_off, h->num_refs, sizeof(uint32_t))
+		|| !mdindex_section_ok(h->hash_off, h->hash_size, sizeof(uint32_t))
+		|| (h->hash_size & (h->hash_size - 1))
+		|| !mdindex_section_ok(h->strings_off, h->strings_size, 1)
+		|| h->strings_size == 0
+		|| ((const char *)g_md.map)[h->strings_off + h->strings_size - 1] != 0) {
+		syslog(LOG_WARNING, "Index: Ignoring damaged or outdated metadata index %s", g_md.path);
+		munmap(g_md.map, g_md.map_size);
+		g_md.map = NULL;
+		return -1;
+	}
+
+	g_md.hdr = h;
+	g_md.tracks = (const void *)((const char *)g_md.map + h->tracks_off);
+	g_md.playlists = (const void *)((const char *)g_md.map + h->playlists_off);
+	g_md.refs = (const void *)((const char *)g_md.map + h->refs_off);
+	g_md.hash = (const void *)((const char *)g_md.map + h->hash_off);
+	g_md.strings = (const char *)g_md.map + h->strings_off;
+
+	return 0;
+}
+
+static int mdindex_vec_push(mdindex_vec_t *v, uint32_t x) {
+	uint32_t *p, size;
+
+	if(v->len == v->size) {
+		size = v->size? v->size * 2: 1024;
+		if((p = realloc(v->v, size * sizeof(uint32_t))) == NULL)
+			return -1;
+
+		v->v = p;
+		v->size = size;
+	}
+
+	v->v[v->len++] = x;
+
+	return 0;
+}
+
+/* Rehash a table of offsets or ids, key() gives the string hashed */
+static uint32_t *mdindex_rehash(const uint32_t *old, uint32_t old_size, uint32_t size,
+		mdindex_writer_t *w, const char *(*key)(mdindex_writer_t *w, uint32_t v)) {
+	uint32_t *table, i, j;
+
+	if((table = calloc(size, sizeof(uint32_t))) == NULL)
+		return NULL;
+
+	for(i = 0; i < old_size; i++) {
+		if(old[i] == 0)
+			continue;
+
+		for(j = mdindex_hash(key(w, old[i])) & (size - 1); table[j] != 0; j = (j + 1) & (size - 1));
+		table[j] = old[i];
+	}
+
+	return table;
+}
+
+static const char *mdindex_str_key(mdindex_writer_t *w, uint32_t v) {
+
+	return w->strings.data + v - 1;
+}
+
+static const char *mdindex_id_key(mdindex_writer_t *w, uint32_t v) {
+
+	return w->strings.data + w->tracks.v[(v - 1) * 6];
+}
+
+/* Offset of the string in the new string table, added if not there yet */
+static int mdindex_intern(mdindex_writer_t *w, const char *s, uint32_t *off) {
+	uint32_t i, v, *table, size;
+
+	for(i = mdindex_hash(s) & (w->strs_size - 1); (v = w->strs[i]) != 0; i = (i + 1) & (w->strs_size - 1)) {
+		if(!strcmp(w->strings.data + v - 1, s)) {
+			*off = v - 1;
+			return 0;
+		}
+	}
+
+	*off = w->strings.len;
+	if(buf_append(&w->strings, s, strlen(s) + 1) < 0)
+		return -1;
+
+	w->strs[i] = *off + 1;
+	if(++w->strs_used * 2 > w->strs_size) {
+		size = w->strs_size * 2;
+		if((table = mdindex_rehash(w->strs, w->strs_size, size, w, mdindex_str_key)) == NULL)
+			return -1;
+
+		free(w->strs);
+		w->strs = table;
+		w->strs_size = size;
+	}
+
+	return 0;
+}
+
+/* Id of the track in the new file, added if not there yet */
+static int mdindex_write_track(mdindex_writer_t *w, const mdindex_track_t *t, uint32_t *id) {
+	uint32_t i, v, uri, f[6], *table, size;
+
+	if(mdindex_intern(w, t->uri, &uri) < 0)
+		return -1;
+
+	for(i = mdindex_hash(t->uri) & (w->ids_size - 1); (v = w->ids[i]) != 0; i = (i + 1) & (w->ids_size - 1)) {
+		if(w->tracks.v[(v - 1) * 6] == uri) {
+			*id = v - 1;
+			return 0;
+		}
+	}
+
+	f[0] = uri;
+	f[4] = t->duration_ms;
+	f[5] = t->avail;
+	if(mdindex_intern(w, t->title, &f[1]) < 0 || mdindex_intern(w, t->artist, &f[2]) < 0
+		|| mdindex_intern(w, t->album, &f[3]) < 0)
+		return -1;
+
+	*id = w->tracks.len / 6;
+	for(v = 0; v < 6; v++)
+		if(mdindex_vec_push(&w->tracks, f[v]) < 0)
+			return -1;
+
+	w->ids[i] = *id + 1;
+	if((*id + 1) * 2 > w->ids_size) {
+		size = w->ids_size * 2;
+		if((table = mdindex_rehash(w->ids, w->ids_size, size, w, mdindex_id_key)) == NULL)
+			return -1;
+
+		free(w->ids);
+		w->ids = table;
+		w->ids_size = size;
+	}
+
+	return 0;
+}
+
+static int mdindex_write_playlist(mdindex_writer_t *w, const char *uri, const char *name,
+		const int *refs, const uint32_t *disk_refs, int num_refs) {
+	mdindex_track_t t;
+	uint32_t f[4], id;
+	int i;
+
+	if(mdindex_intern(w, uri, &f[0]) < 0 || mdindex_intern(w, name, &f[1]) < 0)
+		return -1;
+
+	f[2] = w->refs.len;
+	f[3] = num_refs;
+	for(i = 0; i < num_refs; i++) {
+		if(refs != NULL)
+			mdindex_from_ref(refs[i], &t);
+		else if(disk_refs[i] < g_md.hdr->num_tracks)
+			mdindex_from_disk(disk_refs[i], &t);
+		else
+			continue;
+
+		if(mdindex_write_track(w, &t, &id) < 0 || mdindex_vec_push(&w->refs, id) < 0)
+			return -1;
+	}
+
+	f[3] = w->refs.len - f[2];
+	for(i = 0; i < 4; i++)
+		if(mdindex_vec_push(&w->playlists, f[i]) < 0)
+			return -1;
+
+	return 0;
+}
+
+static int mdindex_list_find(const char *uri) {
+	int i;
+
+	for(i = 0; i < g_md.num_lists; i++)
+		if(!strcmp(g_md.lists[i].uri, uri))
+			return i;
+
+	return -1;
+}
+
+/* Merge the changes with the mapped file into a new file */
+static int mdindex_write(void) {
+	const mdindex_disk_playlist_t *p;
+	mdindex_writer_t w;
+	mdindex_header_t h;
+	char tmp[512];
+	uint32_t i, off;
+	FILE *fp;
+	int ret = -1;
+
+	memset(&w, 0, sizeof(w));
+	buf_init(&w.strings);
+	w.strs_size = w.ids_size = 1024;
+	w.strs = calloc(w.strs_size, sizeof(uint32_t));
+	w.ids = calloc(w.ids_size, sizeof(uint32_t));
+
+	/* Offset 0 is the empty string */
+	if(w.strs == NULL || w.ids == NULL || buf_append(&w.strings, "", 1) < 0)
+		goto out;
+
+	for(i = 0; i < (uint32_t)g_md.num_lists; i++)
+		if(mdindex_write_playlist(&w, g_md.lists[i].uri, g_md.lists[i].name,
+				g_md.lists[i].tracks, NULL, g_md.lists[i].num_tracks) < 0)
+			goto out;
+
+	for(i = 0; g_md.map != NULL && i < g_md.hdr->num_playlists; i++) {
+		p = &g_md.playlists[i];
+		if(mdindex_list_find(mdindex_str(p->uri)) >= 0
+			|| (uint64_t)p->first_ref + p->num_refs > g_md.hdr->num_refs)
+			continue;
+
+		if(mdindex_write_playlist(&w, mdindex_str(p->uri), mdindex_str(p->name), NULL,
+				g_md.refs + p->first_ref, p->num_refs) < 0)
+			goto out;
+	}
+
+	/* Keep the string table word aligned at the end */
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MDINDEX_MAGIC, sizeof(MDINDEX_MAGIC));
+	h.version = MDINDEX_VERSION;
+	h.num_tracks = w.tracks.len / 6;
+	h.num_playlists = w.playlists.len / 4;
+	h.num_refs = w.refs.len;
+	h.hash_size = w.ids_size;
+	h.strings_size = w.strings.len;
+	off = sizeof(h);
+	h.tracks_off = off;
+	off += w.tracks.len * sizeof(uint32_t);
+	h.playlists_off = off;
+	off += w.playlists.len * sizeof(uint32_t);
+	h.refs_off = off;
+	off += w.refs.len * sizeof(uint32_t);
+	h.hash_off = off;
+	off += w.ids_size * sizeof(uint32_t);
+	h.strings_off = off;
+	h.file_size = off + w.strings.len;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_md.path);
+	if((fp = fopen(tmp, "wb")) == NULL)
+		goto out;
+
+	fwrite(&h, sizeof(h), 1, fp);
+	fwrite(w.tracks.v, sizeof(uint32_t), w.tracks.len, fp);
+	fwrite(w.playlists.v, sizeof(uint32_t), w.playlists.len, fp);
+	fwrite(w.refs.v, sizeof(uint32_t), w.refs.len, fp);
+	fwrite(w.ids, sizeof(uint32_t), w.ids_size, fp);
+	fwrite(w.strings.data, 1, w.strings.len, fp);
+	if(ferror(fp) | fclose(fp) || rename(tmp, g_md.path) < 0) {
+		unlink(tmp);
+		goto out;
+	}
+
+	syslog(LOG_INFO, "Index: Wrote %u playlists with %u tracks, %u bytes", h.num_playlists,
+		h.num_tracks, h.file_size);
+	ret = 0;
+
+out:
+	free(w.tracks.v);
+	free(w.playlists.v);
+	free(w.refs.v);
+	free(w.strs);
+	free(w.ids);
+	buf_release(&w.strings);
+
+	return ret;
+}
+
+static void mdindex_flush(void *arg) {
+
+	g_md.flush_armed = 0;
+	if(g_md.num_lists == 0)
+		return;
+
+	if(mdindex_write() < 0) {
+		syslog(LOG_WARNING, "Index: Failed to write metadata index %s", g_md.path);
+		return;
+	}
+
+	/* Everything in memory is in the new file now */
+	mdindex_clear_overlay();
+	mdindex_unmap();
+	mdindex_map();
+}
+
+/* Build the word search index anew from everything known */
+static void mdindex_reindex(void) {
+	mdindex_track_t t;
+	uint32_t i;
+	int j;
+
+	search_reset();
+	for(j = 0; j < g_md.num_recs; j++) {
+		mdindex_from_rec(j, &t);
+		search_add(t.uri, t.title, t.artist, t.album, t.avail);
+	}
+
+	for(i = 0; g_md.map != NULL && i < g_md.hdr->num_tracks; i++) {
+		mdindex_from_disk(i, &t);
+		if(mdindex_rec_find(t.uri) < 0)
+			search_add(t.uri, t.title, t.artist, t.album, t.avail);
+	}
+}
+
+static int mdindex_track_uri(sp_track *t, char *uri, size_t len) {
+	sp_link *link;
+
+	if((link = sp_link_create_from_track(t, 0)) == NULL)
+		return -1;
+
+	sp_link_as_string(link, uri, len);
+	sp_link_release(link);
+
+	return 0;
+}
+
+static int mdindex_disk_equal(int id, const mdindex_track_t *t) {
+	mdindex_track_t d;
+
+	mdindex_from_disk(id, &d);
+
+	return d.duration_ms == t->duration_ms && d.avail == t->avail
+		&& !strcmp(d.title, t->title) && !strcmp(d.artist, t->artist)
+		&& !strcmp(d.album, t->album);
+}
+
+/* Read a loaded playlist and its tracks back into memory */
+static void mdindex_update_playlist(sp_playlist *pl) {
+	mdindex_list_t *l, *lists;
+	mdindex_track_t t;
+	sp_track *track;
+	sp_album *album;
+	sp_link *link;
+	char uri[256], track_uri[256];
+	int i, n, m, id, *tracks;
+
+	if(!sp_playlist_is_loaded(pl) || (link = sp_link_create_from_playlist(pl)) == NULL)
+		return;
+
+	sp_link_as_string(link, uri, sizeof(uri));
+	sp_link_release(link);
+
+	n = sp_playlist_num_tracks(pl);
+	if((tracks = malloc((n + 1) * sizeof(int))) == NULL)
+		return;
+
+	for(i = m = 0; i < n; i++) {
+		track = sp_playlist_track(pl, i);
+		if(track == NULL || mdindex_track_uri(track, track_uri, sizeof(track_uri)) < 0)
+			continue;
+
+		/* Keep what was known about tracks libspotify hasn't loaded yet */
+		if(!sp_track_is_loaded(track)) {
+			if((id = mdindex_rec_find(track_uri)) >= 0)
+				tracks[m++] = id;
+			else if((id = mdindex_disk_find(track_uri)) >= 0)
+				tracks[m++] = -1 - id;
+			else {
+				memset(&t, 0, sizeof(t));
+				t.uri = track_uri;
+				t.title = t.artist = t.album = "";
+				if((id = mdindex_put(&t)) >= 0)
+					tracks[m++] = id;
+			}
+			continue;
+		}
+
+		t.uri = track_uri;
+		t.title = sp_track_name(track);
+		t.artist = sp_track_num_artists(track) > 0?
+			sp_artist_name(sp_track_artist(track, 0)): "";
+		album = sp_track_album(track);
+		t.album = album != NULL? sp_album_name(album): "";
+		t.duration_ms = sp_track_duration(track);
+		t.avail = avail_classify(g_md.session, track);
+		search_add(t.uri, t.title, t.artist, t.album, t.avail);
+
+		/* Unchanged tracks are left where they are in the file */
+		if(mdindex_rec_find(track_uri) < 0 && (id = mdindex_disk_find(track_uri)) >= 0
+			&& mdindex_disk_equal(id, &t))
+			tracks[m++] = -1 - id;
+		else if((id = mdindex_put(&t)) >= 0)
+			tracks[m++] = id;
+	}
+
+	if((i = mdindex_list_find(uri)) < 0) {
+		if((lists = realloc(g_md.lists, (g_md.num_lists + 1) * sizeof(mdindex_list_t))) == NULL) {
+			free(tracks);
+			return;
+		}
+
+		g_md.lists = lists;
+		i = g_md.num_lists++;
+		memset(&g_md.lists[i], 0, sizeof(mdindex_list_t));
+		g_md.lists[i].uri = strdup(uri);
+		if(g_md.lists[i].uri == NULL) {
+			g_md.num_lists--;
+			free(tracks);
+			return;
+		}
+	}
+
+	l = &g_md.lists[i];
+	free(l->name);
+	free(l->tracks);
+	l->name = strdup(sp_playlist_name(pl));
+	l->tracks = tracks;
+	l->num_tracks = m;
+
+	syslog(LOG_DEBUG, "Index: Read back playlist %s with %d tracks", uri, m);
+
+	if(!g_md.flush_armed) {
+		reactor_timer_set(g_md.flush_timer, MDINDEX_FLUSH_MS);
+		g_md.flush_armed = 1;
+	}
+}
+
+static void mdindex_update(void *arg) {
+	int i;
+
+	g_md.update_armed = 0;
+	for(i = 0; i < g_md.num_dirty; i++) {
+		mdindex_update_playlist(g_md.dirty[i]);
+		sp_playlist_release(g_md.dirty[i]);
+	}
+
+	g_md.num_dirty = 0;
+	if(search_stale())
+		mdindex_reindex();
+}
+
+void mdindex_touch(sp_playlist *pl) {
+	int i;
+
+	if(g_md.path == NULL)
+		return;
+
+	for(i = 0; i < g_md.num_dirty && g_md.dirty[i] != pl; i++);
+	if(i == g_md.num_dirty) {
+		if(g_md.num_dirty == MDINDEX_MAX_DIRTY)
+			mdindex_update(NULL);
+
+		sp_playlist_add_ref(pl);
+		g_md.dirty[g_md.num_dirty++] = pl;
+	}
+
+	/* Loading playlists change a lot, read them back once they've settled a bit */
+	if(!g_md.update_armed) {
+		reactor_timer_set(g_md.update_timer, MDINDEX_UPDATE_MS);
+		g_md.update_armed = 1;
+	}
+}
+
+int mdindex_find_track(const char *uri, mdindex_track_t *track) {
+	int id;
+
+	if((id = mdindex_rec_find(uri)) >= 0)
+		mdindex_from_rec(id, track);
+	else if((id = mdindex_disk_find(uri)) >= 0)
+		mdindex_from_disk(id, track);
+	else
+		return -1;
+
+	return 0;
+}
+
+int mdindex_lookup_track(sp_track *t, mdindex_track_t *track) {
+	char uri[256];
+
+	if(t == NULL || mdindex_track_uri(t, uri, sizeof(uri)) < 0)
+		return -1;
+
+	return mdindex_find_track(uri, track);
+}
+
+const char *mdindex_playlist_name(const char *uri) {
+	uint32_t i;
+	int l;
+
+	if((l = mdindex_list_find(uri)) >= 0)
+		return g_md.lists[l].name;
+
+	for(i = 0; g_md.map != NULL && i < g_md.hdr->num_playlists; i++)
+		if(!strcmp(mdindex_str(g_md.playlists[i].uri), uri))
+			return mdindex_str(g_md.playlists[i].name);
+
+	return NULL;
+}
+
+void mdindex_get_stats(int *tracks, int *playlists, size_t *bytes) {
+
+	*tracks = g_md.num_recs + (g_md.map != NULL? (int)g_md.hdr->num_tracks: 0);
+	*playlists = g_md.num_lists + (g_md.map != NULL? (int)g_md.hdr->num_playlists: 0);
+	*bytes = g_md.map != NULL? g_md.map_size: 0;
+}
+
+int mdindex_open(const char *path, sp_session *session) {
+
+	memset(&g_md, 0, sizeof(g_md));
+	g_md.session = session;
+	if((g_md.path = strdup(path)) == NULL)
+		return -1;
+
+	g_md.update_timer = reactor_timer_create(mdindex_update, NULL);
+	g_md.flush_timer = reactor_timer_create(mdindex_flush, NULL);
+
+	if(mdindex_map() == 0)
+		syslog(LOG_INFO, "Index: Loaded %u playlists with %u tracks from %s",
+			g_md.hdr->num_playlists, g_md.hdr->num_tracks, path);
+
+	/* Tracks can be searched for before libspotify has loaded them */
+	mdindex_reindex();
+
+	return 0;
+}
+
+void mdindex_close(void) {
+
+	if(g_md.path == NULL)
+		return;
+
+	mdindex_update(NULL);
+	mdindex_flush(NULL);
+	mdindex_clear_overlay();
+	mdindex_unmap();
+	search_reset();
+
+	reactor_timer_delete(g_md.update_timer);
+	reactor_timer_delete(g_md.flush_timer);
+	free(g_md.path);
+	g_md.path = NULL;
+}
@@ -0,0 +1,45 @@
+/**
+ * mdindex.h
+ *
+ */
+
+#ifndef MDINDEX_H
+#define MDINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libspotify/api.h>
+
+/* Read playlists back this long after libspotify last changed them (ms),
+ * and write the index out at most this often (ms) */
+#define MDINDEX_UPDATE_MS	2000
+#define MDINDEX_FLUSH_MS	60000
+
+/* Playlists waiting to be read back at a time */
+#define MDINDEX_MAX_DIRTY	8
+
+/* Track as last seen; the strings stay valid until the main loop runs */
+typedef struct {
+	const char *uri;
+	const char *title;
+	const char *artist;
+	const char *album;
+	int duration_ms;
+	int avail;	/* avail_state_t */
+} mdindex_track_t;
+
+int mdindex_open(const char *path, sp_session *session);
+void mdindex_close(void);
+
+uint32_t mdindex_hash(const char *s);
+
+/* A playlist changed or got loaded, read it back into the index */
+void mdindex_touch(sp_playlist *pl);
+
+int mdindex_find_track(const char *uri, mdindex_track_t *track);
+int mdindex_lookup_track(sp_track *t, mdindex_track_t *track);
+const char *mdindex_playlist_name(const char *uri);
+
+void mdindex_get_stats(int *tracks, int *playlists, size_t *bytes);
+
+#endif
@@ -0,0 +1,247 @@
+/**
+ * meter.c
+ * Level meter and spectrum analysis of the audio being played
+ *
+ * The audio output thread copies every block it takes off the FIFO into a
+ * lock-free snapshot ring with meter_feed().  Analysis (RMS, peak and a
+ * fixed-point FFT) is done by the main thread in meter_format() so that it
+ * can never hold up the audio output thread.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "meter.h"
+
+#define METER_RING_MASK (METER_RING_FRAMES - 1)
+
+static struct {
+	/* Interleaved stereo snapshot ring, written by the audio thread only */
+	int16_t ring[METER_RING_FRAMES * 2];
+	uint32_t written;
+	int enabled;
+
+	/* Analysis state, only touched by the main thread */
+	uint32_t analyzed;
+	int16_t window[METER_FFT_SIZE];
+	int16_t sine[METER_FFT_SIZE - METER_FFT_SIZE / 4];
+	int band_edges[METER_NUM_BANDS + 1];
+} g_meter;
+
+
+void meter_init(void) {
+	int i, edge;
+
+	memset(&g_meter, 0, sizeof(g_meter));
+
+	/* Q15 sine table, cos(x) is looked up as sin(x + N/4) */
+	for(i = 0; i < METER_FFT_SIZE - METER_FFT_SIZE / 4; i++)
+		g_meter.sine[i] = (int16_t)(32767.0 * sin(2 * M_PI * i / METER_FFT_SIZE));
+
+	/* Q15 Hann window */
+	for(i = 0; i < METER_FFT_SIZE; i++)
+		g_meter.window[i] = (int16_t)(32767.0 * 0.5 *
+			(1.0 - cos(2 * M_PI * i / (METER_FFT_SIZE - 1))));
+
+	/* Logarithmically spaced bands over bins 1..N/2 */
+	g_meter.band_edges[0] = 1;
+	for(i = 1; i <= METER_NUM_BANDS; i++) {
+		edge = (int)pow(METER_FFT_SIZE / 2, (double)i / METER_NUM_BANDS);
+		if(edge <= g_meter.band_edges[i - 1])
+			edge = g_meter.band_edges[i - 1] + 1;
+		if(edge > METER_FFT_SIZE / 2)
+			edge = METER_FFT_SIZE / 2;
+
+		g_meter.band_edges[i] = edge;
+	}
+}
+
+void meter_enable(int enable) {
+
+	if(enable && !__atomic_load_n(&g_meter.enabled, __ATOMIC_RELAXED))
+		g_meter.analyzed = __atomic_load_n(&g_meter.written, __ATOMIC_ACQUIRE);
+
+	__atomic_store_n(&g_meter.enabled, enable, __ATOMIC_RELAXED);
+}
+
+/* Called from the audio output thread; must never block */
+void meter_feed(const audio_fifo_data_t *afd) {
+	const int16_t *src = afd->samples;
+	int16_t *dst;
+	uint32_t pos;
+	int i, n;
+
+	if(!__atomic_load_n(&g_meter.enabled, __ATOMIC_RELAXED))
+		return;
+
+	n = afd->nsamples;
+	if(n > METER_RING_FRAMES) {
+		src += (n - METER_RING_FRAMES) * afd->channels;
+		n = METER_RING_FRAMES;
+	}
+
+	pos = g_meter.written;
+	for(i = 0; i < n; i++, pos++, src += afd->channels) {
+		dst = &g_meter.ring[(pos & METER_RING_MASK) * 2];
+		dst[0] = src[0];
+		dst[1] = afd->channels > 1? src[1]: src[0];
+	}
+
+	__atomic_store_n(&g_meter.written, pos, __ATOMIC_RELEASE);
+}
+
+static uint32_t meter_isqrt(uint64_t v) {
+	uint64_t bit = (uint64_t)1 << 62, r = 0;
+
+	while(bit > v)
+		bit >>= 2;
+
+	while(bit) {
+		if(v >= r + bit) {
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		}
+		else
+			r >>= 1;
+		bit >>= 2;
+	}
+
+	return (uint32_t)r;
+}
+
+/* In-place radix-2 Q15 FFT, each stage is scaled by 1/2 to avoid overflow */
+static void meter_fft(int16_t *re, int16_t *im) {
+	int i, j, k, l, m, step, shift;
+	int32_t wr, wi, tr, ti, qr, qi;
+	int16_t t;
+
+	for(i = 0, j = 0; i < METER_FFT_SIZE - 1; i++) {
+		if(i < j) {
+			t = re[i], re[i] = re[j], re[j] = t;
+			t = im[i], im[i] = im[j], im[j] = t;
+		}
+
+		for(k = METER_FFT_SIZE >> 1; k <= j; k >>= 1)
+			j -= k;
+		j += k;
+	}
+
+	for(l = 1, shift = METER_FFT_LOG2 - 1; l < METER_FFT_SIZE; l <<= 1, shift--) {
+		step = l << 1;
+		for(m = 0; m < l; m++) {
+			wr = g_meter.sine[(m << shift) + METER_FFT_SIZE / 4];
+			wi = -g_meter.sine[m << shift];
+
+			for(i = m; i < METER_FFT_SIZE; i += step) {
+				j = i + l;
+				tr = ((wr * re[j] - wi * im[j]) >> 15) >> 1;
+				ti = ((wr * im[j] + wi * re[j]) >> 15) >> 1;
+				qr = re[i] >> 1;
+				qi = im[i] >> 1;
+
+				re[j] = (int16_t)(qr - tr);
+				im[j] = (int16_t)(qi - ti);
+				re[i] = (int16_t)(qr + tr);
+				im[i] = (int16_t)(qi + ti);
+			}
+		}
+	}
+}
+
+/**
+ * Analyze audio played since the previous call and format a meter line:
+ * "meter <rms L> <rms R> <peak L> <peak R> <band 0> .. <band N-1>"
+ * All values are linear magnitudes in the range 0-32767.
+ * Returns the length of the formatted line or -1 if buf is too small.
+ */
+int meter_format(char *buf, size_t len) {
+	static int16_t snap[METER_FFT_SIZE * 2];
+	int16_t re[METER_FFT_SIZE], im[METER_FFT_SIZE];
+	uint64_t sumsq[2] = { 0, 0 };
+	uint32_t rms[2] = { 0, 0 }, peak[2] = { 0, 0 };
+	uint32_t bands[METER_NUM_BANDS];
+	uint32_t written, start, count, mag, a;
+	int16_t *s;
+	int i, b, c, n, r;
+
+	memset(bands, 0, sizeof(bands));
+
+	written = __atomic_load_n(&g_meter.written, __ATOMIC_ACQUIRE);
+	count = written - g_meter.analyzed;
+	if(count > METER_RING_FRAMES / 2)
+		count = METER_RING_FRAMES / 2;
+	g_meter.analyzed = written;
+
+	if(count) {
+		/* Level meter over all frames played since last time */
+		start = written - count;
+		for(i = 0; i < (int)count; i++) {
+			s = &g_meter.ring[((start + i) & METER_RING_MASK) * 2];
+			for(c = 0; c < 2; c++) {
+				a = s[c] < 0? -(int32_t)s[c]: s[c];
+				if(a > peak[c])
+					peak[c] = a;
+				sumsq[c] += a * a;
+			}
+		}
+
+		for(c = 0; c < 2; c++) {
+			rms[c] = meter_isqrt(sumsq[c] / count);
+			if(peak[c] > 32767)
+				peak[c] = 32767;
+		}
+
+		/* Snapshot the latest FFT window; discard if the writer lapped us */
+		start = written - METER_FFT_SIZE;
+		for(i = 0; i < METER_FFT_SIZE; i++)
+			memcpy(&snap[i * 2], &g_meter.ring[((start + i) & METER_RING_MASK) * 2],
+				2 * sizeof(int16_t));
+
+		if(__atomic_load_n(&g_meter.written, __ATOMIC_ACQUIRE) - start
+				> METER_RING_FRAMES)
+			count = 0;
+	}
+
+	if(count) {
+		/* Windowed mono mix */
+		for(i = 0; i < METER_FFT_SIZE; i++) {
+			re[i] = (int16_t)((((int32_t)snap[i * 2] + snap[i * 2 + 1]) / 2
+				* g_meter.window[i]) >> 15);
+			im[i] = 0;
+		}
+
+		meter_fft(re, im);
+
+		/* Band value is the strongest bin, scaled back up to full scale */
+		for(b = 0; b < METER_NUM_BANDS; b++) {
+			for(i = g_meter.band_edges[b]; i < g_meter.band_edges[b + 1]; i++) {
+				mag = meter_isqrt((uint32_t)((int32_t)re[i] * re[i]) +
+					(uint32_t)((int32_t)im[i] * im[i]));
+				if(mag > bands[b])
+					bands[b] = mag;
+			}
+
+			bands[b] *= 4;
+			if(bands[b] > 32767)
+				bands[b] = 32767;
+		}
+	}
+
+	n = snprintf(buf, len, "meter %u %u %u %u",
+		rms[0], rms[1], peak[0], peak[1]);
+	for(b = 0; b < METER_NUM_BANDS && n > 0 && (size_t)n < len; b++) {
+		r = snprintf(buf + n, len - n, " %u", bands[b]);
+		if(r > 0) n += r;
+	}
+
+	if(n < 0 || (size_t)n >= len - 1)
+		return -1;
+
+	buf[n++] = '\n';
+	buf[n] = 0;
+
+	return n;
+}
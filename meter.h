@@ -0,0 +1,30 @@
+/**
+ * meter.h
+ *
+ */
+
+#ifndef METER_H
+#define METER_H
+
+#include <stddef.h>
+
+#include "audio.h"
+
+/* Snapshot ring size in (stereo) frames, must be a power of two */
+#define METER_RING_FRAMES 4096
+
+/* Fixed-point FFT size (power of two) and number of spectrum bands */
+#define METER_FFT_LOG2 9
+#define METER_FFT_SIZE (1 << METER_FFT_LOG2)
+#define METER_NUM_BANDS 16
+
+/* Frame rate of the published level meter feed */
+#define METER_DEFAULT_FPS 20
+#define METER_MAX_FPS 60
+
+void meter_init(void);
+void meter_enable(int enable);
+void meter_feed(const audio_fifo_data_t *afd);
+int meter_format(char *buf, size_t len);
+
+#endif
@@ -1,226 +1,1470 @@
 /**
  * net.c
- * Network handling - currently only accepts 'next' and 'logout' on port 1234
+ * Network handling - control commands on port 1234 and a Unix domain
+ * socket, HTTP API on port 8080, optional UDP remote control
+ *
+ * Any number of clients may be connected.  Sockets are non-blocking and
+ * replies are queued per connection, so a slow client never holds up the
+ * main loop; one that falls too far behind is disconnected.
+ *
+ * Clients may also subscribe to events (track changes, playback state,
+ * ...) which are pushed to them as single JSON lines.
+ *
+ * HTTP clients are served by the same code, only their input is framed
+ * into requests by http.c instead of into command lines.
+ *
+ * Privileged commands (logout, audio device, ...) can be restricted to
+ * clients on the Unix domain socket running as our own user or root.
+ *
+ * Handheld remotes may send single commands as UDP datagrams instead,
+ * saving a connection setup and teardown per button press.  Datagrams
+ * are authenticated with a shared key and acknowledged by a single reply
+ * datagram; retransmissions are recognized by their sequence number and
+ * only acknowledged again.  Sequence numbers are only tracked in memory,
+ * so they're tied to a random session number that changes whenever that
+ * state is lost, and datagrams from an earlier session are refused.
  *
  */
 
+#define _GNU_SOURCE	/* struct ucred */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <poll.h>
+#include <netdb.h>
 #include <syslog.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "app.h"
+#include "buf.h"
+#include "http.h"
+#include "json.h"
+#include "mdindex.h"
+#include "meter.h"
+#include "player.h"
+#include "prefetch.h"
+#include "playqueue.h"
+#include "reactor.h"
+#include "search.h"
+#include "siphash.h"
+#include "net.h"
 
-static int client_fd;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
-static int net_accept_client(int listen_fd);
-static int net_read_data(int fd);
-static int net_gpio_read(int fd);
+/* Per-connection state of a control client */
+typedef struct {
+	int fd;
+	int index;	/* In conns[] */
+	int events;	/* Currently registered with the reactor */
+	int http;	/* Speaks HTTP rather than the line based protocol */
+	int privileged;	/* May run privileged commands */
+	int datagram;	/* Single command from a UDP datagram, can't stream */
+
+	/* Incomplete command line or request carried over between reads,
+	   allocated along with the connection */
+	char *in;
+	size_t in_size;
+	size_t in_len;
+	int discard;	/* Skipping the rest of an overlong line */
+
+	/* Output not yet accepted by the socket, sent from out_pos */
+	buf_t out;
+	size_t out_pos;
+	int corked;	/* Replies are being batched up */
+	int closing;	/* Peer is done sending, close once output is flushed */
+
+	/* Subscribed event topics and those skipped while it was behind */
+	int topics;
+	int missed;
+} net_conn_t;
+
+/* Control command; args is the unsplit rest of the line after the name */
+typedef struct {
+	const char *name;
+	int min_args;
+	int max_args;	/* -1 for any number */
+	int flags;	/* NET_CMD_* */
+	int (*handler)(net_conn_t *c, int argc, char **argv, const char *args);
+	const char *usage;
+} net_command_t;
+
+#define NET_CMD_PRIVILEGED	0x01	/* Refused to unprivileged clients */
+#define NET_CMD_STREAM		0x02	/* Keeps sending to the client */
+
+/* Kinds of listening sockets */
+#define NET_LISTEN_CONTROL	0
+#define NET_LISTEN_HTTP		1
+#define NET_LISTEN_UNIX		2
+#define NET_LISTEN_UDP		3
 
-int net_create(int port) {
+/* Listening socket, passed to net_accept_client() */
+typedef struct {
 	int fd;
-	int opt;
-	struct sockaddr_in sin;
+	int kind;
+} net_listener_t;
 
-	client_fd = -1;
+/* Connected control clients */
+static net_conn_t *conns[NET_MAX_CLIENTS];
+static int num_conns;
+static unsigned long conns_accepted, conns_rejected, conns_evicted;
+
+/* Listening sockets, and the Unix domain socket path to remove on exit */
+static net_listener_t listeners[NET_MAX_LISTENERS];
+static int num_listeners;
+static char unix_path[108];
+
+/* Only Unix domain socket clients may run privileged commands */
+static int restrict_tcp;
+
+/* Remote sending UDP datagrams, and its last acknowledgement for resending */
+typedef struct {
+	uint32_t id;
+	uint32_t top;		/* Highest sequence number seen */
+	uint64_t window;	/* Bit n set if top - n has been seen */
+	time_t last_seen;
+	size_t ack_len;
+	uint8_t ack[NET_UDP_HEADER + NET_UDP_MAX_REPLY + NET_UDP_MAC];
+} net_remote_t;
+
+static net_remote_t remotes[NET_UDP_REMOTES];
+static uint8_t udp_key[SIPHASH_KEY_SIZE];
+static uint32_t udp_session;
+static net_conn_t udp_conn;
+static unsigned long udp_commands, udp_duplicates, udp_rejected;
+
+/* Prefixed to datagrams for their MAC only, so an ack can't pass for a command */
+#define NET_UDP_COMMAND	'C'
+#define NET_UDP_ACK	'A'
+
+/* Clients subscribed to the level meter feed */
+static net_conn_t *meter_conns[NET_MAX_METER_CLIENTS];
+static int meter_fps;
+static int meter_timer;
+
+/* Event topics, in the order of the NET_TOPIC_* bits */
+static const char *net_topic_names[] = {
+	"track", "playback", "playlist", "offline", "underrun", NULL
+};
+
+/* Union of the topics all clients are subscribed to */
+static int subscribed_topics;
+
+static void net_accept_client(int listen_fd, int events, void *arg);
+static void net_udp_event(int fd, int events, void *arg);
+static void net_udp_new_session(void);
+static void net_client_event(int fd, int events, void *arg);
+static void net_close_client(net_conn_t *c);
+static int net_read_data(net_conn_t *c);
+static int net_command(net_conn_t *c, char *line);
+static int net_http_requests(net_conn_t *c);
+static int net_gpio_read(int fd);
+static void net_gpio_event(int fd, int events, void *arg);
+static void net_meter_publish(void *arg);
+static int net_meter_subscribe(net_conn_t *c, const char *arg);
+static int net_meter_unsubscribe(net_conn_t *c);
+static int net_send_resync(net_conn_t *c);
+static void net_update_topics(void);
+
+static int net_set_nonblocking(int fd) {
+	int flags;
+
+	if((flags = fcntl(fd, F_GETFL)) < 0)
+		return -1;
 
-	fd = socket(PF_INET, SOCK_STREAM, 0);
-	opt = 1;
-	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = PF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(port);
+static int net_add_listener(int fd, int kind) {
+	net_listener_t *l;
 
-	if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
-		syslog(LOG_ERR, "NET: Failed to bind to port %d: %s", ntohs(sin.sin_port), strerror(errno));
+	if(num_listeners == NET_MAX_LISTENERS) {
+		syslog(LOG_WARNING, "NET: Too many listening sockets, closing fd %d", fd);
 		close(fd);
 		return -1;
 	}
 
-	if(listen(fd, 1) < 0) {
+	l = &listeners[num_listeners];
+	l->fd = fd;
+	l->kind = kind;
+
+	if(kind != NET_LISTEN_UDP && listen(fd, NET_LISTEN_BACKLOG) < 0) {
 		syslog(LOG_ERR, "NET: Failed to listen on fd %d: %s", fd, strerror(errno));
 		close(fd);
 		return -1;
 	}
 
-	syslog(LOG_NOTICE, "NET: Created listening fd %d", fd);
+	if(net_set_nonblocking(fd) < 0 || reactor_add(fd, REACTOR_IN,
+			kind == NET_LISTEN_UDP? net_udp_event: net_accept_client, l) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	num_listeners++;
 
-	return fd;
+	return 0;
 }
 
-int net_poll(int listen_fd, int timeout) {
-	int i, nfds = 0, ret;
-	struct pollfd fdset[4];
+/* Listen on port on every bind address; returns the number of sockets */
+static int net_listen_inet(const net_config_t *config, int port, int kind) {
+	struct addrinfo hints, *res, *ai;
+	char service[16], host[NI_MAXHOST];
+	int i, fd, opt, err, n = 0;
 
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = kind == NET_LISTEN_UDP? SOCK_DGRAM: SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(service, sizeof(service), "%d", port);
 
-	memset(fdset, 0, sizeof(fdset));
-	fdset[nfds].fd = listen_fd;
-	fdset[nfds].events = POLLIN;
-	nfds++;
+	/* No bind address means all interfaces, IPv4 and IPv6 */
+	for(i = 0; i < (config->num_bind? config->num_bind: 1); i++) {
+		err = getaddrinfo(config->num_bind? config->bind[i]: NULL, service, &hints, &res);
+		if(err) {
+			syslog(LOG_ERR, "NET: Invalid bind address '%s': %s",
+				config->num_bind? config->bind[i]: "*", gai_strerror(err));
+			continue;
+		}
 
-	fdset[nfds].fd = app_signal_read_fd();
-	fdset[nfds].events = POLLIN;
-	nfds++;
+		for(ai = res; ai != NULL; ai = ai->ai_next) {
+			getnameinfo(ai->ai_addr, ai->ai_addrlen, host, sizeof(host),
+				NULL, 0, NI_NUMERICHOST);
 
-	fdset[nfds].fd = app_gpio_fd();
-	if(fdset[nfds].fd != -1) {
-		fdset[nfds].events = POLLPRI;
-		nfds++;
-	}
+			if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+				syslog(LOG_WARNING, "NET: Failed to create socket for %s: %s",
+					host, strerror(errno));
+				continue;
+			}
+
+			opt = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef IPV6_V6ONLY
+			/* Leave IPv4 to its own socket */
+			if(ai->ai_family == AF_INET6)
+				setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+#endif
+
+			if(bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+				syslog(LOG_ERR, "NET: Failed to bind to %s port %d: %s",
+					host, port, strerror(errno));
+				close(fd);
+				continue;
+			}
+
+			if(net_add_listener(fd, kind) < 0)
+				continue;
 
-	if(client_fd > 0) {
-		fdset[nfds].fd = client_fd;
-		fdset[nfds].events = POLLIN;
-		nfds++;
+			syslog(LOG_NOTICE, "NET: Created listening fd %d for %s port %d", fd, host, port);
+			n++;
+		}
+
+		freeaddrinfo(res);
 	}
 
-	if((ret = poll(fdset, nfds, timeout)) < 0) {
+	return n;
+}
 
-		return 0;
+static int net_listen_unix(const char *path) {
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(sun.sun_path)) {
+		syslog(LOG_ERR, "NET: Unix socket path too long: %s", path);
+		return -1;
 	}
-	else if(ret < 0 && errno != EINTR && errno != EAGAIN) {
-		syslog(LOG_ERR, "NET: poll() returned error: %s", strerror(errno));
+	strcpy(sun.sun_path, path);
+
+	/* Left behind by an earlier run; never remove anything else */
+	if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if(bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		syslog(LOG_ERR, "NET: Failed to bind to %s: %s", path, strerror(errno));
+		close(fd);
 		return -1;
 	}
 
-	for(i = 0; i < nfds; i++) {
-		if(fdset[i].revents & POLLPRI) {
-			net_gpio_read(fdset[i].fd);
-		}
-		else if(fdset[i].revents & POLLIN) {
-			if(fdset[i].fd == listen_fd)
-				ret = net_accept_client(fdset[i].fd);
-			else
-				ret = net_read_data(fdset[i].fd);
+	/* Group members may connect, only the owner and root are privileged */
+	chmod(path, NET_UNIX_MODE);
 
-			if(ret < 0) {
-				syslog(LOG_DEBUG, "NET: Socket %d shutdown", fdset[i].fd);
-				close(fdset[i].fd);
-				if(fdset[i].fd == client_fd)
-					client_fd = -1;
-			}
-		}
+	if(net_add_listener(fd, NET_LISTEN_UNIX) < 0) {
+		unlink(path);
+		return -1;
 	}
 
+	snprintf(unix_path, sizeof(unix_path), "%s", path);
+	syslog(LOG_NOTICE, "NET: Created listening fd %d for %s", fd, path);
+
 	return 0;
 }
 
-static int net_accept_client(int listen_fd) {
-	struct sockaddr_in sin;
-	socklen_t sin_len = sizeof(struct sockaddr_in);
+/* Listen for control commands and HTTP on TCP and the Unix domain socket */
+int net_create(const net_config_t *config) {
+	int i;
 
-	client_fd = accept(listen_fd, (struct sockaddr *)&sin, &sin_len);
-	if(client_fd < 0) {
-		syslog(LOG_WARNING, "NET: Failed to accept() on fd %d: %s", listen_fd, strerror(errno));
+	num_conns = 0;
+	num_listeners = 0;
+	for(i = 0; i < NET_MAX_METER_CLIENTS; i++)
+		meter_conns[i] = NULL;
+	meter_fps = METER_DEFAULT_FPS;
+	meter_timer = reactor_timer_create(net_meter_publish, NULL);
+	restrict_tcp = config->restrict_tcp;
+
+	if(net_listen_inet(config, config->port, NET_LISTEN_CONTROL) == 0)
 		return -1;
+
+	/* The player is still controllable without these */
+	if(config->http_port && net_listen_inet(config, config->http_port, NET_LISTEN_HTTP) == 0)
+		syslog(LOG_WARNING, "NET: HTTP API disabled");
+
+	if(config->udp_port) {
+		memcpy(udp_key, config->udp_key, sizeof(udp_key));
+		memset(remotes, 0, sizeof(remotes));
+		net_udp_new_session();
+		buf_init(&udp_conn.out);
+		udp_conn.fd = -1;
+		udp_conn.corked = 1;
+		udp_conn.datagram = 1;
+		udp_conn.privileged = !restrict_tcp;
+
+		if(net_listen_inet(config, config->udp_port, NET_LISTEN_UDP) == 0)
+			syslog(LOG_WARNING, "NET: UDP remote control disabled");
 	}
 
-	syslog(LOG_INFO, "NET: Accepted client on fd %d, local address %s:%d", client_fd, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+	if(config->unix_path != NULL && *config->unix_path
+		&& net_listen_unix(config->unix_path) < 0)
+		syslog(LOG_WARNING, "NET: Unix domain control socket disabled");
+
+	if(app_gpio_fd() != -1)
+		reactor_add(app_gpio_fd(), REACTOR_PRI, net_gpio_event, NULL);
 
 	return 0;
 }
 
-static int net_write_string(int fd, const char *buf) {
-	size_t len, n;
-	const char *p;
+/* Returns -1 if the peer's credentials are not available */
+static int net_peer_uid(int fd, uid_t *uid, pid_t *pid) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return -1;
+
+	*uid = cred.uid;
+	*pid = cred.pid;
+	return 0;
+#else
+	gid_t gid;
+
+	*pid = -1;
+	return getpeereid(fd, uid, &gid);
+#endif
+}
+
+static void net_accept_client(int listen_fd, int events, void *arg) {
+	net_listener_t *l = arg;
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	net_conn_t *c;
+	int fd, i, http = l->kind == NET_LISTEN_HTTP;
+	size_t in_size = http? HTTP_MAX_REQUEST: NET_MAX_LINE;
+	uid_t uid;
+	pid_t pid;
+
+	/* Take a bounded number of clients per wakeup, the rest come next time */
+	for(i = 0; i < NET_ACCEPT_BATCH; i++) {
+		ss_len = sizeof(ss);
+		fd = accept(listen_fd, (struct sockaddr *)&ss, &ss_len);
+		if(fd < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				syslog(LOG_WARNING, "NET: Failed to accept() on fd %d: %s", listen_fd, strerror(errno));
+			return;
+		}
+
+		c = num_conns < NET_MAX_CLIENTS? calloc(1, sizeof(net_conn_t) + in_size): NULL;
+		if(c == NULL || net_set_nonblocking(fd) < 0
+			|| reactor_add(fd, REACTOR_IN, net_client_event, c) < 0) {
+			syslog(LOG_WARNING, "NET: Rejecting client on fd %d, %d clients connected", fd, num_conns);
+			conns_rejected++;
+			free(c);
+			close(fd);
+			continue;
+		}
+
+#ifdef SO_NOSIGPIPE
+		{
+			int opt = 1;
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+		}
+#endif
+
+		c->fd = fd;
+		c->events = REACTOR_IN;
+		c->http = http;
+		c->in = (char *)(c + 1);
+		c->in_size = in_size;
+		buf_init(&c->out);
+		c->index = num_conns;
+		conns[num_conns++] = c;
+		conns_accepted++;
+
+		if(l->kind == NET_LISTEN_UNIX) {
+			/* Privileged commands are for our own user and root */
+			if(net_peer_uid(fd, &uid, &pid) < 0)
+				uid = (uid_t)-1, pid = -1;
+			c->privileged = uid == 0 || uid == geteuid();
+
+			syslog(LOG_INFO, "NET: Accepted local client on fd %d, uid %ld, pid %ld%s",
+				fd, (long)uid, (long)pid, c->privileged? ", privileged": "");
+			continue;
+		}
+
+		c->privileged = !restrict_tcp;
+		if(getnameinfo((struct sockaddr *)&ss, ss_len, host, sizeof(host),
+				serv, sizeof(serv), NI_NUMERICHOST|NI_NUMERICSERV) != 0)
+			strcpy(host, "?"), strcpy(serv, "?");
+
+		syslog(LOG_INFO, "NET: Accepted client on fd %d, remote address %s port %s", fd, host, serv);
+	}
+}
+
+static void net_close_client(net_conn_t *c) {
+	net_conn_t *last;
+
+	syslog(LOG_DEBUG, "NET: Socket %d shutdown", c->fd);
+
+	net_meter_unsubscribe(c);
+	reactor_remove(c->fd);
+	close(c->fd);
+
+	last = conns[--num_conns];
+	conns[c->index] = last;
+	last->index = c->index;
+
+	if(c->topics)
+		net_update_topics();
+
+	buf_release(&c->out);
+	free(c);
+}
+
+/* Stop reading commands while a client isn't keeping up with the replies */
+static void net_update_events(net_conn_t *c) {
+	size_t queued = c->out.len - c->out_pos;
+	int events;
+
+	events = queued > NET_OUTPUT_HIGH_WATER || c->closing? 0: REACTOR_IN;
+	if(queued)
+		events |= REACTOR_OUT;
+
+	if(events != c->events && reactor_modify(c->fd, events) == 0)
+		c->events = events;
+}
+
+static int net_flush(net_conn_t *c) {
+	ssize_t n;
+
+	while(c->out_pos < c->out.len) {
+		n = send(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos,
+			MSG_DONTWAIT|MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
 
-	len = strlen(buf);
-	p = buf;
-	while(len) {
-		n = write(fd, p, len);
-		if(n <= 0)
 			return -1;
+		}
+
+		c->out_pos += n;
+	}
+
+	if(c->out_pos == c->out.len) {
+		/* Don't hold on to memory from a large reply */
+		if(c->out.size > NET_OUTPUT_HIGH_WATER)
+			buf_release(&c->out);
+		else
+			buf_reset(&c->out);
+		c->out_pos = 0;
+	}
+	else if(c->out_pos > c->out.len / 2) {
+		memmove(c->out.data, c->out.data + c->out_pos, c->out.len - c->out_pos + 1);
+		c->out.len -= c->out_pos;
+		c->out_pos = 0;
+	}
+
+	net_update_events(c);
+
+	/* Everything the client asked for has been sent */
+	if(c->closing && c->out_pos == c->out.len)
+		return -1;
+
+	/* Caught up after events were skipped */
+	if(c->missed && c->out_pos == c->out.len)
+		return net_send_resync(c);
 
+	return 0;
+}
+
+/* Never blocks; returns -1 if the client is gone or too far behind */
+static int net_send(net_conn_t *c, const char *data, size_t len) {
+	ssize_t n;
+
+	/* Try sending right away unless older output is still queued
+	   or replies are being batched up */
+	if(c->out_pos == c->out.len && !c->corked && len > 0) {
+		n = send(c->fd, data, len, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return -1;
+			n = 0;
+		}
+
+		data += n;
 		len -= n;
-		p += n;
 	}
 
+	if(len == 0)
+		return 0;
+
+	if(c->out.len - c->out_pos + len > NET_OUTPUT_MAX) {
+		syslog(LOG_WARNING, "NET: Evicting client on fd %d with %lu bytes of output queued",
+			c->fd, (unsigned long)(c->out.len - c->out_pos));
+		conns_evicted++;
+		return -1;
+	}
+
+	if(buf_append(&c->out, data, len) < 0)
+		return -1;
+
+	if(!c->corked)
+		net_update_events(c);
+
 	return 0;
-} 
+}
 
-static int net_read_data(int fd) {
-	char buf[1024], *p;
-	size_t n;
+static int net_write_string(net_conn_t *c, const char *buf) {
+
+	return net_send(c, buf, strlen(buf));
+}
+
+static void net_client_event(int fd, int events, void *arg) {
+	net_conn_t *c = arg;
+
+	if((events & REACTOR_OUT) && net_flush(c) < 0) {
+		net_close_client(c);
+		return;
+	}
+
+	/* Carry on with pipelined requests held back while output was queued */
+	if((events & REACTOR_OUT) && c->http && c->in_len > 0 && !c->closing) {
+		c->corked = 1;
+		if(net_http_requests(c) < 0) {
+			net_close_client(c);
+			return;
+		}
+
+		c->corked = 0;
+		if(net_flush(c) < 0) {
+			net_close_client(c);
+			return;
+		}
+	}
+
+	if((events & (REACTOR_IN|REACTOR_ERR)) && net_read_data(c) < 0)
+		net_close_client(c);
+}
+
+/**
+ * Read whatever is available and run every complete line as a command, in
+ * order.  An incomplete line is kept for the next read.  Replies to all of
+ * the commands are sent together once they've been run.
+ */
+static int net_read_data(net_conn_t *c) {
+	char *line, *end;
+	ssize_t n;
+	int ret = 0;
 
-	memset(buf, 0, sizeof(buf));
-	n = read(fd, buf, sizeof(buf) - 1);
-	if(n <= 0)
+	if(c->closing)
+		return -1;
+
+	n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	else if(n < 0)
 		return -1;
 
-	/* Remove trailing whitespace */
-	for(p = buf; *p && *p != ' ' && *p != '\r' && *p != '\n'; p++);
-	*p = 0;
+	c->corked = 1;
 
-	/* Remove leading whitespace */
-	for(p = buf; *p && (*p == ' ' || *p == '\r' || *p == '\n'); p++);
+	if(n == 0) {
+		/* Run a last command not terminated by a newline */
+		if(c->in_len > 0 && !c->discard && !c->http && c->in_len < c->in_size) {
+			c->in[c->in_len] = 0;
+			net_command(c, c->in);
+		}
 
-	if(strstr(p, "spotify:") || strstr(p, "http://open.spotify.com")) {
-		sp_link *link;
+		c->in_len = 0;
+		c->closing = 1;
+	}
+	else if(c->http) {
+		c->in_len += n;
+		ret = net_http_requests(c);
+	}
+	else {
+		c->in_len += n;
+		for(line = c->in; ret == 0 &&
+			(end = memchr(line, '\n', c->in + c->in_len - line)) != NULL; line = end + 1) {
+			*end = 0;
+			if(!c->discard)
+				ret = net_command(c, line);
+			c->discard = 0;
+		}
 
+		c->in_len -= line - c->in;
+		memmove(c->in, line, c->in_len);
 
-		link = sp_link_create_from_string(p);
-		if(!link) {
-			syslog(LOG_WARNING, "NET: Not a Spotify URI '%s'", p);
-			return net_write_string(fd, "# ERR, not a Spotify URI\n");
+		/* No newline in a full buffer; anything shorter still fits with
+		   a terminating NUL at EOF */
+		if(c->in_len == c->in_size) {
+			if(!c->discard)
+				ret = net_write_string(c, "# ERR, command too long\n");
+			c->discard = 1;
+			c->in_len = 0;
 		}
+	}
 
-		switch(sp_link_type(link)) {
-		case SP_LINKTYPE_INVALID:
-			syslog(LOG_WARNING, "NET: Invalid Spotify URI '%s'", p);
-			net_write_string(fd, "# ERR, invalid Spotify URI\n");
-			break;
-		case SP_LINKTYPE_PLAYLIST:
-		case SP_LINKTYPE_STARRED:
-			syslog(LOG_NOTICE, "NET: Spotify URI is of type playlist");
-			if(app_set_active_playlist_link(link)) {
-				app_set_track(NULL);
-				net_write_string(fd, "# OK, playlist is now the active playlist\n");
-			}
-			else
-				net_write_string(fd, "# ERR, failed to make playlist active\n");
+	c->corked = 0;
+	if(net_flush(c) < 0)
+		return -1;
+
+	return ret;
+}
+
+/**
+ * Serve every complete HTTP request in the input, in order.  Requests
+ * are held back while the client has a lot of output waiting, and picked
+ * up again once it has been sent.
+ */
+static int net_http_requests(net_conn_t *c) {
+	size_t pos = 0;
+	int n, keep_alive = 1;
+
+	while(keep_alive && pos < c->in_len) {
+		/* Only stop once the socket won't take any more */
+		if(c->out.len - c->out_pos > NET_OUTPUT_HIGH_WATER
+			&& (net_flush(c) < 0 || c->out.len - c->out_pos > NET_OUTPUT_HIGH_WATER))
 			break;
-		default:
-			syslog(LOG_NOTICE, "NET: Unhandled Spotify URI with type: %d", sp_link_type(link));
-			net_write_string(fd, "# ERR, only URIs of type playlist suppported\n");
+
+		n = http_handle(c->in + pos, c->in_len - pos, &c->out, &keep_alive);
+		if(n == 0)
 			break;
-		}
 
-		sp_link_release(link);
+		pos += n;
+	}
+
+	c->in_len -= pos;
+	memmove(c->in, c->in + pos, c->in_len);
+
+	if(c->out.len - c->out_pos > NET_OUTPUT_MAX) {
+		syslog(LOG_WARNING, "NET: Evicting client on fd %d with %lu bytes of output queued",
+			c->fd, (unsigned long)(c->out.len - c->out_pos));
+		conns_evicted++;
+		return -1;
+	}
+
+	/* Close once the response has been sent */
+	if(!keep_alive) {
+		c->closing = 1;
+		c->in_len = 0;
+	}
+
+	return 0;
+}
+
+static void net_udp_put32(uint8_t *p, uint32_t v) {
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t net_udp_get32(const uint8_t *p) {
+
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * MAC of the direction byte followed by the first len bytes of a
+ * datagram, written big endian to mac
+ */
+static void net_udp_mac(int direction, const uint8_t *data, size_t len, uint8_t *mac) {
+	uint8_t msg[1 + NET_UDP_HEADER + NET_MAX_LINE + NET_UDP_MAX_REPLY];
+	uint64_t h;
+
+	msg[0] = direction;
+	memcpy(msg + 1, data, len);
+	h = siphash24(udp_key, msg, len + 1);
+
+	net_udp_put32(mac, (uint32_t)(h >> 32));
+	net_udp_put32(mac + 4, (uint32_t)h);
+}
+
+static int net_udp_verify(const uint8_t *data, size_t len) {
+	uint8_t mac[NET_UDP_MAC], diff = 0;
+	int i;
+
+	net_udp_mac(NET_UDP_COMMAND, data, len - NET_UDP_MAC, mac);
+
+	/* Don't give away how many bytes matched */
+	for(i = 0; i < NET_UDP_MAC; i++)
+		diff |= mac[i] ^ data[len - NET_UDP_MAC + i];
+
+	return diff? -1: 0;
+}
+
+/**
+ * Pick a session number no earlier datagram can carry.  Done at startup
+ * and whenever a remote's sequence numbers are forgotten, after which its
+ * old datagrams could otherwise be replayed.
+ */
+static void net_udp_new_session(void) {
+	uint32_t old = udp_session;
+	int fd;
+
+	if((fd = open("/dev/urandom", O_RDONLY)) < 0
+		|| read(fd, &udp_session, sizeof(udp_session)) != sizeof(udp_session)) {
+		syslog(LOG_WARNING, "NET: Failed to read /dev/urandom, UDP session number is guessable");
+		udp_session = (uint32_t)time(NULL) ^ (uint32_t)getpid() << 16;
+	}
+
+	if(fd >= 0)
+		close(fd);
+
+	if(udp_session == old)
+		udp_session++;
+}
+
+/* Known remote, or the least recently heard from slot to take over */
+static net_remote_t *net_udp_remote(uint32_t id) {
+	net_remote_t *r, *oldest = &remotes[0];
+
+	for(r = remotes; r < remotes + NET_UDP_REMOTES; r++) {
+		if(r->window && r->id == id)
+			return r;
+
+		if(r->last_seen < oldest->last_seen)
+			oldest = r;
+	}
+
+	/* Every remote then picks up the new session from its next ack */
+	if(oldest->window) {
+		syslog(LOG_INFO, "NET: Forgetting UDP remote %08x, starting a new session",
+			(unsigned)oldest->id);
+		net_udp_new_session();
+	}
+
+	memset(oldest, 0, offsetof(net_remote_t, ack));
+	oldest->id = id;
+
+	return oldest;
+}
+
+/**
+ * Sliding window over the last 64 sequence numbers, allowing for datagrams
+ * arriving out of order.  Returns 0 for a new sequence number, 1 for one
+ * already seen and -1 for one too old to tell.
+ */
+static int net_udp_sequence(net_remote_t *r, uint32_t seq) {
+	uint32_t diff;
+
+	/* Sequence numbers wrap around */
+	if(r->window == 0 || (int32_t)(seq - r->top) > 0) {
+		diff = seq - r->top;
+		r->window = r->window == 0 || diff >= 64? 1: r->window << diff | 1;
+		r->top = seq;
+		return 0;
+	}
+
+	diff = r->top - seq;
+	if(diff >= 64)
+		return -1;
+
+	if(r->window & (uint64_t)1 << diff)
+		return 1;
+
+	r->window |= (uint64_t)1 << diff;
+	return 0;
+}
+
+/**
+ * Build an acknowledgement of sequence number seq from remote id in ack
+ * and send it.  It carries the current session, which the remote should
+ * use from then on.
+ */
+static size_t net_udp_ack(int fd, const struct sockaddr_storage *ss, socklen_t ss_len,
+		uint32_t id, uint32_t seq, const char *reply, size_t len, uint8_t *ack) {
+
+	/* Long replies (status json) are cut short */
+	if(len > NET_UDP_MAX_REPLY)
+		len = NET_UDP_MAX_REPLY;
+
+	net_udp_put32(ack, id);
+	net_udp_put32(ack + 4, udp_session);
+	net_udp_put32(ack + 8, seq);
+	memcpy(ack + NET_UDP_HEADER, reply, len);
+	len += NET_UDP_HEADER;
+	net_udp_mac(NET_UDP_ACK, ack, len, ack + len);
+	len += NET_UDP_MAC;
+
+	if(sendto(fd, ack, len, MSG_DONTWAIT|MSG_NOSIGNAL, (const struct sockaddr *)ss, ss_len) < 0)
+		syslog(LOG_DEBUG, "NET: Failed to send UDP ack: %s", strerror(errno));
+
+	return len;
+}
+
+/**
+ * Run a command received as a datagram: remote id, session and sequence
+ * number (32 bits each, big endian), the command line and a SipHash-2-4
+ * MAC over all of that.  Commands are run by the same handlers as those
+ * from connected clients, their reply goes back in an ack with the same
+ * header.  Commands from another session aren't run, their ack only
+ * tells the remote the current session.
+ */
+static void net_udp_datagram(int fd, const struct sockaddr_storage *ss, socklen_t ss_len,
+		const uint8_t *data, size_t len) {
+	uint8_t ack[NET_UDP_HEADER + NET_UDP_MAX_REPLY + NET_UDP_MAC];
+	char line[NET_MAX_LINE];
+	const char *reply;
+	net_remote_t *r;
+	uint32_t id, session, seq;
+	size_t line_len;
+
+	if(len < NET_UDP_HEADER + NET_UDP_MAC || net_udp_verify(data, len) < 0) {
+		syslog(LOG_DEBUG, "NET: Dropping unauthenticated %lu byte datagram", (unsigned long)len);
+		udp_rejected++;
+		return;
 	}
-	else if(!strcmp(p, "next")) {
-		app_post_event(APP_DO_NEXT_TRACK);
 
-		if(fd != app_gpio_fd())
-			return net_write_string(fd, "# OK, playing next track\n");
+	id = net_udp_get32(data);
+	session = net_udp_get32(data + 4);
+	seq = net_udp_get32(data + 8);
+
+	/* Sent before we started, or replayed from before a remote was forgotten */
+	if(session != udp_session) {
+		reply = "# ERR, new session\n";
+		net_udp_ack(fd, ss, ss_len, id, seq, reply, strlen(reply), ack);
+		return;
 	}
-	else if(!strcmp(p, "play")) {
-		app_post_event(APP_DO_PLAY);
-		return net_write_string(fd, "# OK, starting playback\n");
+
+	r = net_udp_remote(id);
+	r->last_seen = time(NULL);
+
+	switch(net_udp_sequence(r, seq)) {
+	case 1:
+		/* The ack was lost, send it again without running the command twice */
+		udp_duplicates++;
+		if(r->ack_len && net_udp_get32(r->ack + 8) == seq) {
+			if(sendto(fd, r->ack, r->ack_len, MSG_DONTWAIT|MSG_NOSIGNAL,
+					(const struct sockaddr *)ss, ss_len) < 0)
+				syslog(LOG_DEBUG, "NET: Failed to resend UDP ack: %s", strerror(errno));
+		}
+		else {
+			reply = "# OK, already done\n";
+			net_udp_ack(fd, ss, ss_len, id, seq, reply, strlen(reply), ack);
+		}
+		return;
+	case -1:
+		udp_duplicates++;
+		reply = "# ERR, stale sequence number\n";
+		net_udp_ack(fd, ss, ss_len, id, seq, reply, strlen(reply), ack);
+		return;
+	}
+
+	line_len = len - NET_UDP_HEADER - NET_UDP_MAC;
+	while(line_len > 0 && data[NET_UDP_HEADER + line_len - 1] == '\n')
+		line_len--;
+
+	buf_reset(&udp_conn.out);
+	if(line_len >= sizeof(line))
+		net_write_string(&udp_conn, "# ERR, command too long\n");
+	else if(memchr(data + NET_UDP_HEADER, '\n', line_len) != NULL)
+		net_write_string(&udp_conn, "# ERR, one command per datagram\n");
+	else {
+		memcpy(line, data + NET_UDP_HEADER, line_len);
+		line[line_len] = 0;
+		syslog(LOG_DEBUG, "NET: UDP command from remote %08x, sequence %u: %s",
+			(unsigned)id, (unsigned)seq, line);
+
+		udp_commands++;
+		net_command(&udp_conn, line);
+	}
+
+	r->ack_len = net_udp_ack(fd, ss, ss_len, id, seq, buf_str(&udp_conn.out),
+		udp_conn.out.len, r->ack);
+}
+
+static void net_udp_event(int fd, int events, void *arg) {
+	uint8_t data[NET_UDP_HEADER + NET_MAX_LINE + NET_UDP_MAC];
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
+	ssize_t n;
+	int i;
+
+	for(i = 0; i < NET_ACCEPT_BATCH; i++) {
+		ss_len = sizeof(ss);
+		n = recvfrom(fd, data, sizeof(data), MSG_DONTWAIT, (struct sockaddr *)&ss, &ss_len);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				syslog(LOG_WARNING, "NET: Failed to receive on fd %d: %s", fd, strerror(errno));
+			return;
+		}
+
+		net_udp_datagram(fd, &ss, ss_len, data, n);
 	}
-	else if(!strcmp(p, "stop")) {
-		app_post_event(APP_DO_STOP);
-		return net_write_string(fd, "# OK, stopping playback\n");
+}
+
+static int net_cmd_uri(net_conn_t *c, const char *uri) {
+	char buf[128];
+	const char *error;
+
+	if((error = app_set_playlist_uri(uri)) != NULL) {
+		snprintf(buf, sizeof(buf), "# ERR, %s\n", error);
+		return net_write_string(c, buf);
 	}
-	else if(!strcmp(p, "status")) {
-		return net_write_string(fd, app_get_status());
+
+	return net_write_string(c, "# OK, playlist is now the active playlist\n");
+}
+
+static int net_cmd_next(net_conn_t *c, int argc, char **argv, const char *args) {
+
+	app_skip_track();
+	return net_write_string(c, "# OK, playing next track\n");
+}
+
+static int net_cmd_play(net_conn_t *c, int argc, char **argv, const char *args) {
+
+	app_post_event(APP_DO_PLAY);
+	return net_write_string(c, "# OK, starting playback\n");
+}
+
+static int net_cmd_stop(net_conn_t *c, int argc, char **argv, const char *args) {
+
+	app_post_event(APP_DO_STOP);
+	return net_write_string(c, "# OK, stopping playback\n");
+}
+
+static int net_cmd_status(net_conn_t *c, int argc, char **argv, const char *args) {
+	size_t len;
+
+	if(argc == 1)
+		return net_write_string(c, app_get_status());
+	else if(strcmp(argv[1], "json"))
+		return net_write_string(c, "# ERR, usage: status [json]\n");
+
+	/* Serialize straight into the output queue */
+	len = c->out.len;
+	if(app_get_status_json(&c->out) < 0) {
+		c->out.len = len;
+		if(c->out.data != NULL)
+			c->out.data[len] = 0;
+		return net_write_string(c, "# ERR, failed to serialize status\n");
 	}
-	else if(!strcmp(p, "logout")) {
-		app_post_event(APP_DO_LOGOUT);
-		return net_write_string(fd, "# OK, logging out and exiting\n");
+
+	if(c->out.len - c->out_pos > NET_OUTPUT_MAX) {
+		conns_evicted++;
+		return -1;
 	}
-	else if(fd != app_signal_read_fd() && fd != app_gpio_fd())
-		return net_write_string(fd, "# ERR, unsupported command");
+
+	if(!c->corked)
+		return net_flush(c);
 
 	return 0;
 }
 
+static int net_cmd_power_save(net_conn_t *c, int argc, char **argv, const char *args) {
+
+	if(argc == 2 && !strcmp(argv[1], "on"))
+		app_set_power_save(1);
+	else if(argc == 2 && !strcmp(argv[1], "off"))
+		app_set_power_save(0);
+	else if(argc > 1)
+		return net_write_string(c, "# ERR, usage: power-save [on|off]\n");
+
+	return net_write_string(c, app_get_power_save()?
+		"# OK, power saving mode is enabled\n":
+		"# OK, power saving mode is disabled\n");
+}
+
+static int net_cmd_shuffle(net_conn_t *c, int argc, char **argv, const char *args) {
+	unsigned long long seed;
+	char buf[128], *end;
+
+	if(argc == 2 && !strcmp(argv[1], "new"))
+		app_reshuffle(0);
+	else if(argc == 3 && !strcmp(argv[1], "seed")) {
+		seed = strtoull(argv[2], &end, 10);
+		if(*end || seed == 0)
+			return net_write_string(c, "# ERR, seed must be a positive integer\n");
+
+		app_reshuffle(seed);
+	}
+	else if(argc == 3 && !strcmp(argv[1], "spread") && !strcmp(argv[2], "on"))
+		app_set_shuffle_spread(1);
+	else if(argc == 3 && !strcmp(argv[1], "spread") && !strcmp(argv[2], "off"))
+		app_set_shuffle_spread(0);
+	else if(argc > 1)
+		return net_write_string(c, "# ERR, usage: shuffle [new|seed <n>|spread on|off]\n");
+
+	snprintf(buf, sizeof(buf), "# OK, shuffle seed %llu, spread %s\n",
+		(unsigned long long)app_get_shuffle_seed(), app_get_shuffle_spread()? "on": "off");
+	return net_write_string(c, buf);
+}
+
+static int net_cmd_queue(net_conn_t *c, int argc, char **argv, const char *args) {
+	char buf[128];
+	const char *error;
+
+	if(argc == 2 && !strcmp(argv[1], "clear")) {
+		playqueue_clear();
+		return net_write_string(c, "# OK, play queue cleared\n");
+	}
+
+	if(argc == 2) {
+		if((error = playqueue_add_uri(argv[1], 0)) != NULL) {
+			snprintf(buf, sizeof(buf), "# ERR, %s\n", error);
+			return net_write_string(c, buf);
+		}
+
+		return net_write_string(c, "# OK, queued at the end of the play queue\n");
+	}
+
+	snprintf(buf, sizeof(buf), "# OK, %d tracks queued, %d albums or playlists loading\n",
+		playqueue_length(), playqueue_pending());
+	return net_write_string(c, buf);
+}
+
+static int net_cmd_playnext(net_conn_t *c, int argc, char **argv, const char *args) {
+	char buf[128];
+	const char *error;
+
+	if((error = playqueue_add_uri(argv[1], 1)) != NULL) {
+		snprintf(buf, sizeof(buf), "# ERR, %s\n", error);
+		return net_write_string(c, buf);
+	}
+
+	return net_write_string(c, "# OK, queued at the front of the play queue\n");
+}
+
+static int net_cmd_find(net_conn_t *c, int argc, char **argv, const char *args) {
+	search_result_t results[SEARCH_MAX_RESULTS];
+	mdindex_track_t t;
+	char buf[512];
+	int i, n;
+
+	n = search_query(args, results, SEARCH_MAX_RESULTS);
+	for(i = 0; i < n; i++) {
+		if(mdindex_find_track(results[i].uri, &t) < 0)
+			continue;
+
+		snprintf(buf, sizeof(buf), "%s %s - %s (%s)\n", t.uri, t.artist, t.title, t.album);
+		if(net_write_string(c, buf) < 0)
+			return -1;
+	}
+
+	snprintf(buf, sizeof(buf), "# OK, %d matches\n", n);
+	return net_write_string(c, buf);
+}
+
+static int net_cmd_prefetch(net_conn_t *c, int argc, char **argv, const char *args) {
+	unsigned long counts[PREFETCH_RESULTS], requests;
+	char buf[192], *end;
+	long tracks;
+	int type;
+
+	if(argc == 2 && (type = app_parse_connection_type(argv[1])) >= 0)
+		app_set_connection_type(type);
+	else if(argc == 2) {
+		tracks = strtol(argv[1], &end, 10);
+		if(*end || tracks < 0 || tracks > PREFETCH_MAX_WINDOW) {
+			snprintf(buf, sizeof(buf), "# ERR, usage: prefetch [0-%d|wired|wifi|mobile|roaming|none]\n",
+				PREFETCH_MAX_WINDOW);
+			return net_write_string(c, buf);
+		}
+
+		app_set_prefetch_window(tracks);
+	}
+
+	prefetch_get_stats(counts, &requests);
+	snprintf(buf, sizeof(buf), "# OK, prefetching %d tracks ahead on %s connection, "
+		"%lu audio hits, %lu metadata only, %lu misses\n", app_get_prefetch_window(),
+		app_get_connection_type(), counts[PREFETCH_AUDIO], counts[PREFETCH_METADATA],
+		counts[PREFETCH_MISS]);
+	return net_write_string(c, buf);
+}
+
+static int net_cmd_trim(net_conn_t *c, int argc, char **argv, const char *args) {
+
+	if(argc == 2 && !strcmp(argv[1], "on"))
+		player_set_trim(1);
+	else if(argc == 2 && !strcmp(argv[1], "off"))
+		player_set_trim(0);
+	else if(argc > 1)
+		return net_write_string(c, "# ERR, usage: trim [on|off]\n");
+
+	return net_write_string(c, player_get_trim()?
+		"# OK, silence trimming is enabled\n":
+		"# OK, silence trimming is disabled\n");
+}
+
+static int net_cmd_device(net_conn_t *c, int argc, char **argv, const char *args) {
+	char devices[2048];
+
+	if(argc == 1) {
+		if(audio_list_devices(devices, sizeof(devices)) == 0)
+			return net_write_string(c, "# ERR, device enumeration not supported\n");
+
+		return net_write_string(c, devices);
+	}
+
+	/* Device names contain spaces, so take the rest of the line.
+	   Reopened by the audio thread, the session is left alone */
+	audio_set_device(strcmp(args, "default")? args: "");
+	return net_write_string(c, "# OK, switching audio device\n");
+}
+
+static int net_cmd_meter(net_conn_t *c, int argc, char **argv, const char *args) {
+
+	return net_meter_subscribe(c, argc > 1? argv[1]: "");
+}
+
+/* Parse topic names into NET_TOPIC_* bits, no names means all topics */
+static int net_parse_topics(int argc, char **argv) {
+	int i, t, topics = 0;
+
+	if(argc == 1)
+		return NET_TOPIC_ALL;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "all")) {
+			topics |= NET_TOPIC_ALL;
+			continue;
+		}
+
+		for(t = 0; net_topic_names[t] && strcmp(argv[i], net_topic_names[t]); t++);
+		if(net_topic_names[t] == NULL)
+			return -1;
+
+		topics |= 1 << t;
+	}
+
+	return topics;
+}
+
+static void net_format_topics(char *buf, size_t len, int topics) {
+	size_t n = 0;
+	int t;
+
+	buf[0] = 0;
+	for(t = 0; net_topic_names[t] && n < len; t++)
+		if(topics & (1 << t))
+			n += snprintf(buf + n, len - n, "%s%s", n? " ": "", net_topic_names[t]);
+}
+
+static int net_cmd_subscribe(net_conn_t *c, int argc, char **argv, const char *args) {
+	char buf[128], names[64];
+	int topics;
+
+	if((topics = net_parse_topics(argc, argv)) < 0)
+		return net_write_string(c, "# ERR, unknown topic\n");
+
+	c->topics |= topics;
+	net_update_topics();
+	syslog(LOG_INFO, "NET: Client on fd %d subscribed to events 0x%02x", c->fd, c->topics);
+
+	net_format_topics(names, sizeof(names), c->topics);
+	snprintf(buf, sizeof(buf), "# OK, subscribed to %s\n", names);
+	return net_write_string(c, buf);
+}
+
+static int net_cmd_unsubscribe(net_conn_t *c, int argc, char **argv, const char *args) {
+	int topics;
+
+	if((topics = net_parse_topics(argc, argv)) < 0)
+		return net_write_string(c, "# ERR, unknown topic\n");
+
+	c->topics &= ~topics;
+	c->missed &= c->topics;
+	net_update_topics();
+
+	return net_write_string(c, "# OK, unsubscribed\n");
+}
+
+static int net_cmd_logout(net_conn_t *c, int argc, char **argv, const char *args) {
+
+	app_post_event(APP_DO_LOGOUT);
+	return net_write_string(c, "# OK, logging out and exiting\n");
+}
+
+static const net_command_t net_commands[] = {
+	{ "next",	0, 0,	0, net_cmd_next,	"next" },
+	{ "play",	0, 0,	0, net_cmd_play,	"play" },
+	{ "stop",	0, 0,	0, net_cmd_stop,	"stop" },
+	{ "status",	0, 1,	0, net_cmd_status,	"status [json]" },
+	{ "power-save",	0, 1,	NET_CMD_PRIVILEGED, net_cmd_power_save,	"power-save [on|off]" },
+	{ "trim",	0, 1,	NET_CMD_PRIVILEGED, net_cmd_trim,	"trim [on|off]" },
+	{ "queue",	0, 1,	0, net_cmd_queue,	"queue [<uri>|clear]" },
+	{ "playnext",	1, 1,	0, net_cmd_playnext,	"playnext <uri>" },
+	{ "find",	1, -1,	0, net_cmd_find,	"find <words>" },
+	{ "prefetch",	0, 1,	0, net_cmd_prefetch,	"prefetch [tracks|wired|wifi|mobile|roaming|none]" },
+	{ "shuffle",	0, 2,	0, net_cmd_shuffle,	"shuffle [new|seed <n>|spread on|off]" },
+	{ "device",	0, -1,	NET_CMD_PRIVILEGED, net_cmd_device,	"device [name|default]" },
+	{ "meter",	0, 1,	NET_CMD_STREAM, net_cmd_meter,	"meter [fps|off]" },
+	{ "subscribe",	0, -1,	NET_CMD_STREAM, net_cmd_subscribe,	"subscribe [track|playback|playlist|offline|underrun|all ...]" },
+	{ "unsubscribe", 0, -1,	NET_CMD_STREAM, net_cmd_unsubscribe,	"unsubscribe [topic ...]" },
+	{ "logout",	0, 0,	NET_CMD_PRIVILEGED, net_cmd_logout,	"logout" },
+	{ NULL }
+};
+
+/* Split a line into whitespace separated arguments and run the command */
+static int net_command(net_conn_t *c, char *line) {
+	const net_command_t *cmd;
+	char *argv[NET_MAX_ARGS], *p, *args, *end, *tok;
+	char split[NET_MAX_LINE], msg[128];
+	int argc;
+
+	/* Remove leading and trailing whitespace */
+	for(p = line; *p == ' ' || *p == '\t' || *p == '\r'; p++);
+	for(end = p + strlen(p); end > p &&
+		(end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'); end--);
+	*end = 0;
+
+	if(*p == 0)
+		return 0;
+
+	/* Keep the unsplit arguments around for commands that want them */
+	for(args = p; *args && *args != ' ' && *args != '\t'; args++);
+	if(*args) {
+		*args++ = 0;
+		while(*args == ' ' || *args == '\t')
+			args++;
+	}
+
+	/* A bare URI selects a playlist; URIs as arguments are left to commands */
+	if(strstr(p, "spotify:") || strstr(p, "http://open.spotify.com"))
+		return net_cmd_uri(c, p);
+
+	/* Arguments are split on a copy */
+	argv[0] = p;
+	argc = 1;
+	snprintf(split, sizeof(split), "%s", args);
+	for(tok = strtok(split, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+		if(argc == NET_MAX_ARGS)
+			return net_write_string(c, "# ERR, too many arguments\n");
+
+		argv[argc++] = tok;
+	}
+
+	for(cmd = net_commands; cmd->name != NULL; cmd++) {
+		if(strcmp(cmd->name, argv[0]))
+			continue;
+
+		if((cmd->flags & NET_CMD_PRIVILEGED) && !c->privileged) {
+			syslog(LOG_NOTICE, "NET: Refused privileged command '%s' on fd %d", cmd->name, c->fd);
+			return net_write_string(c, "# ERR, permission denied\n");
+		}
+
+		if((cmd->flags & NET_CMD_STREAM) && c->datagram)
+			return net_write_string(c, "# ERR, not available over UDP\n");
+
+		if(argc - 1 < cmd->min_args || (cmd->max_args >= 0 && argc - 1 > cmd->max_args)) {
+			snprintf(msg, sizeof(msg), "# ERR, usage: %s\n", cmd->usage);
+			return net_write_string(c, msg);
+		}
+
+		return cmd->handler(c, argc, argv, args);
+	}
+
+	return net_write_string(c, "# ERR, unsupported command\n");
+}
+
+static int net_meter_subscribe(net_conn_t *c, const char *arg) {
+	char buf[128];
+	int i, slot = -1, fps;
+
+	if(!strcmp(arg, "off")) {
+		if(net_meter_unsubscribe(c) < 0)
+			return net_write_string(c, "# ERR, not subscribed to the level meter\n");
+
+		return net_write_string(c, "# OK, level meter feed stopped\n");
+	}
+
+	if(*arg) {
+		fps = atoi(arg);
+		if(fps < 1 || fps > METER_MAX_FPS)
+			return net_write_string(c, "# ERR, invalid frame rate\n");
+
+		meter_fps = fps;
+	}
+
+	for(i = 0; i < NET_MAX_METER_CLIENTS; i++) {
+		if(meter_conns[i] == c)
+			slot = i;
+		else if(meter_conns[i] == NULL && slot == -1)
+			slot = i;
+	}
+
+	if(slot == -1)
+		return net_write_string(c, "# ERR, too many level meter clients\n");
+
+	if(meter_conns[slot] != c) {
+		meter_conns[slot] = c;
+		syslog(LOG_INFO, "NET: Client on fd %d subscribed to the level meter", c->fd);
+	}
+
+	meter_enable(1);
+	reactor_timer_set(meter_timer, 1000 / meter_fps);
+
+	snprintf(buf, sizeof(buf), "# OK, streaming level meter at %d frames/s\n", meter_fps);
+	return net_write_string(c, buf);
+}
+
+/* Returns -1 if the client was not subscribed */
+static int net_meter_unsubscribe(net_conn_t *c) {
+	int i, n = 0, found = -1;
+
+	for(i = 0; i < NET_MAX_METER_CLIENTS; i++) {
+		if(meter_conns[i] == c) {
+			meter_conns[i] = NULL;
+			found = 0;
+		}
+
+		if(meter_conns[i] != NULL)
+			n++;
+	}
+
+	if(n == 0) {
+		meter_enable(0);
+		reactor_timer_set(meter_timer, -1);
+	}
+
+	return found;
+}
+
+static void net_meter_publish(void *arg) {
+	net_conn_t *c;
+	char buf[256];
+	int i, len;
+
+	if((len = meter_format(buf, sizeof(buf))) <= 0)
+		len = 0;
+
+	for(i = 0; i < NET_MAX_METER_CLIENTS && len > 0; i++) {
+		if((c = meter_conns[i]) == NULL)
+			continue;
+
+		/* Drop the frame for a client that hasn't taken the last one yet */
+		if(c->out_pos != c->out.len)
+			continue;
+
+		if(net_send(c, buf, len) < 0)
+			net_close_client(c);
+	}
+
+	for(i = 0; i < NET_MAX_METER_CLIENTS && meter_conns[i] == NULL; i++);
+	if(i < NET_MAX_METER_CLIENTS)
+		reactor_timer_set(meter_timer, 1000 / meter_fps);
+}
+
+static void net_update_topics(void) {
+	int i;
+
+	subscribed_topics = 0;
+	for(i = 0; i < num_conns; i++)
+		subscribed_topics |= conns[i]->topics;
+}
+
+/* Lets the caller skip building an event nobody is listening to */
+int net_has_subscribers(int topic) {
+
+	return (subscribed_topics & topic) != 0;
+}
+
+/**
+ * Push an event line to every client subscribed to topic; main thread only.
+ * A client that isn't keeping up gets no events until its output has
+ * drained, and is then sent a resync event naming the topics it missed.
+ */
+void net_publish(int topic, const char *data, size_t len) {
+	net_conn_t *c;
+	int i;
+
+	if(!(subscribed_topics & topic))
+		return;
+
+	/* Backwards, as closing a client moves the last one into its slot */
+	for(i = num_conns - 1; i >= 0; i--) {
+		c = conns[i];
+		if(!(c->topics & topic) || c->closing)
+			continue;
+
+		if(c->missed || c->out.len - c->out_pos > NET_SUBSCRIBER_BACKLOG) {
+			if(!c->missed)
+				syslog(LOG_DEBUG, "NET: Client on fd %d is behind, skipping events", c->fd);
+			c->missed |= topic;
+			continue;
+		}
+
+		if(net_send(c, data, len) < 0)
+			net_close_client(c);
+	}
+}
+
+static int net_send_resync(net_conn_t *c) {
+	buf_t b;
+	json_t j;
+	int t, ret;
+
+	buf_init(&b);
+	json_init(&j, &b);
+	json_object_begin(&j, NULL);
+	json_string(&j, "type", "resync");
+	json_array_begin(&j, "topics");
+	for(t = 0; net_topic_names[t]; t++)
+		if(c->missed & (1 << t))
+			json_string(&j, NULL, net_topic_names[t]);
+	json_array_end(&j);
+	json_object_end(&j);
+
+	c->missed = 0;
+	ret = json_finish(&j) < 0? 0: net_send(c, b.data, b.len);
+	buf_release(&b);
+
+	return ret;
+}
+
+static void net_gpio_event(int fd, int events, void *arg) {
+
+	net_gpio_read(fd);
+}
+
 static int net_gpio_read(int fd) {
 	char status[2] = { 0 };
 	size_t n;
@@ -230,19 +1474,49 @@ static int net_gpio_read(int fd) {
 
 	syslog(LOG_DEBUG, "GPIO: Input %c", status[0]);		
 	if(status[0] == '0') {
-		app_post_event(APP_DO_NEXT_TRACK);
+		app_skip_track();
 	}
 
 	return n == 2? 0: -1;
 }
 
-void net_release(int fd) {
+void net_get_stats(int *clients, unsigned long *accepted,
+		unsigned long *rejected, unsigned long *evicted) {
 
-	if(client_fd != -1) {
-		close(client_fd);
-		client_fd = -1;
-	}
+	*clients = num_conns;
+	*accepted = conns_accepted;
+	*rejected = conns_rejected;
+	*evicted = conns_evicted;
+}
 
-	close(fd);
+void net_get_udp_stats(unsigned long *commands, unsigned long *duplicates,
+		unsigned long *rejected) {
+
+	*commands = udp_commands;
+	*duplicates = udp_duplicates;
+	*rejected = udp_rejected;
 }
 
+void net_release(void) {
+	int i;
+
+	while(num_conns > 0)
+		net_close_client(conns[0]);
+
+	reactor_timer_delete(meter_timer);
+
+	for(i = 0; i < num_listeners; i++) {
+		reactor_remove(listeners[i].fd);
+		close(listeners[i].fd);
+	}
+	num_listeners = 0;
+	buf_release(&udp_conn.out);
+
+	if(unix_path[0]) {
+		unlink(unix_path);
+		unix_path[0] = 0;
+	}
+
+	if(app_gpio_fd() != -1)
+		reactor_remove(app_gpio_fd());
+}
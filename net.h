@@ -6,11 +6,78 @@
 #ifndef NET_H
 #define NET_H
 
-/* Accept commands on TCP port 1234 */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Accept commands on TCP port 1234 (see http.h for the HTTP API port) */
 #define CTRL_TCP_PORT 1234
 
-int net_create(int port);
-int net_poll(int listen_fd, int timeout);
-void net_release(int fd);
+/* ..and on this Unix domain socket, which group members may connect to */
+#define NET_UNIX_PATH "/tmp/pi-boombox.sock"
+#define NET_UNIX_MODE 0660
+
+/* Max number of TCP and UDP bind addresses and of listening sockets in total */
+#define NET_MAX_BIND 8
+#define NET_MAX_LISTENERS 24
+
+/* UDP remote control, off unless a port and key are given (see README).
+ * Datagrams start with a remote id, a session and a sequence number and
+ * end with a SipHash-2-4 MAC; remotes are tracked for duplicates by id. */
+#define NET_UDP_PORT 1234
+#define NET_UDP_KEY_SIZE 16
+#define NET_UDP_HEADER 12
+#define NET_UDP_MAC 8
+#define NET_UDP_MAX_REPLY 1200
+#define NET_UDP_REMOTES 16
+
+/* Max number of connected control clients and connections taken per wakeup */
+#define NET_MAX_CLIENTS 1024
+#define NET_LISTEN_BACKLOG 128
+#define NET_ACCEPT_BATCH 32
+
+/* Longest command line accepted and max number of arguments to a command */
+#define NET_MAX_LINE 1024
+#define NET_MAX_ARGS 16
+
+/* Queued output beyond which reading commands from a client is paused,
+ * and beyond which the client is disconnected */
+#define NET_OUTPUT_HIGH_WATER (64 * 1024)
+#define NET_OUTPUT_MAX (1024 * 1024)
+
+/* Max number of clients subscribed to the level meter feed */
+#define NET_MAX_METER_CLIENTS 4
+
+/* Event topics clients may subscribe to */
+#define NET_TOPIC_TRACK		0x01
+#define NET_TOPIC_PLAYBACK	0x02
+#define NET_TOPIC_PLAYLIST	0x04
+#define NET_TOPIC_OFFLINE	0x08
+#define NET_TOPIC_UNDERRUN	0x10
+#define NET_TOPIC_ALL		0x1f
+
+/* Events are skipped for a subscriber with more output than this queued;
+ * it's told to resync once it has caught up */
+#define NET_SUBSCRIBER_BACKLOG (16 * 1024)
+
+/* Where to listen; no bind addresses means all IPv4 and IPv6 interfaces */
+typedef struct {
+	const char *bind[NET_MAX_BIND];
+	int num_bind;
+	int port;
+	int http_port;		/* 0 to disable the HTTP API */
+	int udp_port;		/* 0 to disable UDP remote control */
+	uint8_t udp_key[NET_UDP_KEY_SIZE];
+	const char *unix_path;	/* NULL or empty to disable */
+	int restrict_tcp;	/* Privileged commands on the Unix socket only */
+} net_config_t;
+
+int net_create(const net_config_t *config);
+void net_get_stats(int *clients, unsigned long *accepted,
+	unsigned long *rejected, unsigned long *evicted);
+void net_get_udp_stats(unsigned long *commands, unsigned long *duplicates,
+	unsigned long *rejected);
+int net_has_subscribers(int topic);
+void net_publish(int topic, const char *data, size_t len);
+void net_release(void);
 
 #endif
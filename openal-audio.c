@@ -31,11 +31,13 @@
 #else
 #include <AL/al.h>
 #include <AL/alc.h>
+#include <AL/alext.h>
 #endif
 #include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <syslog.h>
@@ -44,73 +46,264 @@
 
 #define NUM_BUFFERS 3
 
-static void error_exit(const char *msg)
+/* Delay between attempts to reopen a failed device */
+#define REOPEN_BACKOFF_MIN_MS 250
+#define REOPEN_BACKOFF_MAX_MS 8000
+
+/* Give up on a device that hasn't played anything for this long */
+#define STALL_TIMEOUT_MS 3000
+
+/* Output device state, shared between the audio thread and the rest */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	char requested[256];
+	int switch_pending;
+	char current[256];
+	int is_open;
+	int failures;
+} g_dev = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Tell the playback clock how much queued audio has yet to be heard */
+static void report_latency(ALuint source, audio_fifo_t *af, int queued, int rate)
 {
-	syslog(LOG_ERR, "OpenAL error: %s", msg);
-	exit(1);
+	ALint offset = 0;
+
+	/* Offset is relative to the start of all buffers still queued */
+	alGetSourcei(source, AL_SAMPLE_OFFSET, &offset);
+	audio_set_device_latency(af, queued > offset? queued - offset: 0, rate);
 }
 
-static int queue_buffer(ALuint source, audio_fifo_t *af, ALuint buffer)
+static void buffer_data(ALuint buffer, audio_fifo_data_t *afd)
 {
-	audio_fifo_data_t *afd = audio_get(af) /* blocks until data available */;
-
 	alBufferData(buffer,
 		 afd->channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16,
 		 afd->samples,
 		 afd->nsamples * afd->channels * sizeof(short),
 		 afd->rate);
-	alSourceQueueBuffers(source, 1, &buffer);
+}
 
-	free(afd);
+static int elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
 
-	return 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int)((now.tv_sec - since->tv_sec) * 1000
+		+ (now.tv_nsec - since->tv_nsec) / 1000000);
 }
 
-static void* audio_start(void *aux)
+/**
+ * Microseconds to sleep while waiting for a buffer to finish playing.
+ * Normally a short poll; with large output blocks (power saving) sleep
+ * until the buffer at the head of the queue is expected to be done.
+ */
+static useconds_t wait_interval(audio_fifo_t *af, ALuint source, int head_frames, int rate)
+{
+	ALint offset = 0;
+	int64_t left;
+
+	if (__atomic_load_n(&af->block_ms, __ATOMIC_RELAXED) == 0 || rate <= 0)
+		return 100;
+
+	alGetSourcei(source, AL_SAMPLE_OFFSET, &offset);
+	left = (int64_t)(head_frames - offset) * 1000000 / rate;
+	if (left < 1000)
+		return 1000;
+	if (left > 500000)
+		return 500000;
+
+	return (useconds_t)left;
+}
+
+static int switch_requested(void)
+{
+	int pending;
+
+	pthread_mutex_lock(&g_dev.mutex);
+	pending = g_dev.switch_pending;
+	pthread_mutex_unlock(&g_dev.mutex);
+
+	return pending;
+}
+
+/* Returns non-zero if the device reported an error or went away */
+static int device_failed(ALCdevice *device)
+{
+	ALCenum alc_error;
+	ALenum al_error;
+#ifdef ALC_CONNECTED
+	ALCint connected = 1;
+#endif
+
+	if ((alc_error = alcGetError(device)) != ALC_NO_ERROR) {
+		syslog(LOG_ERR, "OpenAL error: alcGetError() returned %d", alc_error);
+		return 1;
+	}
+
+	if ((al_error = alGetError()) != AL_NO_ERROR) {
+		syslog(LOG_ERR, "OpenAL error: alGetError() returned %d", al_error);
+		return 1;
+	}
+
+#ifdef ALC_CONNECTED
+	if (alcIsExtensionPresent(device, "ALC_EXT_disconnect")) {
+		alcGetIntegerv(device, ALC_CONNECTED, 1, &connected);
+		if (!connected) {
+			syslog(LOG_ERR, "OpenAL error: device disconnected");
+			return 1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * Open the requested device and play audio from the FIFO until the device
+ * fails or another device is requested.  Audio taken off the FIFO but not
+ * yet queued is handed back in *pending so that it isn't lost.
+ *
+ * Returns 0 if a device switch was requested, 1 if an opened device failed
+ * and -1 if the device couldn't be opened at all.
+ */
+static int audio_play(audio_fifo_t *af, audio_fifo_data_t **pending)
 {
-	audio_fifo_t *af = aux;
 	audio_fifo_data_t *afd;
 	unsigned int frame = 0;
 	ALCdevice *device = NULL;
 	ALCcontext *context = NULL;
 	ALuint buffers[NUM_BUFFERS];
+	int buffer_frames[NUM_BUFFERS];
+	int queued = 0;
 	ALuint source;
 	ALint processed;
-	ALenum error;
 	ALint rate;
 	ALint channels;
 	ALint val;
+	char name[sizeof(g_dev.requested)];
+	struct timespec wait_start;
+	unsigned int generation;
+	int waited, last_check, ret = 1;
+
+	pthread_mutex_lock(&g_dev.mutex);
+	strcpy(name, g_dev.requested);
+	g_dev.switch_pending = 0;
+	pthread_mutex_unlock(&g_dev.mutex);
 
-	device = alcOpenDevice(NULL); /* Use the default device */
-	if(!device)
-		error_exit("failed to open device");
+	device = alcOpenDevice(*name? name: NULL); /* Empty name means the default device */
+	if (!device) {
+		syslog(LOG_ERR, "OpenAL error: failed to open device '%s'", *name? name: "default");
+		return -1;
+	}
 
 	context = alcCreateContext(device, NULL);
-	alcMakeContextCurrent(context);
+	if (!context || !alcMakeContextCurrent(context)) {
+		syslog(LOG_ERR, "OpenAL error: failed to create context on device '%s'",
+			*name? name: "default");
+		if (context)
+			alcDestroyContext(context);
+		alcCloseDevice(device);
+		return -1;
+	}
+
 	alListenerf(AL_GAIN, 1.0f);
 	alDistanceModel(AL_NONE);
 	alGenBuffers((ALsizei)NUM_BUFFERS, buffers);
 	alGenSources(1, &source);
+	if (device_failed(device)) {
+		ret = -1;
+		goto out;
+	}
 
-	/* First prebuffer some audio */
-	for(val = 0; val < NUM_BUFFERS; val++)
-		queue_buffer(source, af, buffers[val]);
+	pthread_mutex_lock(&g_dev.mutex);
+	snprintf(g_dev.current, sizeof(g_dev.current), "%s",
+		alcGetString(device, ALC_DEVICE_SPECIFIER));
+	g_dev.is_open = 1;
+	pthread_mutex_unlock(&g_dev.mutex);
+	syslog(LOG_NOTICE, "OpenAL: opened device '%s'", g_dev.current);
 
 	for (;;) {
 
+		/* Prebuffer some audio, starting with any audio held over */
+		generation = __atomic_load_n(&af->generation, __ATOMIC_RELAXED);
+		for (val = 0; val < NUM_BUFFERS; val++) {
+			afd = *pending? *pending: audio_get_block(af) /* blocks until data available */;
+			*pending = NULL;
+
+			buffer_data(buffers[val], afd);
+			queued += buffer_frames[val] = afd->nsamples;
+			alSourceQueueBuffers(source, 1, &buffers[val]);
+			free(afd);
+		}
+
 		alSourcePlay(source);
+		alGetBufferi(buffers[0], AL_FREQUENCY, &rate);
+		report_latency(source, af, queued, rate);
+		if (device_failed(device))
+			goto out;
+
+		frame = 0;
 		for (;;) {
 			/* Wait for some audio to play */
+			afd = NULL;
+			clock_gettime(CLOCK_MONOTONIC, &wait_start);
+			last_check = 0;
 			do {
 				alGetSourcei(source, AL_BUFFERS_PROCESSED, &processed);
-				usleep(100);
+				if (processed)
+					break;
+
+				usleep(wait_interval(af, source, buffer_frames[frame % NUM_BUFFERS], rate));
+				__atomic_add_fetch(&af->driver_wakeups, 1, __ATOMIC_RELAXED);
+
+				/* Now and then make sure the device is still alive */
+				waited = elapsed_ms(&wait_start);
+				if (waited - last_check < 100)
+					continue;
+				last_check = waited;
+
+				if (switch_requested()) {
+					ret = 0;
+					goto out;
+				}
+
+				if (device_failed(device))
+					goto out;
+
+				if (waited > STALL_TIMEOUT_MS
+					+ (int)((int64_t)buffer_frames[frame % NUM_BUFFERS] * 1000 / rate)) {
+					syslog(LOG_ERR, "OpenAL error: device stalled");
+					goto out;
+				}
+
+				/* FIFO was flushed, drop what's queued on the device too */
+				if (__atomic_load_n(&af->generation, __ATOMIC_RELAXED) != generation)
+					break;
 			} while (!processed);
 
+			if (!processed)
+				break;
+
 			/* Remove old audio from the queue.. */
 			alSourceUnqueueBuffers(source, 1, &buffers[frame % NUM_BUFFERS]);
+			queued -= buffer_frames[frame % NUM_BUFFERS];
 
 			/* and queue some more audio */
-			afd = audio_get(af);
+			afd = audio_get_block(af);
+			if (switch_requested()) {
+				*pending = afd;
+				ret = 0;
+				goto out;
+			}
+
+			if (__atomic_load_n(&af->generation, __ATOMIC_RELAXED) != generation) {
+				syslog(LOG_DEBUG, "OpenAL: audio flushed, resetting");
+				break;
+			}
+
 			alGetBufferi(buffers[frame % NUM_BUFFERS], AL_FREQUENCY, &rate);
 			alGetBufferi(buffers[frame % NUM_BUFFERS], AL_CHANNELS, &channels);
 			if (afd->rate != rate || afd->channels != channels) {
@@ -122,43 +315,144 @@ static void* audio_start(void *aux)
 			alGetSourcei(source, AL_SOURCE_STATE, &val);
 			if(val != AL_PLAYING) {
 				syslog(LOG_NOTICE, "OpenAL: Audio playback stopped (buffer underrun?), restarting");
+				audio_report_underrun(af);
 				break;
 			}
 
-			alBufferData(buffers[frame % NUM_BUFFERS],
-					 afd->channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16,
-					 afd->samples,
-					 afd->nsamples * afd->channels * sizeof(short),
-					 afd->rate);
-			free(afd);
+			buffer_data(buffers[frame % NUM_BUFFERS], afd);
+			queued += buffer_frames[frame % NUM_BUFFERS] = afd->nsamples;
 			alSourceQueueBuffers(source, 1, &buffers[frame % NUM_BUFFERS]);
+			report_latency(source, af, queued, afd->rate);
+			free(afd);
 
-			if ((error = alcGetError(device)) != AL_NO_ERROR) {
-				syslog(LOG_ERR, "OpenAL error: alcGetError() returned %d, killing audio thread", error);
-				exit(1);
-			}
+			if (device_failed(device))
+				goto out;
 
 			frame++;
 		}
 
-		/* Format or rate changed, so we need to reset all buffers */
+		/* Format or rate changed, or audio was flushed, so we need to reset
+		 * all buffers.  Make sure we don't lose the audio packet we got */
+		*pending = afd;
 		alSourcei(source, AL_BUFFER, 0);
 		alSourceStop(source);
+		queued = 0;
+	}
 
-		/* Make sure we don't lose the audio packet that caused the change */
-		alBufferData(buffers[0],
-				 afd->channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16,
-				 afd->samples,
-				 afd->nsamples * afd->channels * sizeof(short),
-				 afd->rate);
-		free(afd);
+out:
+	alSourceStop(source);
+	alSourcei(source, AL_BUFFER, 0);
+	alDeleteSources(1, &source);
+	alDeleteBuffers((ALsizei)NUM_BUFFERS, buffers);
+	alcMakeContextCurrent(NULL);
+	alcDestroyContext(context);
+	alcCloseDevice(device);
 
-		alSourceQueueBuffers(source, 1, &buffers[0]);
-		for(val = 1; val < NUM_BUFFERS; val++)
-			queue_buffer(source, af, buffers[val]);
+	/* Whatever was queued on the device is gone */
+	audio_set_device_latency(af, 0, 0);
 
-		frame = 0;
+	pthread_mutex_lock(&g_dev.mutex);
+	g_dev.is_open = 0;
+	pthread_mutex_unlock(&g_dev.mutex);
+
+	return ret;
+}
+
+/* Audio output thread; keeps (re)opening the device, never exits */
+static void* audio_start(void *aux)
+{
+	audio_fifo_t *af = aux;
+	audio_fifo_data_t *pending = NULL;
+	struct timespec deadline;
+	int ret, backoff = 0;
+
+	for (;;) {
+		ret = audio_play(af, &pending);
+		if (ret == 0) {
+			syslog(LOG_NOTICE, "OpenAL: switching output device");
+			backoff = 0;
+			continue;
+		}
+
+		/* A device that worked for a while gets retried quickly */
+		if (ret > 0 || backoff == 0)
+			backoff = REOPEN_BACKOFF_MIN_MS;
+		else if ((backoff *= 2) > REOPEN_BACKOFF_MAX_MS)
+			backoff = REOPEN_BACKOFF_MAX_MS;
+
+		syslog(LOG_WARNING, "OpenAL: reopening device in %dms", backoff);
+
+		/* Wait for the backoff to expire or for a new device to be selected */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += backoff / 1000;
+		deadline.tv_nsec += (backoff % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&g_dev.mutex);
+		g_dev.failures++;
+		while (!g_dev.switch_pending &&
+			pthread_cond_timedwait(&g_dev.cond, &g_dev.mutex, &deadline) != ETIMEDOUT);
+		pthread_mutex_unlock(&g_dev.mutex);
+	}
+
+	return NULL;
+}
+
+/* Select output device by name, an empty name selects the default device */
+void audio_set_device(const char *name)
+{
+	pthread_mutex_lock(&g_dev.mutex);
+	snprintf(g_dev.requested, sizeof(g_dev.requested), "%s", name);
+	g_dev.switch_pending = 1;
+	pthread_cond_signal(&g_dev.cond);
+	pthread_mutex_unlock(&g_dev.mutex);
+}
+
+/* Copy name of the current device; returns non-zero if it's open */
+int audio_get_device(char *name, size_t len, int *failures)
+{
+	int is_open;
+
+	pthread_mutex_lock(&g_dev.mutex);
+	snprintf(name, len, "%s", *g_dev.current? g_dev.current:
+		*g_dev.requested? g_dev.requested: "default");
+	is_open = g_dev.is_open;
+	if (failures)
+		*failures = g_dev.failures;
+	pthread_mutex_unlock(&g_dev.mutex);
+
+	return is_open;
+}
+
+/* List available output devices, one per line */
+int audio_list_devices(char *buf, size_t len)
+{
+	const ALCchar *list = NULL;
+	int n, total = 0;
+
+#ifdef ALC_ALL_DEVICES_SPECIFIER
+	if (alcIsExtensionPresent(NULL, "ALC_ENUMERATE_ALL_EXT"))
+		list = alcGetString(NULL, ALC_ALL_DEVICES_SPECIFIER);
+	else
+#endif
+	if (alcIsExtensionPresent(NULL, "ALC_ENUMERATION_EXT"))
+		list = alcGetString(NULL, ALC_DEVICE_SPECIFIER);
+
+	if (len)
+		*buf = 0;
+
+	/* The list is a sequence of NUL terminated strings ending with an empty one */
+	for (; list && *list; list += strlen(list) + 1) {
+		n = snprintf(buf + total, len - total, "Audio device: %s\n", list);
+		if (n < 0 || (size_t)n >= len - total)
+			break;
+		total += n;
 	}
+
+	return total;
 }
 
 void audio_init(audio_fifo_t *af)
@@ -167,6 +461,8 @@ void audio_init(audio_fifo_t *af)
 
 	TAILQ_INIT(&af->q);
 	af->qlen = 0;
+	af->max_ms = 1000;
+	af->block_ms = 0;
 
 	pthread_mutex_init(&af->mutex, NULL);
 	pthread_cond_init(&af->cond, NULL);
@@ -16,32 +16,136 @@
 #include <syslog.h>
 #include <pthread.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "player.h"
 #include "app.h"
 #include "audio.h"
 
 static void player_stats_update(int num_frames, int sample_rate);
+static void player_trim_update(int peak, int num_frames, int skip, int sample_rate);
+
+/* Frames delivered by libspotify for the current track and its length */
+static uint32_t frames_sunk, frames_expected;
+static int frames_rate;
+
+/* Silence trimming state for the current track */
+enum {
+	PLAYER_TRIM_HEAD,	/* Dropping leading silence */
+	PLAYER_TRIM_BODY,	/* Watching for trailing silence */
+	PLAYER_TRIM_DONE	/* Tail cut, waiting for the next track */
+};
+static int trim_enabled = PLAYER_TRIM_SILENCE;
+static int trim_state;
+static uint32_t trim_silent_run;
+
+
+/* Largest absolute sample value in a block of interleaved samples */
+static int player_max_abs(const int16_t *samples, int n) {
+	int i = 0, v, max = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	int16x8_t acc = vdupq_n_s16(0);
+	int16x4_t m;
+
+	for(; i + 8 <= n; i += 8)
+		acc = vmaxq_s16(acc, vqabsq_s16(vld1q_s16(samples + i)));
+
+	m = vmax_s16(vget_low_s16(acc), vget_high_s16(acc));
+	m = vpmax_s16(m, m);
+	m = vpmax_s16(m, m);
+	max = vget_lane_s16(m, 0);
+#elif defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128(), x;
+
+	for(; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128((const __m128i *)(samples + i));
+		/* Saturating negate so that -32768 becomes 32767 */
+		acc = _mm_max_epi16(acc, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+	}
+
+	acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 4));
+	acc = _mm_max_epi16(acc, _mm_srli_si128(acc, 2));
+	max = (int16_t)_mm_extract_epi16(acc, 0);
+#endif
+
+	/* Remainder, or the whole block if there's no SIMD available */
+	for(; i < n; i++) {
+		v = samples[i];
+		v = v < 0? -v: v;
+		max = v > max? v: max;
+	}
+
+	return max;
+}
+
+/* Index of the first frame with a sample above the silence threshold */
+static int player_first_loud_frame(const int16_t *samples, int num_frames, int channels) {
+	int i, block = 64 * channels, n = num_frames * channels;
+
+	for(i = 0; i < n; i += block) {
+		if(player_max_abs(samples + i, n - i < block? n - i: block)
+				<= PLAYER_SILENCE_THRESHOLD)
+			continue;
+
+		for(; i < n; i++)
+			if(samples[i] > PLAYER_SILENCE_THRESHOLD || samples[i] < -PLAYER_SILENCE_THRESHOLD)
+				return i / channels;
+	}
 
-uint32_t frames_sunk, frames_expected;
+	return num_frames;
+}
 
 
 /* Called from libspotify's internal thread */
 int player_callback_frame_delivery(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames) {
 	audio_fifo_t *af = app_get_audio_fifo();
 	audio_fifo_data_t *afd;
+	const int16_t *samples = frames;
+	int trim, peak = 0, skip = 0;
 	size_t len;
 
 	if(num_frames == 0)
 		return 0; // Audio discontinuity, do nothing
 
-	/* Buffer one second of audio */
+	/* Scan for silence before taking the lock the audio thread waits on */
+	trim = __atomic_load_n(&trim_enabled, __ATOMIC_RELAXED);
+	if(trim) {
+		switch(__atomic_load_n(&trim_state, __ATOMIC_RELAXED)) {
+		case PLAYER_TRIM_DONE:
+			/* Refuse more audio until the next track is loaded */
+			return 0;
+
+		case PLAYER_TRIM_HEAD:
+			peak = player_max_abs(samples, num_frames * format->channels);
+			if(peak <= PLAYER_SILENCE_THRESHOLD) {
+				/* Consume leading silence without queueing it */
+				player_stats_update(num_frames, format->sample_rate);
+				return num_frames;
+			}
+
+			skip = player_first_loud_frame(samples, num_frames, format->channels);
+			break;
+
+		default:
+			peak = player_max_abs(samples, num_frames * format->channels);
+			break;
+		}
+	}
+
+	/* Buffer one second of audio, or more when saving power */
 	pthread_mutex_lock(&af->mutex);
-	if(af->qlen > format->sample_rate) {
+	if((int64_t)af->qlen * 1000 > (int64_t)format->sample_rate * af->max_ms) {
 		pthread_mutex_unlock(&af->mutex);
 		return 0;
 	}
 
-	len = num_frames * sizeof(int16_t) * format->channels;
+	len = (num_frames - skip) * sizeof(int16_t) * format->channels;
 
 	afd = malloc(sizeof(audio_fifo_data_t) + len);
 	if(afd == NULL) {
@@ -49,19 +153,21 @@ int player_callback_frame_delivery(sp_session *session, const sp_audioformat *fo
 		return 0;
 	}
 
-	memcpy(afd->samples, frames, len);
-	afd->nsamples = num_frames;
+	memcpy(afd->samples, samples + skip * format->channels, len);
+	afd->nsamples = num_frames - skip;
 
 	afd->rate = format->sample_rate;
 	afd->channels = format->channels;
 
 	TAILQ_INSERT_TAIL(&af->q, afd, link);
-	af->qlen += num_frames;
+	af->qlen += afd->nsamples;
 
 	pthread_cond_signal(&af->cond);
 	pthread_mutex_unlock(&af->mutex);
 
 	player_stats_update(num_frames, format->sample_rate);
+	if(trim)
+		player_trim_update(peak, num_frames, skip, format->sample_rate);
 
 #if 0
 {
@@ -105,12 +211,18 @@ void player_callback_stop_playback(sp_session *session) {
 
 /* Called from libspotify's internal thread */
 void player_callback_get_audio_buffer_stats(sp_session *session, sp_audio_buffer_stats *stats) {
+	static unsigned long underruns;
 	audio_fifo_t *af = app_get_audio_fifo();
+	unsigned long n;
 
 	pthread_mutex_lock(&af->mutex);
 	stats->samples = af->qlen;
 	pthread_mutex_unlock(&af->mutex);
-	stats->stutter = 0;
+
+	/* Underruns since libspotify last asked */
+	n = __atomic_load_n(&af->underruns, __ATOMIC_RELAXED);
+	stats->stutter = (int)(n - underruns);
+	underruns = n;
 
 	//syslog(LOG_DEBUG, "%s: samples:%d, stutter:%d", __func__, stats->samples, stats->stutter);
 }
@@ -127,8 +239,10 @@ void player_callback_end_of_track(sp_session *session) {
 				sp_artist_name(sp_track_artist(track, 0)),
 				sp_track_name(track));
 
-		/* Unload current track */
-		audio_fifo_flush(app_get_audio_fifo());
+		/* Unload current track; a large power saving FIFO is left
+		   to play out rather than cutting off the end of the track */
+		if(!app_get_power_save())
+			audio_fifo_flush(app_get_audio_fifo());
 		sp_session_player_unload(session);
 	}
 
@@ -143,22 +257,117 @@ void player_callback_playtoken_lost(sp_session *session) {
 }
 
 void player_stats_reset(void) {
-	frames_sunk = 0;
-	frames_expected = 0;
+	__atomic_store_n(&frames_sunk, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&frames_expected, 0, __ATOMIC_RELAXED);
 
 	syslog(LOG_DEBUG, "Player: statistics reset");
 }
 
+/* Arm leading silence trimming for a newly loaded track */
+void player_trim_reset(void) {
+	__atomic_store_n(&trim_silent_run, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&trim_state, PLAYER_TRIM_HEAD, __ATOMIC_RELAXED);
+}
+
 static void player_stats_update(int num_frames, int sample_rate) {
 	sp_track *track;
 
 	if(frames_expected == 0) {
 		track = app_get_track();
 		if(track) {
-			frames_expected = sample_rate;
-			frames_expected *= sp_track_duration(track) / 1000;
+			__atomic_store_n(&frames_rate, sample_rate, __ATOMIC_RELAXED);
+			__atomic_store_n(&frames_expected,
+				(uint32_t)((uint64_t)sample_rate * sp_track_duration(track) / 1000),
+				__ATOMIC_RELAXED);
 		}
 	}
 
-	frames_sunk += num_frames;
+	__atomic_add_fetch(&frames_sunk, num_frames, __ATOMIC_RELAXED);
+}
+
+/**
+ * Position of the sample currently at the speaker: frames delivered
+ * minus what's still waiting in the FIFO and in the output device.
+ * Returns -1 if nothing has been delivered for the current track yet.
+ */
+int player_get_position(int *elapsed_ms, int *remaining_ms) {
+	uint32_t sunk, expected;
+	int64_t played;
+	int rate;
+
+	sunk = __atomic_load_n(&frames_sunk, __ATOMIC_RELAXED);
+	expected = __atomic_load_n(&frames_expected, __ATOMIC_RELAXED);
+	rate = __atomic_load_n(&frames_rate, __ATOMIC_RELAXED);
+	if(expected == 0 || rate == 0)
+		return -1;
+
+	played = (int64_t)sunk - audio_get_latency(app_get_audio_fifo(), rate);
+	if(played < 0)
+		played = 0;
+	else if(played > expected)
+		played = expected;
+
+	*elapsed_ms = (int)(played * 1000 / rate);
+	*remaining_ms = (int)(((int64_t)expected - played) * 1000 / rate);
+
+	return 0;
+}
+
+/* Sample rate of the audio delivered last, which is what's in the FIFO */
+int player_get_rate(void) {
+	int rate = __atomic_load_n(&frames_rate, __ATOMIC_RELAXED);
+
+	return rate > 0? rate: PLAYER_DEFAULT_RATE;
+}
+
+/* Called from libspotify's internal thread after audio has been queued */
+static void player_trim_update(int peak, int num_frames, int skip, int sample_rate) {
+	uint32_t sunk, expected, run;
+
+	if(__atomic_load_n(&trim_state, __ATOMIC_RELAXED) == PLAYER_TRIM_HEAD) {
+		sunk = __atomic_load_n(&frames_sunk, __ATOMIC_RELAXED) - num_frames + skip;
+		if(sunk > 0)
+			syslog(LOG_INFO, "Player: trimmed %ums of leading silence",
+				(unsigned)((uint64_t)sunk * 1000 / sample_rate));
+
+		__atomic_store_n(&trim_state, PLAYER_TRIM_BODY, __ATOMIC_RELAXED);
+		return;
+	}
+
+	sunk = __atomic_load_n(&frames_sunk, __ATOMIC_RELAXED);
+	expected = __atomic_load_n(&frames_expected, __ATOMIC_RELAXED);
+	if(expected == 0 ||
+		sunk + (uint64_t)sample_rate * PLAYER_TRIM_TAIL_WINDOW_MS / 1000 < expected)
+		return;
+
+	if(peak > PLAYER_SILENCE_THRESHOLD) {
+		__atomic_store_n(&trim_silent_run, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	run = __atomic_add_fetch(&trim_silent_run, num_frames, __ATOMIC_RELAXED);
+	if(run < (uint64_t)sample_rate * PLAYER_TRIM_TAIL_MIN_MS / 1000)
+		return;
+
+	syslog(LOG_INFO, "Player: trailing silence detected, skipping the last %ums of the track",
+		expected > sunk? (unsigned)((uint64_t)(expected - sunk) * 1000 / sample_rate): 0);
+
+	/* Hand over to the next track now instead of waiting for end_of_track */
+	__atomic_store_n(&trim_state, PLAYER_TRIM_DONE, __ATOMIC_RELAXED);
+	app_post_event(APP_DO_NEXT_TRACK);
+}
+
+void player_set_trim(int enable) {
+
+	/* Don't treat a quiet passage as leading silence when enabled mid-track */
+	if(enable && __atomic_load_n(&frames_sunk, __ATOMIC_RELAXED) > 0)
+		__atomic_store_n(&trim_state, PLAYER_TRIM_BODY, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&trim_enabled, enable, __ATOMIC_RELAXED);
+	syslog(LOG_INFO, "Player: silence trimming %s", enable? "enabled": "disabled");
+}
+
+int player_get_trim(void) {
+
+	return __atomic_load_n(&trim_enabled, __ATOMIC_RELAXED);
 }
@@ -7,6 +7,21 @@
 
 #include <libspotify/api.h>
 
+/* Silence trimming at track boundaries, toggled with player_set_trim() */
+#define PLAYER_TRIM_SILENCE 0
+
+/* Samples with an absolute value at or below this count as silence (~-54dBFS) */
+#define PLAYER_SILENCE_THRESHOLD 64
+
+/* Only look for trailing silence within this distance from the end of a track */
+#define PLAYER_TRIM_TAIL_WINDOW_MS 20000
+
+/* Trailing silence longer than this ends the track */
+#define PLAYER_TRIM_TAIL_MIN_MS 1000
+
+/* Sample rate assumed until libspotify has delivered any audio */
+#define PLAYER_DEFAULT_RATE 44100
+
 int player_callback_frame_delivery(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames);
 void player_callback_end_of_track(sp_session *session);
 void player_callback_playtoken_lost(sp_session *session);
@@ -14,5 +29,10 @@ void player_callback_start_playback(sp_session *session);
 void player_callback_stop_playback(sp_session *session);
 void player_callback_get_audio_buffer_stats(sp_session *session, sp_audio_buffer_stats *stats);
 void player_stats_reset(void);
+int player_get_position(int *elapsed_ms, int *remaining_ms);
+int player_get_rate(void);
+void player_trim_reset(void);
+void player_set_trim(int enable);
+int player_get_trim(void);
 
 #endif
@@ -8,6 +8,7 @@
 #include <string.h>
 
 #include "app.h"
+#include "mdindex.h"
 #include "playlist.h"
 
 static void pl_callback_tracks_added(sp_playlist *pl, sp_track *const *tracks, int num_tracks, int position, void *userdata);
@@ -70,6 +71,8 @@ static void pc_callback_playlist_added(sp_playlistcontainer *pc, sp_playlist *pl
 	syslog(LOG_DEBUG, "Playlist container: playlist %p of type %d inserted at position %d/%d",
 			pl, sp_playlistcontainer_playlist_type(pc, position),
 			position + 1, sp_playlistcontainer_num_playlists(pc));
+
+	app_status_invalidate(APP_STATUS_PLAYLISTS);
 }
 
 static void pc_callback_playlist_removed(sp_playlistcontainer *pc, sp_playlist *pl, int position, void *userdata) {
@@ -77,18 +80,25 @@ static void pc_callback_playlist_removed(sp_playlistcontainer *pc, sp_playlist *
 	syslog(LOG_DEBUG, "Playlist container: playlist %p of type %d removed from position %d/%d",
 			pl, sp_playlistcontainer_playlist_type(pc, position),
 			position + 1, sp_playlistcontainer_num_playlists(pc));
+
+	/* The playlist may be freed and its address reused */
+	app_status_invalidate(APP_STATUS_PLAYLISTS|APP_STATUS_URIS);
 }
 
 static void pc_callback_playlist_moved(sp_playlistcontainer *pc, sp_playlist *pl, int position, int new_position, void *userdata) {
 
 	syslog(LOG_DEBUG, "PL CONTAINER CALLBACK[%s]: playlist %p (%s) moved",
 		__func__, pl, sp_playlist_name(pl));
+
+	app_status_invalidate(APP_STATUS_PLAYLISTS);
 }
 
 static void pc_callback_container_loaded(sp_playlistcontainer *pc, void *userdata) {
 
 	syslog(LOG_INFO, "Playlist container: loading completed, now have %d playlists",
 			sp_playlistcontainer_num_playlists(pc));
+
+	app_status_invalidate(APP_STATUS_PLAYLISTS);
 }
 
 
@@ -97,8 +107,9 @@ static void pl_callback_tracks_added(sp_playlist *pl, sp_track *const *tracks, i
 	syslog(LOG_DEBUG, "Playlist tracks added: %d tracks inserted at position %d in playlist: %s",
 		num_tracks, position, sp_playlist_name(pl));
 
-	/* resize */
-	app_randomize_playlist_order();
+	app_playlist_tracks_added(pl, position, num_tracks);
+	app_notify_playlist(pl);
+	mdindex_touch(pl);
 }
 
 static void pl_callback_tracks_removed(sp_playlist *pl, const int *tracks, int num_tracks, void *userdata) {
@@ -106,19 +117,26 @@ static void pl_callback_tracks_removed(sp_playlist *pl, const int *tracks, int n
 	syslog(LOG_DEBUG, "Playlist tracks removed: %d tracks removed in playlist: %s",
 		num_tracks, sp_playlist_name(pl));
 
-	/* resize */
-	app_randomize_playlist_order();
+	app_playlist_tracks_removed(pl, tracks, num_tracks);
+	app_notify_playlist(pl);
+	mdindex_touch(pl);
 }
 
 static void pl_callback_tracks_moved(sp_playlist *pl, const int *tracks, int num_tracks, int new_position, void *userdata) {
 
 	syslog(LOG_DEBUG, "Playlist tracks moved: %d tracks inserted at position %d in playlist: %s",
 		num_tracks, new_position, sp_playlist_name(pl));
+
+	app_playlist_tracks_moved(pl, tracks, num_tracks, new_position);
+	mdindex_touch(pl);
 }
 
 static void pl_callback_playlist_renamed(sp_playlist *pl, void *userdata) {
 
 	syslog(LOG_DEBUG, "Playlist rename: pl:%p, new name: %s", pl, sp_playlist_name(pl));
+
+	app_status_invalidate(APP_STATUS_PLAYLISTS);
+	mdindex_touch(pl);
 }
 
 static void pl_callback_playlist_state_changed(sp_playlist *pl, void *userdata) {
@@ -126,6 +144,9 @@ static void pl_callback_playlist_state_changed(sp_playlist *pl, void *userdata)
 	syslog(LOG_DEBUG, "Playlist change: pl:%p, loaded:%d, collaborative:%d, tracks:%d, name:%s",
 			pl, sp_playlist_is_loaded(pl), sp_playlist_is_collaborative(pl),
 			sp_playlist_num_tracks(pl), sp_playlist_name(pl));
+
+	app_status_invalidate(APP_STATUS_PLAYLISTS);
+	mdindex_touch(pl);
 }
 
 static void pl_callback_playlist_update_in_progress(sp_playlist *pl, bool done, void *userdata) {
@@ -142,6 +163,7 @@ static void pl_callback_playlist_metadata_updated(sp_playlist *pl, void *userdat
 			sp_playlist_num_tracks(pl), sp_playlist_name(pl));
 
 	app_post_event(APP_DO_METADATA);
+	mdindex_touch(pl);
 }
 
 static void pl_callback_track_message_changed(sp_playlist *pl, int position, const char *message, void *userdata) {
@@ -0,0 +1,393 @@
+/**
+ * playqueue.c
+ * Explicit play queue, played before the active playlist
+ *
+ * Tracks, albums and playlists are queued by URI.  Albums are expanded
+ * once their browse completes and playlists once they're loaded, a batch
+ * of tracks per main loop wakeup, so neither stalls the main loop.  The
+ * queue itself is a doubly linked list of track references, making
+ * enqueueing at either end and popping the next track O(1).
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "playqueue.h"
+#include "app.h"
+#include "queue.h"
+#include "reactor.h"
+
+typedef struct playqueue_entry {
+	sp_track *track;
+	TAILQ_ENTRY(playqueue_entry) link;
+} playqueue_entry_t;
+
+/* Album or playlist still being expanded into the queue */
+typedef struct playqueue_request {
+	/* Queued up front, after the last track added by this request */
+	int next;
+	playqueue_entry_t *after;
+
+	sp_albumbrowse *browse;
+	sp_playlist *pl;
+	int pos;
+	int expanding;
+
+	/* Playlist put in RAM by the queue (-L), to be unloaded when done */
+	int loaded;
+
+	/* Queue cleared while the album browse was in flight */
+	int cancelled;
+
+	TAILQ_ENTRY(playqueue_request) link;
+} playqueue_request_t;
+
+static void playqueue_playlist_state_changed(sp_playlist *pl, void *userdata);
+
+static sp_playlist_callbacks playqueue_playlist_callbacks = {
+	.playlist_state_changed = &playqueue_playlist_state_changed,
+};
+
+static struct {
+	sp_session *session;
+	TAILQ_HEAD(, playqueue_entry) q;
+	TAILQ_HEAD(, playqueue_request) requests;
+	int length;
+
+	/* Runs playlist expansion a batch at a time */
+	int timer;
+} g_queue;
+
+
+/* Add a track to the queue, taking a reference on it */
+static int playqueue_push(sp_track *track, playqueue_request_t *req, int next) {
+	playqueue_entry_t *e;
+
+	if((e = malloc(sizeof(*e))) == NULL)
+		return -1;
+
+	sp_track_add_ref(track);
+	e->track = track;
+
+	if(!next)
+		TAILQ_INSERT_TAIL(&g_queue.q, e, link);
+	else if(req != NULL && req->after != NULL)
+		TAILQ_INSERT_AFTER(&g_queue.q, req->after, e, link);
+	else
+		TAILQ_INSERT_HEAD(&g_queue.q, e, link);
+
+	/* Keep the tracks of an album or playlist played next in order */
+	if(req != NULL)
+		req->after = e;
+
+	g_queue.length++;
+
+	return 0;
+}
+
+/* Unload a playlist the queue loaded, unless it's still in use */
+static void playqueue_unload(sp_playlist *pl) {
+	playqueue_request_t *req;
+
+	/* Another request for the same playlist unloads it when done */
+	TAILQ_FOREACH(req, &g_queue.requests, link) {
+		if(req->pl == pl) {
+			req->loaded = 1;
+			return;
+		}
+	}
+
+	if(pl == app_get_active_playlist())
+		return;
+
+	syslog(LOG_DEBUG, "Queue: Unloading playlist '%s'", sp_playlist_name(pl));
+	sp_playlist_set_in_ram(g_queue.session, pl, 0);
+}
+
+static void playqueue_request_free(playqueue_request_t *req) {
+
+	TAILQ_REMOVE(&g_queue.requests, req, link);
+	if(req->browse != NULL)
+		sp_albumbrowse_release(req->browse);
+	if(req->pl != NULL) {
+		if(!req->expanding)
+			sp_playlist_remove_callbacks(req->pl, &playqueue_playlist_callbacks, req);
+		if(req->loaded)
+			playqueue_unload(req->pl);
+		sp_playlist_release(req->pl);
+	}
+
+	free(req);
+}
+
+static playqueue_request_t *playqueue_request_create(int next) {
+	playqueue_request_t *req;
+
+	if((req = calloc(1, sizeof(*req))) == NULL)
+		return NULL;
+
+	req->next = next;
+	TAILQ_INSERT_TAIL(&g_queue.requests, req, link);
+
+	return req;
+}
+
+static void playqueue_album_loaded(sp_albumbrowse *browse, void *userdata) {
+	playqueue_request_t *req = userdata;
+	sp_error error;
+	int i, n;
+
+	error = sp_albumbrowse_error(browse);
+	if(req->cancelled) {
+		syslog(LOG_DEBUG, "Queue: Dropping album browsed after the queue was cleared");
+	}
+	else if(error != SP_ERROR_OK) {
+		syslog(LOG_WARNING, "Queue: Failed to browse album: %s",
+			sp_error_message(error));
+	}
+	else {
+		n = sp_albumbrowse_num_tracks(browse);
+		for(i = 0; i < n; i++)
+			if(playqueue_push(sp_albumbrowse_track(browse, i), req, req->next) < 0)
+				break;
+
+		syslog(LOG_INFO, "Queue: Added %d tracks from album, %d queued", i, g_queue.length);
+	}
+
+	playqueue_request_free(req);
+}
+
+/* Move the next batch of tracks of loaded playlists into the queue */
+static void playqueue_expand(void *arg) {
+	playqueue_request_t *req, *next;
+	int n, more = 0;
+
+	for(req = TAILQ_FIRST(&g_queue.requests); req != NULL; req = next) {
+		next = TAILQ_NEXT(req, link);
+		if(!req->expanding)
+			continue;
+
+		n = sp_playlist_num_tracks(req->pl);
+		while(req->pos < n) {
+			if(playqueue_push(sp_playlist_track(req->pl, req->pos), req, req->next) < 0)
+				break;
+
+			if(++req->pos % PLAYQUEUE_EXPAND_BATCH == 0)
+				break;
+		}
+
+		if(req->pos < n && req->pos % PLAYQUEUE_EXPAND_BATCH == 0) {
+			more = 1;
+			continue;
+		}
+
+		syslog(LOG_INFO, "Queue: Added %d tracks from playlist '%s', %d queued",
+			req->pos, sp_playlist_name(req->pl), g_queue.length);
+		playqueue_request_free(req);
+	}
+
+	if(more)
+		reactor_timer_set(g_queue.timer, 0);
+}
+
+static void playqueue_start_expand(playqueue_request_t *req) {
+
+	req->expanding = 1;
+	reactor_timer_set(g_queue.timer, 0);
+}
+
+static void playqueue_playlist_state_changed(sp_playlist *pl, void *userdata) {
+	playqueue_request_t *req = userdata;
+
+	if(req->expanding || !sp_playlist_is_loaded(pl))
+		return;
+
+	sp_playlist_remove_callbacks(pl, &playqueue_playlist_callbacks, req);
+	playqueue_start_expand(req);
+}
+
+/* Queue a track, album or playlist URI; returns NULL or an error message */
+const char *playqueue_add_uri(const char *uri, int next) {
+	playqueue_request_t *req;
+	const char *error = NULL;
+	sp_track *track;
+	sp_link *link;
+
+	if(g_queue.session == NULL)
+		return "not logged in";
+
+	link = sp_link_create_from_string(uri);
+	if(!link) {
+		syslog(LOG_WARNING, "Queue: Not a Spotify URI '%s'", uri);
+		return "not a Spotify URI";
+	}
+
+	switch(sp_link_type(link)) {
+	case SP_LINKTYPE_TRACK:
+	case SP_LINKTYPE_LOCALTRACK:
+		track = sp_link_as_track(link);
+		if(track == NULL || playqueue_push(track, NULL, next) < 0)
+			error = "failed to queue track";
+		else
+			syslog(LOG_INFO, "Queue: Added track '%s', %d queued", uri, g_queue.length);
+		break;
+
+	case SP_LINKTYPE_ALBUM:
+		if((req = playqueue_request_create(next)) == NULL) {
+			error = "out of memory";
+			break;
+		}
+
+		req->browse = sp_albumbrowse_create(g_queue.session, sp_link_as_album(link),
+			&playqueue_album_loaded, req);
+		if(req->browse == NULL) {
+			playqueue_request_free(req);
+			error = "failed to browse album";
+		}
+		break;
+
+	case SP_LINKTYPE_PLAYLIST:
+	case SP_LINKTYPE_STARRED:
+		if((req = playqueue_request_create(next)) == NULL) {
+			error = "out of memory";
+			break;
+		}
+
+		if((req->pl = sp_playlist_create(g_queue.session, link)) == NULL) {
+			playqueue_request_free(req);
+			error = "failed to load playlist";
+			break;
+		}
+
+		/* Playlists may be left unloaded until needed (-L) */
+		if(!sp_playlist_is_in_ram(g_queue.session, req->pl)) {
+			sp_playlist_set_in_ram(g_queue.session, req->pl, 1);
+			req->loaded = 1;
+		}
+
+		if(sp_playlist_is_loaded(req->pl))
+			playqueue_start_expand(req);
+		else
+			sp_playlist_add_callbacks(req->pl, &playqueue_playlist_callbacks, req);
+		break;
+
+	default:
+		syslog(LOG_NOTICE, "Queue: Unhandled Spotify URI with type: %d", sp_link_type(link));
+		error = "only track, album and playlist URIs can be queued";
+		break;
+	}
+
+	sp_link_release(link);
+
+	return error;
+}
+
+/* Whether a playlist is still being loaded or expanded into the queue */
+int playqueue_holds(sp_playlist *pl) {
+	playqueue_request_t *req;
+
+	TAILQ_FOREACH(req, &g_queue.requests, link) {
+		if(req->pl == pl)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Next queued track with a reference for the caller, or NULL */
+sp_track *playqueue_pop(void) {
+	playqueue_entry_t *e;
+	playqueue_request_t *req;
+	sp_track *track;
+
+	if((e = TAILQ_FIRST(&g_queue.q)) == NULL)
+		return NULL;
+
+	/* Requests still adding after this one start over at the head */
+	TAILQ_FOREACH(req, &g_queue.requests, link)
+		if(req->after == e)
+			req->after = NULL;
+
+	TAILQ_REMOVE(&g_queue.q, e, link);
+	g_queue.length--;
+
+	track = e->track;
+	free(e);
+
+	return track;
+}
+
+/* Queued track at index without taking it off the queue, or NULL */
+sp_track *playqueue_peek(int index) {
+	playqueue_entry_t *e;
+
+	TAILQ_FOREACH(e, &g_queue.q, link)
+		if(index-- == 0)
+			return e->track;
+
+	return NULL;
+}
+
+int playqueue_length(void) {
+
+	return g_queue.length;
+}
+
+/* Albums and playlists not yet added in full */
+int playqueue_pending(void) {
+	playqueue_request_t *req;
+	int n = 0;
+
+	TAILQ_FOREACH(req, &g_queue.requests, link)
+		n++;
+
+	return n;
+}
+
+void playqueue_clear(void) {
+	playqueue_entry_t *e;
+	playqueue_request_t *req, *next;
+
+	while((e = TAILQ_FIRST(&g_queue.q)) != NULL) {
+		TAILQ_REMOVE(&g_queue.q, e, link);
+		sp_track_release(e->track);
+		free(e);
+	}
+
+	g_queue.length = 0;
+
+	/* A browse can't be aborted, so its result is dropped when it comes */
+	for(req = TAILQ_FIRST(&g_queue.requests); req != NULL; req = next) {
+		next = TAILQ_NEXT(req, link);
+		req->after = NULL;
+		if(req->browse != NULL)
+			req->cancelled = 1;
+		else
+			playqueue_request_free(req);
+	}
+}
+
+void playqueue_init(sp_session *session) {
+
+	g_queue.session = session;
+	TAILQ_INIT(&g_queue.q);
+	TAILQ_INIT(&g_queue.requests);
+	g_queue.length = 0;
+	g_queue.timer = reactor_timer_create(playqueue_expand, NULL);
+}
+
+void playqueue_release(void) {
+	playqueue_request_t *req;
+
+	if(g_queue.session == NULL)
+		return;
+
+	playqueue_clear();
+	while((req = TAILQ_FIRST(&g_queue.requests)) != NULL)
+		playqueue_request_free(req);
+
+	reactor_timer_delete(g_queue.timer);
+	g_queue.session = NULL;
+}
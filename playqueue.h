@@ -0,0 +1,28 @@
+/**
+ * playqueue.h
+ *
+ */
+
+#ifndef PLAYQUEUE_H
+#define PLAYQUEUE_H
+
+#include <libspotify/api.h>
+
+/* Tracks of a loaded playlist added to the queue per main loop wakeup */
+#define PLAYQUEUE_EXPAND_BATCH 256
+
+void playqueue_init(sp_session *session);
+void playqueue_release(void);
+
+/* Queue a track, album or playlist URI, at the front if next is set */
+const char *playqueue_add_uri(const char *uri, int next);
+
+/* Next queued track with a reference for the caller, or NULL */
+sp_track *playqueue_pop(void);
+sp_track *playqueue_peek(int index);
+int playqueue_length(void);
+int playqueue_pending(void);
+int playqueue_holds(sp_playlist *pl);
+void playqueue_clear(void);
+
+#endif
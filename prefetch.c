@@ -0,0 +1,117 @@
+/**
+ * prefetch.c
+ * Window of upcoming tracks kept ready for playback
+ *
+ * Holding a reference on a track keeps libspotify loading and caching its
+ * metadata, so the next few tracks in play order are held on to.  Audio
+ * is prefetched for the first of them, as many as the connection allows.
+ *
+ */
+
+#include <string.h>
+#include <syslog.h>
+
+#include "prefetch.h"
+
+typedef struct {
+	sp_track *track;
+	int audio;
+} prefetch_entry_t;
+
+static struct {
+	sp_session *session;
+	prefetch_entry_t window[PREFETCH_MAX_WINDOW];
+	int count;
+
+	unsigned long results[PREFETCH_RESULTS];
+	unsigned long requests;
+} g_prefetch;
+
+
+static prefetch_entry_t *prefetch_find(sp_track *track) {
+	int i;
+
+	for(i = 0; i < g_prefetch.count; i++)
+		if(g_prefetch.window[i].track == track)
+			return &g_prefetch.window[i];
+
+	return NULL;
+}
+
+void prefetch_update(sp_track *const *tracks, int count, int audio) {
+	prefetch_entry_t window[PREFETCH_MAX_WINDOW], *e;
+	int i;
+
+	if(g_prefetch.session == NULL)
+		return;
+
+	if(count > PREFETCH_MAX_WINDOW)
+		count = PREFETCH_MAX_WINDOW;
+
+	/* Take the new references first so tracks in both stay loaded */
+	for(i = 0; i < count; i++) {
+		sp_track_add_ref(tracks[i]);
+		window[i].track = tracks[i];
+		e = prefetch_find(tracks[i]);
+		window[i].audio = e != NULL && e->audio;
+	}
+
+	for(i = 0; i < g_prefetch.count; i++)
+		sp_track_release(g_prefetch.window[i].track);
+
+	memcpy(g_prefetch.window, window, count * sizeof(prefetch_entry_t));
+	g_prefetch.count = count;
+
+	for(i = 0; i < count && i < audio; i++) {
+		e = &g_prefetch.window[i];
+		if(e->audio || !sp_track_is_loaded(e->track)
+			|| sp_track_error(e->track) != SP_ERROR_OK)
+			continue;
+
+		if(sp_session_player_prefetch(g_prefetch.session, e->track) != SP_ERROR_OK) {
+			syslog(LOG_NOTICE, "Prefetch: Failed to prefetch track '%s'", sp_track_name(e->track));
+			continue;
+		}
+
+		syslog(LOG_INFO, "Prefetch: Prefetching track '%s'", sp_track_name(e->track));
+		e->audio = 1;
+		g_prefetch.requests++;
+	}
+}
+
+prefetch_result_t prefetch_lookup(sp_track *track) {
+	prefetch_entry_t *e;
+	prefetch_result_t result;
+
+	if((e = prefetch_find(track)) == NULL)
+		result = PREFETCH_MISS;
+	else
+		result = e->audio? PREFETCH_AUDIO: PREFETCH_METADATA;
+
+	g_prefetch.results[result]++;
+
+	return result;
+}
+
+int prefetch_window(void) {
+
+	return g_prefetch.count;
+}
+
+void prefetch_get_stats(unsigned long counts[PREFETCH_RESULTS], unsigned long *requests) {
+
+	memcpy(counts, g_prefetch.results, sizeof(g_prefetch.results));
+	*requests = g_prefetch.requests;
+}
+
+void prefetch_init(sp_session *session) {
+
+	memset(&g_prefetch, 0, sizeof(g_prefetch));
+	g_prefetch.session = session;
+}
+
+void prefetch_release(void) {
+
+	prefetch_update(NULL, 0, 0);
+	g_prefetch.session = NULL;
+}
@@ -0,0 +1,34 @@
+/**
+ * prefetch.h
+ *
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <libspotify/api.h>
+
+/* Most upcoming tracks held on to at a time */
+#define PREFETCH_MAX_WINDOW 16
+
+/* How well a track picked for playback had been prepared */
+typedef enum {
+	PREFETCH_MISS = 0,	/* Not in the window */
+	PREFETCH_METADATA,	/* Held, but no audio prefetched */
+	PREFETCH_AUDIO,		/* Audio prefetch requested */
+	PREFETCH_RESULTS
+} prefetch_result_t;
+
+void prefetch_init(sp_session *session);
+void prefetch_release(void);
+
+/* Hold on to the upcoming tracks, prefetching audio of the first audio */
+void prefetch_update(sp_track *const *tracks, int count, int audio);
+
+/* Track picked for playback, counted as a hit or a miss */
+prefetch_result_t prefetch_lookup(sp_track *track);
+
+int prefetch_window(void);
+void prefetch_get_stats(unsigned long counts[PREFETCH_RESULTS], unsigned long *requests);
+
+#endif
@@ -0,0 +1,576 @@
+/**
+ * reactor.c
+ * Main loop event dispatching
+ *
+ * File descriptors are registered once together with a handler instead of
+ * being collected into a poll set on every wakeup.  On Linux this is backed
+ * by epoll, with a timerfd for timers and an eventfd for wakeups from other
+ * threads.  Elsewhere the poll() set is kept up to date incrementally, a
+ * pipe is used for wakeups and timers shorten the poll() timeout.
+ *
+ * Everything but reactor_wakeup() must be called from the main thread.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#define REACTOR_EPOLL
+#endif
+
+#include "reactor.h"
+
+typedef struct {
+	reactor_fd_cb_t cb;
+	void *arg;
+	int events;
+	unsigned int gen;	/* Detects stale events for a reused fd */
+	int slot;		/* Index in the poll() set */
+} reactor_handler_t;
+
+typedef struct {
+	reactor_timer_cb_t cb;
+	void *arg;
+	int in_use;
+	int armed;
+	int64_t due_ms;
+} reactor_timer_t;
+
+typedef struct {
+	int fd;
+	int events;
+	unsigned int gen;
+} reactor_ready_t;
+
+static struct {
+	/* Handlers indexed by file descriptor */
+	reactor_handler_t *handlers;
+	int num_handlers;
+
+	reactor_timer_t timers[REACTOR_MAX_TIMERS];
+	int hold_timer;
+
+	/* Same eventfd at both ends on Linux, a pipe elsewhere */
+	int wake_fds[2];
+	int wake_pending;
+
+	/* Wakeups requested from any thread vs. ones that reached the loop */
+	unsigned long wake_requests;
+	unsigned long wake_signals;
+	unsigned long wake_deliveries;
+
+#ifdef REACTOR_EPOLL
+	int epoll_fd;
+	int timer_fd;
+	int64_t timer_fd_due;
+#else
+	struct pollfd *pfds;
+	int num_pfds;
+	int max_pfds;
+#endif
+} g_reactor;
+
+static void reactor_drain(int fd, int events, void *arg);
+static void reactor_drain_wakeup(int fd, int events, void *arg);
+static void reactor_release_hold(void *arg);
+
+
+static int64_t reactor_now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int reactor_init(void) {
+#ifndef REACTOR_EPOLL
+	int i;
+#endif
+
+	memset(&g_reactor, 0, sizeof(g_reactor));
+	g_reactor.wake_fds[0] = g_reactor.wake_fds[1] = -1;
+
+#ifdef REACTOR_EPOLL
+	g_reactor.timer_fd_due = -1;
+	g_reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	g_reactor.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	g_reactor.wake_fds[0] = g_reactor.wake_fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(g_reactor.epoll_fd < 0 || g_reactor.timer_fd < 0 || g_reactor.wake_fds[0] < 0) {
+		syslog(LOG_ERR, "Reactor: Failed to create epoll, timer or event fd: %s", strerror(errno));
+		return -1;
+	}
+
+	if(reactor_add(g_reactor.timer_fd, REACTOR_IN, reactor_drain, NULL) < 0)
+		return -1;
+#else
+	if(pipe(g_reactor.wake_fds) < 0) {
+		syslog(LOG_ERR, "Reactor: pipe() failed with error: %s", strerror(errno));
+		return -1;
+	}
+
+	for(i = 0; i < 2; i++)
+		fcntl(g_reactor.wake_fds[i], F_SETFL,
+			fcntl(g_reactor.wake_fds[i], F_GETFL) | O_NONBLOCK);
+#endif
+
+	if(reactor_add(g_reactor.wake_fds[0], REACTOR_IN, reactor_drain_wakeup, NULL) < 0)
+		return -1;
+
+	g_reactor.hold_timer = reactor_timer_create(reactor_release_hold, NULL);
+
+	syslog(LOG_DEBUG, "Reactor: Using %s",
+#ifdef REACTOR_EPOLL
+		"epoll"
+#else
+		"poll"
+#endif
+		);
+
+	return 0;
+}
+
+void reactor_release(void) {
+
+#ifdef REACTOR_EPOLL
+	if(g_reactor.epoll_fd >= 0)
+		close(g_reactor.epoll_fd);
+	if(g_reactor.timer_fd >= 0)
+		close(g_reactor.timer_fd);
+	if(g_reactor.wake_fds[0] >= 0)
+		close(g_reactor.wake_fds[0]);
+#else
+	if(g_reactor.wake_fds[0] >= 0) {
+		close(g_reactor.wake_fds[0]);
+		close(g_reactor.wake_fds[1]);
+	}
+
+	free(g_reactor.pfds);
+#endif
+
+	free(g_reactor.handlers);
+	memset(&g_reactor, 0, sizeof(g_reactor));
+}
+
+/* Eventfd and timerfd reads need 8 bytes, a pipe may hold more */
+static void reactor_drain(int fd, int events, void *arg) {
+	char buf[64];
+
+	while(read(fd, buf, sizeof(buf)) > 0);
+}
+
+/* One read empties an eventfd no matter how many times it was signalled */
+static void reactor_drain_wakeup(int fd, int events, void *arg) {
+
+	reactor_drain(fd, events, arg);
+	g_reactor.wake_deliveries++;
+
+	/* Cleared after draining; wakeups requested in between are served
+	   by the main loop iteration that is already in progress */
+	__atomic_store_n(&g_reactor.wake_pending, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef REACTOR_EPOLL
+static uint32_t reactor_to_epoll(int events) {
+	uint32_t e = 0;
+
+	if(events & REACTOR_IN)
+		e |= EPOLLIN;
+	if(events & REACTOR_PRI)
+		e |= EPOLLPRI;
+	if(events & REACTOR_OUT)
+		e |= EPOLLOUT;
+
+	return e;
+}
+
+static int reactor_from_epoll(uint32_t e) {
+	int events = 0;
+
+	if(e & EPOLLIN)
+		events |= REACTOR_IN;
+	if(e & EPOLLPRI)
+		events |= REACTOR_PRI;
+	if(e & EPOLLOUT)
+		events |= REACTOR_OUT;
+	if(e & (EPOLLERR|EPOLLHUP))
+		events |= REACTOR_ERR;
+
+	return events;
+}
+#else
+static short reactor_to_poll(int events) {
+	short e = 0;
+
+	if(events & REACTOR_IN)
+		e |= POLLIN;
+	if(events & REACTOR_PRI)
+		e |= POLLPRI;
+	if(events & REACTOR_OUT)
+		e |= POLLOUT;
+
+	return e;
+}
+
+static int reactor_from_poll(short e) {
+	int events = 0;
+
+	if(e & POLLIN)
+		events |= REACTOR_IN;
+	if(e & POLLPRI)
+		events |= REACTOR_PRI;
+	if(e & POLLOUT)
+		events |= REACTOR_OUT;
+	if(e & (POLLERR|POLLHUP|POLLNVAL))
+		events |= REACTOR_ERR;
+
+	return events;
+}
+#endif
+
+static int reactor_grow(int fd) {
+	reactor_handler_t *handlers;
+	int n = g_reactor.num_handlers;
+
+	if(fd < n)
+		return 0;
+
+	while(n <= fd)
+		n = n? n * 2: 64;
+
+	handlers = realloc(g_reactor.handlers, n * sizeof(reactor_handler_t));
+	if(handlers == NULL)
+		return -1;
+
+	memset(handlers + g_reactor.num_handlers, 0,
+		(n - g_reactor.num_handlers) * sizeof(reactor_handler_t));
+	g_reactor.handlers = handlers;
+	g_reactor.num_handlers = n;
+
+	return 0;
+}
+
+int reactor_add(int fd, int events, reactor_fd_cb_t cb, void *arg) {
+	reactor_handler_t *h;
+#ifdef REACTOR_EPOLL
+	struct epoll_event ev;
+#else
+	struct pollfd *pfds;
+#endif
+
+	if(fd < 0 || cb == NULL || reactor_grow(fd) < 0)
+		return -1;
+
+	h = &g_reactor.handlers[fd];
+	if(h->cb != NULL) {
+		syslog(LOG_WARNING, "Reactor: fd %d is already registered", fd);
+		return -1;
+	}
+
+#ifdef REACTOR_EPOLL
+	memset(&ev, 0, sizeof(ev));
+	ev.events = reactor_to_epoll(events);
+	ev.data.u64 = (uint64_t)(h->gen + 1) << 32 | (uint32_t)fd;
+	if(epoll_ctl(g_reactor.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		syslog(LOG_ERR, "Reactor: Failed to add fd %d: %s", fd, strerror(errno));
+		return -1;
+	}
+#else
+	if(g_reactor.num_pfds == g_reactor.max_pfds) {
+		int n = g_reactor.max_pfds? g_reactor.max_pfds * 2: 16;
+
+		pfds = realloc(g_reactor.pfds, n * sizeof(struct pollfd));
+		if(pfds == NULL)
+			return -1;
+
+		g_reactor.pfds = pfds;
+		g_reactor.max_pfds = n;
+	}
+
+	h->slot = g_reactor.num_pfds++;
+	g_reactor.pfds[h->slot].fd = fd;
+	g_reactor.pfds[h->slot].events = reactor_to_poll(events);
+	g_reactor.pfds[h->slot].revents = 0;
+#endif
+
+	h->cb = cb;
+	h->arg = arg;
+	h->events = events;
+	h->gen++;
+
+	return 0;
+}
+
+int reactor_modify(int fd, int events) {
+	reactor_handler_t *h;
+#ifdef REACTOR_EPOLL
+	struct epoll_event ev;
+#endif
+
+	if(fd < 0 || fd >= g_reactor.num_handlers || g_reactor.handlers[fd].cb == NULL)
+		return -1;
+
+	h = &g_reactor.handlers[fd];
+	if(h->events == events)
+		return 0;
+
+#ifdef REACTOR_EPOLL
+	memset(&ev, 0, sizeof(ev));
+	ev.events = reactor_to_epoll(events);
+	ev.data.u64 = (uint64_t)h->gen << 32 | (uint32_t)fd;
+	if(epoll_ctl(g_reactor.epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		syslog(LOG_ERR, "Reactor: Failed to modify fd %d: %s", fd, strerror(errno));
+		return -1;
+	}
+#else
+	g_reactor.pfds[h->slot].events = reactor_to_poll(events);
+#endif
+
+	h->events = events;
+
+	return 0;
+}
+
+/* Must be called before the descriptor is closed */
+void reactor_remove(int fd) {
+	reactor_handler_t *h;
+#ifdef REACTOR_EPOLL
+	struct epoll_event ev;
+#else
+	int last;
+#endif
+
+	if(fd < 0 || fd >= g_reactor.num_handlers || g_reactor.handlers[fd].cb == NULL)
+		return;
+
+	h = &g_reactor.handlers[fd];
+	h->cb = NULL;
+	h->arg = NULL;
+	h->gen++;
+
+#ifdef REACTOR_EPOLL
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(g_reactor.epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+#else
+	/* Move the last entry into the hole */
+	last = --g_reactor.num_pfds;
+	if(h->slot != last) {
+		g_reactor.pfds[h->slot] = g_reactor.pfds[last];
+		g_reactor.handlers[g_reactor.pfds[h->slot].fd].slot = h->slot;
+	}
+#endif
+}
+
+int reactor_timer_create(reactor_timer_cb_t cb, void *arg) {
+	int i;
+
+	for(i = 0; i < REACTOR_MAX_TIMERS; i++) {
+		if(g_reactor.timers[i].in_use)
+			continue;
+
+		g_reactor.timers[i].in_use = 1;
+		g_reactor.timers[i].armed = 0;
+		g_reactor.timers[i].cb = cb;
+		g_reactor.timers[i].arg = arg;
+
+		return i;
+	}
+
+	syslog(LOG_ERR, "Reactor: Out of timers");
+
+	return -1;
+}
+
+/* Fire the timer in ms milliseconds, or disarm it if ms is negative */
+void reactor_timer_set(int id, int ms) {
+	reactor_timer_t *t;
+
+	if(id < 0 || id >= REACTOR_MAX_TIMERS || !g_reactor.timers[id].in_use)
+		return;
+
+	t = &g_reactor.timers[id];
+	t->armed = ms >= 0;
+	t->due_ms = reactor_now_ms() + (ms > 0? ms: 0);
+}
+
+void reactor_timer_delete(int id) {
+
+	if(id < 0 || id >= REACTOR_MAX_TIMERS)
+		return;
+
+	g_reactor.timers[id].in_use = 0;
+	g_reactor.timers[id].armed = 0;
+}
+
+static int64_t reactor_next_due(void) {
+	int64_t due = -1;
+	int i;
+
+	for(i = 0; i < REACTOR_MAX_TIMERS; i++) {
+		if(!g_reactor.timers[i].armed)
+			continue;
+
+		if(due < 0 || g_reactor.timers[i].due_ms < due)
+			due = g_reactor.timers[i].due_ms;
+	}
+
+	return due;
+}
+
+static int reactor_run_timers(void) {
+	reactor_timer_t *t;
+	int64_t now;
+	int i, n = 0;
+
+	now = reactor_now_ms();
+	for(i = 0; i < REACTOR_MAX_TIMERS; i++) {
+		t = &g_reactor.timers[i];
+		if(!t->armed || t->due_ms > now)
+			continue;
+
+		/* Disarm first so the callback may re-arm */
+		t->armed = 0;
+		t->cb(t->arg);
+		n++;
+	}
+
+	return n;
+}
+
+/* May be called from any thread */
+void reactor_wakeup(void) {
+	uint64_t one = 1;
+
+	__atomic_add_fetch(&g_reactor.wake_requests, 1, __ATOMIC_RELAXED);
+
+	/* Skip the system call while a wakeup is already on its way */
+	if(__atomic_exchange_n(&g_reactor.wake_pending, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	__atomic_add_fetch(&g_reactor.wake_signals, 1, __ATOMIC_RELAXED);
+
+	/* A full pipe or eventfd also means a wakeup is already pending */
+	if(write(g_reactor.wake_fds[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+		syslog(LOG_WARNING, "Reactor: Failed to signal wakeup: %s", strerror(errno));
+}
+
+void reactor_get_wakeup_stats(unsigned long *requests, unsigned long *signals,
+		unsigned long *deliveries) {
+
+	*requests = __atomic_load_n(&g_reactor.wake_requests, __ATOMIC_RELAXED);
+	*signals = __atomic_load_n(&g_reactor.wake_signals, __ATOMIC_RELAXED);
+	*deliveries = g_reactor.wake_deliveries;
+}
+
+static void reactor_release_hold(void *arg) {
+
+	reactor_modify(g_reactor.wake_fds[0], REACTOR_IN);
+}
+
+/* Leave wakeups pending for a while so that they are handled in batches */
+void reactor_hold_wakeups(int ms) {
+
+	if(ms <= 0)
+		return;
+
+	reactor_modify(g_reactor.wake_fds[0], 0);
+	reactor_timer_set(g_reactor.hold_timer, ms);
+}
+
+/**
+ * Wait for at most timeout ms (forever if negative) or until the next timer
+ * is due, then dispatch ready descriptors and expired timers.
+ * Returns number of handlers called or -1 on error.
+ */
+int reactor_run(int timeout) {
+	reactor_ready_t ready[REACTOR_MAX_EVENTS];
+	reactor_handler_t *h;
+	int64_t due;
+	int i, n, nready = 0;
+#ifdef REACTOR_EPOLL
+	struct epoll_event evs[REACTOR_MAX_EVENTS];
+	struct itimerspec its;
+#else
+	int64_t ms;
+#endif
+
+	due = reactor_next_due();
+
+#ifdef REACTOR_EPOLL
+	if(due != g_reactor.timer_fd_due) {
+		/* An all zero value disarms the timerfd */
+		memset(&its, 0, sizeof(its));
+		if(due >= 0) {
+			its.it_value.tv_sec = due / 1000;
+			its.it_value.tv_nsec = (due % 1000) * 1000000 + 1;
+		}
+
+		if(timerfd_settime(g_reactor.timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+			syslog(LOG_WARNING, "Reactor: Failed to arm timer: %s", strerror(errno));
+		else
+			g_reactor.timer_fd_due = due;
+	}
+
+	n = epoll_wait(g_reactor.epoll_fd, evs, REACTOR_MAX_EVENTS, timeout);
+	if(n < 0 && errno != EINTR) {
+		syslog(LOG_ERR, "Reactor: epoll_wait() returned error: %s", strerror(errno));
+		return -1;
+	}
+
+	for(i = 0; i < n; i++) {
+		ready[nready].fd = (int)(evs[i].data.u64 & 0xffffffff);
+		ready[nready].gen = (unsigned int)(evs[i].data.u64 >> 32);
+		ready[nready].events = reactor_from_epoll(evs[i].events);
+		nready++;
+	}
+#else
+	if(due >= 0) {
+		ms = due - reactor_now_ms();
+		if(ms < 0)
+			ms = 0;
+		if(timeout < 0 || ms < timeout)
+			timeout = (int)ms;
+	}
+
+	n = poll(g_reactor.pfds, g_reactor.num_pfds, timeout);
+	if(n < 0 && errno != EINTR && errno != EAGAIN) {
+		syslog(LOG_ERR, "Reactor: poll() returned error: %s", strerror(errno));
+		return -1;
+	}
+
+	/* Level triggered, whatever does not fit is picked up next time */
+	for(i = 0; n > 0 && i < g_reactor.num_pfds && nready < REACTOR_MAX_EVENTS; i++) {
+		if(g_reactor.pfds[i].revents == 0)
+			continue;
+
+		ready[nready].fd = g_reactor.pfds[i].fd;
+		ready[nready].gen = g_reactor.handlers[ready[nready].fd].gen;
+		ready[nready].events = reactor_from_poll(g_reactor.pfds[i].revents);
+		nready++;
+	}
+#endif
+
+	/* Handlers may add and remove descriptors, so look them up every time */
+	for(i = 0, n = 0; i < nready; i++) {
+		h = &g_reactor.handlers[ready[i].fd];
+		if(h->cb == NULL || h->gen != ready[i].gen)
+			continue;
+
+		h->cb(ready[i].fd, ready[i].events, h->arg);
+		n++;
+	}
+
+	return n + reactor_run_timers();
+}
@@ -0,0 +1,43 @@
+/**
+ * reactor.h
+ *
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/* Events a file descriptor handler can be registered for */
+#define REACTOR_IN	0x01
+#define REACTOR_PRI	0x02
+#define REACTOR_OUT	0x04
+#define REACTOR_ERR	0x08	/* Always reported */
+
+/* Max number of timers and ready descriptors dispatched per wakeup */
+#define REACTOR_MAX_TIMERS 16
+#define REACTOR_MAX_EVENTS 64
+
+typedef void (*reactor_fd_cb_t)(int fd, int events, void *arg);
+typedef void (*reactor_timer_cb_t)(void *arg);
+
+int reactor_init(void);
+void reactor_release(void);
+
+/* File descriptors are registered once and dispatched to their handler */
+int reactor_add(int fd, int events, reactor_fd_cb_t cb, void *arg);
+int reactor_modify(int fd, int events);
+void reactor_remove(int fd);
+
+/* One-shot timers, re-armed with reactor_timer_set() as needed */
+int reactor_timer_create(reactor_timer_cb_t cb, void *arg);
+void reactor_timer_set(int id, int ms);
+void reactor_timer_delete(int id);
+
+/* Make reactor_run() return; may be called from any thread */
+void reactor_wakeup(void);
+void reactor_hold_wakeups(int ms);
+void reactor_get_wakeup_stats(unsigned long *requests, unsigned long *signals,
+	unsigned long *deliveries);
+
+int reactor_run(int timeout);
+
+#endif
@@ -0,0 +1,443 @@
+/**
+ * search.c
+ * Word search over the tracks of the playlists seen
+ *
+ * An inverted index from the words of track titles, artists and albums to
+ * the tracks having them.  Tracks are numbered in the order they're first
+ * indexed, so each word's list of tracks only ever grows at the end and is
+ * kept as varint encoded gaps between track numbers, with the fields the
+ * word was found in folded into the low bits.
+ *
+ * Queries match every word of the query as a word prefix, and rank the
+ * tracks having all of them by where the words were found and whether
+ * they matched in full.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "avail.h"
+#include "buf.h"
+#include "mdindex.h"
+#include "search.h"
+
+/* Fields a word was found in, kept in the low bits of postings */
+#define SEARCH_TITLE		1
+#define SEARCH_ARTIST		2
+#define SEARCH_ALBUM		4
+#define SEARCH_FIELD_BITS	3
+
+/* Distinct words indexed per track */
+#define SEARCH_MAX_TRACK_WORDS	64
+
+typedef struct {
+	uint32_t word;		/* Offset in the word table */
+	uint32_t last_doc;
+	uint8_t *postings;
+	uint32_t len;
+	uint32_t size;
+} search_term_t;
+
+typedef struct {
+	uint32_t uri;		/* Offset in the URI table */
+	uint32_t hash;		/* Of the title, artist and album */
+	uint8_t avail;
+	uint8_t stale;
+} search_doc_t;
+
+typedef struct {
+	char word[SEARCH_MAX_TERM + 1];
+	int fields;
+} search_word_t;
+
+static struct {
+	search_doc_t *docs;
+	int num_docs;
+	int docs_size;
+	int num_stale;
+
+	/* Tracks by URI and terms by word, as index + 1 */
+	uint32_t *doc_hash;
+	int doc_hash_size;
+	uint32_t *term_hash;
+	int term_hash_size;
+
+	search_term_t *terms;
+	int num_terms;
+	int terms_size;
+
+	buf_t uris;
+	buf_t words;
+	size_t postings_bytes;
+} g_search;
+
+
+static int search_is_word(int c) {
+
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+		|| (c >= '0' && c <= '9') || c >= 0x80 || c == '\'';
+}
+
+/**
+ * Next lower case word of ASCII letters and digits, other UTF-8 left as is.
+ * Apostrophes are dropped, so "don't" is found by "dont" as well.
+ */
+static int search_next_word(const char **s, char *word) {
+	const unsigned char *p = (const unsigned char *)*s;
+	int len = 0;
+
+	while(*p && (!search_is_word(*p) || *p == '\''))
+		p++;
+
+	for(; *p && search_is_word(*p); p++) {
+		if(*p == '\'' || len == SEARCH_MAX_TERM)
+			continue;
+
+		word[len++] = *p >= 'A' && *p <= 'Z'? *p + 'a' - 'A': *p;
+	}
+
+	word[len] = 0;
+	*s = (const char *)p;
+
+	return len;
+}
+
+static int search_split(const char *s, int field, search_word_t *words, int num_words, int max) {
+	char word[SEARCH_MAX_TERM + 1];
+	int i;
+
+	while(s != NULL && search_next_word(&s, word) > 0) {
+		for(i = 0; i < num_words && strcmp(words[i].word, word); i++);
+		if(i < num_words) {
+			words[i].fields |= field;
+			continue;
+		}
+
+		if(num_words == max)
+			break;
+
+		strcpy(words[num_words].word, word);
+		words[num_words++].fields = field;
+	}
+
+	return num_words;
+}
+
+static const char *search_doc_key(uint32_t v) {
+
+	return g_search.uris.data + g_search.docs[v - 1].uri;
+}
+
+static const char *search_term_key(uint32_t v) {
+
+	return g_search.words.data + g_search.terms[v - 1].word;
+}
+
+/* Slot of the key in an open addressing table of index + 1 */
+static int search_slot(const uint32_t *table, int size, const char *key,
+		const char *(*key_of)(uint32_t v)) {
+	uint32_t v;
+	int i;
+
+	for(i = mdindex_hash(key) & (size - 1); (v = table[i]) != 0; i = (i + 1) & (size - 1))
+		if(!strcmp(key_of(v), key))
+			break;
+
+	return i;
+}
+
+static int search_doc_slot(const char *uri) {
+
+	return search_slot(g_search.doc_hash, g_search.doc_hash_size, uri, search_doc_key);
+}
+
+static int search_term_slot(const char *word) {
+
+	return search_slot(g_search.term_hash, g_search.term_hash_size, word, search_term_key);
+}
+
+/* Grow a table to keep it at most half full */
+static int search_rehash(uint32_t **table, int *size, int used, int (*slot)(const char *),
+		const char *(*key)(uint32_t v)) {
+	uint32_t *old = *table, v;
+	int old_size = *size, i;
+
+	if((used + 1) * 2 <= *size)
+		return 0;
+
+	*size = old_size? old_size * 2: 1024;
+	if((*table = calloc(*size, sizeof(uint32_t))) == NULL) {
+		*table = old;
+		*size = old_size;
+		return -1;
+	}
+
+	for(i = 0; i < old_size; i++)
+		if((v = old[i]) != 0)
+			(*table)[slot(key(v))] = v;
+
+	free(old);
+
+	return 0;
+}
+
+static int search_intern(buf_t *b, const char *s, uint32_t *off) {
+
+	*off = b->len;
+
+	return buf_append(b, s, strlen(s) + 1);
+}
+
+static search_term_t *search_term(const char *word) {
+	search_term_t *t, *terms;
+	int i, size;
+
+	if(search_rehash(&g_search.term_hash, &g_search.term_hash_size, g_search.num_terms,
+			search_term_slot, search_term_key) < 0)
+		return NULL;
+
+	i = search_term_slot(word);
+	if(g_search.term_hash[i] != 0)
+		return &g_search.terms[g_search.term_hash[i] - 1];
+
+	if(g_search.num_terms == g_search.terms_size) {
+		size = g_search.terms_size? g_search.terms_size * 2: 1024;
+		if((terms = realloc(g_search.terms, size * sizeof(search_term_t))) == NULL)
+			return NULL;
+
+		g_search.terms = terms;
+		g_search.terms_size = size;
+	}
+
+	t = &g_search.terms[g_search.num_terms];
+	memset(t, 0, sizeof(*t));
+	if(search_intern(&g_search.words, word, &t->word) < 0)
+		return NULL;
+
+	g_search.term_hash[i] = ++g_search.num_terms;
+
+	return t;
+}
+
+/* Add a track to the end of a word's postings */
+static int search_post(search_term_t *t, uint32_t doc, int fields) {
+	uint32_t v = (doc - t->last_doc) << SEARCH_FIELD_BITS | fields, size;
+	uint8_t *p;
+
+	if(t->len + 5 > t->size) {
+		size = t->size? t->size * 2: 8;
+		if((p = realloc(t->postings, size)) == NULL)
+			return -1;
+
+		g_search.postings_bytes += size - t->size;
+		t->postings = p;
+		t->size = size;
+	}
+
+	for(; v >= 0x80; v >>= 7)
+		t->postings[t->len++] = v | 0x80;
+	t->postings[t->len++] = v;
+	t->last_doc = doc;
+
+	return 0;
+}
+
+static uint32_t search_doc_hash(const char *title, const char *artist, const char *album) {
+
+	return (mdindex_hash(title) * 16777619u ^ mdindex_hash(artist)) * 16777619u
+		^ mdindex_hash(album);
+}
+
+void search_add(const char *uri, const char *title, const char *artist,
+		const char *album, int avail) {
+	search_word_t words[SEARCH_MAX_TRACK_WORDS];
+	search_doc_t *d, *docs;
+	search_term_t *t;
+	uint32_t hash, uri_off = 0;
+	int i, slot, n, size;
+
+	if(search_rehash(&g_search.doc_hash, &g_search.doc_hash_size, g_search.num_docs,
+			search_doc_slot, search_doc_key) < 0)
+		return;
+
+	/* A track seen before only gets indexed again if its words changed */
+	hash = search_doc_hash(title, artist, album);
+	slot = search_doc_slot(uri);
+	if(g_search.doc_hash[slot] != 0) {
+		d = &g_search.docs[g_search.doc_hash[slot] - 1];
+		d->avail = avail;
+		if(d->hash == hash)
+			return;
+
+		/* Its old postings are passed over until the index is built anew */
+		d->hash = hash;
+		if(!d->stale) {
+			d->stale = 1;
+			g_search.num_stale++;
+		}
+		uri_off = d->uri;
+	}
+
+	n = search_split(title, SEARCH_TITLE, words, 0, SEARCH_MAX_TRACK_WORDS);
+	n = search_split(artist, SEARCH_ARTIST, words, n, SEARCH_MAX_TRACK_WORDS);
+	n = search_split(album, SEARCH_ALBUM, words, n, SEARCH_MAX_TRACK_WORDS);
+	if(n == 0)
+		return;
+
+	if(g_search.doc_hash[slot] == 0 && search_intern(&g_search.uris, uri, &uri_off) < 0)
+		return;
+
+	if(g_search.num_docs == g_search.docs_size) {
+		size = g_search.docs_size? g_search.docs_size * 2: 1024;
+		if((docs = realloc(g_search.docs, size * sizeof(search_doc_t))) == NULL)
+			return;
+
+		g_search.docs = docs;
+		g_search.docs_size = size;
+	}
+
+	d = &g_search.docs[g_search.num_docs];
+	d->uri = uri_off;
+	d->hash = hash;
+	d->avail = avail;
+	d->stale = 0;
+	g_search.doc_hash[slot] = ++g_search.num_docs;
+
+	for(i = 0; i < n; i++)
+		if((t = search_term(words[i].word)) == NULL
+			|| search_post(t, g_search.num_docs - 1, words[i].fields) < 0)
+			break;
+}
+
+/* Where a word was found, full words counting double */
+static int search_weight(int fields, int full) {
+	int w = 0;
+
+	if(fields & SEARCH_TITLE)
+		w += 4;
+	if(fields & SEARCH_ARTIST)
+		w += 3;
+	if(fields & SEARCH_ALBUM)
+		w += 2;
+
+	return full? w * 2: w;
+}
+
+/* Best weight of the word per track, over the words it's a prefix of */
+static int search_match(const char *word, uint8_t *best) {
+	const search_term_t *t;
+	const char *w;
+	uint32_t doc, v;
+	int i, j, shift, weight, len = strlen(word), found = 0;
+
+	for(i = 0; i < g_search.num_terms; i++) {
+		t = &g_search.terms[i];
+		w = g_search.words.data + t->word;
+		if(strncmp(w, word, len))
+			continue;
+
+		found = 1;
+		for(j = 0, doc = 0; j < (int)t->len; ) {
+			for(v = 0, shift = 0; t->postings[j] & 0x80; shift += 7)
+				v |= (uint32_t)(t->postings[j++] & 0x7f) << shift;
+			v |= (uint32_t)t->postings[j++] << shift;
+
+			doc += v >> SEARCH_FIELD_BITS;
+			weight = search_weight(v & ((1 << SEARCH_FIELD_BITS) - 1), w[len] == 0);
+			if(weight > best[doc])
+				best[doc] = weight;
+		}
+	}
+
+	return found;
+}
+
+int search_query(const char *query, search_result_t *results, int max) {
+	search_word_t words[SEARCH_MAX_WORDS];
+	const search_doc_t *d;
+	uint16_t *score = NULL;
+	uint8_t *best = NULL, *hits = NULL;
+	int i, j, n, num = 0;
+
+	n = search_split(query, SEARCH_TITLE, words, 0, SEARCH_MAX_WORDS);
+	if(n == 0 || g_search.num_docs == 0)
+		return 0;
+
+	score = calloc(g_search.num_docs, sizeof(uint16_t));
+	best = calloc(g_search.num_docs, 1);
+	hits = calloc(g_search.num_docs, 1);
+	if(score == NULL || best == NULL || hits == NULL)
+		goto out;
+
+	for(i = 0; i < n; i++) {
+		if(!search_match(words[i].word, best))
+			goto out;
+
+		for(j = 0; j < g_search.num_docs; j++) {
+			if(best[j] == 0)
+				continue;
+
+			score[j] += best[j];
+			hits[j]++;
+			best[j] = 0;
+		}
+	}
+
+	/* Keep the best few, those indexed first ahead on a tie */
+	for(j = 0; j < g_search.num_docs; j++) {
+		d = &g_search.docs[j];
+		if(hits[j] != n || d->stale || d->avail == AVAIL_UNPLAYABLE)
+			continue;
+
+		for(i = num; i > 0 && results[i - 1].score < score[j]; i--)
+			if(i < max)
+				results[i] = results[i - 1];
+
+		if(i == max)
+			continue;
+
+		results[i].uri = g_search.uris.data + d->uri;
+		results[i].score = score[j];
+		if(num < max)
+			num++;
+	}
+
+out:
+	free(score);
+	free(best);
+	free(hits);
+
+	return num;
+}
+
+int search_stale(void) {
+
+	return g_search.num_stale >= SEARCH_MIN_STALE && g_search.num_stale * 2 > g_search.num_docs;
+}
+
+void search_reset(void) {
+	int i;
+
+	for(i = 0; i < g_search.num_terms; i++)
+		free(g_search.terms[i].postings);
+
+	free(g_search.terms);
+	free(g_search.term_hash);
+	free(g_search.docs);
+	free(g_search.doc_hash);
+	buf_release(&g_search.uris);
+	buf_release(&g_search.words);
+	memset(&g_search, 0, sizeof(g_search));
+}
+
+void search_get_stats(int *tracks, int *terms, size_t *bytes) {
+
+	*tracks = g_search.num_docs - g_search.num_stale;
+	*terms = g_search.num_terms;
+	*bytes = g_search.postings_bytes + g_search.uris.size + g_search.words.size
+		+ g_search.docs_size * sizeof(search_doc_t)
+		+ g_search.terms_size * sizeof(search_term_t)
+		+ (g_search.doc_hash_size + g_search.term_hash_size) * sizeof(uint32_t);
+}
@@ -0,0 +1,42 @@
+/**
+ * search.h
+ *
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Words of a query and results returned at most */
+#define SEARCH_MAX_WORDS	8
+#define SEARCH_MAX_RESULTS	20
+
+/* Longest word indexed, longer ones are cut short */
+#define SEARCH_MAX_TERM		32
+
+/* Tracks indexed again keep their old postings until the index is built
+ * anew, worth doing once this many are out of date and more than half */
+#define SEARCH_MIN_STALE	1024
+
+typedef struct {
+	const char *uri;
+	int score;
+} search_result_t;
+
+/* Index a track, or index it again if its title, artist or album changed */
+void search_add(const char *uri, const char *title, const char *artist,
+	const char *album, int avail);
+
+/* Drop everything indexed, and whether it's time to build it anew */
+void search_reset(void);
+int search_stale(void);
+
+/* Playable tracks with every word of the query, best match first; the
+ * results are valid until the next search_add() */
+int search_query(const char *query, search_result_t *results, int max);
+
+void search_get_stats(int *tracks, int *terms, size_t *bytes);
+
+#endif
@@ -0,0 +1,590 @@
+/**
+ * shuffle.c
+ * Play order of the active playlist, maintained across playlist edits
+ *
+ * Every track is a node in two implicit treaps (randomized balanced
+ * trees keyed by position): one in play order and one in playlist order.
+ * A track's position in either order is its rank in that tree, so tracks
+ * can be added, removed and moved in O(log N) while the rest of the play
+ * order, including the part already played, stays as it is.
+ *
+ * Randomness comes from xoshiro128** seeded with a 64-bit seed, so a play
+ * order can be recreated from its seed.  In spread mode tracks by the same
+ * artist, and from the same album, are spread out evenly over the play
+ * order rather than placed independently at random.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shuffle.h"
+
+/* The two trees every node is in */
+#define SHUFFLE_ORDER		0
+#define SHUFFLE_PLAYLIST	1
+
+#define NIL -1
+
+typedef struct {
+	int left[2];
+	int right[2];
+	int parent[2];
+	int size[2];	/* Of the subtree rooted here */
+	uint32_t prio;	/* Heap order, shared by both trees */
+} shuffle_node_t;
+
+struct shuffle {
+	shuffle_node_t *nodes;
+	int num_nodes;
+	int max_nodes;
+	int free_list;	/* Chained through left[0] */
+	int root[2];
+	uint32_t prio_state;
+
+	uint64_t seed;
+	uint32_t rng[4];
+};
+
+/* Track sorted into artist and album groups by shuffle_spread() */
+typedef struct {
+	uintptr_t artist;
+	uintptr_t album;
+	uint32_t tiebreak;
+	int node;
+	double pos;
+} shuffle_item_t;
+
+
+static uint32_t shuffle_rotl(uint32_t x, int k) {
+
+	return (x << k) | (x >> (32 - k));
+}
+
+/* xoshiro128** (Blackman and Vigna) */
+static uint32_t shuffle_next(shuffle_t *s) {
+	uint32_t *st = s->rng;
+	uint32_t result = shuffle_rotl(st[1] * 5, 7) * 9, t = st[1] << 9;
+
+	st[2] ^= st[0];
+	st[3] ^= st[1];
+	st[1] ^= st[2];
+	st[0] ^= st[3];
+	st[2] ^= t;
+	st[3] = shuffle_rotl(st[3], 11);
+
+	return result;
+}
+
+/* Unbiased integer in [0, n), Lemire's multiply and reject method */
+static uint32_t shuffle_random(shuffle_t *s, uint32_t n) {
+	uint64_t m = (uint64_t)shuffle_next(s) * n;
+	uint32_t threshold;
+
+	if((uint32_t)m < n) {
+		threshold = -n % n;
+		while((uint32_t)m < threshold)
+			m = (uint64_t)shuffle_next(s) * n;
+	}
+
+	return (uint32_t)(m >> 32);
+}
+
+/* Uniform in [0, 1) */
+static double shuffle_unit(shuffle_t *s) {
+
+	return shuffle_next(s) * (1.0 / 4294967296.0);
+}
+
+/* Expand the seed with splitmix64, which never yields an all zero state */
+static void shuffle_seed_rng(shuffle_t *s, uint64_t seed) {
+	uint64_t z;
+	int i;
+
+	s->seed = seed;
+	for(i = 0; i < 4; i += 2) {
+		z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+
+		s->rng[i] = (uint32_t)z;
+		s->rng[i + 1] = (uint32_t)(z >> 32);
+	}
+
+	s->prio_state = shuffle_next(s) | 1;
+}
+
+static uint64_t shuffle_new_seed(void) {
+	uint64_t seed = 0;
+	struct timespec ts;
+	int fd;
+
+	if((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+		if(read(fd, &seed, sizeof(seed)) != sizeof(seed))
+			seed = 0;
+		close(fd);
+	}
+
+	if(seed == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+	}
+
+	return seed? seed: 1;
+}
+
+/* xorshift32, only used to balance the trees */
+static uint32_t shuffle_prio(shuffle_t *s) {
+	uint32_t x = s->prio_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return s->prio_state = x;
+}
+
+static int shuffle_size_of(const shuffle_t *s, int t, int n) {
+
+	return n == NIL? 0: s->nodes[n].size[t];
+}
+
+static void shuffle_update(shuffle_t *s, int t, int n) {
+	shuffle_node_t *node = &s->nodes[n];
+
+	node->size[t] = 1 + shuffle_size_of(s, t, node->left[t])
+		+ shuffle_size_of(s, t, node->right[t]);
+	if(node->left[t] != NIL)
+		s->nodes[node->left[t]].parent[t] = n;
+	if(node->right[t] != NIL)
+		s->nodes[node->right[t]].parent[t] = n;
+}
+
+static int shuffle_merge(shuffle_t *s, int t, int a, int b) {
+
+	if(a == NIL)
+		return b;
+	if(b == NIL)
+		return a;
+
+	if(s->nodes[a].prio > s->nodes[b].prio) {
+		s->nodes[a].right[t] = shuffle_merge(s, t, s->nodes[a].right[t], b);
+		shuffle_update(s, t, a);
+		return a;
+	}
+
+	s->nodes[b].left[t] = shuffle_merge(s, t, a, s->nodes[b].left[t]);
+	shuffle_update(s, t, b);
+	return b;
+}
+
+/* The first k nodes of n go to a, the rest to b */
+static void shuffle_split(shuffle_t *s, int t, int n, int k, int *a, int *b) {
+	int left;
+
+	if(n == NIL) {
+		*a = *b = NIL;
+		return;
+	}
+
+	left = shuffle_size_of(s, t, s->nodes[n].left[t]);
+	if(k <= left) {
+		shuffle_split(s, t, s->nodes[n].left[t], k, a, &s->nodes[n].left[t]);
+		shuffle_update(s, t, n);
+		*b = n;
+	}
+	else {
+		shuffle_split(s, t, s->nodes[n].right[t], k - left - 1, &s->nodes[n].right[t], b);
+		shuffle_update(s, t, n);
+		*a = n;
+	}
+}
+
+static void shuffle_set_root(shuffle_t *s, int t, int n) {
+
+	s->root[t] = n;
+	if(n != NIL)
+		s->nodes[n].parent[t] = NIL;
+}
+
+static void shuffle_insert_at(shuffle_t *s, int t, int n, int k) {
+	int a, b;
+
+	shuffle_split(s, t, s->root[t], k, &a, &b);
+	shuffle_set_root(s, t, shuffle_merge(s, t, shuffle_merge(s, t, a, n), b));
+}
+
+static int shuffle_remove_at(shuffle_t *s, int t, int k) {
+	int a, b, n, c;
+
+	shuffle_split(s, t, s->root[t], k, &a, &b);
+	shuffle_split(s, t, b, 1, &n, &c);
+	shuffle_set_root(s, t, shuffle_merge(s, t, a, c));
+
+	return n;
+}
+
+/* Node at position k */
+static int shuffle_kth(const shuffle_t *s, int t, int k) {
+	int n = s->root[t], left;
+
+	while(n != NIL) {
+		left = shuffle_size_of(s, t, s->nodes[n].left[t]);
+		if(k == left)
+			break;
+
+		if(k < left)
+			n = s->nodes[n].left[t];
+		else {
+			k -= left + 1;
+			n = s->nodes[n].right[t];
+		}
+	}
+
+	return n;
+}
+
+/* Position of node n */
+static int shuffle_rank(const shuffle_t *s, int t, int n) {
+	int r = shuffle_size_of(s, t, s->nodes[n].left[t]), p;
+
+	for(p = s->nodes[n].parent[t]; p != NIL; n = p, p = s->nodes[n].parent[t])
+		if(s->nodes[p].right[t] == n)
+			r += shuffle_size_of(s, t, s->nodes[p].left[t]) + 1;
+
+	return r;
+}
+
+static int shuffle_alloc(shuffle_t *s) {
+	shuffle_node_t *nodes, *node;
+	int n, t, max;
+
+	if(s->free_list != NIL) {
+		n = s->free_list;
+		s->free_list = s->nodes[n].left[0];
+	}
+	else {
+		if(s->num_nodes == s->max_nodes) {
+			max = s->max_nodes? 2 * s->max_nodes: 64;
+			nodes = realloc(s->nodes, max * sizeof(shuffle_node_t));
+			if(nodes == NULL)
+				return NIL;
+
+			s->nodes = nodes;
+			s->max_nodes = max;
+		}
+
+		n = s->num_nodes++;
+	}
+
+	node = &s->nodes[n];
+	for(t = 0; t < 2; t++) {
+		node->left[t] = node->right[t] = node->parent[t] = NIL;
+		node->size[t] = 1;
+	}
+	node->prio = shuffle_prio(s);
+
+	return n;
+}
+
+static void shuffle_free(shuffle_t *s, int n) {
+
+	s->nodes[n].left[0] = s->free_list;
+	s->free_list = n;
+}
+
+/* Build a tree from nodes in order in O(N), using stack for its right spine */
+static void shuffle_build(shuffle_t *s, int t, const int *seq, int count, int *stack) {
+	int i, n, last, top = 0;
+
+	for(i = 0; i < count; i++) {
+		n = seq[i];
+		last = NIL;
+		while(top > 0 && s->nodes[stack[top - 1]].prio < s->nodes[n].prio) {
+			last = stack[--top];
+			shuffle_update(s, t, last);
+		}
+
+		s->nodes[n].left[t] = last;
+		if(top > 0)
+			s->nodes[stack[top - 1]].right[t] = n;
+		stack[top++] = n;
+	}
+
+	shuffle_set_root(s, t, top? stack[0]: NIL);
+	while(top > 0)
+		shuffle_update(s, t, stack[--top]);
+}
+
+static int shuffle_compare_group(const void *a, const void *b) {
+	const shuffle_item_t *x = a, *y = b;
+
+	if(x->artist != y->artist)
+		return x->artist < y->artist? -1: 1;
+	if(x->album != y->album)
+		return x->album < y->album? -1: 1;
+
+	return x->tiebreak < y->tiebreak? -1: x->tiebreak > y->tiebreak;
+}
+
+static int shuffle_compare_pos(const void *a, const void *b) {
+	const shuffle_item_t *x = a, *y = b;
+
+	return x->pos < y->pos? -1: x->pos > y->pos;
+}
+
+/* Evenly spaced positions in [0, 1) from a random start, with some jitter */
+static void shuffle_space(shuffle_t *s, shuffle_item_t *items, int count) {
+	double step = 1.0 / count, start = shuffle_unit(s) * step;
+	int i;
+
+	for(i = 0; i < count; i++)
+		items[i].pos = start + i * step
+			+ (shuffle_unit(s) - 0.5) * step * SHUFFLE_SPREAD_JITTER;
+}
+
+static int shuffle_conflict(const shuffle_item_t *a, const shuffle_item_t *b) {
+
+	return (a->artist && a->artist == b->artist) || (a->album && a->album == b->album);
+}
+
+/**
+ * Order nodes so that tracks by the same artist are spread out over the
+ * whole play order, and within an artist the albums are spread out too.
+ * Tracks with unknown metadata (key 0) are placed at random.  O(N log N).
+ */
+static int shuffle_spread(shuffle_t *s, int *seq, const shuffle_key_t *keys, int count) {
+	shuffle_item_t *items, t;
+	int i, j, k, a;
+
+	if((items = malloc(count * sizeof(shuffle_item_t))) == NULL)
+		return -1;
+
+	for(i = 0; i < count; i++) {
+		items[i].artist = keys[i].artist;
+		items[i].album = keys[i].album;
+		items[i].tiebreak = shuffle_next(s);
+		items[i].node = seq[i];
+	}
+
+	qsort(items, count, sizeof(shuffle_item_t), shuffle_compare_group);
+
+	for(i = 0; i < count; i = j) {
+		for(j = i + 1; j < count && items[j].artist == items[i].artist; j++);
+
+		if(items[i].artist == 0) {
+			for(k = i; k < j; k++)
+				items[k].pos = shuffle_unit(s);
+			continue;
+		}
+
+		/* Albums over the artist's share of the play order, then the artist */
+		for(k = i; k < j; k = a) {
+			for(a = k + 1; a < j && items[a].album == items[k].album; a++);
+			shuffle_space(s, items + k, a - k);
+		}
+
+		qsort(items + i, j - i, sizeof(shuffle_item_t), shuffle_compare_pos);
+		shuffle_space(s, items + i, j - i);
+	}
+
+	qsort(items, count, sizeof(shuffle_item_t), shuffle_compare_pos);
+
+	/* Break up what's left of back to back tracks where a neighbour allows */
+	for(i = 1; i < count; i++) {
+		if(!shuffle_conflict(&items[i], &items[i - 1]))
+			continue;
+
+		for(k = i + 1; k < count && k <= i + SHUFFLE_SPREAD_WINDOW; k++) {
+			if(shuffle_conflict(&items[k], &items[i - 1]))
+				continue;
+
+			t = items[i];
+			items[i] = items[k];
+			items[k] = t;
+			break;
+		}
+	}
+
+	for(i = 0; i < count; i++)
+		seq[i] = items[i].node;
+
+	free(items);
+
+	return 0;
+}
+
+/**
+ * Play order for num_tracks tracks, reproducible from seed (0 to pick one
+ * at random).  keys, if not NULL, has the artist and album of each track
+ * and turns on spread mode.
+ */
+shuffle_t *shuffle_create(int num_tracks, uint64_t seed, const shuffle_key_t *keys) {
+	shuffle_t *s;
+	int *seq, *stack, i, r, t;
+
+	if((s = calloc(1, sizeof(shuffle_t))) == NULL)
+		return NULL;
+
+	s->free_list = NIL;
+	s->root[SHUFFLE_ORDER] = s->root[SHUFFLE_PLAYLIST] = NIL;
+	shuffle_seed_rng(s, seed? seed: shuffle_new_seed());
+
+	seq = malloc(2 * (num_tracks + 1) * sizeof(int));
+	if(seq == NULL) {
+		free(s);
+		return NULL;
+	}
+	stack = seq + num_tracks + 1;
+
+	/* Nodes are allocated in playlist order */
+	for(i = 0; i < num_tracks; i++) {
+		if((seq[i] = shuffle_alloc(s)) == NIL) {
+			free(seq);
+			shuffle_release(s);
+			return NULL;
+		}
+	}
+	shuffle_build(s, SHUFFLE_PLAYLIST, seq, num_tracks, stack);
+
+	if(keys == NULL || shuffle_spread(s, seq, keys, num_tracks) < 0) {
+		/* Fisher-Yates */
+		for(i = num_tracks - 1; i > 0; i--) {
+			r = shuffle_random(s, i + 1);
+
+			t = seq[i];
+			seq[i] = seq[r];
+			seq[r] = t;
+		}
+	}
+	shuffle_build(s, SHUFFLE_ORDER, seq, num_tracks, stack);
+
+	free(seq);
+
+	return s;
+}
+
+void shuffle_release(shuffle_t *s) {
+
+	if(s == NULL)
+		return;
+
+	free(s->nodes);
+	free(s);
+}
+
+uint64_t shuffle_seed(const shuffle_t *s) {
+
+	return s->seed;
+}
+
+int shuffle_size(const shuffle_t *s) {
+
+	return shuffle_size_of(s, SHUFFLE_ORDER, s->root[SHUFFLE_ORDER]);
+}
+
+int shuffle_track(const shuffle_t *s, int index) {
+	int n;
+
+	if(index < 0 || index >= shuffle_size(s))
+		return -1;
+
+	n = shuffle_kth(s, SHUFFLE_ORDER, index);
+
+	return shuffle_rank(s, SHUFFLE_PLAYLIST, n);
+}
+
+/**
+ * Tracks were inserted at position in the playlist.  They're placed at
+ * random in the play order, but never among the first played tracks.
+ * Returns -1 if out of memory.
+ */
+int shuffle_insert(shuffle_t *s, int position, int count, int played) {
+	int i, n, size, k;
+
+	for(i = 0; i < count; i++) {
+		if((n = shuffle_alloc(s)) == NIL)
+			return -1;
+
+		shuffle_insert_at(s, SHUFFLE_PLAYLIST, n, position + i);
+
+		size = shuffle_size_of(s, SHUFFLE_ORDER, s->root[SHUFFLE_ORDER]);
+		if(played > size)
+			played = size;
+		else if(played < 0)
+			played = 0;
+
+		k = played + shuffle_random(s, size - played + 1);
+		shuffle_insert_at(s, SHUFFLE_ORDER, n, k);
+	}
+
+	return 0;
+}
+
+/* Track at position was removed; returns where it was in the play order */
+int shuffle_remove(shuffle_t *s, int position) {
+	int n, index;
+
+	if((n = shuffle_kth(s, SHUFFLE_PLAYLIST, position)) == NIL)
+		return -1;
+
+	index = shuffle_rank(s, SHUFFLE_ORDER, n);
+	shuffle_remove_at(s, SHUFFLE_ORDER, index);
+	shuffle_remove_at(s, SHUFFLE_PLAYLIST, position);
+	shuffle_free(s, n);
+
+	return index;
+}
+
+/**
+ * Tracks were moved to new_position, which counts positions as they were
+ * before the move.  Only their playlist positions change.
+ */
+void shuffle_move(shuffle_t *s, const int *positions, int count, int new_position) {
+	int i, n, dest = new_position;
+	int *moved;
+
+	if(count <= 0 || (moved = malloc(count * sizeof(int))) == NULL)
+		return;
+
+	for(i = 0; i < count; i++) {
+		moved[i] = shuffle_kth(s, SHUFFLE_PLAYLIST, positions[i]);
+		if(positions[i] < new_position)
+			dest--;
+	}
+
+	for(i = 0; i < count; i++) {
+		if((n = moved[i]) != NIL)
+			shuffle_remove_at(s, SHUFFLE_PLAYLIST, shuffle_rank(s, SHUFFLE_PLAYLIST, n));
+	}
+
+	for(i = 0; i < count; i++) {
+		if((n = moved[i]) != NIL)
+			shuffle_insert_at(s, SHUFFLE_PLAYLIST, n, dest++);
+	}
+
+	free(moved);
+}
+
+void shuffle_swap(shuffle_t *s, int a, int b) {
+	int na, nb;
+
+	if(a == b)
+		return;
+
+	if(a > b) {
+		na = a;
+		a = b;
+		b = na;
+	}
+
+	nb = shuffle_remove_at(s, SHUFFLE_ORDER, b);
+	na = shuffle_remove_at(s, SHUFFLE_ORDER, a);
+	shuffle_insert_at(s, SHUFFLE_ORDER, nb, a);
+	shuffle_insert_at(s, SHUFFLE_ORDER, na, b);
+}
@@ -0,0 +1,43 @@
+/**
+ * shuffle.h
+ *
+ */
+
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include <stdint.h>
+
+/* Spread mode: random shift of a track off its even spacing, as a share
+ * of the spacing, and how far ahead to look for a track to swap in when
+ * two by the same artist or from the same album still end up together */
+#define SHUFFLE_SPREAD_JITTER 0.5
+#define SHUFFLE_SPREAD_WINDOW 16
+
+/* Random play order over the positions of a playlist */
+typedef struct shuffle shuffle_t;
+
+/* What spread mode keeps apart, any value unique per artist and album;
+ * 0 if not known */
+typedef struct {
+	uintptr_t artist;
+	uintptr_t album;
+} shuffle_key_t;
+
+shuffle_t *shuffle_create(int num_tracks, uint64_t seed, const shuffle_key_t *keys);
+void shuffle_release(shuffle_t *s);
+uint64_t shuffle_seed(const shuffle_t *s);
+int shuffle_size(const shuffle_t *s);
+
+/* Playlist position of the track at index in the play order */
+int shuffle_track(const shuffle_t *s, int index);
+
+/* Keep up with playlist edits; the order of the other tracks is kept */
+int shuffle_insert(shuffle_t *s, int position, int count, int played);
+int shuffle_remove(shuffle_t *s, int position);
+void shuffle_move(shuffle_t *s, const int *positions, int count, int new_position);
+
+/* Exchange two tracks in the play order */
+void shuffle_swap(shuffle_t *s, int a, int b);
+
+#endif
@@ -0,0 +1,17 @@
+/**
+ * siphash.h
+ *
+ */
+
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY_SIZE 16
+
+/* SipHash-2-4 with a 64-bit result */
+uint64_t siphash24(const uint8_t key[SIPHASH_KEY_SIZE], const void *data, size_t len);
+
+#endif
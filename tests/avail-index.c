@@ -0,0 +1,233 @@
+/**
+ * avail-index.c
+ * Availability index kept up with playlist edits
+ *
+ * Random sets, inserts, removals and moves are made to an availability
+ * index and to a plain array model of it; the state at every position
+ * and the count of each state must always match the model.  Positions
+ * out of range must be refused, and tracks must be classified from what
+ * is known of them.
+ *
+ * libspotify is stood in for by spotify.c.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../avail.h"
+#include "spotify.h"
+
+#define TEST_MAX_TRACKS		4096
+#define TEST_EDITS		20000
+
+/* Model: state by playlist position */
+static struct {
+	unsigned char state[TEST_MAX_TRACKS];
+	int num_tracks;
+	uint64_t rng;
+	int failed;
+} m;
+
+#define TEST(cond, ...) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "FAIL: " __VA_ARGS__); \
+		fprintf(stderr, " (line %d)\n", __LINE__); \
+		m.failed++; \
+	} \
+} while(0)
+
+static uint32_t test_random(void) {
+
+	/* xorshift64* */
+	m.rng ^= m.rng >> 12;
+	m.rng ^= m.rng << 25;
+	m.rng ^= m.rng >> 27;
+
+	return (uint32_t)((m.rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static int test_check(avail_t *a, const char *after) {
+	int count[AVAIL_MAX], i;
+
+	if(avail_size(a) != m.num_tracks) {
+		TEST(0, "after %s, %d tracks in the index, expected %d", after, avail_size(a), m.num_tracks);
+		return -1;
+	}
+
+	memset(count, 0, sizeof(count));
+	for(i = 0; i < m.num_tracks; i++) {
+		count[m.state[i]]++;
+		if(avail_get(a, i) != m.state[i]) {
+			TEST(0, "after %s, position %d is %d, expected %d", after, i, avail_get(a, i),
+				m.state[i]);
+			return -1;
+		}
+	}
+
+	for(i = 0; i < AVAIL_MAX; i++) {
+		if(avail_count(a, i) != count[i]) {
+			TEST(0, "after %s, %d tracks counted in state %d, expected %d", after,
+				avail_count(a, i), i, count[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void test_set(avail_t *a) {
+	int pos;
+	avail_state_t state;
+
+	if(m.num_tracks == 0)
+		return;
+
+	pos = test_random() % m.num_tracks;
+	state = test_random() % AVAIL_MAX;
+	m.state[pos] = state;
+	avail_set(a, pos, state);
+}
+
+static void test_insert(avail_t *a) {
+	int pos, count;
+
+	count = 1 + test_random() % 8;
+	if(m.num_tracks + count > TEST_MAX_TRACKS)
+		return;
+
+	pos = test_random() % (m.num_tracks + 1);
+	memmove(m.state + pos + count, m.state + pos, m.num_tracks - pos);
+	memset(m.state + pos, AVAIL_UNKNOWN, count);
+	m.num_tracks += count;
+
+	TEST(avail_insert(a, pos, count) == 0, "inserting %d at %d", count, pos);
+}
+
+static void test_remove(avail_t *a) {
+	int pos;
+
+	if(m.num_tracks == 0)
+		return;
+
+	pos = test_random() % m.num_tracks;
+	memmove(m.state + pos, m.state + pos + 1, m.num_tracks - pos - 1);
+	m.num_tracks--;
+	avail_remove(a, pos);
+}
+
+/* As libspotify reports it: positions before the move, and where to */
+static void test_move(avail_t *a) {
+	unsigned char moved[3], rest[TEST_MAX_TRACKS];
+	int positions[3], i, j, k, count, new_position, dest, n;
+
+	if(m.num_tracks < 4)
+		return;
+
+	count = 1 + test_random() % 3;
+	for(k = 0; k < count; ) {
+		positions[k] = test_random() % m.num_tracks;
+		for(j = 0; j < k && positions[j] != positions[k]; j++);
+		if(j == k)
+			moved[k] = m.state[positions[k]], k++;
+	}
+	new_position = test_random() % (m.num_tracks + 1);
+
+	/* Take the tracks out and put them back where new_position ends up */
+	for(dest = new_position, i = 0; i < count; i++) {
+		if(positions[i] < new_position)
+			dest--;
+	}
+
+	for(n = 0, i = 0; i < m.num_tracks; i++) {
+		for(j = 0; j < count && positions[j] != i; j++);
+		if(j == count)
+			rest[n++] = m.state[i];
+	}
+	memmove(rest + dest + count, rest + dest, n - dest);
+	memcpy(rest + dest, moved, count);
+	memcpy(m.state, rest, m.num_tracks);
+
+	avail_move(a, positions, count, new_position);
+}
+
+static void test_edits(void) {
+	static const char *names[] = { "set", "set", "insert", "remove", "move" };
+	void (*edits[])(avail_t *) = { test_set, test_set, test_insert, test_remove, test_move };
+	avail_t *a;
+	int i, op, ret = 0;
+
+	/* Starts below the initial capacity so the index has to grow */
+	m.rng = 0x9e3779b97f4a7c15ULL;
+	m.num_tracks = 10;
+	memset(m.state, AVAIL_UNKNOWN, sizeof(m.state));
+
+	a = avail_create(m.num_tracks);
+	ret = test_check(a, "creating");
+	for(i = 0; i < TEST_EDITS && ret == 0; i++) {
+		op = test_random() % 5;
+		edits[op](a);
+		ret = test_check(a, names[op]);
+	}
+
+	avail_release(a);
+}
+
+static void test_bounds(void) {
+	avail_t *a = avail_create(3);
+
+	avail_set(a, 1, AVAIL_PLAYABLE);
+	avail_set(a, -1, AVAIL_PLAYABLE);
+	avail_set(a, 3, AVAIL_UNPLAYABLE);
+	TEST(avail_get(a, -1) == AVAIL_UNKNOWN && avail_get(a, 3) == AVAIL_UNKNOWN,
+		"state out of range");
+	TEST(avail_count(a, AVAIL_PLAYABLE) == 1 && avail_count(a, AVAIL_UNPLAYABLE) == 0,
+		"set out of range counted");
+
+	TEST(avail_insert(a, -1, 1) < 0 && avail_insert(a, 4, 1) < 0 && avail_insert(a, 0, 0) < 0,
+		"insert out of range");
+	avail_remove(a, 3);
+	avail_remove(a, -1);
+	TEST(avail_size(a) == 3 && avail_count(a, AVAIL_UNKNOWN) == 2, "remove out of range");
+
+	/* At the end, like libspotify adding tracks to a playlist */
+	TEST(avail_insert(a, 3, 2) == 0 && avail_size(a) == 5 && avail_get(a, 1) == AVAIL_PLAYABLE,
+		"appending");
+	avail_release(a);
+	avail_release(NULL);
+}
+
+static void test_classify(void) {
+	sp_session *session = (sp_session *)&m;
+	sp_track *t;
+
+	t = stub_track("spotify:track:1", "Title", "Artist", "Album", 1000);
+	TEST(avail_classify(session, t) == AVAIL_PLAYABLE, "available track not playable");
+
+	t->available = 0;
+	TEST(avail_classify(session, t) == AVAIL_UNPLAYABLE, "unavailable track playable");
+
+	t->loaded = 0;
+	TEST(avail_classify(session, t) == AVAIL_UNKNOWN, "track not loaded yet classified");
+	TEST(avail_classify(session, NULL) == AVAIL_UNKNOWN, "no track classified");
+
+	stub_spotify_reset();
+}
+
+int main(int argc, char **argv) {
+
+	test_edits();
+	test_bounds();
+	test_classify();
+
+	if(m.failed) {
+		fprintf(stderr, "avail-index: %d failed\n", m.failed);
+		return 1;
+	}
+
+	printf("avail-index: OK\n");
+
+	return 0;
+}
@@ -0,0 +1,289 @@
+/**
+ * http-load.c
+ * Load test of the HTTP API with keep-alive and pipelined requests
+ *
+ * The server (net.c, http.c, reactor.c and stubs.c) runs on the main
+ * thread like in pi-boombox.  Client threads each keep one connection
+ * open and alternate GET /status and GET /metrics on it, first one
+ * request at a time, then HTTP_PIPELINE requests written at once.  Every
+ * response is checked: 200, the content type of its path, a body of the
+ * length announced, and the connection kept open throughout.  The last
+ * request asks for the connection to be closed, which it then must be.
+ *
+ *   http-load [<seconds per mode> [<connections>]]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../buf.h"
+#include "../net.h"
+#include "../reactor.h"
+#include "stubs.h"
+
+#define HTTP_PORT		12341
+#define HTTP_CONTROL_PORT	12342
+#define HTTP_PIPELINE		16
+
+typedef struct {
+	pthread_t thread;
+	int fd;
+	int depth;	/* Requests written at once */
+	buf_t in;
+
+	/* Requests and batches of them answered, and their latency in ms */
+	unsigned long requests;
+	double *lat;
+	size_t num_lat, size_lat;
+	unsigned long errors;
+} http_client_t;
+
+static struct {
+	double seconds;
+} g_load;
+
+static const char *http_paths[] = { "/status", "/metrics" };
+static const char *http_types[] = { "application/json", "text/plain" };
+
+static double load_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int load_connect(void) {
+	struct sockaddr_in sin;
+	int fd, opt = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(HTTP_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	return fd;
+}
+
+static int load_error(http_client_t *cl, const char *what) {
+
+	if(cl->errors++ < 5)
+		fprintf(stderr, "http-load: %s\n", what);
+
+	return -1;
+}
+
+/**
+ * Read one response to a request for path out of the connection; 0 if it
+ * was as expected, 1 once closed after a final response, -1 on errors
+ */
+static int load_response(http_client_t *cl, int path, int last) {
+	char data[65536], *head, *end, *p;
+	size_t head_len, body_len;
+	ssize_t n;
+
+	while((end = memmem(cl->in.data, cl->in.len, "\r\n\r\n", 4)) == NULL
+		|| (p = memmem(cl->in.data, end - cl->in.data, "Content-Length: ", 16)) == NULL
+		|| cl->in.len < (size_t)(end + 4 - cl->in.data) + strtoul(p + 16, NULL, 10)) {
+		if((n = recv(cl->fd, data, sizeof(data), 0)) <= 0)
+			return load_error(cl, n? strerror(errno): "connection closed early");
+
+		buf_append(&cl->in, data, n);
+	}
+
+	head = cl->in.data;
+	head_len = end + 4 - head;
+	body_len = strtoul(p + 16, NULL, 10);
+
+	if(strncmp(head, "HTTP/1.1 200 ", 13))
+		return load_error(cl, "status not 200");
+	if(memmem(head, head_len, http_types[path], strlen(http_types[path])) == NULL)
+		return load_error(cl, "wrong content type");
+	if(!last && memmem(head, head_len, "Connection: close", 17) != NULL)
+		return load_error(cl, "connection not kept alive");
+	if(path == 0 && (body_len == 0 || head[head_len + body_len - 1] != '\n'
+			|| head[head_len] != '{'))
+		return load_error(cl, "bad status document");
+
+	cl->in.len -= head_len + body_len;
+	memmove(cl->in.data, head + head_len + body_len, cl->in.len);
+
+	if(last) {
+		if((n = recv(cl->fd, data, sizeof(data), 0)) != 0 || cl->in.len)
+			return load_error(cl, "connection not closed after the last request");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void load_record(http_client_t *cl, double ms) {
+
+	if(cl->num_lat == cl->size_lat) {
+		cl->size_lat = cl->size_lat? cl->size_lat * 2: 65536;
+		cl->lat = realloc(cl->lat, cl->size_lat * sizeof(double));
+	}
+
+	cl->lat[cl->num_lat++] = ms;
+}
+
+static void *load_client(void *arg) {
+	http_client_t *cl = arg;
+	char req[HTTP_PIPELINE * 64];
+	double start, sent;
+	size_t len;
+	int i, last = 0, next = 0;
+
+	if((cl->fd = load_connect()) < 0) {
+		load_error(cl, "failed to connect");
+		return NULL;
+	}
+
+	start = load_now();
+	while(!last) {
+		last = load_now() - start >= g_load.seconds;
+
+		for(len = 0, i = 0; i < cl->depth; i++)
+			len += snprintf(req + len, sizeof(req) - len,
+				"GET %s HTTP/1.1\r\nHost: boombox\r\n%s\r\n",
+				http_paths[(next + i) % 2],
+				last && i == cl->depth - 1? "Connection: close\r\n": "");
+
+		sent = load_now();
+		if(send(cl->fd, req, len, MSG_NOSIGNAL) != (ssize_t)len) {
+			load_error(cl, "failed to send");
+			break;
+		}
+
+		for(i = 0; i < cl->depth; i++) {
+			if(load_response(cl, (next + i) % 2, last && i == cl->depth - 1) < 0)
+				break;
+		}
+		if(i < cl->depth)
+			break;
+
+		load_record(cl, (load_now() - sent) * 1000);
+		cl->requests += cl->depth;
+		next += cl->depth;
+	}
+
+	close(cl->fd);
+
+	return NULL;
+}
+
+static int load_cmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y? -1: x > y;
+}
+
+/* Run one mode; returns the number of errors */
+static unsigned long load_run(const char *name, int num_clients, int depth) {
+	http_client_t *clients;
+	unsigned long requests = 0, errors = 0;
+	double *lat, start, secs;
+	unsigned long accepted, rejected, evicted;
+	size_t num_lat = 0;
+	int t, running;
+
+	clients = calloc(num_clients, sizeof(*clients));
+	start = load_now();
+	for(t = 0; t < num_clients; t++) {
+		clients[t].depth = depth;
+		buf_init(&clients[t].in);
+		pthread_create(&clients[t].thread, NULL, load_client, &clients[t]);
+	}
+
+	/* Serve until every client has had its connection closed */
+	do {
+		reactor_run(100);
+		net_get_stats(&running, &accepted, &rejected, &evicted);
+	} while(running > 0 || load_now() - start < g_load.seconds);
+
+	secs = load_now() - start;
+	for(t = 0; t < num_clients; t++) {
+		pthread_join(clients[t].thread, NULL);
+		requests += clients[t].requests;
+		errors += clients[t].errors;
+		num_lat += clients[t].num_lat;
+	}
+
+	lat = malloc((num_lat + 1) * sizeof(double));
+	for(num_lat = 0, t = 0; t < num_clients; t++) {
+		memcpy(lat + num_lat, clients[t].lat, clients[t].num_lat * sizeof(double));
+		num_lat += clients[t].num_lat;
+		free(clients[t].lat);
+		buf_release(&clients[t].in);
+	}
+	qsort(lat, num_lat, sizeof(double), load_cmp);
+	if(num_lat == 0)
+		lat[0] = 0;
+
+	printf("%-10s %d connections, %2d deep: %8lu requests %8.0f/s, "
+		"%s latency p50 %.2f ms p99 %.2f ms, %lu errors\n",
+		name, num_clients, depth, requests, requests / secs,
+		depth > 1? "batch": "request", lat[num_lat / 2], lat[num_lat * 99 / 100], errors);
+
+	free(lat);
+	free(clients);
+
+	return errors;
+}
+
+int main(int argc, char **argv) {
+	net_config_t config;
+	unsigned long errors;
+	int num_clients;
+
+	g_load.seconds = argc > 1? atof(argv[1]): 5;
+	num_clients = argc > 2? atoi(argv[2]): 16;
+	if(g_load.seconds <= 0 || num_clients < 1 || num_clients > NET_MAX_CLIENTS) {
+		fprintf(stderr, "Usage: %s [<seconds per mode> [<connections>]]\n", argv[0]);
+		return 1;
+	}
+
+	openlog("http-load", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	memset(&config, 0, sizeof(config));
+	config.bind[0] = "127.0.0.1";
+	config.num_bind = 1;
+	config.port = HTTP_CONTROL_PORT;
+	config.http_port = HTTP_PORT;
+
+	if(reactor_init() < 0 || net_create(&config) < 0) {
+		fprintf(stderr, "Failed to listen on ports %d and %d\n", HTTP_CONTROL_PORT, HTTP_PORT);
+		return 1;
+	}
+
+	errors = load_run("keep-alive", num_clients, 1);
+	errors += load_run("pipelined", num_clients, HTTP_PIPELINE);
+
+	net_release();
+
+	return errors? 1: 0;
+}
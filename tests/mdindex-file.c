@@ -0,0 +1,317 @@
+/**
+ * mdindex-file.c
+ * The metadata index file: writing, mapping it back and damaged files
+ *
+ * Playlists are read into the index and written out, and must come back
+ * the same from the mapped file after a restart.  Changes read back on
+ * top of the mapped file must win over it and end up in the next file.
+ * Truncated, damaged and garbage files must be refused or read without
+ * reaching outside the mapping.
+ *
+ * mdindex.c is included so its static functions can be driven directly;
+ * libspotify is stood in for by spotify.c.
+ *
+ */
+
+#include "../mdindex.c"
+
+#include <syslog.h>
+
+#include "spotify.h"
+
+static struct {
+	char dir[64];
+	char path[96];
+	int failed;
+} g_test;
+
+#define TEST(cond, ...) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "FAIL: " __VA_ARGS__); \
+		fprintf(stderr, " (line %d)\n", __LINE__); \
+		g_test.failed++; \
+	} \
+} while(0)
+
+/* Read the playlists in now instead of waiting for the update timer */
+static void test_read_back(sp_playlist **pls, int n) {
+	int i;
+
+	for(i = 0; i < n; i++)
+		mdindex_touch(pls[i]);
+
+	mdindex_update(NULL);
+}
+
+static void test_expect(const char *uri, const char *title, const char *artist,
+		const char *album, int duration_ms, int avail, const char *where) {
+	mdindex_track_t t;
+
+	if(mdindex_find_track(uri, &t) < 0) {
+		TEST(0, "%s not found %s", uri, where);
+		return;
+	}
+
+	TEST(!strcmp(t.title, title) && !strcmp(t.artist, artist) && !strcmp(t.album, album)
+		&& t.duration_ms == duration_ms && t.avail == avail,
+		"%s is '%s' by '%s' on '%s', %d ms, avail %d %s", uri, t.title, t.artist,
+		t.album, t.duration_ms, t.avail, where);
+}
+
+static void test_stats(int tracks, int playlists, const char *where) {
+	int n_tracks, n_playlists;
+	size_t bytes;
+
+	mdindex_get_stats(&n_tracks, &n_playlists, &bytes);
+	TEST(n_tracks == tracks && n_playlists == playlists,
+		"%d tracks and %d playlists %s, expected %d and %d",
+		n_tracks, n_playlists, where, tracks, playlists);
+}
+
+static size_t test_read_file(char **data) {
+	FILE *fp;
+	long n;
+
+	if((fp = fopen(g_test.path, "rb")) == NULL)
+		return 0;
+
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	rewind(fp);
+	*data = malloc(n);
+	if(fread(*data, 1, n, fp) != (size_t)n)
+		n = 0;
+	fclose(fp);
+
+	return n;
+}
+
+static void test_write_file(const char *data, size_t len) {
+	FILE *fp;
+
+	if((fp = fopen(g_test.path, "wb")) == NULL) {
+		perror(g_test.path);
+		exit(1);
+	}
+
+	fwrite(data, 1, len, fp);
+	fclose(fp);
+}
+
+static void test_round_trip(void) {
+	search_result_t results[SEARCH_MAX_RESULTS];
+	sp_track *t[5];
+	sp_track *a_tracks[3], *b_tracks[2], *a2_tracks[3];
+	sp_playlist *pls[2];
+
+	t[0] = stub_track("spotify:track:1", "Heroes", "David Bowie", "Heroes", 371000);
+	t[1] = stub_track("spotify:track:2", "Low", "David Bowie", "Low", 200000);
+	t[2] = stub_track("spotify:track:3", "Warszawa", "David Bowie", "Low", 380000);
+	t[3] = stub_track("spotify:track:4", "Not Loaded Yet", "Someone", "Something", 1000);
+	t[3]->loaded = 0;
+	t[4] = stub_track("spotify:track:5", "Ashes to Ashes", "David Bowie", "Scary Monsters", 265000);
+	t[2]->available = 0;
+
+	a_tracks[0] = t[0];
+	a_tracks[1] = t[1];
+	a_tracks[2] = t[2];
+	b_tracks[0] = t[2];
+	b_tracks[1] = t[3];
+	pls[0] = stub_playlist("spotify:user:x:playlist:a", "Berlin", a_tracks, 3);
+	pls[1] = stub_playlist("spotify:user:x:playlist:b", "Mixed", b_tracks, 2);
+
+	if(mdindex_open(g_test.path, NULL) < 0 || g_md.map != NULL) {
+		TEST(0, "opening without a file");
+		return;
+	}
+
+	test_read_back(pls, 2);
+	test_expect("spotify:track:1", "Heroes", "David Bowie", "Heroes", 371000, AVAIL_PLAYABLE,
+		"before writing");
+	test_stats(4, 2, "before writing");
+	mdindex_close();
+
+	/* Restart: everything comes from the mapped file */
+	mdindex_open(g_test.path, NULL);
+	TEST(g_md.map != NULL && g_md.num_recs == 0 && g_md.num_lists == 0, "file not mapped");
+	test_stats(4, 2, "after mapping");
+	test_expect("spotify:track:1", "Heroes", "David Bowie", "Heroes", 371000, AVAIL_PLAYABLE,
+		"after mapping");
+	test_expect("spotify:track:3", "Warszawa", "David Bowie", "Low", 380000, AVAIL_UNPLAYABLE,
+		"after mapping");
+	test_expect("spotify:track:4", "", "", "", 0, AVAIL_UNKNOWN, "after mapping");
+	TEST(mdindex_find_track("spotify:track:5", &(mdindex_track_t){ 0 }) < 0,
+		"track 5 found before it was read");
+	TEST(mdindex_playlist_name("spotify:user:x:playlist:a") != NULL
+		&& !strcmp(mdindex_playlist_name("spotify:user:x:playlist:a"), "Berlin"),
+		"playlist a not named after mapping");
+	TEST(mdindex_playlist_name("spotify:user:x:playlist:c") == NULL, "unknown playlist named");
+	TEST(search_query("warsz", results, SEARCH_MAX_RESULTS) == 0
+		&& search_query("heroes bowie", results, SEARCH_MAX_RESULTS) == 1
+		&& !strcmp(results[0].uri, "spotify:track:1"),
+		"mapped tracks not searchable");
+
+	/* Changes on top: a retitled track, one added, a renamed playlist */
+	t[1]->title = "Sound and Vision";
+	a2_tracks[0] = t[0];
+	a2_tracks[1] = t[1];
+	a2_tracks[2] = t[4];
+	pls[0]->tracks = a2_tracks;
+	pls[0]->name = "Berlin Years";
+	test_read_back(pls, 1);
+
+	TEST(mdindex_rec_find("spotify:track:1") < 0 && mdindex_disk_find("spotify:track:1") >= 0,
+		"unchanged track copied out of the file");
+	test_expect("spotify:track:2", "Sound and Vision", "David Bowie", "Low", 200000,
+		AVAIL_PLAYABLE, "over the file");
+	test_expect("spotify:track:5", "Ashes to Ashes", "David Bowie", "Scary Monsters", 265000,
+		AVAIL_PLAYABLE, "over the file");
+	test_expect("spotify:track:3", "Warszawa", "David Bowie", "Low", 380000, AVAIL_UNPLAYABLE,
+		"over the file");
+	TEST(!strcmp(mdindex_playlist_name("spotify:user:x:playlist:a"), "Berlin Years"),
+		"playlist a not renamed over the file");
+
+	/* Flushed, it's all in the new file; playlist b only was in the old one */
+	mdindex_flush(NULL);
+	TEST(g_md.map != NULL && g_md.num_recs == 0 && g_md.num_lists == 0,
+		"overlay left after flushing");
+	test_stats(5, 2, "after flushing");
+	test_expect("spotify:track:2", "Sound and Vision", "David Bowie", "Low", 200000,
+		AVAIL_PLAYABLE, "after flushing");
+	test_expect("spotify:track:5", "Ashes to Ashes", "David Bowie", "Scary Monsters", 265000,
+		AVAIL_PLAYABLE, "after flushing");
+	test_expect("spotify:track:4", "", "", "", 0, AVAIL_UNKNOWN, "after flushing");
+	TEST(!strcmp(mdindex_playlist_name("spotify:user:x:playlist:a"), "Berlin Years")
+		&& !strcmp(mdindex_playlist_name("spotify:user:x:playlist:b"), "Mixed"),
+		"playlists not named after flushing");
+	TEST(g_md.hdr->num_refs == 5, "%u playlist entries after flushing, expected 5",
+		g_md.hdr->num_refs);
+
+	mdindex_close();
+	TEST(stub_spotify_reset() == 0, "playlist references left");
+}
+
+/* Damaged copies of a good file must be refused */
+static void test_damaged(const char *good, size_t len) {
+	static const struct {
+		const char *name;
+		size_t field;	/* Offset of the header word to change */
+		uint32_t value;
+	} cases[] = {
+		{ "bad magic", 0, 0x21214141 },
+		{ "newer version", offsetof(mdindex_header_t, version), MDINDEX_VERSION + 1 },
+		{ "wrong size", offsetof(mdindex_header_t, file_size), 1 << 20 },
+		{ "tracks past the end", offsetof(mdindex_header_t, num_tracks), 1 << 20 },
+		{ "playlists past the end", offsetof(mdindex_header_t, playlists_off), 0xfffffff0 },
+		{ "refs past the end", offsetof(mdindex_header_t, num_refs), 0x40000000 },
+		{ "misaligned hash", offsetof(mdindex_header_t, hash_off), 2 },
+		{ "odd hash size", offsetof(mdindex_header_t, hash_size), 3 },
+		{ "no strings", offsetof(mdindex_header_t, strings_size), 0 },
+		{ "strings past the end", offsetof(mdindex_header_t, strings_off), 0xfffffffc },
+	};
+	mdindex_header_t *h;
+	mdindex_track_t t;
+	char *data;
+	size_t i;
+
+	data = malloc(len);
+	for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		memcpy(data, good, len);
+		memcpy(data + cases[i].field, &cases[i].value, sizeof(uint32_t));
+		test_write_file(data, len);
+
+		mdindex_open(g_test.path, NULL);
+		TEST(g_md.map == NULL && mdindex_find_track("spotify:track:1", &t) < 0,
+			"%s accepted", cases[i].name);
+		mdindex_close();
+	}
+
+	/* Truncated anywhere, even inside the header */
+	for(i = 0; i < len; i += i < sizeof(mdindex_header_t)? 1: 7) {
+		test_write_file(good, i);
+		mdindex_open(g_test.path, NULL);
+		TEST(g_md.map == NULL, "truncated to %zu of %zu bytes accepted", i, len);
+		mdindex_close();
+	}
+
+	/* Strings not terminated at the end of the file */
+	memcpy(data, good, len);
+	data[len - 1] = 'x';
+	test_write_file(data, len);
+	mdindex_open(g_test.path, NULL);
+	TEST(g_md.map == NULL, "unterminated strings accepted");
+	mdindex_close();
+
+	/* A good header over garbage: lookups, search and rewriting must stay in bounds */
+	memcpy(data, good, len);
+	h = (mdindex_header_t *)data;
+	for(i = h->tracks_off; i < h->strings_off; i++)
+		data[i] = (char)(i * 2654435761u >> 13);
+	for(i = h->strings_off; i < len - 1; i++)
+		data[i] = i % 11? 'a' + i % 26: 0;
+	test_write_file(data, len);
+
+	mdindex_open(g_test.path, NULL);
+	TEST(g_md.map != NULL, "garbage with a good header refused");
+	mdindex_find_track("spotify:track:1", &t);
+	mdindex_find_track("", &t);
+	mdindex_playlist_name("spotify:user:x:playlist:a");
+	if(mdindex_write() < 0)
+		TEST(0, "rewriting garbage failed");
+	mdindex_close();
+
+	free(data);
+}
+
+int main(int argc, char **argv) {
+	sp_track *tracks[1];
+	sp_playlist *pl;
+	char *good;
+	size_t len;
+
+	openlog("mdindex-file", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	strcpy(g_test.dir, "/tmp/mdindex-file-XXXXXX");
+	if(mkdtemp(g_test.dir) == NULL || reactor_init() < 0) {
+		perror("mdindex-file");
+		return 1;
+	}
+	snprintf(g_test.path, sizeof(g_test.path), "%s/index", g_test.dir);
+
+	test_round_trip();
+
+	if((len = test_read_file(&good)) == 0) {
+		TEST(0, "no index file written");
+	}
+	else {
+		test_damaged(good, len);
+
+		/* A good file again, written over a damaged one */
+		test_write_file(good, len / 2);
+		tracks[0] = stub_track("spotify:track:9", "Fixed", "Artist", "Album", 1000);
+		pl = stub_playlist("spotify:user:x:playlist:z", "Z", tracks, 1);
+		mdindex_open(g_test.path, NULL);
+		test_read_back(&pl, 1);
+		mdindex_close();
+		mdindex_open(g_test.path, NULL);
+		test_expect("spotify:track:9", "Fixed", "Artist", "Album", 1000, AVAIL_PLAYABLE,
+			"written over a damaged file");
+		mdindex_close();
+		stub_spotify_reset();
+		free(good);
+	}
+
+	unlink(g_test.path);
+	rmdir(g_test.dir);
+	reactor_release();
+
+	if(g_test.failed) {
+		fprintf(stderr, "mdindex-file: %d failed\n", g_test.failed);
+		return 1;
+	}
+
+	printf("mdindex-file: OK\n");
+
+	return 0;
+}
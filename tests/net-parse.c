@@ -0,0 +1,379 @@
+/**
+ * net-parse.c
+ * Input framing of control clients and HTTP clients in net_read_data()
+ *
+ * A corpus of command lines and HTTP requests, and random input built
+ * from the same pieces, is fed to a client connection whole, a byte at a
+ * time, split at every position and in random chunks.  The replies must
+ * be the same however the input arrives.  With "bench", measures how
+ * fast command lines and pipelined requests are taken apart instead.
+ *
+ * net.c is included so its static functions can be driven directly; the
+ * client is one end of a socket pair registered like an accepted one.
+ *
+ */
+
+#include "../net.c"
+
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "stubs.h"
+
+#define TEST_FUZZ_RUNS		2000
+#define TEST_BENCH_BYTES	(32 * 1024 * 1024)
+
+typedef struct {
+	const char *name;
+	int http;
+	const char *input;
+	size_t len;	/* 0 for strlen(input) */
+} test_case_t;
+
+static const test_case_t test_corpus[] = {
+	{ "commands", 0, "play\nstop\nnext\nstatus\ntrim on\ntrim\npower-save off\n" },
+	{ "whitespace", 0, "  play  \r\n\t stop\t\n\n\r\n   \nstatus  json \n" },
+	{ "arguments", 0, "trim on off\ntrim maybe\nshuffle spread on\nqueue\nqueue x y z\n" },
+	{ "too many arguments", 0, "next 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17\n" },
+	{ "uris", 0, "spotify:user:x:playlist:abc\nqueue spotify:track:abc\nhttp://example.com\n" },
+	{ "unknown", 0, "bogus\nPLAY\nplay-\n" },
+	{ "privileged", 0, "logout\ndevice Stub device\n" },
+	{ "unterminated", 0, "play\nstop" },
+	{ "nul bytes", 0, "pl\0ay\nst\0\nstatus\n", 17 },
+	{ "http get", 1, "GET /status HTTP/1.1\r\nHost: x\r\n\r\n"
+		"GET /metrics HTTP/1.1\r\n\r\n" },
+	{ "http post", 1, "POST /next HTTP/1.1\r\nContent-Length: 0\r\n\r\n"
+		"PUT /playlist HTTP/1.1\r\nContent-Length: 27\r\n\r\nspotify:user:x:playlist:abc"
+		"POST /stop HTTP/1.1\r\n\r\n" },
+	{ "http errors", 1, "GET /nothing HTTP/1.1\r\n\r\nDELETE /status HTTP/1.1\r\n\r\n"
+		"GET /status HTTP/1.0\r\n\r\n" },
+	{ "http close", 1, "GET /status HTTP/1.1\r\nConnection: close\r\n\r\n"
+		"GET /metrics HTTP/1.1\r\n\r\n" },
+	{ "http garbage", 1, "\r\n\r\nnot http at all\r\n\r\n" },
+	{ NULL }
+};
+
+/* Pieces random input is put together from */
+static const char *test_pieces[] = {
+	"play", "stop", "next", "status", "status json", "trim", "on", "off",
+	"shuffle", "queue", "find", "subscribe", "bogus", "spotify:track:x",
+	" ", " ", "\t", "\r", "\n", "\n", "\n", "\r\n", "\0",
+	NULL
+};
+
+/* The client under test and the other end of its socket */
+static struct {
+	net_conn_t *c;
+	int peer;
+	buf_t out;
+	uint64_t rng;
+} t;
+
+static uint32_t test_random(void) {
+
+	/* xorshift64* */
+	t.rng ^= t.rng >> 12;
+	t.rng ^= t.rng << 25;
+	t.rng ^= t.rng >> 27;
+
+	return (uint32_t)((t.rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/* Connection set up as net_accept_client() would */
+static void test_open(int http) {
+	size_t in_size = http? HTTP_MAX_REQUEST: NET_MAX_LINE;
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	net_set_nonblocking(sv[0]);
+	net_set_nonblocking(sv[1]);
+
+	t.c = calloc(1, sizeof(net_conn_t) + in_size);
+	t.c->fd = sv[0];
+	t.c->events = REACTOR_IN;
+	t.c->http = http;
+	t.c->in = (char *)(t.c + 1);
+	t.c->in_size = in_size;
+	buf_init(&t.c->out);
+	t.c->index = num_conns;
+	conns[num_conns++] = t.c;
+
+	t.peer = sv[1];
+	buf_reset(&t.out);
+	stub_status_requests = 0;
+}
+
+static void test_drain(void) {
+	char data[65536];
+	ssize_t n;
+
+	while((n = recv(t.peer, data, sizeof(data), MSG_DONTWAIT)) > 0)
+		buf_append(&t.out, data, n);
+}
+
+/* Deliver what the client is waiting for, as the reactor would; 0 if nothing */
+static int test_step(void) {
+	struct pollfd p;
+	int events = 0;
+
+	test_drain();
+	if(t.c == NULL)
+		return 0;
+
+	p.fd = t.c->fd;
+	p.events = POLLIN|POLLOUT;
+	if(poll(&p, 1, 0) <= 0)
+		return 0;
+
+	if((p.revents & (POLLIN|POLLHUP|POLLERR)) && (t.c->events & REACTOR_IN))
+		events |= REACTOR_IN;
+	if((p.revents & POLLOUT) && (t.c->events & REACTOR_OUT))
+		events |= REACTOR_OUT;
+	if(events == 0)
+		return 0;
+
+	net_client_event(t.c->fd, events, t.c);
+	if(num_conns == 0)
+		t.c = NULL;
+
+	return 1;
+}
+
+static void test_send(const char *data, size_t len) {
+	ssize_t n;
+
+	while(len > 0 && t.c != NULL) {
+		if((n = send(t.peer, data, len, MSG_DONTWAIT|MSG_NOSIGNAL)) > 0) {
+			data += n;
+			len -= n;
+		}
+
+		while(test_step());
+	}
+}
+
+/* Close our end and let the client finish; leaves the replies in t.out */
+static void test_close(void) {
+
+	shutdown(t.peer, SHUT_WR);
+	while(test_step());
+
+	if(t.c != NULL)
+		net_close_client(t.c);
+	t.c = NULL;
+
+	test_drain();
+	close(t.peer);
+}
+
+/* Split sizes: 0 whole, 1 byte at a time, -1 random; or at one position */
+static void test_feed(const char *input, size_t len, int http, int chunk, size_t at) {
+	size_t pos, n;
+
+	test_open(http);
+
+	if(at) {
+		test_send(input, at);
+		test_send(input + at, len - at);
+	}
+	else {
+		for(pos = 0; pos < len; pos += n) {
+			n = chunk == 0? len: chunk > 0? (size_t)chunk: 1 + test_random() % 64;
+			if(n > len - pos)
+				n = len - pos;
+			test_send(input + pos, n);
+		}
+	}
+
+	test_close();
+}
+
+static int test_compare(const char *name, const char *how, const char *expect, size_t expect_len) {
+
+	if(t.out.len == expect_len && !memcmp(t.out.data, expect, expect_len))
+		return 0;
+
+	fprintf(stderr, "FAIL: %s, %s: got %lu bytes of replies, expected %lu\n"
+		"--- expected\n%.*s--- got\n%.*s---\n", name, how,
+		(unsigned long)t.out.len, (unsigned long)expect_len,
+		(int)expect_len, expect, (int)t.out.len, t.out.data);
+
+	return -1;
+}
+
+/* Feed input every which way; returns the number of failures */
+static int test_input(const char *name, const char *input, size_t len, int http, int every_split) {
+	buf_t expect;
+	char how[64];
+	size_t at;
+	int i, failed = 0;
+
+	buf_init(&expect);
+	test_feed(input, len, http, 0, 0);
+	buf_append(&expect, t.out.data, t.out.len);
+
+	test_feed(input, len, http, 1, 0);
+	failed += test_compare(name, "a byte at a time", expect.data, expect.len) < 0;
+
+	for(i = 0; i < 8; i++) {
+		test_feed(input, len, http, -1, 0);
+		snprintf(how, sizeof(how), "random chunks #%d", i);
+		failed += test_compare(name, how, expect.data, expect.len) < 0;
+	}
+
+	for(at = 1; every_split && at < len; at++) {
+		test_feed(input, len, http, 0, at);
+		snprintf(how, sizeof(how), "split at %lu", (unsigned long)at);
+		failed += test_compare(name, how, expect.data, expect.len) < 0;
+	}
+
+	buf_release(&expect);
+
+	return failed;
+}
+
+static int test_corpus_all(void) {
+	const test_case_t *tc;
+	buf_t all[2];
+	char line[NET_MAX_LINE + 16];
+	int http, failed = 0;
+
+	buf_init(&all[0]);
+	buf_init(&all[1]);
+
+	for(tc = test_corpus; tc->name != NULL; tc++) {
+		size_t len = tc->len? tc->len: strlen(tc->input);
+
+		failed += test_input(tc->name, tc->input, len, tc->http, 1);
+
+		/* Everything back to back, as a pipelining client would send it;
+		   unterminated input and closing requests only go last */
+		if(strcmp(tc->name, "unterminated") && strcmp(tc->name, "http close"))
+			buf_append(&all[tc->http], tc->input, len);
+	}
+
+	for(http = 0; http < 2; http++)
+		failed += test_input(http? "all requests": "all commands",
+			all[http].data, all[http].len, http, 0);
+
+	/* Lines right at and past the limit, and an unterminated one at EOF */
+	memset(line, 'a', sizeof(line));
+	memcpy(line + NET_MAX_LINE - 1, "\nplay\n", 6);
+	failed += test_input("longest line", line, NET_MAX_LINE + 5, 0, 0);
+	memset(line, 'a', sizeof(line));
+	memcpy(line + NET_MAX_LINE, "\nplay\n", 6);
+	failed += test_input("line one too long", line, NET_MAX_LINE + 6, 0, 0);
+	memset(line, 'a', sizeof(line));
+	memcpy(line + NET_MAX_LINE + 8, "\nplay\n", 6);
+	failed += test_input("overlong line", line, NET_MAX_LINE + 14, 0, 0);
+	memset(line, 'a', sizeof(line));
+	failed += test_input("longest last line", line, NET_MAX_LINE - 1, 0, 0);
+
+	buf_release(&all[0]);
+	buf_release(&all[1]);
+
+	return failed;
+}
+
+/* Random inputs built from the pieces, some with overlong lines */
+static int test_fuzz(void) {
+	buf_t input;
+	char name[32];
+	int i, n, failed = 0;
+
+	buf_init(&input);
+
+	for(i = 0; i < TEST_FUZZ_RUNS && failed < 10; i++) {
+		buf_reset(&input);
+		for(n = test_random() % 64; n > 0; n--) {
+			const char *piece = test_pieces[test_random() % (sizeof(test_pieces) / sizeof(char *) - 1)];
+
+			if(test_random() % 64 == 0) {
+				char junk[NET_MAX_LINE + 64];
+				size_t len = test_random() % sizeof(junk);
+
+				memset(junk, 'x', len);
+				buf_append(&input, junk, len);
+			}
+
+			buf_append(&input, piece, *piece? strlen(piece): 1);
+		}
+
+		snprintf(name, sizeof(name), "fuzz #%d", i);
+		failed += test_input(name, input.data, input.len, 0, 0) != 0;
+	}
+
+	buf_release(&input);
+
+	return failed;
+}
+
+static double test_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Throughput of input taken apart, sent in 4 kB chunks as from a busy client */
+static void test_bench(const char *name, const char *unit, int http, const char *pattern, int per_pattern) {
+	buf_t input;
+	size_t pos, n, len = strlen(pattern);
+	double start, secs;
+	unsigned long count = 0;
+
+	buf_init(&input);
+	while(input.len + len <= TEST_BENCH_BYTES) {
+		buf_append(&input, pattern, len);
+		count += per_pattern;
+	}
+
+	start = test_now();
+	test_open(http);
+	for(pos = 0; pos < input.len; pos += n) {
+		n = input.len - pos < 4096? input.len - pos: 4096;
+		test_send(input.data + pos, n);
+	}
+	test_close();
+	secs = test_now() - start;
+
+	printf("%-10s %6.1f MB/s %10.0f %s/s %8.1f MB of replies\n", name,
+		input.len / secs / 1e6, count / secs, unit, t.out.len / 1e6);
+
+	buf_release(&input);
+}
+
+int main(int argc, char **argv) {
+	int failed;
+
+	openlog("net-parse", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+	reactor_init();
+	buf_init(&t.out);
+	t.rng = 0x9e3779b97f4a7c15ULL;
+
+	if(argc > 1 && !strcmp(argv[1], "bench")) {
+		test_bench("commands", "lines", 0,
+			"stop\n  trim on\r\nbogus command\n\npower-save off\nshuffle\n", 6);
+		test_bench("blank", "lines", 0, "\n\r\n  \n\t\n", 4);
+		test_bench("http", "requests", 1,
+			"POST /stop HTTP/1.1\r\nHost: boombox\r\nContent-Length: 0\r\n\r\n", 1);
+		return 0;
+	}
+
+	failed = test_corpus_all();
+	failed += test_fuzz();
+	if(failed) {
+		fprintf(stderr, "net-parse: %d failed\n", failed);
+		return 1;
+	}
+
+	printf("net-parse: OK\n");
+
+	return 0;
+}
@@ -0,0 +1,402 @@
+/**
+ * net-udp.c
+ * Authentication and duplicate detection of UDP remote control datagrams
+ *
+ * Datagrams are handed to net_udp_datagram() as if received from a
+ * remote's socket on loopback, and its acks are read back there.  Every
+ * command must run once: duplicates only get their ack again, sequence
+ * numbers out of order are taken within the window of 64 and across the
+ * wraparound, older ones are refused.  Datagrams from another session,
+ * with a bad MAC or reflected acks must not run anything, and forgetting
+ * a remote must start a new session its old datagrams can't be replayed
+ * into.  With "bench", measures the round trip of a command over UDP,
+ * over a TCP connection kept open and over a new connection each time.
+ *
+ * net.c is included so its static functions can be driven directly.
+ *
+ */
+
+#include "../net.c"
+
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+#include "stubs.h"
+
+#define UDP_PORT		12343
+#define UDP_CONTROL_PORT	12344
+#define UDP_BENCH_ROUNDS	20000
+
+/* The server's socket and the remote's, and what the remote last got */
+static struct {
+	int srv, cli;
+	struct sockaddr_storage cli_addr;
+	socklen_t cli_addr_len;
+	uint8_t ack[NET_UDP_HEADER + NET_UDP_MAX_REPLY + NET_UDP_MAC];
+	ssize_t ack_len;
+	char reply[NET_UDP_MAX_REPLY + 1];
+	int failed;
+} t;
+
+static struct {
+	volatile int done;
+	double *lat;
+} g_bench;
+
+#define TEST(cond, ...) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "FAIL: " __VA_ARGS__); \
+		fprintf(stderr, " (line %d)\n", __LINE__); \
+		t.failed++; \
+	} \
+} while(0)
+
+static int test_socket(struct sockaddr_storage *ss, socklen_t *ss_len, int port) {
+	struct sockaddr_in sin;
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+		|| bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("udp socket");
+		exit(1);
+	}
+
+	if(ss != NULL) {
+		*ss_len = sizeof(*ss);
+		getsockname(fd, (struct sockaddr *)ss, ss_len);
+	}
+
+	return fd;
+}
+
+/* Datagram as a remote builds it, MAC'd as coming from direction */
+static size_t test_build(uint8_t *d, int direction, uint32_t id, uint32_t session,
+		uint32_t seq, const char *cmd) {
+	size_t len = NET_UDP_HEADER + strlen(cmd);
+
+	net_udp_put32(d, id);
+	net_udp_put32(d + 4, session);
+	net_udp_put32(d + 8, seq);
+	memcpy(d + NET_UDP_HEADER, cmd, strlen(cmd));
+	net_udp_mac(direction, d, len, d + len);
+
+	return len + NET_UDP_MAC;
+}
+
+/**
+ * Hand a datagram to the server and take its ack; returns 1 if the command
+ * ran, 0 if not and -1 if there was no ack
+ */
+static int test_deliver(const uint8_t *d, size_t len) {
+	unsigned long before = stub_events[APP_DO_NEXT_TRACK];
+	uint8_t mac[NET_UDP_MAC];
+	size_t n;
+
+	net_udp_datagram(t.srv, &t.cli_addr, t.cli_addr_len, d, len);
+
+	/* Loopback delivers before sendto() returns */
+	t.reply[0] = 0;
+	if((t.ack_len = recv(t.cli, t.ack, sizeof(t.ack), MSG_DONTWAIT)) < 0)
+		return stub_events[APP_DO_NEXT_TRACK] != before? 1: -1;
+
+	n = t.ack_len - NET_UDP_HEADER - NET_UDP_MAC;
+	net_udp_mac(NET_UDP_ACK, t.ack, t.ack_len - NET_UDP_MAC, mac);
+	TEST(t.ack_len >= NET_UDP_HEADER + NET_UDP_MAC
+		&& !memcmp(mac, t.ack + t.ack_len - NET_UDP_MAC, NET_UDP_MAC)
+		&& !memcmp(t.ack, d, 4) && !memcmp(t.ack + 8, d + 8, 4),
+		"ack not authenticated or for another datagram");
+	memcpy(t.reply, t.ack + NET_UDP_HEADER, n);
+	t.reply[n] = 0;
+
+	return stub_events[APP_DO_NEXT_TRACK] != before;
+}
+
+/* Send "next" from remote id with seq in the current session */
+static int test_next(uint32_t id, uint32_t seq) {
+	uint8_t d[64];
+
+	return test_deliver(d, test_build(d, NET_UDP_COMMAND, id, udp_session, seq, "next"));
+}
+
+static void test_sequence(void) {
+	uint8_t first[NET_UDP_HEADER + NET_UDP_MAX_REPLY + NET_UDP_MAC];
+	ssize_t first_len;
+	uint32_t seq;
+
+	TEST(test_next(1, 100) == 1 && !strcmp(t.reply, "# OK, playing next track\n"),
+		"new sequence number not run: '%s'", t.reply);
+	memcpy(first, t.ack, t.ack_len);
+	first_len = t.ack_len;
+
+	/* A retransmission gets the very same ack again */
+	TEST(test_next(1, 100) == 0 && t.ack_len == first_len && !memcmp(t.ack, first, first_len),
+		"duplicate run or acked differently");
+
+	/* Late but within the window, once */
+	TEST(test_next(1, 99) == 1, "out of order sequence number not run");
+	TEST(test_next(1, 99) == 0, "out of order duplicate run");
+	TEST(test_next(1, 100 - 63) == 1, "oldest sequence number in the window not run");
+	TEST(test_next(1, 100 - 64) == 0 && !strcmp(t.reply, "# ERR, stale sequence number\n"),
+		"sequence number outside the window: '%s'", t.reply);
+	TEST(test_next(1, 50) == 1 && test_next(1, 50) == 0, "gap in the window");
+
+	/* A jump ahead moves the window along */
+	TEST(test_next(1, 1000) == 1 && test_next(1, 999) == 1 && test_next(1, 100) == 0,
+		"window not moved along");
+
+	/* Wraparound: 0 comes after 0xffffffff */
+	TEST(test_next(2, 0xfffffffe) == 1 && test_next(2, 0) == 1 && test_next(2, 0xffffffff) == 1,
+		"sequence numbers not taken across the wraparound");
+	TEST(test_next(2, 0xfffffffe) == 0 && test_next(2, 0) == 0 && test_next(2, 0xffffffc0) == 0,
+		"duplicates or stale numbers run across the wraparound");
+	for(seq = 1; seq <= 64; seq++)
+		if(test_next(2, seq) != 1)
+			break;
+	TEST(seq == 65 && test_next(2, 0xffffffff) == 0, "sequence number 65 back run across the wraparound");
+
+	/* Remotes are tracked apart */
+	TEST(test_next(3, 100) == 1, "sequence number of another remote taken as a duplicate");
+}
+
+static void test_authentication(void) {
+	uint8_t d[64], ack[sizeof(t.ack)];
+	unsigned long rejected = udp_rejected;
+	size_t len, ack_len;
+
+	len = test_build(d, NET_UDP_COMMAND, 4, udp_session, 1, "next");
+	d[len - 1] ^= 1;
+	TEST(test_deliver(d, len) == -1, "bad MAC answered or run");
+
+	len = test_build(d, NET_UDP_COMMAND, 4, udp_session, 1, "next");
+	d[NET_UDP_HEADER] ^= 0x20;
+	TEST(test_deliver(d, len) == -1, "changed command answered or run");
+
+	len = test_build(d, NET_UDP_COMMAND, 4, udp_session, 1, "next");
+	d[8] ^= 0x80;
+	TEST(test_deliver(d, len) == -1, "changed sequence number answered or run");
+
+	TEST(test_deliver(d, NET_UDP_HEADER + NET_UDP_MAC - 1) == -1, "short datagram answered");
+
+	/* MAC'd with the key but as an ack */
+	len = test_build(d, NET_UDP_ACK, 4, udp_session, 1, "next");
+	TEST(test_deliver(d, len) == -1, "command MAC'd as an ack run");
+
+	/* An ack sent back at the server */
+	len = test_build(d, NET_UDP_COMMAND, 4, udp_session, 2, "status");
+	TEST(test_deliver(d, len) == 0 && t.ack_len > 0, "status not acked");
+	memcpy(ack, t.ack, t.ack_len);
+	ack_len = t.ack_len;
+	TEST(test_deliver(ack, ack_len) == -1, "reflected ack answered");
+
+	TEST(udp_rejected - rejected == 6, "%lu datagrams counted as rejected, expected 6",
+		udp_rejected - rejected);
+	TEST(test_next(4, 1) == 1, "good datagram refused after bad ones");
+}
+
+static void test_session(void) {
+	uint8_t d[64], replay[64];
+	size_t len, replay_len;
+	uint32_t old, id;
+	int i;
+
+	/* A datagram from before a restart only learns the session */
+	old = udp_session;
+	len = test_build(d, NET_UDP_COMMAND, 5, old ^ 0x5a5a5a5a, 1, "next");
+	TEST(test_deliver(d, len) == 0 && !strcmp(t.reply, "# ERR, new session\n")
+		&& net_udp_get32(t.ack + 4) == udp_session,
+		"other session: '%s'", t.reply);
+
+	/* Fill up the table of remotes, the first of them recorded on the way */
+	memset(remotes, 0, sizeof(remotes));
+	replay_len = test_build(replay, NET_UDP_COMMAND, 100, old, 1, "next");
+	TEST(test_deliver(replay, replay_len) == 1, "remote 100 not run");
+	for(id = 101; id < 100 + NET_UDP_REMOTES; id++)
+		test_next(id, 1);
+	TEST(udp_session == old, "session renewed before a remote was forgotten");
+
+	/* One more remote forgets the one least recently seen, remote 100 */
+	for(i = 0; i < NET_UDP_REMOTES; i++)
+		if(remotes[i].id == 100)
+			remotes[i].last_seen--;
+	TEST(test_next(200, 1) == 1 && udp_session != old && net_udp_get32(t.ack + 4) == udp_session,
+		"no new session after forgetting a remote");
+
+	/* Its state is gone, but its old datagrams can't be replayed */
+	TEST(test_deliver(replay, replay_len) == 0 && !strcmp(t.reply, "# ERR, new session\n"),
+		"replay after forgetting a remote: '%s'", t.reply);
+
+	/* In the new session it's taken from the start */
+	TEST(test_next(100, 1) == 1, "remote not taken in the new session");
+}
+
+static void test_setup(void) {
+
+	memcpy(udp_key, "0123456789abcdef", sizeof(udp_key));
+	net_udp_new_session();
+	buf_init(&udp_conn.out);
+	udp_conn.fd = -1;
+	udp_conn.corked = 1;
+	udp_conn.datagram = 1;
+
+	t.srv = test_socket(NULL, NULL, 0);
+	t.cli = test_socket(&t.cli_addr, &t.cli_addr_len, 0);
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_connect(void) {
+	struct sockaddr_in sin;
+	int fd, opt = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(UDP_CONTROL_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+		|| connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	return fd;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y? -1: x > y;
+}
+
+static void bench_report(const char *name, double secs) {
+	double *lat = g_bench.lat;
+
+	qsort(lat, UDP_BENCH_ROUNDS, sizeof(double), bench_cmp);
+	printf("%-14s %6.1f us per command, p50 %6.1f us, p99 %6.1f us\n", name,
+		secs / UDP_BENCH_ROUNDS * 1e6, lat[UDP_BENCH_ROUNDS / 2] * 1e6,
+		lat[UDP_BENCH_ROUNDS * 99 / 100] * 1e6);
+}
+
+/* Round trips of "status" to the server running on the main thread */
+static void *bench_client(void *arg) {
+	struct sockaddr_in sin;
+	uint8_t d[64], ack[sizeof(t.ack)];
+	char reply[1024];
+	double start, sent;
+	size_t len;
+	int i, fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(UDP_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = test_socket(NULL, NULL, 0);
+	connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+
+	/* Learn the session first */
+	len = test_build(d, NET_UDP_COMMAND, 1, 0, 0, "status");
+	send(fd, d, len, 0);
+	recv(fd, ack, sizeof(ack), 0);
+
+	start = bench_now();
+	for(i = 0; i < UDP_BENCH_ROUNDS; i++) {
+		sent = bench_now();
+		len = test_build(d, NET_UDP_COMMAND, 1, net_udp_get32(ack + 4), i + 1, "status");
+		send(fd, d, len, 0);
+		recv(fd, ack, sizeof(ack), 0);
+		g_bench.lat[i] = bench_now() - sent;
+	}
+	bench_report("udp", bench_now() - start);
+	close(fd);
+
+	fd = bench_connect();
+	start = bench_now();
+	for(i = 0; i < UDP_BENCH_ROUNDS; i++) {
+		sent = bench_now();
+		send(fd, "status\n", 7, MSG_NOSIGNAL);
+		recv(fd, reply, sizeof(reply), 0);
+		g_bench.lat[i] = bench_now() - sent;
+	}
+	bench_report("tcp kept open", bench_now() - start);
+	close(fd);
+
+	start = bench_now();
+	for(i = 0; i < UDP_BENCH_ROUNDS; i++) {
+		sent = bench_now();
+		fd = bench_connect();
+		send(fd, "status\n", 7, MSG_NOSIGNAL);
+		recv(fd, reply, sizeof(reply), 0);
+		close(fd);
+		g_bench.lat[i] = bench_now() - sent;
+	}
+	bench_report("tcp connect", bench_now() - start);
+
+	g_bench.done = 1;
+
+	return NULL;
+}
+
+static int bench_udp(void) {
+	net_config_t config;
+	pthread_t client;
+
+	memset(&config, 0, sizeof(config));
+	config.bind[0] = "127.0.0.1";
+	config.num_bind = 1;
+	config.port = UDP_CONTROL_PORT;
+	config.udp_port = UDP_PORT;
+	memcpy(config.udp_key, "0123456789abcdef", sizeof(config.udp_key));
+
+	if(net_create(&config) < 0) {
+		fprintf(stderr, "Failed to listen on port %d\n", UDP_PORT);
+		return 1;
+	}
+
+	g_bench.lat = malloc(UDP_BENCH_ROUNDS * sizeof(double));
+	pthread_create(&client, NULL, bench_client, NULL);
+	while(!g_bench.done)
+		reactor_run(100);
+	pthread_join(client, NULL);
+
+	free(g_bench.lat);
+	net_release();
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	openlog("net-udp", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+	reactor_init();
+
+	if(argc > 1 && !strcmp(argv[1], "bench"))
+		return bench_udp();
+
+	test_setup();
+	test_sequence();
+	test_authentication();
+	test_session();
+
+	if(t.failed) {
+		fprintf(stderr, "net-udp: %d failed\n", t.failed);
+		return 1;
+	}
+
+	printf("net-udp: OK\n");
+
+	return 0;
+}
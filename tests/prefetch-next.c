@@ -0,0 +1,168 @@
+/**
+ * prefetch-next.c
+ * Window of upcoming tracks kept ready for playback
+ *
+ * The window is moved along a play order of tracks: it must hold one
+ * reference on each track in it and none on tracks that left it, ask for
+ * the audio of the first tracks only once while they stay in the window,
+ * wait for tracks to load before asking, and count how well each track
+ * picked for playback had been prepared.
+ *
+ * libspotify is stood in for by spotify.c.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "../prefetch.h"
+#include "spotify.h"
+
+#define TEST_TRACKS		40
+
+static struct {
+	sp_track *tracks[TEST_TRACKS];
+	char uris[TEST_TRACKS][32];
+	int failed;
+} g_test;
+
+#define TEST(cond, ...) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "FAIL: " __VA_ARGS__); \
+		fprintf(stderr, " (line %d)\n", __LINE__); \
+		g_test.failed++; \
+	} \
+} while(0)
+
+static void test_setup(void) {
+	int i;
+
+	stub_spotify_reset();
+	for(i = 0; i < TEST_TRACKS; i++) {
+		snprintf(g_test.uris[i], sizeof(g_test.uris[i]), "spotify:track:%d", i);
+		g_test.tracks[i] = stub_track(g_test.uris[i], g_test.uris[i] + 14, "Artist", "Album", 1000);
+	}
+
+	prefetch_init((sp_session *)&g_test);
+}
+
+static void test_teardown(const char *name) {
+	int refs;
+
+	prefetch_release();
+	TEST(prefetch_window() == 0, "%s: window left after release", name);
+	refs = stub_spotify_reset();
+	TEST(refs == 0, "%s: %d references left", name, refs);
+}
+
+/* References held on tracks first to first + count only, one each */
+static void test_window(int first, int count, const char *name) {
+	int i, in;
+
+	TEST(prefetch_window() == count, "%s: window of %d, expected %d", name, prefetch_window(), count);
+	for(i = 0; i < TEST_TRACKS; i++) {
+		in = i >= first && i < first + count;
+		TEST(g_test.tracks[i]->refs == in, "%s: track %d has %d references", name, i,
+			g_test.tracks[i]->refs);
+	}
+}
+
+/* Play through the tracks one at a time with a window of 8, prefetching 2 */
+static void test_moving(void) {
+	unsigned long counts[PREFETCH_RESULTS], requests;
+	int i;
+
+	test_setup();
+	for(i = 0; i + 8 <= TEST_TRACKS; i++) {
+		TEST(prefetch_lookup(g_test.tracks[i]) == (i? PREFETCH_AUDIO: PREFETCH_MISS),
+			"track %d picked", i);
+		prefetch_update(g_test.tracks + i, 8, 2);
+		test_window(i, 8, "moving");
+	}
+
+	/* Each asked for once, up to the last window's first two */
+	for(i = 0; i < TEST_TRACKS; i++)
+		TEST(g_test.tracks[i]->prefetched == (i <= TEST_TRACKS - 7),
+			"track %d prefetched %d times", i, g_test.tracks[i]->prefetched);
+
+	prefetch_get_stats(counts, &requests);
+	TEST(counts[PREFETCH_MISS] == 1 && counts[PREFETCH_AUDIO] == TEST_TRACKS - 8
+		&& counts[PREFETCH_METADATA] == 0, "counted %lu misses, %lu hits",
+		counts[PREFETCH_MISS], counts[PREFETCH_AUDIO]);
+	TEST(requests == TEST_TRACKS - 6, "%lu requests, expected %d", requests, TEST_TRACKS - 6);
+
+	test_teardown("moving");
+}
+
+static void test_skips(void) {
+	unsigned long counts[PREFETCH_RESULTS], requests;
+	sp_track *reordered[4];
+
+	test_setup();
+
+	/* Capped at the largest window */
+	prefetch_update(g_test.tracks, TEST_TRACKS, 0);
+	test_window(0, PREFETCH_MAX_WINDOW, "capped");
+	TEST(prefetch_lookup(g_test.tracks[3]) == PREFETCH_METADATA, "held track not warm");
+	TEST(prefetch_lookup(g_test.tracks[PREFETCH_MAX_WINDOW]) == PREFETCH_MISS,
+		"track past the window held");
+
+	/* Tracks still loading or unplayable are left until they can be */
+	g_test.tracks[0]->loaded = 0;
+	g_test.tracks[1]->available = 0;
+	prefetch_update(g_test.tracks, 3, 3);
+	test_window(0, 3, "shrunk");
+	TEST(g_test.tracks[0]->prefetched == 0 && g_test.tracks[1]->prefetched == 0
+		&& g_test.tracks[2]->prefetched == 1, "prefetched tracks not ready");
+	TEST(prefetch_lookup(g_test.tracks[1]) == PREFETCH_METADATA, "failed prefetch counted");
+
+	g_test.tracks[0]->loaded = 1;
+	prefetch_update(g_test.tracks, 3, 3);
+	TEST(g_test.tracks[0]->prefetched == 1 && g_test.tracks[2]->prefetched == 1,
+		"track loaded later not prefetched once");
+
+	/* Reordered, as by a shuffle: what was asked for stays asked for */
+	reordered[0] = g_test.tracks[2];
+	reordered[1] = g_test.tracks[5];
+	reordered[2] = g_test.tracks[0];
+	reordered[3] = g_test.tracks[6];
+	prefetch_update(reordered, 4, 1);
+	TEST(g_test.tracks[2]->prefetched == 1 && g_test.tracks[5]->prefetched == 0,
+		"reordered window prefetched again");
+	TEST(prefetch_lookup(g_test.tracks[0]) == PREFETCH_AUDIO, "reordered track forgotten");
+	TEST(g_test.tracks[1]->refs == 0 && g_test.tracks[5]->refs == 1, "reordered references");
+
+	/* Emptied when there's nothing to play */
+	prefetch_update(NULL, 0, 0);
+	test_window(0, 0, "emptied");
+
+	prefetch_get_stats(counts, &requests);
+	TEST(requests == 2, "%lu requests, expected 2", requests);
+
+	/* Nothing held once released */
+	prefetch_update(g_test.tracks, 4, 4);
+	prefetch_release();
+	prefetch_update(g_test.tracks, 4, 4);
+	test_window(0, 0, "released");
+	test_teardown("skips");
+}
+
+int main(int argc, char **argv) {
+
+	openlog("prefetch-next", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	test_moving();
+	test_skips();
+
+	if(g_test.failed) {
+		fprintf(stderr, "prefetch-next: %d failed\n", g_test.failed);
+		return 1;
+	}
+
+	printf("prefetch-next: OK\n");
+
+	return 0;
+}
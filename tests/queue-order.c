@@ -0,0 +1,296 @@
+/**
+ * queue-order.c
+ * Order of tracks in the play queue and the references it holds
+ *
+ * Tracks, albums and playlists are queued at the end and played next,
+ * and must come out of the queue in the order they were asked for: the
+ * tracks of an album or playlist played next stay together and in order,
+ * also when tracks are popped while a large playlist is still being
+ * expanded a batch at a time.  Clearing the queue must stop expansions
+ * and drop albums still being browsed.  Playlists the queue had to load
+ * (-L) must be unloaded again once added, unless they're the active one.
+ * Every track reference taken must be given back.
+ *
+ * libspotify is stood in for by spotify.c.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "../app.h"
+#include "../playqueue.h"
+#include "../reactor.h"
+#include "spotify.h"
+
+#define TEST_TRACKS		1000
+#define TEST_BIG_PLAYLIST	600
+
+static struct {
+	sp_track *tracks[TEST_TRACKS];
+	char uris[TEST_TRACKS][32];
+	sp_playlist *active;
+	int failed;
+} g_test;
+
+#define TEST(cond, ...) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "FAIL: " __VA_ARGS__); \
+		fprintf(stderr, " (line %d)\n", __LINE__); \
+		g_test.failed++; \
+	} \
+} while(0)
+
+sp_playlist *app_get_active_playlist(void) {
+
+	return g_test.active;
+}
+
+static void test_setup(void) {
+	int i;
+
+	stub_spotify_reset();
+	for(i = 0; i < TEST_TRACKS; i++) {
+		snprintf(g_test.uris[i], sizeof(g_test.uris[i]), "spotify:track:%d", i);
+		g_test.tracks[i] = stub_track(g_test.uris[i], g_test.uris[i] + 14, "Artist", "Album", 1000);
+	}
+
+	g_test.active = NULL;
+	playqueue_init((sp_session *)&g_test);
+}
+
+static void test_teardown(const char *name) {
+	int refs;
+
+	playqueue_release();
+	refs = stub_spotify_reset();
+	TEST(refs == 0, "%s: %d references left", name, refs);
+}
+
+/* Let playlist expansion run until it's done */
+static void test_expand(void) {
+	int i;
+
+	for(i = 0; i < 100 && playqueue_pending() > 0; i++)
+		reactor_run(0);
+}
+
+static void test_add(const char *uri, int next) {
+	const char *error;
+
+	if((error = playqueue_add_uri(uri, next)) != NULL)
+		TEST(0, "queueing %s: %s", uri, error);
+}
+
+/**
+ * Pop n tracks, which must be those numbered from expect on, or the
+ * queue must be empty if n is 0
+ */
+static void test_pop(int n, const int *expect, const char *name) {
+	sp_track *t;
+	int i;
+
+	for(i = 0; n == 0 || i < n; i++) {
+		t = playqueue_pop();
+		if(n == 0) {
+			TEST(t == NULL, "%s: %s left over", name, t? t->uri: "");
+			if(t != NULL)
+				sp_track_release(t);
+			return;
+		}
+
+		if(t == NULL || t != g_test.tracks[expect[i]]) {
+			TEST(0, "%s: track %d is %s, expected %s", name, i,
+				t? t->uri: "none", g_test.uris[expect[i]]);
+			if(t != NULL)
+				sp_track_release(t);
+			return;
+		}
+
+		sp_track_release(t);
+	}
+}
+
+static void test_tracks(void) {
+	static const int order[] = { 3, 2, 0, 1 };
+
+	test_setup();
+	test_add("spotify:track:0", 0);
+	test_add("spotify:track:1", 0);
+	test_add("spotify:track:2", 1);
+	test_add("spotify:track:3", 1);
+	TEST(playqueue_length() == 4 && playqueue_pending() == 0, "four tracks not queued");
+	TEST(playqueue_peek(0) == g_test.tracks[3] && playqueue_peek(3) == g_test.tracks[1]
+		&& playqueue_peek(4) == NULL, "peeking");
+	TEST(g_test.tracks[0]->refs == 1, "queued track not referenced");
+	test_pop(4, order, "tracks");
+	test_pop(0, NULL, "tracks");
+
+	TEST(playqueue_add_uri("spotify:nothing", 0) != NULL, "unknown URI queued");
+	TEST(playqueue_length() == 0, "unknown URI queued");
+	test_teardown("tracks");
+}
+
+/* Albums a, b and c with tracks 10-12, 20-22 and 30-31 */
+static void test_setup_albums(sp_track **tracks) {
+	int i;
+
+	test_setup();
+	for(i = 0; i < 8; i++)
+		tracks[i] = g_test.tracks[(i / 3 + 1) * 10 + i % 3];
+
+	stub_album("spotify:album:a", "A", tracks, 3);
+	stub_album("spotify:album:b", "B", tracks + 3, 3);
+	stub_album("spotify:album:c", "C", tracks + 6, 2);
+}
+
+static void test_albums(void) {
+	static const int order[] = { 20, 21, 22, 10, 11, 12, 0, 30, 31 };
+	sp_track *tracks[8];
+
+	test_setup_albums(tracks);
+
+	/* Albums played next stay in order, the last asked for first */
+	test_add("spotify:track:0", 0);
+	test_add("spotify:album:a", 1);
+	test_add("spotify:album:b", 1);
+	test_add("spotify:album:c", 0);
+	TEST(playqueue_pending() == 3 && playqueue_length() == 1, "albums added before browsed");
+	stub_albumbrowse_complete();
+	TEST(playqueue_pending() == 0 && playqueue_length() == 9, "albums not added once browsed");
+
+	test_pop(9, order, "albums");
+	test_pop(0, NULL, "albums");
+	test_teardown("albums");
+
+	/* The same with each browse done before the next album is asked for */
+	test_setup_albums(tracks);
+	test_add("spotify:track:0", 0);
+	test_add("spotify:album:a", 1);
+	stub_albumbrowse_complete();
+	test_add("spotify:album:b", 1);
+	stub_albumbrowse_complete();
+	test_add("spotify:album:c", 0);
+	stub_albumbrowse_complete();
+	test_pop(9, order, "albums one by one");
+	test_pop(0, NULL, "albums one by one");
+
+	/* Cleared while browsing: nothing arrives afterwards */
+	test_add("spotify:album:a", 0);
+	playqueue_clear();
+	stub_albumbrowse_complete();
+	TEST(playqueue_length() == 0 && playqueue_pending() == 0, "album added after clearing");
+	test_teardown("albums one by one");
+}
+
+static void test_playlists(void) {
+	int order[TEST_BIG_PLAYLIST + 1], i;
+	sp_track *small[3];
+	sp_playlist *big, *pl;
+
+	test_setup();
+	big = stub_playlist("spotify:user:x:playlist:big", "Big", g_test.tracks + 100,
+		TEST_BIG_PLAYLIST);
+	for(i = 0; i < TEST_BIG_PLAYLIST; i++)
+		order[i] = 100 + i;
+	order[i] = 0;
+
+	/* Popped from while still being expanded after track 0 */
+	test_add("spotify:track:0", 0);
+	test_add("spotify:user:x:playlist:big", 1);
+	reactor_run(0);
+	TEST(playqueue_length() == PLAYQUEUE_EXPAND_BATCH + 1 && playqueue_pending() == 1,
+		"%d queued after one batch", playqueue_length());
+	test_pop(10, order, "popped while expanding");
+	reactor_run(0);
+	test_pop(PLAYQUEUE_EXPAND_BATCH, order + 10, "popped while expanding");
+	test_pop(PLAYQUEUE_EXPAND_BATCH - 10, order + 10 + PLAYQUEUE_EXPAND_BATCH,
+		"emptied while expanding");
+	test_expand();
+	test_pop(TEST_BIG_PLAYLIST + 1 - 2 * PLAYQUEUE_EXPAND_BATCH, order + 2 * PLAYQUEUE_EXPAND_BATCH,
+		"popped while expanding");
+	test_pop(0, NULL, "popped while expanding");
+
+	/* Cleared in the middle, expansion stops */
+	test_add("spotify:user:x:playlist:big", 0);
+	reactor_run(0);
+	playqueue_clear();
+	test_expand();
+	TEST(playqueue_length() == 0 && playqueue_pending() == 0 && big->refs == 0,
+		"expansion went on after clearing");
+
+	/* Waiting for the playlist to load */
+	small[0] = g_test.tracks[1];
+	small[1] = g_test.tracks[2];
+	small[2] = g_test.tracks[3];
+	pl = stub_playlist("spotify:user:x:playlist:small", "Small", small, 3);
+	pl->loaded = 0;
+	test_add("spotify:user:x:playlist:small", 0);
+	test_expand();
+	TEST(playqueue_length() == 0 && playqueue_pending() == 1, "unloaded playlist added");
+	stub_playlist_loaded(pl);
+	test_expand();
+	test_pop(3, (int []){ 1, 2, 3 }, "loaded later");
+	test_teardown("playlists");
+}
+
+/* Playlists left unloaded (-L) are only kept in RAM while needed */
+static void test_lazy(void) {
+	sp_playlist *pl;
+
+	test_setup();
+	pl = stub_playlist("spotify:user:x:playlist:lazy", "Lazy", g_test.tracks + 100, 300);
+	pl->in_ram = 0;
+	test_add("spotify:user:x:playlist:lazy", 0);
+	TEST(pl->in_ram, "playlist not loaded to be queued");
+	test_expand();
+	TEST(!pl->in_ram && playqueue_length() == 300, "playlist left loaded after adding it");
+
+	/* Queued twice, unloaded after the second is done */
+	pl->in_ram = 0;
+	test_add("spotify:user:x:playlist:lazy", 0);
+	test_add("spotify:user:x:playlist:lazy", 1);
+	reactor_run(0);
+	TEST(pl->in_ram, "playlist unloaded while still being queued");
+	test_expand();
+	TEST(!pl->in_ram && playqueue_length() == 900, "playlist queued twice left loaded");
+
+	/* The active playlist stays */
+	pl->in_ram = 0;
+	g_test.active = pl;
+	test_add("spotify:user:x:playlist:lazy", 0);
+	test_expand();
+	TEST(pl->in_ram, "active playlist unloaded");
+
+	/* Loaded already, it's left alone */
+	g_test.active = NULL;
+	test_add("spotify:user:x:playlist:lazy", 0);
+	test_expand();
+	TEST(pl->in_ram, "playlist loaded by someone else unloaded");
+
+	playqueue_clear();
+	test_teardown("lazy");
+}
+
+int main(int argc, char **argv) {
+
+	openlog("queue-order", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+	reactor_init();
+
+	test_tracks();
+	test_albums();
+	test_playlists();
+	test_lazy();
+
+	if(g_test.failed) {
+		fprintf(stderr, "queue-order: %d failed\n", g_test.failed);
+		return 1;
+	}
+
+	printf("queue-order: OK\n");
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/**
+ * search-index.c
+ * Track search over titles, artists and albums
+ *
+ * A few tracks are indexed and looked up: every word must match, in any
+ * field, as a prefix and regardless of case; unplayable tracks are left
+ * out and tracks indexed again only match their new metadata.  With
+ * "bench", builds an index of 100k tracks from a small vocabulary, so
+ * posting lists get long, and times queries against it.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../avail.h"
+#include "../search.h"
+
+#define BENCH_TRACKS		100000
+#define BENCH_QUERY_RUNS	20
+
+typedef struct {
+	const char *query;
+	int count;		/* Results expected */
+	const char *first;	/* Best match expected, or NULL */
+} test_query_t;
+
+static const char *bench_words[] = {
+	"love", "night", "heart", "fire", "dance", "dream", "blue", "rain",
+	"summer", "road", "time", "light", "girl", "home", "baby", "world",
+	"sky", "gold", "river", "moon"
+};
+
+static uint64_t rng = 1;
+
+/* As in mdindex.c, which the index shares its hash with */
+uint32_t mdindex_hash(const char *s) {
+	uint32_t h = 2166136261u;
+
+	while(*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static uint32_t test_random(void) {
+
+	/* xorshift64* */
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+
+	return (uint32_t)((rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static double test_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int test_queries(const test_query_t *q, int num_queries) {
+	search_result_t results[SEARCH_MAX_RESULTS];
+	int i, n, failed = 0;
+
+	for(i = 0; i < num_queries; i++) {
+		n = search_query(q[i].query, results, SEARCH_MAX_RESULTS);
+		if(n != q[i].count || (q[i].first != NULL && strcmp(results[0].uri, q[i].first))) {
+			fprintf(stderr, "FAIL: '%s' gave %d results, best %s; expected %d, best %s\n",
+				q[i].query, n, n? results[0].uri: "none", q[i].count,
+				q[i].first? q[i].first: "any");
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+static int test_search(void) {
+	static const test_query_t queries[] = {
+		{ "queen", 3, "spotify:track:d" },
+		{ "dont stop", 1, "spotify:track:a" },
+		{ "boh QUE", 1, "spotify:track:b" },
+		{ "zzz queen", 0, NULL },
+		{ "", 0, NULL },
+	};
+	static const test_query_t requeried[] = {
+		{ "bohemian", 0, NULL },
+		{ "radio", 1, "spotify:track:b" },
+		{ "queen", 3, NULL },
+	};
+	int tracks, terms, failed;
+	size_t bytes;
+
+	search_add("spotify:track:a", "Don't Stop Me Now", "Queen", "Jazz", AVAIL_PLAYABLE);
+	search_add("spotify:track:b", "Bohemian Rhapsody", "Queen", "A Night at the Opera", AVAIL_PLAYABLE);
+	search_add("spotify:track:c", "Queen of Hearts", "Someone", "Queen", AVAIL_UNPLAYABLE);
+	search_add("spotify:track:d", "Killer Queen", "QUEEN", "Sheer Heart Attack", AVAIL_UNKNOWN);
+	failed = test_queries(queries, sizeof(queries) / sizeof(queries[0]));
+
+	/* Same track, new metadata */
+	search_add("spotify:track:b", "Radio Ga Ga", "Queen", "The Works", AVAIL_PLAYABLE);
+	failed += test_queries(requeried, sizeof(requeried) / sizeof(requeried[0]));
+
+	search_get_stats(&tracks, &terms, &bytes);
+	if(tracks != 4) {
+		fprintf(stderr, "FAIL: %d tracks indexed, expected 4\n", tracks);
+		failed++;
+	}
+
+	search_reset();
+
+	return failed;
+}
+
+static void bench_search(void) {
+	static const char *queries[] = {
+		"love", "night fire", "artist12", "bl", "moon river 42", "album1999 gold"
+	};
+	search_result_t results[SEARCH_MAX_RESULTS];
+	char uri[64], title[128], artist[64], album[96];
+	double start, built;
+	int i, j, n = 0, tracks, terms;
+	size_t bytes;
+
+	start = test_now();
+	for(i = 0; i < BENCH_TRACKS; i++) {
+		snprintf(uri, sizeof(uri), "spotify:track:%022d", i);
+		snprintf(title, sizeof(title), "%s %s %s %u",
+			bench_words[test_random() % 20], bench_words[test_random() % 20],
+			bench_words[test_random() % 20], test_random() % 500);
+		snprintf(artist, sizeof(artist), "Artist%u %s",
+			test_random() % 8000, bench_words[test_random() % 20]);
+		snprintf(album, sizeof(album), "Album%u %s",
+			test_random() % 20000, bench_words[test_random() % 20]);
+		search_add(uri, title, artist, album,
+			test_random() % 10? AVAIL_PLAYABLE: AVAIL_UNPLAYABLE);
+	}
+	built = test_now();
+
+	search_get_stats(&tracks, &terms, &bytes);
+	printf("%d tracks: indexed in %.1f ms, %d words, %.1f MB\n",
+		tracks, (built - start) * 1e3, terms, bytes / 1e6);
+
+	for(i = 0; i < (int)(sizeof(queries) / sizeof(queries[0])); i++) {
+		start = test_now();
+		for(j = 0; j < BENCH_QUERY_RUNS; j++)
+			n = search_query(queries[i], results, SEARCH_MAX_RESULTS);
+
+		printf("query '%s': %d results in %.2f ms\n", queries[i], n,
+			(test_now() - start) / BENCH_QUERY_RUNS * 1e3);
+	}
+
+	search_reset();
+}
+
+int main(int argc, char **argv) {
+
+	if(argc > 1 && !strcmp(argv[1], "bench")) {
+		bench_search();
+		return 0;
+	}
+
+	if(test_search()) {
+		fprintf(stderr, "search-index: failed\n");
+		return 1;
+	}
+
+	printf("search-index: OK\n");
+
+	return 0;
+}
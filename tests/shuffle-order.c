@@ -0,0 +1,449 @@
+/**
+ * shuffle-order.c
+ * Play order kept up with playlist edits
+ *
+ * Random inserts, removals, moves and swaps are made to a playlist and
+ * to its shuffle; the play order must always be what a plain array model
+ * of both gives, and inserts must leave the tracks already played alone.
+ * Shuffles must also be uniform, the same again for the same seed, and
+ * in spread mode have fewer tracks by the same artist or from the same
+ * album back to back.  With "bench", times edits on a 100k track shuffle
+ * instead, against shuffling everything anew on every edit as was done
+ * before, and shuffling 50k tracks with and without spread.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../shuffle.h"
+
+#define TEST_MAX_TRACKS		4096
+#define TEST_EDITS		20000
+#define BENCH_TRACKS		100000
+#define BENCH_EDITS		100000
+#define BENCH_SPREAD_TRACKS	50000
+
+/* Shuffles of TEST_UNIFORM_TRACKS tracks made to check for bias; each
+ * track must land in each place within TEST_UNIFORM_TOLERANCE of 1/n */
+#define TEST_UNIFORM_TRACKS	5
+#define TEST_UNIFORM_RUNS	200000
+#define TEST_UNIFORM_TOLERANCE	0.03
+
+/* Model: track ids by playlist position, and by play order */
+static struct {
+	int playlist[TEST_MAX_TRACKS];
+	int order[TEST_MAX_TRACKS];
+	int num_tracks;
+	int next_id;
+	uint64_t rng;
+} m;
+
+static uint32_t test_random(void) {
+
+	/* xorshift64* */
+	m.rng ^= m.rng >> 12;
+	m.rng ^= m.rng << 25;
+	m.rng ^= m.rng >> 27;
+
+	return (uint32_t)((m.rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static double test_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int test_position(int id) {
+	int i;
+
+	for(i = 0; i < m.num_tracks; i++) {
+		if(m.playlist[i] == id)
+			return i;
+	}
+
+	return -1;
+}
+
+static int test_check(shuffle_t *s, const char *after) {
+	char seen[TEST_MAX_TRACKS];
+	int i, pos;
+
+	if(shuffle_size(s) != m.num_tracks) {
+		fprintf(stderr, "FAIL: after %s, %d tracks in the shuffle, expected %d\n",
+			after, shuffle_size(s), m.num_tracks);
+		return -1;
+	}
+
+	/* Every position played once, and each where the model has it */
+	memset(seen, 0, sizeof(seen));
+	for(i = 0; i < m.num_tracks; i++) {
+		pos = shuffle_track(s, i);
+		if(pos < 0 || pos >= m.num_tracks || seen[pos]++) {
+			fprintf(stderr, "FAIL: after %s, index %d plays position %d twice or out of range\n",
+				after, i, pos);
+			return -1;
+		}
+
+		if(pos != test_position(m.order[i])) {
+			fprintf(stderr, "FAIL: after %s, index %d plays position %d, expected %d\n",
+				after, i, pos, test_position(m.order[i]));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* New tracks go anywhere in the order after what's been played */
+static int test_insert(shuffle_t *s) {
+	int before[TEST_MAX_TRACKS];
+	int i, pos, count, played;
+
+	pos = test_random() % (m.num_tracks + 1);
+	count = 1 + test_random() % 3;
+	played = test_random() % (m.num_tracks + 1);
+	if(m.num_tracks + count > TEST_MAX_TRACKS)
+		return 0;
+
+	memcpy(before, m.order, m.num_tracks * sizeof(int));
+	memmove(m.playlist + pos + count, m.playlist + pos, (m.num_tracks - pos) * sizeof(int));
+	for(i = 0; i < count; i++)
+		m.playlist[pos + i] = m.next_id++;
+	m.num_tracks += count;
+
+	if(shuffle_insert(s, pos, count, played) < 0) {
+		fprintf(stderr, "FAIL: insert of %d tracks at %d\n", count, pos);
+		return -1;
+	}
+
+	/* Where they went is up to the shuffle, take it over */
+	for(i = 0; i < m.num_tracks; i++)
+		m.order[i] = m.playlist[shuffle_track(s, i)];
+
+	for(i = 0; i < played; i++) {
+		if(m.order[i] != before[i]) {
+			fprintf(stderr, "FAIL: insert at %d changed the %d tracks played\n", pos, played);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int test_remove(shuffle_t *s) {
+	int pos, id, index;
+
+	if(m.num_tracks == 0)
+		return 0;
+
+	pos = test_random() % m.num_tracks;
+	id = m.playlist[pos];
+	index = shuffle_remove(s, pos);
+	if(index < 0 || index >= m.num_tracks || m.order[index] != id) {
+		fprintf(stderr, "FAIL: removing position %d returned index %d\n", pos, index);
+		return -1;
+	}
+
+	m.num_tracks--;
+	memmove(m.playlist + pos, m.playlist + pos + 1, (m.num_tracks - pos) * sizeof(int));
+	memmove(m.order + index, m.order + index + 1, (m.num_tracks - index) * sizeof(int));
+
+	return 0;
+}
+
+/* As libspotify reports it: positions before the move, and where to */
+static int test_move(shuffle_t *s) {
+	int positions[3], ids[3], rest[TEST_MAX_TRACKS];
+	int i, j, k, count, new_position, dest, n;
+
+	if(m.num_tracks < 4)
+		return 0;
+
+	count = 1 + test_random() % 3;
+	for(k = 0; k < count; ) {
+		positions[k] = test_random() % m.num_tracks;
+		for(j = 0; j < k && positions[j] != positions[k]; j++);
+		if(j == k)
+			ids[k] = m.playlist[positions[k]], k++;
+	}
+	new_position = test_random() % (m.num_tracks + 1);
+
+	/* Take the tracks out and put them back where new_position ends up */
+	for(dest = new_position, i = 0; i < count; i++) {
+		if(positions[i] < new_position)
+			dest--;
+	}
+
+	for(n = 0, i = 0; i < m.num_tracks; i++) {
+		for(j = 0; j < count && m.playlist[i] != ids[j]; j++);
+		if(j == count)
+			rest[n++] = m.playlist[i];
+	}
+	memmove(rest + dest + count, rest + dest, (n - dest) * sizeof(int));
+	for(i = 0; i < count; i++)
+		rest[dest + i] = ids[i];
+	memcpy(m.playlist, rest, m.num_tracks * sizeof(int));
+
+	shuffle_move(s, positions, count, new_position);
+
+	return 0;
+}
+
+static int test_swap(shuffle_t *s) {
+	int a, b, id;
+
+	if(m.num_tracks < 2)
+		return 0;
+
+	a = test_random() % m.num_tracks;
+	b = test_random() % m.num_tracks;
+	id = m.order[a];
+	m.order[a] = m.order[b];
+	m.order[b] = id;
+	shuffle_swap(s, a, b);
+
+	return 0;
+}
+
+static int test_edits(void) {
+	static const char *names[] = { "insert", "remove", "move", "swap" };
+	int (*edits[])(shuffle_t *) = { test_insert, test_remove, test_move, test_swap };
+	shuffle_t *s;
+	int i, op, ret = 0;
+
+	m.rng = 0x9e3779b97f4a7c15ULL;
+	m.num_tracks = m.next_id = 50;
+	for(i = 0; i < m.num_tracks; i++)
+		m.playlist[i] = i;
+
+	s = shuffle_create(m.num_tracks, 1, NULL);
+	for(i = 0; i < m.num_tracks; i++)
+		m.order[i] = m.playlist[shuffle_track(s, i)];
+
+	for(i = 0; i < TEST_EDITS && ret == 0; i++) {
+		op = test_random() % 4;
+		if((ret = edits[op](s)) == 0 && (i % 97 == 0 || i == TEST_EDITS - 1))
+			ret = test_check(s, names[op]);
+	}
+
+	shuffle_release(s);
+
+	return ret;
+}
+
+/* Every track as likely in every place, including its own */
+static int test_uniform(void) {
+	int counts[TEST_UNIFORM_TRACKS][TEST_UNIFORM_TRACKS];
+	double expect = (double)TEST_UNIFORM_RUNS / TEST_UNIFORM_TRACKS;
+	shuffle_t *s;
+	int i, j;
+
+	memset(counts, 0, sizeof(counts));
+	for(i = 0; i < TEST_UNIFORM_RUNS; i++) {
+		s = shuffle_create(TEST_UNIFORM_TRACKS, i + 1, NULL);
+		for(j = 0; j < TEST_UNIFORM_TRACKS; j++)
+			counts[shuffle_track(s, j)][j]++;
+		shuffle_release(s);
+	}
+
+	for(i = 0; i < TEST_UNIFORM_TRACKS; i++) {
+		for(j = 0; j < TEST_UNIFORM_TRACKS; j++) {
+			if(counts[i][j] < expect * (1 - TEST_UNIFORM_TOLERANCE)
+				|| counts[i][j] > expect * (1 + TEST_UNIFORM_TOLERANCE)) {
+				fprintf(stderr, "FAIL: position %d played at index %d %d times out of %d, "
+					"expected about %.0f\n", i, j, counts[i][j], TEST_UNIFORM_RUNS, expect);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int test_seed(void) {
+	shuffle_t *a, *b, *c;
+	int i, same = 1, differ = 0, ret = 0;
+
+	a = shuffle_create(1000, 42, NULL);
+	b = shuffle_create(1000, 42, NULL);
+	c = shuffle_create(1000, 43, NULL);
+	for(i = 0; i < 1000; i++) {
+		same &= shuffle_track(a, i) == shuffle_track(b, i);
+		differ |= shuffle_track(a, i) != shuffle_track(c, i);
+	}
+
+	if(shuffle_seed(a) != 42 || !same || !differ) {
+		fprintf(stderr, "FAIL: seed %lu, same order for the same seed %d, "
+			"for another seed %d\n", (unsigned long)shuffle_seed(a), same, !differ);
+		ret = -1;
+	}
+
+	shuffle_release(a);
+	shuffle_release(b);
+	shuffle_release(c);
+
+	return ret;
+}
+
+/* A few artists with many tracks and a long tail, three albums each */
+static shuffle_key_t *test_keys(int n) {
+	shuffle_key_t *keys = malloc(n * sizeof(shuffle_key_t));
+	double u;
+	int i, artist;
+
+	for(i = 0; i < n; i++) {
+		u = (test_random() + 1.0) / 4294967296.0;
+		artist = 1 + (int)(1 / (u * u)) % 3000;
+		keys[i].artist = artist;
+		keys[i].album = artist * 10 + 1 + test_random() % 3;
+	}
+
+	return keys;
+}
+
+/* Tracks by the same artist or from the same album one after another */
+static int test_adjacent(shuffle_t *s, const shuffle_key_t *keys) {
+	int i, prev, pos, n = 0;
+
+	prev = shuffle_track(s, 0);
+	for(i = 1; i < shuffle_size(s); i++) {
+		pos = shuffle_track(s, i);
+		if(keys[pos].artist == keys[prev].artist || keys[pos].album == keys[prev].album)
+			n++;
+		prev = pos;
+	}
+
+	return n;
+}
+
+static int test_spread(void) {
+	char seen[TEST_MAX_TRACKS];
+	shuffle_key_t *keys;
+	shuffle_t *plain, *spread;
+	int i, pos, ret = 0;
+
+	m.rng = 7;
+	keys = test_keys(TEST_MAX_TRACKS);
+	plain = shuffle_create(TEST_MAX_TRACKS, 7, NULL);
+	spread = shuffle_create(TEST_MAX_TRACKS, 7, keys);
+
+	memset(seen, 0, sizeof(seen));
+	for(i = 0; i < TEST_MAX_TRACKS && ret == 0; i++) {
+		pos = shuffle_track(spread, i);
+		if(pos < 0 || pos >= TEST_MAX_TRACKS || seen[pos]++) {
+			fprintf(stderr, "FAIL: spread shuffle plays position %d twice or out of range\n", pos);
+			ret = -1;
+		}
+	}
+
+	if(ret == 0 && test_adjacent(spread, keys) >= test_adjacent(plain, keys) / 2) {
+		fprintf(stderr, "FAIL: %d tracks by the same artist or album back to back with spread, "
+			"%d without\n", test_adjacent(spread, keys), test_adjacent(plain, keys));
+		ret = -1;
+	}
+
+	shuffle_release(plain);
+	shuffle_release(spread);
+	free(keys);
+
+	return ret;
+}
+
+/* Edits on a large playlist while it's being played through */
+static void bench_edits(void) {
+	shuffle_t *s;
+	int i, n, pos, tmp, played = 0, *order;
+	double start, created, edited;
+
+	m.rng = 1;
+	start = test_now();
+	s = shuffle_create(BENCH_TRACKS, 1, NULL);
+	created = test_now();
+
+	for(i = 0; i < BENCH_EDITS; i++) {
+		n = shuffle_size(s);
+		switch(test_random() % 3) {
+		case 0:
+			shuffle_insert(s, test_random() % (n + 1), 1, played);
+			break;
+		case 1:
+			shuffle_remove(s, test_random() % n);
+			break;
+		case 2:
+			pos = test_random() % n;
+			shuffle_move(s, &pos, 1, test_random() % (n + 1));
+			break;
+		}
+
+		if(i % 10 == 0)
+			shuffle_track(s, played++ % shuffle_size(s));
+	}
+	edited = test_now();
+	shuffle_release(s);
+
+	printf("%d tracks: shuffled in %.1f ms, %.2f us per edit\n", BENCH_TRACKS,
+		(created - start) * 1e3, (edited - created) / BENCH_EDITS * 1e6);
+
+	/* What every edit used to cost */
+	order = malloc(BENCH_TRACKS * sizeof(int));
+	start = test_now();
+	for(i = 0; i < 100; i++) {
+		for(n = 0; n < BENCH_TRACKS; n++)
+			order[n] = n;
+		for(n = BENCH_TRACKS - 1; n > 0; n--) {
+			pos = test_random() % (n + 1);
+			tmp = order[n];
+			order[n] = order[pos];
+			order[pos] = tmp;
+		}
+	}
+	printf("%d tracks: shuffled anew on every edit, %.2f ms per edit\n", BENCH_TRACKS,
+		(test_now() - start) / 100 * 1e3);
+	free(order);
+}
+
+static void bench_spread(void) {
+	shuffle_key_t *keys;
+	shuffle_t *plain, *spread;
+	double start, shuffled, spread_out;
+
+	m.rng = 1;
+	keys = test_keys(BENCH_SPREAD_TRACKS);
+
+	start = test_now();
+	plain = shuffle_create(BENCH_SPREAD_TRACKS, 7, NULL);
+	shuffled = test_now();
+	spread = shuffle_create(BENCH_SPREAD_TRACKS, 7, keys);
+	spread_out = test_now();
+
+	printf("%d tracks: shuffled in %.1f ms, %d by the same artist or album back to back\n",
+		BENCH_SPREAD_TRACKS, (shuffled - start) * 1e3, test_adjacent(plain, keys));
+	printf("%d tracks: spread out in %.1f ms, %d by the same artist or album back to back\n",
+		BENCH_SPREAD_TRACKS, (spread_out - shuffled) * 1e3, test_adjacent(spread, keys));
+
+	shuffle_release(plain);
+	shuffle_release(spread);
+	free(keys);
+}
+
+int main(int argc, char **argv) {
+
+	if(argc > 1 && !strcmp(argv[1], "bench")) {
+		bench_edits();
+		bench_spread();
+		return 0;
+	}
+
+	if(test_edits() < 0 || test_uniform() < 0 || test_seed() < 0 || test_spread() < 0)
+		return 1;
+
+	printf("shuffle-order: OK\n");
+
+	return 0;
+}
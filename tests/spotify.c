@@ -0,0 +1,424 @@
+/**
+ * spotify.c
+ * Stand-in for the parts of libspotify the metadata index, the play
+ * queue, the availability index and prefetching use, so they can be
+ * tested without a Spotify session
+ *
+ * Tracks, albums and playlists are made up by the tests and found again
+ * by URI.  Everything is loaded from the start unless a test says
+ * otherwise; album browses complete when the test asks them to.
+ * References and audio prefetches are counted so tests can check
+ * nothing is leaked or asked for twice.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spotify.h"
+
+#define STUB_MAX_OBJECTS	1024
+#define STUB_MAX_BROWSES	64
+
+struct sp_link {
+	sp_linktype type;
+	const char *uri;
+	void *obj;
+};
+
+typedef struct {
+	sp_linktype type;
+	const char *uri;
+	void *obj;
+
+	/* Tracks of an album */
+	sp_track **tracks;
+	int num_tracks;
+} stub_object_t;
+
+static struct {
+	stub_object_t objects[STUB_MAX_OBJECTS];
+	int num_objects;
+	sp_albumbrowse *browses[STUB_MAX_BROWSES];
+	int num_browses;
+} g_spotify;
+
+
+static void *stub_register(sp_linktype type, const char *uri, void *obj) {
+	stub_object_t *o;
+
+	if(obj == NULL || g_spotify.num_objects == STUB_MAX_OBJECTS) {
+		fprintf(stderr, "spotify: out of stub objects\n");
+		exit(1);
+	}
+
+	o = &g_spotify.objects[g_spotify.num_objects++];
+	o->type = type;
+	o->uri = uri;
+	o->obj = obj;
+
+	return obj;
+}
+
+static stub_object_t *stub_find(const char *uri, const void *obj) {
+	int i;
+
+	for(i = 0; i < g_spotify.num_objects; i++)
+		if((uri != NULL && !strcmp(g_spotify.objects[i].uri, uri)) || g_spotify.objects[i].obj == obj)
+			return &g_spotify.objects[i];
+
+	return NULL;
+}
+
+sp_track *stub_track(const char *uri, const char *title, const char *artist,
+		const char *album, int duration_ms) {
+	sp_track *t = calloc(1, sizeof(*t));
+
+	if(t != NULL) {
+		t->uri = uri;
+		t->title = title;
+		t->artist.name = artist;
+		t->album.name = album;
+		t->duration_ms = duration_ms;
+		t->loaded = 1;
+		t->available = 1;
+	}
+
+	return stub_register(SP_LINKTYPE_TRACK, uri, t);
+}
+
+sp_playlist *stub_playlist(const char *uri, const char *name, sp_track **tracks, int num_tracks) {
+	sp_playlist *pl = calloc(1, sizeof(*pl));
+
+	if(pl != NULL) {
+		pl->uri = uri;
+		pl->name = name;
+		pl->tracks = tracks;
+		pl->num_tracks = num_tracks;
+		pl->loaded = 1;
+		pl->in_ram = 1;
+	}
+
+	return stub_register(SP_LINKTYPE_PLAYLIST, uri, pl);
+}
+
+sp_album *stub_album(const char *uri, const char *name, sp_track **tracks, int num_tracks) {
+	stub_object_t *o;
+	sp_album *a = calloc(1, sizeof(*a));
+
+	if(a != NULL)
+		a->name = name;
+
+	stub_register(SP_LINKTYPE_ALBUM, uri, a);
+	o = &g_spotify.objects[g_spotify.num_objects - 1];
+	o->tracks = tracks;
+	o->num_tracks = num_tracks;
+
+	return a;
+}
+
+int stub_albumbrowse_complete(void) {
+	sp_albumbrowse *b;
+	int i, n = g_spotify.num_browses;
+
+	/* Callbacks may start new browses */
+	g_spotify.num_browses = 0;
+	for(i = 0; i < n; i++) {
+		b = g_spotify.browses[i];
+		b->done = 1;
+		b->cb(b, b->userdata);
+		sp_albumbrowse_release(b);
+	}
+
+	return n;
+}
+
+void stub_playlist_loaded(sp_playlist *pl) {
+
+	pl->loaded = 1;
+	if(pl->callbacks != NULL && pl->callbacks->playlist_state_changed != NULL)
+		pl->callbacks->playlist_state_changed(pl, pl->userdata);
+}
+
+int stub_spotify_reset(void) {
+	stub_object_t *o;
+	int i, refs = 0;
+
+	for(i = 0; i < g_spotify.num_objects; i++) {
+		o = &g_spotify.objects[i];
+		if(o->type == SP_LINKTYPE_TRACK)
+			refs += ((sp_track *)o->obj)->refs;
+		else if(o->type == SP_LINKTYPE_PLAYLIST)
+			refs += ((sp_playlist *)o->obj)->refs;
+
+		free(o->obj);
+	}
+
+	g_spotify.num_objects = 0;
+
+	return refs;
+}
+
+const char *sp_error_message(sp_error error) {
+
+	return error == SP_ERROR_OK? "no error": "stub error";
+}
+
+sp_link *sp_link_create_from_string(const char *link) {
+	stub_object_t *o;
+	sp_link *l;
+
+	if((o = stub_find(link, NULL)) == NULL || (l = malloc(sizeof(*l))) == NULL)
+		return NULL;
+
+	l->type = o->type;
+	l->uri = o->uri;
+	l->obj = o->obj;
+
+	return l;
+}
+
+static sp_link *stub_link(const void *obj) {
+	stub_object_t *o;
+
+	if((o = stub_find(NULL, obj)) == NULL)
+		return NULL;
+
+	return sp_link_create_from_string(o->uri);
+}
+
+sp_link *sp_link_create_from_playlist(sp_playlist *playlist) {
+
+	return stub_link(playlist);
+}
+
+sp_link *sp_link_create_from_track(sp_track *track, int offset) {
+
+	return stub_link(track);
+}
+
+int sp_link_as_string(sp_link *link, char *buffer, int buffer_size) {
+
+	return snprintf(buffer, buffer_size, "%s", link->uri);
+}
+
+sp_linktype sp_link_type(sp_link *link) {
+
+	return link->type;
+}
+
+sp_track *sp_link_as_track(sp_link *link) {
+
+	return link->type == SP_LINKTYPE_TRACK? link->obj: NULL;
+}
+
+sp_album *sp_link_as_album(sp_link *link) {
+
+	return link->type == SP_LINKTYPE_ALBUM? link->obj: NULL;
+}
+
+sp_error sp_link_release(sp_link *link) {
+
+	free(link);
+
+	return SP_ERROR_OK;
+}
+
+bool sp_track_is_loaded(sp_track *track) {
+
+	return track->loaded;
+}
+
+sp_error sp_track_error(sp_track *track) {
+
+	return track->loaded? SP_ERROR_OK: SP_ERROR_IS_LOADING;
+}
+
+const char *sp_track_name(sp_track *track) {
+
+	return track->title;
+}
+
+int sp_track_num_artists(sp_track *track) {
+
+	return track->artist.name != NULL;
+}
+
+sp_artist *sp_track_artist(sp_track *track, int index) {
+
+	return &track->artist;
+}
+
+sp_album *sp_track_album(sp_track *track) {
+
+	return track->album.name != NULL? &track->album: NULL;
+}
+
+int sp_track_duration(sp_track *track) {
+
+	return track->duration_ms;
+}
+
+sp_track_availability sp_track_get_availability(sp_session *session, sp_track *track) {
+
+	return track->available? SP_TRACK_AVAILABILITY_AVAILABLE: SP_TRACK_AVAILABILITY_UNAVAILABLE;
+}
+
+sp_track_offline_status sp_track_offline_get_status(sp_track *track) {
+
+	return SP_TRACK_OFFLINE_NO;
+}
+
+sp_error sp_session_player_prefetch(sp_session *session, sp_track *track) {
+
+	if(!track->available)
+		return SP_ERROR_TRACK_NOT_PLAYABLE;
+
+	track->prefetched++;
+
+	return SP_ERROR_OK;
+}
+
+sp_error sp_track_add_ref(sp_track *track) {
+
+	track->refs++;
+
+	return SP_ERROR_OK;
+}
+
+sp_error sp_track_release(sp_track *track) {
+
+	track->refs--;
+
+	return SP_ERROR_OK;
+}
+
+const char *sp_artist_name(sp_artist *artist) {
+
+	return artist->name;
+}
+
+const char *sp_album_name(sp_album *album) {
+
+	return album->name;
+}
+
+sp_albumbrowse *sp_albumbrowse_create(sp_session *session, sp_album *album,
+		albumbrowse_complete_cb *callback, void *userdata) {
+	stub_object_t *o;
+	sp_albumbrowse *b;
+
+	if(g_spotify.num_browses == STUB_MAX_BROWSES || (o = stub_find(NULL, album)) == NULL
+		|| (b = calloc(1, sizeof(*b))) == NULL)
+		return NULL;
+
+	b->album = album;
+	b->tracks = o->tracks;
+	b->num_tracks = o->num_tracks;
+	b->cb = callback;
+	b->userdata = userdata;
+
+	/* One reference for the caller, one until it completes */
+	b->refs = 2;
+	g_spotify.browses[g_spotify.num_browses++] = b;
+
+	return b;
+}
+
+sp_error sp_albumbrowse_error(sp_albumbrowse *alb) {
+
+	return alb->done? SP_ERROR_OK: SP_ERROR_IS_LOADING;
+}
+
+int sp_albumbrowse_num_tracks(sp_albumbrowse *alb) {
+
+	return alb->num_tracks;
+}
+
+sp_track *sp_albumbrowse_track(sp_albumbrowse *alb, int index) {
+
+	return alb->tracks[index];
+}
+
+sp_error sp_albumbrowse_release(sp_albumbrowse *alb) {
+
+	if(--alb->refs == 0)
+		free(alb);
+
+	return SP_ERROR_OK;
+}
+
+sp_playlist *sp_playlist_create(sp_session *session, sp_link *link) {
+	sp_playlist *pl;
+
+	if(link->type != SP_LINKTYPE_PLAYLIST)
+		return NULL;
+
+	pl = link->obj;
+	pl->refs++;
+
+	return pl;
+}
+
+bool sp_playlist_is_loaded(sp_playlist *playlist) {
+
+	return playlist->loaded;
+}
+
+const char *sp_playlist_name(sp_playlist *playlist) {
+
+	return playlist->name;
+}
+
+int sp_playlist_num_tracks(sp_playlist *playlist) {
+
+	return playlist->loaded? playlist->num_tracks: 0;
+}
+
+sp_track *sp_playlist_track(sp_playlist *playlist, int index) {
+
+	return index < sp_playlist_num_tracks(playlist)? playlist->tracks[index]: NULL;
+}
+
+sp_error sp_playlist_add_ref(sp_playlist *playlist) {
+
+	playlist->refs++;
+
+	return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_release(sp_playlist *playlist) {
+
+	playlist->refs--;
+
+	return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_add_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata) {
+
+	playlist->callbacks = callbacks;
+	playlist->userdata = userdata;
+
+	return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_remove_callbacks(sp_playlist *playlist, sp_playlist_callbacks *callbacks, void *userdata) {
+
+	if(playlist->callbacks == callbacks && playlist->userdata == userdata)
+		playlist->callbacks = NULL;
+
+	return SP_ERROR_OK;
+}
+
+bool sp_playlist_is_in_ram(sp_session *session, sp_playlist *playlist) {
+
+	return playlist->in_ram;
+}
+
+sp_error sp_playlist_set_in_ram(sp_session *session, sp_playlist *playlist, bool in_ram) {
+
+	playlist->in_ram = in_ram;
+
+	return SP_ERROR_OK;
+}
@@ -0,0 +1,70 @@
+/**
+ * spotify.h
+ *
+ */
+
+#ifndef SPOTIFY_H
+#define SPOTIFY_H
+
+#include <libspotify/api.h>
+
+struct sp_artist {
+	const char *name;
+};
+
+struct sp_album {
+	const char *name;
+};
+
+struct sp_track {
+	const char *uri;
+	const char *title;
+	sp_artist artist;
+	sp_album album;
+	int duration_ms;
+	int loaded;
+	int available;
+	int refs;
+
+	/* Audio prefetches asked for */
+	int prefetched;
+};
+
+struct sp_playlist {
+	const char *uri;
+	const char *name;
+	sp_track **tracks;
+	int num_tracks;
+	int loaded;
+	int in_ram;
+	int refs;
+	sp_playlist_callbacks *callbacks;
+	void *userdata;
+};
+
+struct sp_albumbrowse {
+	sp_album *album;
+	sp_track **tracks;
+	int num_tracks;
+	albumbrowse_complete_cb *cb;
+	void *userdata;
+	int done;
+	int refs;
+};
+
+/* Make an object known to sp_link_create_from_string() by its URI */
+sp_track *stub_track(const char *uri, const char *title, const char *artist,
+	const char *album, int duration_ms);
+sp_playlist *stub_playlist(const char *uri, const char *name, sp_track **tracks, int num_tracks);
+sp_album *stub_album(const char *uri, const char *name, sp_track **tracks, int num_tracks);
+
+/* Finish the album browses in flight, returns how many */
+int stub_albumbrowse_complete(void);
+
+/* Set loaded and tell the callbacks registered */
+void stub_playlist_loaded(sp_playlist *pl);
+
+/* Forget every object, returns the number of references still held */
+int stub_spotify_reset(void);
+
+#endif
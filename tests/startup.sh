@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# startup.sh
+# Time from startup to the first track playing, and the peak RSS by then,
+# with full and lazy (-L) playlist loading.
+#
+# Run from the source directory after a normal run has logged in, so the
+# credentials are remembered and tmp/ holds the cache.  Any arguments are
+# passed on to pi-boombox (e.g. a playlist link to start with):
+#   $ sh tests/startup.sh 5 [<username> [<password> [<spotify link>]]]
+#
+
+RUNS=${1:-3}
+[ $# -gt 0 ] && shift
+TIMEOUT=120
+LOG=${TMPDIR:-/tmp}/pi-boombox-startup.$$
+
+if [ ! -x ./pi-boombox ]; then
+	echo "Build pi-boombox first (make)" >&2
+	exit 1
+fi
+
+run() {
+	./pi-boombox -H 0 -s "" "$@" 2>"$LOG" &
+	pid=$!
+
+	i=0
+	while [ $i -lt $TIMEOUT ] && ! grep -q "First track playing" "$LOG"; do
+		sleep 1
+		i=$((i + 1))
+	done
+
+	kill $pid 2>/dev/null
+	wait $pid 2>/dev/null
+
+	# "App: First track playing 4.2s after startup with lazy playlist
+	# loading, peak RSS 41234 kB"
+	sed -n 's/.*First track playing \([0-9.]*\)s .* with \([a-z]*\) .*peak RSS \([0-9]*\) kB.*/\2 \1 \3/p' "$LOG"
+}
+
+for mode in full lazy; do
+	n=0
+	while [ $n -lt $RUNS ]; do
+		if [ $mode = lazy ]; then
+			run -L "$@"
+		else
+			run "$@"
+		fi
+		n=$((n + 1))
+	done
+done | awk '
+	{ secs[$1] += $2; if($3 > max[$1]) max[$1] = $3; runs[$1]++ }
+	END {
+		printf("%-5s %5s %12s %14s\n", "mode", "runs", "first audio", "peak RSS kB")
+		for(m in runs)
+			printf("%-5s %5d %11.1fs %14d\n", m, runs[m], secs[m] / runs[m], max[m])
+	}'
+
+rm -f "$LOG"
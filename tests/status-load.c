@@ -0,0 +1,345 @@
+/**
+ * status-load.c
+ * Many control clients polling "status json" while audio plays
+ *
+ * The control server (net.c, http.c, reactor.c and the status stand-in
+ * from stubs.c) runs on the main thread like in pi-boombox.  A timer on
+ * the main loop stands in for libspotify: every STATUS_TICK_MS it tops up
+ * an audio buffer of APP_BUFFER_MS, while an output thread drains it in
+ * real time and counts underruns when it runs dry.  So audio only stalls
+ * if serving clients holds up the main loop for longer than the buffer.
+ *
+ * Client threads each keep their share of the connections busy sending
+ * "status json" and waiting for the reply, and time every request.
+ *
+ *   status-load [<clients> [<seconds>]]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../app.h"
+#include "../net.h"
+#include "../reactor.h"
+#include "stubs.h"
+
+#define STATUS_PORT		12340
+#define STATUS_THREADS		8
+#define STATUS_TICK_MS		10
+
+typedef struct {
+	int fd;
+	double sent;	/* When the pending request went out */
+} status_conn_t;
+
+typedef struct {
+	pthread_t thread;
+	int num_conns;
+	status_conn_t *conns;
+
+	/* Latency of every request, in ms */
+	double *lat;
+	size_t num_lat, size_lat;
+	unsigned long errors;
+} status_client_t;
+
+static struct {
+	volatile int done;
+	int clients_ready;
+
+	/* Audio buffered, topped up by the main loop and drained by the output thread */
+	pthread_mutex_t mutex;
+	double buffered_ms;
+	double lowest_ms;
+	unsigned long underruns;
+
+	/* Main loop responsiveness, as seen by the libspotify stand-in */
+	int tick_timer;
+	double last_tick;
+	double longest_gap_ms;
+} g_load;
+
+static double load_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What sp_session_process_events() would deliver music from */
+static void load_tick(void *arg) {
+	double now = load_now();
+
+	if(g_load.last_tick && (now - g_load.last_tick) * 1000 > g_load.longest_gap_ms)
+		g_load.longest_gap_ms = (now - g_load.last_tick) * 1000;
+	g_load.last_tick = now;
+
+	pthread_mutex_lock(&g_load.mutex);
+	g_load.buffered_ms = APP_BUFFER_MS;
+	pthread_mutex_unlock(&g_load.mutex);
+
+	if(!g_load.done)
+		reactor_timer_set(g_load.tick_timer, STATUS_TICK_MS);
+}
+
+/* The audio device, taking STATUS_TICK_MS of audio every STATUS_TICK_MS */
+static void *load_output(void *arg) {
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(!g_load.done) {
+		next.tv_nsec += STATUS_TICK_MS * 1000000L;
+		if(next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		pthread_mutex_lock(&g_load.mutex);
+		if(g_load.buffered_ms < STATUS_TICK_MS) {
+			g_load.underruns++;
+			g_load.buffered_ms = 0;
+		}
+		else
+			g_load.buffered_ms -= STATUS_TICK_MS;
+
+		if(g_load.buffered_ms < g_load.lowest_ms)
+			g_load.lowest_ms = g_load.buffered_ms;
+		pthread_mutex_unlock(&g_load.mutex);
+	}
+
+	return NULL;
+}
+
+static int load_connect(void) {
+	struct sockaddr_in sin;
+	int fd, opt = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(STATUS_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+static void load_send(status_client_t *cl, status_conn_t *c) {
+	static const char request[] = "status json\n";
+
+	c->sent = load_now();
+	if(send(c->fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != sizeof(request) - 1)
+		cl->errors++;
+}
+
+static void load_record(status_client_t *cl, double ms) {
+
+	if(cl->num_lat == cl->size_lat) {
+		cl->size_lat = cl->size_lat? cl->size_lat * 2: 65536;
+		cl->lat = realloc(cl->lat, cl->size_lat * sizeof(double));
+	}
+
+	cl->lat[cl->num_lat++] = ms;
+}
+
+static void *load_client(void *arg) {
+	status_client_t *cl = arg;
+	struct pollfd *pfd;
+	char data[65536];
+	ssize_t n;
+	int i;
+
+	pfd = calloc(cl->num_conns, sizeof(*pfd));
+	for(i = 0; i < cl->num_conns; i++) {
+		if((cl->conns[i].fd = load_connect()) < 0) {
+			perror("connect");
+			exit(1);
+		}
+
+		pfd[i].fd = cl->conns[i].fd;
+		pfd[i].events = POLLIN;
+	}
+
+	__atomic_add_fetch(&g_load.clients_ready, cl->num_conns, __ATOMIC_RELAXED);
+	while(__atomic_load_n(&g_load.clients_ready, __ATOMIC_RELAXED) >= 0 && !g_load.done)
+		usleep(1000);
+
+	for(i = 0; i < cl->num_conns; i++)
+		load_send(cl, &cl->conns[i]);
+
+	while(!g_load.done) {
+		if(poll(pfd, cl->num_conns, 100) <= 0)
+			continue;
+
+		for(i = 0; i < cl->num_conns; i++) {
+			status_conn_t *c = &cl->conns[i];
+
+			if(!pfd[i].revents)
+				continue;
+
+			if((n = recv(c->fd, data, sizeof(data), MSG_DONTWAIT)) <= 0) {
+				if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+					cl->errors++;
+					pfd[i].fd = -1;
+				}
+				continue;
+			}
+
+			/* The JSON document is a single line */
+			if(data[n - 1] != '\n')
+				continue;
+
+			load_record(cl, (load_now() - c->sent) * 1000);
+			load_send(cl, c);
+		}
+	}
+
+	for(i = 0; i < cl->num_conns; i++)
+		close(cl->conns[i].fd);
+	free(pfd);
+
+	return NULL;
+}
+
+static int load_cmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y? -1: x > y;
+}
+
+static void load_raise_fd_limit(int need) {
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)need) {
+		rl.rlim_cur = rl.rlim_max < (rlim_t)need? rl.rlim_max: (rlim_t)need;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+int main(int argc, char **argv) {
+	status_client_t clients[STATUS_THREADS];
+	net_config_t config;
+	pthread_t output;
+	double *lat, start, secs;
+	size_t i, num_lat = 0;
+	unsigned long errors = 0;
+	int num_clients, seconds, t, connected;
+	unsigned long accepted, rejected, evicted;
+
+	num_clients = argc > 1? atoi(argv[1]): 1000;
+	seconds = argc > 2? atoi(argv[2]): 10;
+	if(num_clients < STATUS_THREADS || num_clients > NET_MAX_CLIENTS || seconds < 1) {
+		fprintf(stderr, "Usage: %s [<clients> (%d-%d) [<seconds>]]\n",
+			argv[0], STATUS_THREADS, NET_MAX_CLIENTS);
+		return 1;
+	}
+
+	openlog("status-load", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+	load_raise_fd_limit(2 * num_clients + 64);
+
+	memset(&config, 0, sizeof(config));
+	config.bind[0] = "127.0.0.1";
+	config.num_bind = 1;
+	config.port = STATUS_PORT;
+
+	if(reactor_init() < 0 || net_create(&config) < 0) {
+		fprintf(stderr, "Failed to listen on port %d\n", STATUS_PORT);
+		return 1;
+	}
+
+	pthread_mutex_init(&g_load.mutex, NULL);
+	g_load.buffered_ms = g_load.lowest_ms = APP_BUFFER_MS;
+	g_load.tick_timer = reactor_timer_create(load_tick, NULL);
+	reactor_timer_set(g_load.tick_timer, 0);
+
+	memset(clients, 0, sizeof(clients));
+	for(t = 0; t < STATUS_THREADS; t++) {
+		clients[t].num_conns = num_clients / STATUS_THREADS
+			+ (t < num_clients % STATUS_THREADS);
+		clients[t].conns = calloc(clients[t].num_conns, sizeof(status_conn_t));
+		pthread_create(&clients[t].thread, NULL, load_client, &clients[t]);
+	}
+
+	/* Accept everyone before audio starts and the clock runs */
+	do {
+		reactor_run(STATUS_TICK_MS);
+		net_get_stats(&connected, &accepted, &rejected, &evicted);
+	} while(connected < num_clients
+		|| __atomic_load_n(&g_load.clients_ready, __ATOMIC_RELAXED) < num_clients);
+
+	g_load.last_tick = 0;
+	g_load.longest_gap_ms = 0;
+	pthread_create(&output, NULL, load_output, NULL);
+	__atomic_store_n(&g_load.clients_ready, -1, __ATOMIC_RELAXED);
+
+	start = load_now();
+	while(load_now() - start < seconds)
+		reactor_run(-1);
+
+	g_load.done = 1;
+	secs = load_now() - start;
+	for(t = 0; t < STATUS_THREADS; t++) {
+		pthread_join(clients[t].thread, NULL);
+		num_lat += clients[t].num_lat;
+		errors += clients[t].errors;
+	}
+	pthread_join(output, NULL);
+
+	lat = malloc((num_lat + 1) * sizeof(double));
+	for(num_lat = 0, t = 0; t < STATUS_THREADS; t++) {
+		memcpy(lat + num_lat, clients[t].lat, clients[t].num_lat * sizeof(double));
+		num_lat += clients[t].num_lat;
+	}
+	qsort(lat, num_lat, sizeof(double), load_cmp);
+	if(num_lat == 0)
+		lat[0] = 0;
+
+	net_get_stats(&connected, &accepted, &rejected, &evicted);
+	printf("%d clients for %.1f s: %lu status replies (%.0f/s), %lu errors, %lu evicted\n",
+		num_clients, secs, (unsigned long)num_lat, num_lat / secs, errors, evicted);
+	printf("latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		lat[num_lat / 2], lat[num_lat * 99 / 100], lat[num_lat? num_lat - 1: 0]);
+	printf("audio: %lu underruns, lowest buffer %.0f of %d ms, "
+		"main loop ticks every %d ms at most %.1f ms apart\n",
+		g_load.underruns, g_load.lowest_ms, APP_BUFFER_MS,
+		STATUS_TICK_MS, g_load.longest_gap_ms);
+
+	for(i = 0; i < STATUS_THREADS; i++) {
+		free(clients[i].conns);
+		free(clients[i].lat);
+	}
+	free(lat);
+
+	reactor_timer_delete(g_load.tick_timer);
+	net_release();
+
+	return g_load.underruns || errors? 1: 0;
+}
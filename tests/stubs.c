@@ -0,0 +1,255 @@
+/**
+ * stubs.c
+ * Stand-ins for the application modules net.c and http.c call into, so
+ * the network code can be tested and benchmarked without libspotify
+ *
+ * Commands only change the flags below and say so; "status json" builds a
+ * document of roughly the size and shape of the real one every time.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../app.h"
+#include "../audio.h"
+#include "../json.h"
+#include "../mdindex.h"
+#include "../meter.h"
+#include "../player.h"
+#include "../playqueue.h"
+#include "../prefetch.h"
+#include "../search.h"
+#include "stubs.h"
+
+static struct {
+	int power_save;
+	int trim;
+	int shuffle_spread;
+	uint64_t shuffle_seed;
+	int prefetch_window;
+	int connection_type;
+} g_stub = { 0, 0, 0, 1, 2, 0 };
+
+unsigned long stub_status_requests;
+unsigned long stub_events[APP_MAX];
+
+static const char *stub_connection_types[] = {
+	"unknown", "none", "mobile", "wifi", "wired", "roaming", NULL
+};
+
+int app_gpio_fd(void) {
+
+	return -1;
+}
+
+const char *app_get_status(void) {
+
+	stub_status_requests++;
+
+	return "Playback: playing\n"
+		"Track: 03. Stub Artist - Stub Track (1:23/4:56)\n"
+		"Playlist: Stub playlist (120 tracks, loaded)\n"
+		"Queue: 0 tracks\n";
+}
+
+int app_get_status_json(buf_t *out) {
+	char name[32];
+	json_t j;
+	int i;
+
+	stub_status_requests++;
+
+	json_init(&j, out);
+	json_object_begin(&j, NULL);
+	json_string(&j, "type", "status");
+	json_int(&j, "version", 1);
+
+	json_object_begin(&j, "track");
+	json_bool(&j, "loaded", 1);
+	json_string(&j, "name", "Stub Track");
+	json_string(&j, "artist", "Stub Artist");
+	json_int(&j, "duration_ms", 296000);
+	json_string(&j, "uri", "spotify:track:0123456789abcdefghijkl");
+	json_int(&j, "elapsed_ms", 83000);
+	json_int(&j, "remaining_ms", 213000);
+	json_object_end(&j);
+
+	json_object_begin(&j, "playlist");
+	json_string(&j, "name", "Stub playlist");
+	json_string(&j, "uri", "spotify:user:stub:playlist:0123456789abcdefghijkl");
+	json_int(&j, "tracks", 120);
+	json_bool(&j, "loaded", 1);
+	json_object_end(&j);
+
+	json_object_begin(&j, "queue");
+	json_int(&j, "tracks", 0);
+	json_int(&j, "loading", 0);
+	json_object_end(&j);
+
+	json_object_begin(&j, "audio");
+	json_int(&j, "buffered_ms", 950);
+	json_int(&j, "buffer_max_ms", 1000);
+	json_int(&j, "underruns", 0);
+	json_double(&j, "event_latency_max_ms", 0.25);
+	json_object_end(&j);
+
+	json_array_begin(&j, "playlists");
+	for(i = 0; i < 20; i++) {
+		snprintf(name, sizeof(name), "Playlist %d", i + 1);
+		json_object_begin(&j, NULL);
+		json_string(&j, "name", name);
+		json_string(&j, "uri", "spotify:user:stub:playlist:0123456789abcdefghijkl");
+		json_int(&j, "tracks", 100 + i);
+		json_object_end(&j);
+	}
+	json_array_end(&j);
+
+	json_object_end(&j);
+
+	return json_finish(&j);
+}
+
+int app_get_metrics(buf_t *out) {
+
+	return buf_printf(out,
+		"# HELP boombox_status_requests_total Status documents built.\n"
+		"# TYPE boombox_status_requests_total counter\n"
+		"boombox_status_requests_total %lu\n", stub_status_requests) < 0? -1: 0;
+}
+
+const char *app_set_playlist_uri(const char *uri) {
+
+	return strncmp(uri, "spotify:", 8)? "not a Spotify URI": NULL;
+}
+
+void app_post_event(app_event_t event) {
+
+	stub_events[event]++;
+}
+
+void app_skip_track(void) {
+
+	stub_events[APP_DO_NEXT_TRACK]++;
+}
+
+void app_set_power_save(int enable) {
+
+	g_stub.power_save = enable;
+}
+
+int app_get_power_save(void) {
+
+	return g_stub.power_save;
+}
+
+void app_reshuffle(uint64_t seed) {
+
+	g_stub.shuffle_seed = seed? seed: 1;
+}
+
+void app_set_shuffle_spread(int enable) {
+
+	g_stub.shuffle_spread = enable;
+}
+
+int app_get_shuffle_spread(void) {
+
+	return g_stub.shuffle_spread;
+}
+
+uint64_t app_get_shuffle_seed(void) {
+
+	return g_stub.shuffle_seed;
+}
+
+int app_parse_connection_type(const char *name) {
+	int i;
+
+	for(i = 0; stub_connection_types[i] != NULL; i++) {
+		if(!strcmp(stub_connection_types[i], name))
+			return i;
+	}
+
+	return -1;
+}
+
+void app_set_connection_type(int type) {
+
+	g_stub.connection_type = type;
+}
+
+const char *app_get_connection_type(void) {
+
+	return stub_connection_types[g_stub.connection_type];
+}
+
+void app_set_prefetch_window(int tracks) {
+
+	g_stub.prefetch_window = tracks;
+}
+
+int app_get_prefetch_window(void) {
+
+	return g_stub.prefetch_window;
+}
+
+void audio_set_device(const char *name) {
+}
+
+int audio_list_devices(char *buf, size_t len) {
+
+	return snprintf(buf, len, "Stub device\n");
+}
+
+void meter_enable(int enable) {
+}
+
+int meter_format(char *buf, size_t len) {
+
+	return snprintf(buf, len, "meter -20.0 -20.0 -6.0 -6.0\n");
+}
+
+void player_set_trim(int enable) {
+
+	g_stub.trim = enable;
+}
+
+int player_get_trim(void) {
+
+	return g_stub.trim;
+}
+
+const char *playqueue_add_uri(const char *uri, int next) {
+
+	return strncmp(uri, "spotify:", 8)? "not a Spotify URI": NULL;
+}
+
+int playqueue_length(void) {
+
+	return 0;
+}
+
+int playqueue_pending(void) {
+
+	return 0;
+}
+
+void playqueue_clear(void) {
+}
+
+void prefetch_get_stats(unsigned long counts[PREFETCH_RESULTS], unsigned long *requests) {
+
+	memset(counts, 0, PREFETCH_RESULTS * sizeof(counts[0]));
+	*requests = 0;
+}
+
+int mdindex_find_track(const char *uri, mdindex_track_t *track) {
+
+	return -1;
+}
+
+int search_query(const char *query, search_result_t *results, int max) {
+
+	return 0;
+}
@@ -0,0 +1,15 @@
+/**
+ * stubs.h
+ *
+ */
+
+#ifndef STUBS_H
+#define STUBS_H
+
+#include "../app.h"
+
+/* Status documents built and events posted by commands so far */
+extern unsigned long stub_status_requests;
+extern unsigned long stub_events[APP_MAX];
+
+#endif